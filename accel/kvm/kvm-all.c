@@ -758,7 +758,11 @@ static bool kvm_slot_get_dirty_log(KVMState *s, KVMSlot *slot)
     return ret == 0;
 }
 
-/* Should be with all slots_lock held for the address spaces. */
+/*
+ * Should be with all slots_lock held for the address spaces.  The slot
+ * bitmaps are shared by all the dirty ring harvesters, so the bit is set
+ * atomically.
+ */
 static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
                                      uint32_t slot_id, uint64_t offset)
 {
@@ -777,7 +781,7 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    set_bit_atomic(offset, mem->dirty_bmap);
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -850,11 +854,125 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+/*
+ * Whether the dirty ring of @cpu is at least half full.  Only the slot
+ * half way from the fetch index needs to be checked, because KVM fills
+ * the ring in order.
+ */
+static bool kvm_dirty_ring_soft_full(KVMState *s, CPUState *cpu)
+{
+    uint32_t ring_size = s->kvm_dirty_ring_size;
+
+    if (!cpu->created) {
+        return false;
+    }
+
+    return dirty_gfn_is_dirtied(&cpu->kvm_dirty_gfns[(cpu->kvm_fetch_index +
+                                                      ring_size / 2) %
+                                                     ring_size]);
+}
+
+/*
+ * Collect the dirty rings of the vCPUs whose index falls in @group out of
+ * @nr_groups.  Should be with all slots_lock held for the address spaces.
+ */
+static uint64_t kvm_dirty_ring_reap_group(KVMState *s, int group,
+                                          int nr_groups)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index % nr_groups == group) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+
+    return total;
+}
+
+static void *kvm_dirty_ring_harvester_thread(void *opaque)
+{
+    KVMDirtyRingHarvester *h = opaque;
+    KVMState *s = h->s;
+    struct KVMDirtyRingReaper *r = &s->reaper;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&h->start);
+        /*
+         * The reaping thread holds the slots lock and the BQL until every
+         * harvester has posted harvest_done, so neither the vCPU list nor
+         * the slots can change under our feet.
+         */
+        WITH_RCU_READ_LOCK_GUARD() {
+            h->count = kvm_dirty_ring_reap_group(s, h->group,
+                                                 r->nr_harvesters + 1);
+        }
+        trace_kvm_dirty_ring_harvest(h->group, h->count);
+        qemu_sem_post(&r->harvest_done);
+    }
+
+    g_assert_not_reached();
+}
+
+/*
+ * Collect the dirty rings of all the vCPUs, splitting the work with the
+ * harvester threads if there are any.  Should be with all slots_lock held
+ * for the address spaces.
+ */
+static uint64_t kvm_dirty_ring_reap_all(KVMState *s)
+{
+    struct KVMDirtyRingReaper *r = &s->reaper;
+    uint64_t total;
+    int i;
+
+    if (!r->nr_harvesters) {
+        return kvm_dirty_ring_reap_group(s, 0, 1);
+    }
+
+    for (i = 0; i < r->nr_harvesters; i++) {
+        qemu_sem_post(&r->harvesters[i].start);
+    }
+
+    total = kvm_dirty_ring_reap_group(s, 0, r->nr_harvesters + 1);
+
+    for (i = 0; i < r->nr_harvesters; i++) {
+        qemu_sem_wait(&r->harvest_done);
+    }
+    for (i = 0; i < r->nr_harvesters; i++) {
+        total += r->harvesters[i].count;
+    }
+
+    return total;
+}
+
+/*
+ * Reset the dirty rings after @total pages have been collected since
+ * @stamp.  Must be with slots_lock held, so that the dirty bits are not
+ * consumed before the pages are write protected again.
+ */
+static void kvm_dirty_ring_reset_locked(KVMState *s, uint64_t total,
+                                        int64_t stamp)
+{
+    int ret;
+
+    if (!total) {
+        return;
+    }
+
+    ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+    assert(ret == total);
+
+    stamp = get_clock() - stamp;
+    trace_kvm_dirty_ring_reap(total, stamp / 1000);
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
-    int ret;
-    uint64_t total = 0;
+    uint64_t total;
     int64_t stamp;
 
     stamp = get_clock();
@@ -862,28 +980,47 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
     if (cpu) {
         total = kvm_dirty_ring_reap_one(s, cpu);
     } else {
-        CPU_FOREACH(cpu) {
-            total += kvm_dirty_ring_reap_one(s, cpu);
-        }
+        total = kvm_dirty_ring_reap_all(s);
     }
 
-    if (total) {
-        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
-        assert(ret == total);
-    }
+    kvm_dirty_ring_reset_locked(s, total, stamp);
 
-    stamp = get_clock() - stamp;
+    return total;
+}
+
+/*
+ * Collect only the dirty rings that are at least half full, so that the
+ * vCPUs dirtying memory the fastest do not run into ring-full exits.
+ * Must be called with BQL held.
+ */
+static uint64_t kvm_dirty_ring_reap_soft_full(KVMState *s)
+{
+    CPUState *cpu;
+    uint64_t total = 0;
+    int64_t stamp;
+
+    kvm_slots_lock();
+    stamp = get_clock();
+    CPU_FOREACH(cpu) {
+        if (kvm_dirty_ring_soft_full(s, cpu)) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
+    }
+    kvm_dirty_ring_reset_locked(s, total, stamp);
+    kvm_slots_unlock();
 
     if (total) {
-        trace_kvm_dirty_ring_reap(total, stamp / 1000);
+        trace_kvm_dirty_ring_reap_soft_full(total);
     }
 
     return total;
 }
 
 /*
- * Currently for simplicity, we must hold BQL before calling this.  We can
- * consider to drop the BQL if we're clear with all the race conditions.
+ * When reaping all the vCPUs (@cpu is NULL) we must hold BQL before
+ * calling this, to walk the vCPU list.  A vCPU thread can reap its own
+ * ring without BQL, since only the slots lock is needed to keep the ring
+ * and the slot bitmaps consistent.
  */
 static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu)
 {
@@ -1559,10 +1696,23 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
     } while (size);
 }
 
+/*
+ * While dirty tracking is on, the reaper wakes up this often to collect
+ * the rings that are filling up, and does a full reap every
+ * KVM_DIRTY_RING_REAPER_TICKS wakeups.
+ */
+#define KVM_DIRTY_RING_REAPER_TICK_MS   100
+#define KVM_DIRTY_RING_REAPER_TICKS     10
+
+/* One harvester thread for every this many vCPUs, up to the maximum */
+#define KVM_DIRTY_RING_HARVEST_VCPUS    16
+#define KVM_DIRTY_RING_HARVESTERS_MAX   8
+
 static void *kvm_dirty_ring_reaper_thread(void *data)
 {
     KVMState *s = data;
     struct KVMDirtyRingReaper *r = &s->reaper;
+    unsigned int tick = 0;
 
     rcu_register_thread();
 
@@ -1571,16 +1721,40 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
     while (true) {
         r->reaper_state = KVM_DIRTY_RING_REAPER_WAIT;
         trace_kvm_dirty_ring_reaper("wait");
+        g_usleep(KVM_DIRTY_RING_REAPER_TICK_MS * 1000);
+
         /*
-         * TODO: provide a smarter timeout rather than a constant?
+         * keep sleeping so that dirtylimit not be interfered by reaper;
+         * the ring-full exits are what throttles the vCPUs in that case.
+         *
+         * Rings that are half full are not reported to dirtylimit either:
+         * it sizes the sleep of a vCPU for a whole ring of dirty pages
+         * (see dirtylimit_dirty_ring_full_time()), and its feedback loop
+         * already adjusts that sleep to the measured dirty rate.
          */
-        sleep(1);
-
-        /* keep sleeping so that dirtylimit not be interfered by reaper */
         if (dirtylimit_in_service()) {
             continue;
         }
 
+        /*
+         * Without dirty tracking nobody is waiting for the bits, so only
+         * reap once per second.  With it, keep the rings from becoming
+         * full between two full reaps.
+         */
+        if (++tick < KVM_DIRTY_RING_REAPER_TICKS) {
+            if (!qatomic_read(&global_dirty_tracking)) {
+                continue;
+            }
+            trace_kvm_dirty_ring_reaper("soft-full");
+            r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
+
+            bql_lock();
+            kvm_dirty_ring_reap_soft_full(s);
+            bql_unlock();
+            continue;
+        }
+        tick = 0;
+
         trace_kvm_dirty_ring_reaper("wakeup");
         r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
 
@@ -1594,9 +1768,29 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
     g_assert_not_reached();
 }
 
-static void kvm_dirty_ring_reaper_init(KVMState *s)
+static void kvm_dirty_ring_reaper_init(KVMState *s, unsigned int max_cpus)
 {
     struct KVMDirtyRingReaper *r = &s->reaper;
+    int i;
+
+    /*
+     * Large guests get helper threads for full reaps, the reaping thread
+     * itself takes care of the first group of vCPUs.
+     */
+    r->nr_harvesters = MIN(DIV_ROUND_UP(max_cpus, KVM_DIRTY_RING_HARVEST_VCPUS),
+                           KVM_DIRTY_RING_HARVESTERS_MAX) - 1;
+    qemu_sem_init(&r->harvest_done, 0);
+    r->harvesters = g_new0(KVMDirtyRingHarvester, r->nr_harvesters);
+    for (i = 0; i < r->nr_harvesters; i++) {
+        KVMDirtyRingHarvester *h = &r->harvesters[i];
+        g_autofree char *name = g_strdup_printf("kvm-harvest-%d", i);
+
+        h->s = s;
+        h->group = i + 1;
+        qemu_sem_init(&h->start, 0);
+        qemu_thread_create(&h->thr, name, kvm_dirty_ring_harvester_thread,
+                           h, QEMU_THREAD_JOINABLE);
+    }
 
     qemu_thread_create(&r->reaper_thr, "kvm-reaper",
                        kvm_dirty_ring_reaper_thread,
@@ -2750,7 +2944,7 @@ static int kvm_init(MachineState *ms)
     }
 
     if (s->kvm_dirty_ring_size) {
-        kvm_dirty_ring_reaper_init(s);
+        kvm_dirty_ring_reaper_init(s, ms->smp.max_cpus);
     }
 
     if (kvm_check_extension(kvm_state, KVM_CAP_BINARY_STATS_FD)) {
@@ -3209,19 +3403,14 @@ int kvm_cpu_exec(CPUState *cpu)
              * still full.  Got kicked by KVM_RESET_DIRTY_RINGS.
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
-            bql_lock();
             /*
-             * We throttle vCPU by making it sleep once it exit from kernel
-             * due to dirty ring full. In the dirtylimit scenario, reaping
-             * all vCPUs after a single vCPU dirty ring get full result in
-             * the miss of sleep, so just reap the ring-fulled vCPU.
+             * Only reap the ring-fulled vCPU, without BQL, so that a vCPU
+             * with a high dirty rate neither stalls on the other vCPUs'
+             * rings nor on the BQL.  The reaper keeps the other rings from
+             * filling up.  In the dirtylimit scenario, this also keeps the
+             * sleep below from being missed.
              */
-            if (dirtylimit_in_service()) {
-                kvm_dirty_ring_reap(kvm_state, cpu);
-            } else {
-                kvm_dirty_ring_reap(kvm_state, NULL);
-            }
-            bql_unlock();
+            kvm_dirty_ring_reap(kvm_state, cpu);
             dirtylimit_vcpu_execute(cpu);
             ret = 0;
             break;
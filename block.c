@@ -429,6 +429,7 @@ BlockDriverState *bdrv_new(void)
 
     qemu_co_mutex_init(&bs->bsc_modify_lock);
     bs->block_status_cache = g_new0(BdrvBlockStatusCache, 1);
+    seqlock_init(&bs->unallocated_cache.seqlock);
 
     for (i = 0; i < bdrv_drain_all_count; i++) {
         bdrv_drained_begin(bs);
@@ -1824,6 +1825,12 @@ QemuOptsList bdrv_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "always accept other writers (default: off)",
         },
+        {
+            .name = BDRV_OPT_UNALLOCATED_CACHE,
+            .type = QEMU_OPT_BOOL,
+            .help = "cache unallocated ranges of read-only backing layers "
+                    "(default: on)",
+        },
         { /* end of list */ }
     },
 };
@@ -1970,6 +1977,9 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
         goto fail_opts;
     }
 
+    bs->use_unallocated_cache =
+        qemu_opt_get_bool(opts, BDRV_OPT_UNALLOCATED_CACHE, true);
+
     if (filename != NULL) {
         pstrcpy(bs->filename, sizeof(bs->filename), filename);
     } else {
@@ -4878,6 +4888,9 @@ bdrv_reopen_prepare(BDRVReopenState *reopen_state, BlockReopenQueue *queue,
         goto error;
     }
 
+    reopen_state->use_unallocated_cache =
+        qemu_opt_get_bool_del(opts, BDRV_OPT_UNALLOCATED_CACHE, true);
+
     /* All other options (including node-name and driver) must be unchanged.
      * Put them back into the QDict, so that they are checked at the end
      * of this function. */
@@ -5081,6 +5094,7 @@ static void GRAPH_UNLOCKED bdrv_reopen_commit(BDRVReopenState *reopen_state)
     bs->options            = reopen_state->options;
     bs->open_flags         = reopen_state->flags;
     bs->detect_zeroes      = reopen_state->detect_zeroes;
+    bs->use_unallocated_cache = reopen_state->use_unallocated_cache;
 
     /* Remove child references from bs->options and bs->explicit_options.
      * Child options were already removed in bdrv_reopen_queue_child() */
@@ -5094,6 +5108,9 @@ static void GRAPH_UNLOCKED bdrv_reopen_commit(BDRVReopenState *reopen_state)
 
     bdrv_refresh_limits(bs, NULL, NULL);
     bdrv_refresh_total_sectors(bs, bs->total_sectors);
+
+    /* The node may have been modified while it was writable */
+    bdrv_uac_invalidate(bs);
 }
 
 /*
@@ -6907,6 +6924,8 @@ int coroutine_fn bdrv_co_invalidate_cache(BlockDriverState *bs, Error **errp)
     assert(!(bs->open_flags & BDRV_O_INACTIVE));
     assert_bdrv_graph_readable();
 
+    bdrv_uac_invalidate(bs);
+
     if (bs->drv->bdrv_co_invalidate_cache) {
         bs->drv->bdrv_co_invalidate_cache(bs, &local_err);
         if (local_err) {
@@ -8430,3 +8449,71 @@ void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes)
         g_free_rcu(old_bsc, rcu);
     }
 }
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+bool bdrv_uac_is_unallocated(BlockDriverState *bs, int64_t offset,
+                             int64_t *pnum)
+{
+    BdrvUnallocatedCache *uac = &bs->unallocated_cache;
+    unsigned int seq, write_gen;
+    int64_t start, end;
+    bool valid;
+    IO_CODE();
+
+    /*
+     * Writable nodes are skipped not only because they are written to
+     * frequently, but also because their allocation status may change
+     * without going through the generic write path (e.g. when committing
+     * into them empties them).
+     */
+    if (bs->open_flags & BDRV_O_RDWR) {
+        return false;
+    }
+
+    do {
+        seq = seqlock_read_begin(&uac->seqlock);
+        valid = qatomic_read(&uac->valid);
+        write_gen = uac->write_gen;
+        start = uac->start;
+        end = uac->end;
+    } while (seqlock_read_retry(&uac->seqlock, seq));
+
+    if (!valid || write_gen != qatomic_read(&bs->write_gen) ||
+        offset < start || offset >= end) {
+        return false;
+    }
+
+    *pnum = end - offset;
+    return true;
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_uac_invalidate(BlockDriverState *bs)
+{
+    IO_CODE();
+
+    qatomic_set(&bs->unallocated_cache.valid, false);
+}
+
+/**
+ * See block_int.h for this function's documentation.
+ */
+void bdrv_uac_fill(BlockDriverState *bs, unsigned int write_gen,
+                   int64_t offset, int64_t bytes)
+{
+    BdrvUnallocatedCache *uac = &bs->unallocated_cache;
+    IO_CODE();
+
+    QEMU_LOCK_GUARD(&bs->bsc_modify_lock);
+
+    seqlock_write_begin(&uac->seqlock);
+    uac->write_gen = write_gen;
+    uac->start = offset;
+    uac->end = offset + bytes;
+    qatomic_set(&uac->valid, true);
+    seqlock_write_end(&uac->seqlock);
+}
@@ -15,6 +15,7 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "trace.h"
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
@@ -43,8 +44,23 @@ typedef struct CommitBlockJob {
     bool chain_frozen;
     char *backing_file_str;
     bool backing_mask_protocol;
+    int max_workers;
+
+    /* The first failed request since the last error was handled */
+    int error_ret;
+    int64_t error_offset;
+    bool error_in_source;
+    /* Total size of the failed requests */
+    int64_t failed_bytes;
 } CommitBlockJob;
 
+typedef struct CommitTask {
+    AioTask task;
+    CommitBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} CommitTask;
+
 static int commit_prepare(Job *job)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
@@ -126,13 +142,59 @@ static void commit_clean(Job *job)
     blk_unref(s->top);
 }
 
+static void commit_set_error(CommitBlockJob *s, int64_t offset, int64_t bytes,
+                             int ret, bool error_in_source)
+{
+    if (!s->error_ret || offset < s->error_offset) {
+        s->error_ret = ret;
+        s->error_offset = offset;
+        s->error_in_source = error_in_source;
+    }
+    s->failed_bytes += bytes;
+}
+
+static void commit_reset_error(CommitBlockJob *s)
+{
+    s->error_ret = 0;
+    s->error_offset = INT64_MAX;
+    s->error_in_source = true;
+    s->failed_bytes = 0;
+}
+
+static int coroutine_fn commit_task_entry(AioTask *task)
+{
+    CommitTask *t = container_of(task, CommitTask, task);
+    CommitBlockJob *s = t->s;
+    QEMU_AUTO_VFREE void *buf = NULL;
+    int ret;
+
+    assert(t->bytes <= COMMIT_BUFFER_SIZE);
+    buf = blk_blockalign(s->top, t->bytes);
+
+    ret = blk_co_pread(s->top, t->offset, t->bytes, buf, 0);
+    if (ret < 0) {
+        commit_set_error(s, t->offset, t->bytes, ret, true);
+        return ret;
+    }
+
+    ret = blk_co_pwrite(s->base, t->offset, t->bytes, buf, 0);
+    if (ret < 0) {
+        commit_set_error(s, t->offset, t->bytes, ret, false);
+        return ret;
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
 static int coroutine_fn commit_run(Job *job, Error **errp)
 {
     CommitBlockJob *s = container_of(job, CommitBlockJob, common.job);
-    int64_t offset;
+    AioTaskPool *pool;
+    int64_t offset = 0;
     int ret = 0;
     int64_t n = 0; /* bytes */
-    QEMU_AUTO_VFREE void *buf = NULL;
     int64_t len, base_len;
 
     len = blk_co_getlength(s->top);
@@ -153,55 +215,87 @@ static int coroutine_fn commit_run(Job *job, Error **errp)
         }
     }
 
-    buf = blk_blockalign(s->top, COMMIT_BUFFER_SIZE);
+    pool = aio_task_pool_new(s->max_workers);
+    commit_reset_error(s);
 
-    for (offset = 0; offset < len; offset += n) {
-        bool copy;
-        bool error_in_source = true;
+    while (true) {
+        CommitTask *t;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that the job can be paused for bdrv_drain_all().
          */
         block_job_ratelimit_sleep(&s->common);
         if (job_is_cancelled(&s->common.job)) {
+            ret = 0;
             break;
         }
-        /* Copy if allocated above the base */
-        ret = blk_co_is_allocated_above(s->top, s->base_overlay, true,
-                                        offset, COMMIT_BUFFER_SIZE, &n);
-        copy = (ret > 0);
-        trace_commit_one_iteration(s, offset, n, ret);
-        if (copy) {
-            assert(n < SIZE_MAX);
-
-            ret = blk_co_pread(s->top, offset, n, buf, 0);
-            if (ret >= 0) {
-                ret = blk_co_pwrite(s->base, offset, n, buf, 0);
-                if (ret < 0) {
-                    error_in_source = false;
-                }
-            }
+
+        aio_task_pool_wait_slot(pool);
+        if (s->error_ret < 0 || offset >= len) {
+            aio_task_pool_wait_all(pool);
         }
-        if (ret < 0) {
+
+        if (s->error_ret < 0) {
             BlockErrorAction action =
                 block_job_error_action(&s->common, s->on_error,
-                                       error_in_source, -ret);
+                                       s->error_in_source, -s->error_ret);
             if (action == BLOCK_ERROR_ACTION_REPORT) {
-                return ret;
-            } else {
-                n = 0;
-                continue;
+                ret = s->error_ret;
+                break;
             }
+
+            /*
+             * Retry from the first failed request.  Requests after it that
+             * did succeed will be repeated, so account for them again.
+             */
+            job_progress_increase_remaining(&s->common.job,
+                                            offset - s->error_offset -
+                                            s->failed_bytes);
+            offset = s->error_offset;
+            commit_reset_error(s);
+            continue;
+        }
+
+        if (offset >= len) {
+            ret = 0;
+            break;
         }
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
 
-        if (copy) {
+        /*
+         * Copy if allocated above the base.  Query the whole remaining
+         * range so that unallocated areas are skipped in one go.
+         */
+        ret = blk_co_is_allocated_above(s->top, s->base_overlay, true,
+                                        offset, len - offset, &n);
+        trace_commit_one_iteration(s, offset, n, ret);
+        if (ret < 0) {
+            commit_set_error(s, offset, 0, ret, true);
+            continue;
+        }
+
+        if (ret > 0) {
+            n = MIN(n, COMMIT_BUFFER_SIZE);
+
+            t = g_new(CommitTask, 1);
+            *t = (CommitTask) {
+                .task.func  = commit_task_entry,
+                .s          = s,
+                .offset     = offset,
+                .bytes      = n,
+            };
+            aio_task_pool_start_task(pool, &t->task);
             block_job_ratelimit_processed_bytes(&s->common, n);
+        } else {
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
     }
 
-    return 0;
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+
+    return ret;
 }
 
 static const BlockJobDriver commit_job_driver = {
@@ -256,7 +350,7 @@ void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error, const char *backing_file_str,
-                  bool backing_mask_protocol,
+                  bool backing_mask_protocol, int64_t max_workers,
                   const char *filter_node_name, Error **errp)
 {
     CommitBlockJob *s;
@@ -270,6 +364,12 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     GLOBAL_STATE_CODE();
 
     assert(top != bs);
+
+    if (max_workers < 1 || max_workers > INT_MAX) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
     bdrv_graph_rdlock_main_loop();
     if (bdrv_skip_filters(top) == bdrv_skip_filters(base)) {
         error_setg(errp, "Invalid files for merge: top and base are the same");
@@ -413,6 +513,7 @@ void commit_start(const char *job_id, BlockDriverState *bs,
     s->backing_file_str = g_strdup(backing_file_str);
     s->backing_mask_protocol = backing_mask_protocol;
     s->on_error = on_error;
+    s->max_workers = max_workers;
 
     trace_commit_start(bs, base, top, s);
     job_start(&s->common.job);
@@ -32,6 +32,7 @@
 #include "qemu/option.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "qemu/range.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/iov.h"
@@ -73,6 +74,7 @@
 #endif
 #include <linux/cdrom.h>
 #include <linux/fd.h>
+#include <linux/fiemap.h>
 #include <linux/fs.h>
 #include <linux/hdreg.h>
 #include <linux/magic.h>
@@ -134,6 +136,33 @@
 #define RAW_LOCK_PERM_BASE             100
 #define RAW_LOCK_SHARED_BASE           200
 
+/* Number of extents requested from FIEMAP when filling the extent cache */
+#define RAW_EXTENT_CACHE_SIZE          256
+
+typedef struct RawExtent {
+    int64_t start;
+    int64_t end;
+    bool zero;  /* allocated, but reads as zeroes (unwritten) */
+} RawExtent;
+
+/*
+ * Allocation map of a regular file, filled in bulk via FIEMAP so that
+ * block-status queries do not need two lseek() calls each.
+ *
+ * The cache covers [start, end).  Within that window, the ranges in
+ * @extents (sorted and non-overlapping; adjacent only if their @zero
+ * flags differ) are allocated, and everything else is a hole.  If @to_eof
+ * is set, @end was the file length when the cache was filled.
+ */
+typedef struct RawExtentCache {
+    bool valid;
+    bool to_eof;
+    int64_t start;
+    int64_t end;
+    unsigned int nb_extents;
+    RawExtent extents[RAW_EXTENT_CACHE_SIZE];
+} RawExtentCache;
+
 typedef struct BDRVRawState {
     int fd;
     bool use_lock;
@@ -173,6 +202,20 @@ typedef struct BDRVRawState {
         uint64_t discard_bytes_ok;
     } stats;
 
+    /*
+     * Protects has_fiemap, extent_cache_gen, extent_cache_flushed_gen and
+     * extent_cache, which may be accessed from multiple AioContexts.
+     * extent_cache_gen is incremented by every request that may change the
+     * allocation status of the file, and starts ahead of
+     * extent_cache_flushed_gen, which is the generation covered by the
+     * last successful flush.
+     */
+    QemuMutex extent_cache_lock;
+    bool has_fiemap;
+    uint64_t extent_cache_gen;
+    uint64_t extent_cache_flushed_gen;
+    RawExtentCache extent_cache;
+
     PRManager *pr_mgr;
 } BDRVRawState;
 
@@ -195,6 +238,68 @@ static int fd_open(BlockDriverState *bs)
 
 static int64_t raw_getlength(BlockDriverState *bs);
 
+/*
+ * Index of the first cached extent that ends after @offset, or
+ * c->nb_extents if there is none.
+ */
+static unsigned int raw_extent_cache_find(RawExtentCache *c, int64_t offset)
+{
+    unsigned int lo = 0, hi = c->nb_extents;
+
+    while (lo < hi) {
+        unsigned int mid = lo + (hi - lo) / 2;
+
+        if (c->extents[mid].end <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+/*
+ * To be called after every request that may have changed the allocation
+ * status of [offset, offset + bytes) has completed.
+ *
+ * Plain writes can only turn holes and unwritten extents into data, so with
+ * @only_holes, the cache is kept if the range lies entirely within a cached
+ * data extent that is not @zero.
+ */
+static void raw_extent_cache_invalidate(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, bool only_holes)
+{
+    BDRVRawState *s = bs->opaque;
+    RawExtentCache *c = &s->extent_cache;
+    unsigned int i;
+
+    if (!qatomic_read(&s->has_fiemap)) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&s->extent_cache_lock);
+    s->extent_cache_gen++;
+
+    if (!c->valid) {
+        return;
+    }
+    if (c->to_eof && offset + bytes > c->end) {
+        /* The file may have grown behind the cached window */
+    } else if (!ranges_overlap(offset, bytes, c->start, c->end - c->start)) {
+        return;
+    } else if (only_holes) {
+        i = raw_extent_cache_find(c, offset);
+        if (i < c->nb_extents && c->extents[i].start <= offset &&
+            c->extents[i].end >= offset + bytes && !c->extents[i].zero) {
+            return;
+        }
+    }
+
+    trace_file_extent_cache_invalidate(bs, offset, bytes);
+    c->valid = false;
+}
+
 typedef struct RawPosixAIOData {
     BlockDriverState *bs;
     int aio_type;
@@ -808,7 +913,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     if (S_ISREG(st.st_mode)) {
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
+#ifdef FS_IOC_FIEMAP
+        s->has_fiemap = true;
+#endif
     }
+    qemu_mutex_init(&s->extent_cache_lock);
+    /*
+     * Another process may have written to the file without syncing it, and
+     * FIEMAP may still report the extents it wrote as unwritten.  Only
+     * trust unwritten extents once a flush of our own has succeeded.
+     */
+    s->extent_cache_gen = 1;
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -2537,6 +2652,9 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, int64_t *offset_ptr,
     goto out; /* Avoid the compiler err of unused label */
 
 out:
+    if (type & (QEMU_AIO_WRITE | QEMU_AIO_ZONE_APPEND)) {
+        raw_extent_cache_invalidate(bs, offset, bytes, true);
+    }
 #if defined(CONFIG_BLKZONED)
     if ((type & (QEMU_AIO_WRITE | QEMU_AIO_ZONE_APPEND)) &&
         bs->bl.zoned != BLK_Z_NONE) {
@@ -2585,6 +2703,7 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
+    uint64_t gen;
     int ret;
 
     ret = fd_open(bs);
@@ -2592,6 +2711,10 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
         return ret;
     }
 
+    WITH_QEMU_LOCK_GUARD(&s->extent_cache_lock) {
+        gen = s->extent_cache_gen;
+    }
+
     acb = (RawPosixAIOData) {
         .bs             = bs,
         .aio_fildes     = s->fd,
@@ -2600,15 +2723,26 @@ static int coroutine_fn raw_co_flush_to_disk(BlockDriverState *bs)
 
 #ifdef CONFIG_LINUX_IO_URING
     if (raw_check_linux_io_uring(s)) {
-        return luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        ret = luring_co_submit(bs, s->fd, 0, NULL, QEMU_AIO_FLUSH);
+        goto out;
     }
 #endif
 #ifdef CONFIG_LINUX_AIO
     if (s->has_laio_fdsync && raw_check_linux_aio(s)) {
-        return laio_co_submit(s->fd, 0, NULL, QEMU_AIO_FLUSH, 0);
+        ret = laio_co_submit(s->fd, 0, NULL, QEMU_AIO_FLUSH, 0);
+        goto out;
     }
 #endif
-    return raw_thread_pool_submit(handle_aiocb_flush, &acb);
+    ret = raw_thread_pool_submit(handle_aiocb_flush, &acb);
+    goto out; /* Avoid the compiler err of unused label */
+
+out:
+    if (ret == 0) {
+        /* Everything completed before the flush started is on disk now */
+        QEMU_LOCK_GUARD(&s->extent_cache_lock);
+        s->extent_cache_flushed_gen = MAX(s->extent_cache_flushed_gen, gen);
+    }
+    return ret;
 }
 
 static void raw_close(BlockDriverState *bs)
@@ -2622,6 +2756,7 @@ static void raw_close(BlockDriverState *bs)
         qemu_close(s->fd);
         s->fd = -1;
     }
+    qemu_mutex_destroy(&s->extent_cache_lock);
 }
 
 /**
@@ -2666,7 +2801,9 @@ static int coroutine_fn raw_co_truncate(BlockDriverState *bs, int64_t offset,
 
     if (S_ISREG(st.st_mode)) {
         /* Always resizes to the exact @offset */
-        return raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
+        ret = raw_regular_truncate(bs, s->fd, offset, prealloc, errp);
+        raw_extent_cache_invalidate(bs, 0, INT64_MAX, false);
+        return ret;
     }
 
     if (prealloc != PREALLOC_MODE_OFF) {
@@ -3175,6 +3312,211 @@ static int find_allocation(BlockDriverState *bs, off_t start,
 #endif
 }
 
+#ifdef FS_IOC_FIEMAP
+static bool raw_extent_cache_usable(BDRVRawState *s)
+{
+    /*
+     * Unlike data, cached holes must not go stale, or we would report
+     * zeroes for data written behind our back.  Only trust the cache if
+     * no one else can write to the file.
+     */
+    return s->has_fiemap && s->use_lock &&
+           !(s->shared_perm & BLK_PERM_WRITE);
+}
+
+/*
+ * Look up @start in the extent cache.  On a hit, fill @data and @hole
+ * like find_allocation() does, set @zero if @start is in an unwritten
+ * extent, and return true.
+ */
+static bool raw_extent_cache_lookup(BlockDriverState *bs, off_t start,
+                                    off_t *data, off_t *hole, bool *zero)
+{
+    BDRVRawState *s = bs->opaque;
+    RawExtentCache *c = &s->extent_cache;
+    unsigned int i;
+
+    QEMU_LOCK_GUARD(&s->extent_cache_lock);
+
+    if (!raw_extent_cache_usable(s) || !c->valid ||
+        start < c->start || start >= c->end) {
+        return false;
+    }
+
+    i = raw_extent_cache_find(c, start);
+    if (i < c->nb_extents && c->extents[i].start <= start) {
+        *data = start;
+        *hole = c->extents[i].end;
+        *zero = c->extents[i].zero;
+    } else {
+        /*
+         * Past the last extent, report a hole up to the end of the window
+         * rather than a trailing hole: we cannot tell whether there is
+         * more data beyond it.
+         */
+        *hole = start;
+        *data = i < c->nb_extents ? c->extents[i].start : c->end;
+    }
+    return true;
+}
+
+/*
+ * Fill the extent cache with up to RAW_EXTENT_CACHE_SIZE extents starting
+ * at @start.  Returns 0 on success and a negative errno otherwise.
+ */
+static int coroutine_fn raw_co_extent_cache_fill(BlockDriverState *bs,
+                                                 off_t start)
+{
+    BDRVRawState *s = bs->opaque;
+    RawExtentCache *c = &s->extent_cache;
+    g_autofree struct fiemap *fm = NULL;
+    RawPosixAIOData acb;
+    struct fiemap_extent *last;
+    bool trust_unwritten;
+    uint64_t gen;
+    int64_t length;
+    unsigned int i;
+    int ret;
+
+    WITH_QEMU_LOCK_GUARD(&s->extent_cache_lock) {
+        if (!raw_extent_cache_usable(s)) {
+            return -ENOTSUP;
+        }
+        gen = s->extent_cache_gen;
+        /*
+         * Some filesystems keep reporting extents as unwritten while they
+         * still have dirty data in the page cache.  We do not ask for
+         * FIEMAP_FLAG_SYNC because of its cost, so only believe that
+         * unwritten extents read as zeroes once we flushed the file, after
+         * all of our writes (nobody else can write while it is open, see
+         * raw_extent_cache_usable(), but someone may have before).
+         */
+        trust_unwritten = gen == s->extent_cache_flushed_gen;
+    }
+
+    length = raw_getlength(bs);
+    if (length < 0) {
+        return length;
+    }
+    if (start >= length) {
+        return -ENXIO;
+    }
+
+    fm = g_malloc0(sizeof(*fm) +
+                   RAW_EXTENT_CACHE_SIZE * sizeof(fm->fm_extents[0]));
+    fm->fm_start = start;
+    fm->fm_length = length - start;
+    fm->fm_extent_count = RAW_EXTENT_CACHE_SIZE;
+
+    acb = (RawPosixAIOData) {
+        .bs             = bs,
+        .aio_fildes     = s->fd,
+        .aio_type       = QEMU_AIO_IOCTL,
+        .ioctl          = {
+            .buf            = fm,
+            .cmd            = FS_IOC_FIEMAP,
+        },
+    };
+
+    ret = raw_thread_pool_submit(handle_aiocb_ioctl, &acb);
+
+    QEMU_LOCK_GUARD(&s->extent_cache_lock);
+
+    if (ret == -ENOTSUP || ret == -EOPNOTSUPP || ret == -ENOTTY) {
+        /* Not supported by this filesystem (e.g. NFS); lseek() works there */
+        qatomic_set(&s->has_fiemap, false);
+        return ret;
+    } else if (ret < 0) {
+        /* Possibly transient, fall back to lseek() for this query only */
+        return ret;
+    }
+    if (s->extent_cache_gen != gen) {
+        /* A request has changed the allocation status in the meantime */
+        return -EAGAIN;
+    }
+
+    *c = (RawExtentCache) {
+        .valid  = true,
+        .to_eof = true,
+        .start  = start,
+        .end    = length,
+    };
+
+    for (i = 0; i < fm->fm_mapped_extents; i++) {
+        struct fiemap_extent *fe = &fm->fm_extents[i];
+        int64_t ext_start = MAX(fe->fe_logical, start);
+        int64_t ext_end = MIN(fe->fe_logical + fe->fe_length, length);
+        RawExtent *prev = c->nb_extents ? &c->extents[c->nb_extents - 1]
+                                        : NULL;
+        bool zero;
+
+        if (ext_start >= ext_end) {
+            continue;
+        }
+
+        /* Delayed allocations always hold data, even if marked unwritten */
+        zero = trust_unwritten &&
+               (fe->fe_flags & FIEMAP_EXTENT_UNWRITTEN) &&
+               !(fe->fe_flags & FIEMAP_EXTENT_DELALLOC);
+
+        if (prev && prev->end >= ext_start) {
+            if (prev->zero == zero) {
+                prev->end = MAX(prev->end, ext_end);
+                continue;
+            }
+            ext_start = prev->end;
+            if (ext_start >= ext_end) {
+                continue;
+            }
+        }
+        c->extents[c->nb_extents++] = (RawExtent) {
+            .start  = ext_start,
+            .end    = ext_end,
+            .zero   = zero,
+        };
+    }
+
+    last = fm->fm_mapped_extents ?
+           &fm->fm_extents[fm->fm_mapped_extents - 1] : NULL;
+    if (fm->fm_mapped_extents == RAW_EXTENT_CACHE_SIZE &&
+        !(last->fe_flags & FIEMAP_EXTENT_LAST))
+    {
+        /* There may be more extents, only trust the range we have seen */
+        c->end = MIN(last->fe_logical + last->fe_length, length);
+        c->to_eof = c->end == length;
+        if (c->end <= start) {
+            c->valid = false;
+            return -EAGAIN;
+        }
+    }
+
+    trace_file_extent_cache_fill(bs, c->start, c->end, c->nb_extents);
+    return 0;
+}
+#endif
+
+/*
+ * Like find_allocation(), but try to answer from the extent cache first,
+ * filling it on a miss.
+ */
+static int coroutine_fn raw_co_find_allocation(BlockDriverState *bs,
+                                               off_t start,
+                                               off_t *data, off_t *hole,
+                                               bool *zero)
+{
+    *zero = false;
+#ifdef FS_IOC_FIEMAP
+    if (raw_extent_cache_lookup(bs, start, data, hole, zero)) {
+        return 0;
+    }
+    if (raw_co_extent_cache_fill(bs, start) == 0 &&
+        raw_extent_cache_lookup(bs, start, data, hole, zero)) {
+        return 0;
+    }
+#endif
+    return find_allocation(bs, start, data, hole);
+}
+
 /*
  * Returns the allocation status of the specified offset.
  *
@@ -3195,6 +3537,7 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
                                             BlockDriverState **file)
 {
     off_t data = 0, hole = 0;
+    bool zero;
     int ret;
 
     assert(QEMU_IS_ALIGNED(offset | bytes, bs->bl.request_alignment));
@@ -3211,7 +3554,7 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
         return BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
     }
 
-    ret = find_allocation(bs, offset, &data, &hole);
+    ret = raw_co_find_allocation(bs, offset, &data, &hole, &zero);
     if (ret == -ENXIO) {
         /* Trailing hole */
         *pnum = bytes;
@@ -3238,7 +3581,8 @@ static int coroutine_fn raw_co_block_status(BlockDriverState *bs,
             *pnum = ROUND_UP(*pnum, bs->bl.request_alignment);
         }
 
-        ret = BDRV_BLOCK_DATA;
+        /* Unwritten extents are allocated, but read as zeroes */
+        ret = BDRV_BLOCK_DATA | (zero ? BDRV_BLOCK_ZERO : 0);
     } else {
         /* On a hole, compute bytes to the beginning of the next extent.  */
         assert(hole == offset);
@@ -3565,6 +3909,7 @@ raw_do_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes,
     }
 
     ret = raw_thread_pool_submit(handle_aiocb_discard, &acb);
+    raw_extent_cache_invalidate(bs, offset, bytes, false);
     raw_account_discard(s, bytes, ret);
     return ret;
 }
@@ -3582,6 +3927,7 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
     BDRVRawState *s = bs->opaque;
     RawPosixAIOData acb;
     ThreadPoolFunc *handler;
+    int ret;
 
 #ifdef CONFIG_FALLOCATE
     if (offset + bytes > bs->total_sectors * BDRV_SECTOR_SIZE) {
@@ -3639,7 +3985,9 @@ raw_do_pwrite_zeroes(BlockDriverState *bs, int64_t offset, int64_t bytes,
         handler = handle_aiocb_write_zeroes;
     }
 
-    return raw_thread_pool_submit(handler, &acb);
+    ret = raw_thread_pool_submit(handler, &acb);
+    raw_extent_cache_invalidate(bs, offset, bytes, false);
+    return ret;
 }
 
 static int coroutine_fn raw_co_pwrite_zeroes(
@@ -3818,6 +4166,9 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     raw_handle_perm_lock(bs, RAW_PL_COMMIT, perm, shared, NULL);
     s->perm = perm;
     s->shared_perm = shared;
+
+    /* Others may have written to the file while we were sharing it */
+    raw_extent_cache_invalidate(bs, 0, INT64_MAX, false);
 }
 
 static void raw_abort_perm_update(BlockDriverState *bs)
@@ -3853,6 +4204,7 @@ raw_co_copy_range_to(BlockDriverState *bs,
     RawPosixAIOData acb;
     BDRVRawState *s = bs->opaque;
     BDRVRawState *src_s;
+    int ret;
 
     assert(dst->bs == bs);
     if (src->bs->drv->bdrv_co_copy_range_to != raw_co_copy_range_to) {
@@ -3876,7 +4228,9 @@ raw_co_copy_range_to(BlockDriverState *bs,
         },
     };
 
-    return raw_thread_pool_submit(handle_aiocb_copy_range, &acb);
+    ret = raw_thread_pool_submit(handle_aiocb_copy_range, &acb);
+    raw_extent_cache_invalidate(bs, dst_offset, bytes, true);
+    return ret;
 }
 
 BlockDriver bdrv_file = {
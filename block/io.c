@@ -2667,6 +2667,31 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
     for (p = bdrv_filter_or_cow_bs(bs); include_base || p != base;
          p = bdrv_filter_or_cow_bs(p))
     {
+        BlockDriverState *next = bdrv_filter_or_cow_bs(p);
+        unsigned int write_gen = qatomic_read(&p->write_gen);
+        bool use_uac;
+        int64_t n;
+
+        /*
+         * The status of an unallocated intermediate layer does not matter
+         * beyond its length, so for intermediate format nodes, remember
+         * the unallocated range to skip inquiring their metadata next time
+         * (typically, the next query is about the following range on the
+         * same layer, as long as nothing is allocated in upper layers).
+         * The last layer we look at is always inquired, because its status
+         * is returned.
+         */
+        use_uac = p->use_unallocated_cache &&
+                  p != base && next && (include_base || next != base) &&
+                  p->drv && p->drv->bdrv_co_block_status &&
+                  !p->drv->is_filter;
+
+        if (use_uac && bdrv_uac_is_unallocated(p, offset, &n)) {
+            ++*depth;
+            bytes = MIN(bytes, n);
+            continue;
+        }
+
         ret = bdrv_co_do_block_status(p, want_zero, offset, bytes, pnum,
                                       map, file);
         ++*depth;
@@ -2714,6 +2739,10 @@ bdrv_co_common_block_status_above(BlockDriverState *bs,
          */
         assert(*pnum <= bytes);
         bytes = *pnum;
+
+        if (use_uac) {
+            bdrv_uac_fill(p, write_gen, offset, bytes);
+        }
     }
 
     if (offset + *pnum == eof) {
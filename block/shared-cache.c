@@ -0,0 +1,706 @@
+/*
+ * Shared read cache filter driver
+ *
+ * The driver caches data read from a read-only image in a memory-mapped
+ * file (typically on tmpfs or hugetlbfs). All QEMU processes on a host that
+ * open the same image through the same cache file share the cached data, so
+ * a common backing image used by many VMs is read from storage only once,
+ * even when it is opened with cache.direct=on.
+ *
+ * The cache file starts with a SharedCacheHeader, followed by a table of
+ * SharedCacheSlot entries and the page-aligned data area, which holds one
+ * cluster per slot. Clusters are direct-mapped to slots by hashing the image
+ * key and the cluster index. The image key combines the cache id, the image
+ * length and a generation derived from the image file (device, inode and
+ * modification time, if it is a local file) and its first bytes, so that a
+ * modified or replaced image does not hit stale data.
+ *
+ * Each slot is protected by a sequence counter: a writer claims a slot by
+ * atomically making its sequence odd, and readers fall back to the filtered
+ * node if the sequence changed while they copied the data. A slot that stays
+ * busy for longer than SHARED_CACHE_BUSY_TIMEOUT (because the process
+ * filling it died or hangs) is taken over by the next process that wants to
+ * fill it. Every slot carries a checksum of its key and data, which readers
+ * verify, so neither a late write from the previous owner of a taken over
+ * slot nor any other corruption of the cache file can return wrong data.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/crc32c.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/timer.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define SHARED_CACHE_MAGIC      0x5145534843414348ULL /* "QESHCACH" */
+#define SHARED_CACHE_VERSION    2
+
+#define SHARED_CACHE_MIN_CLUSTER_SIZE   (4 * KiB)
+#define SHARED_CACHE_MAX_CLUSTER_SIZE   (2 * MiB)
+
+/* Number of bytes at the start of the image that go into the image key */
+#define SHARED_CACHE_GEN_HASH_SIZE      (4 * KiB)
+
+#define SHARED_CACHE_BUSY_TIMEOUT       30 /* seconds */
+
+typedef struct SharedCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+    uint64_t file_size;
+} SharedCacheHeader;
+
+typedef struct SharedCacheSlot {
+    /* Even: @image_key and @cluster describe the data; odd: being filled */
+    uint32_t seq;
+    /* CRC32C of @image_key, @cluster and the data */
+    uint32_t checksum;
+    uint64_t image_key;
+    uint64_t cluster;
+    /* get_clock() in seconds when the slot was last claimed */
+    uint32_t busy_since;
+    uint32_t reserved;
+} SharedCacheSlot;
+
+QEMU_BUILD_BUG_ON(sizeof(SharedCacheSlot) != 32);
+
+typedef struct BDRVSharedCacheState {
+    int fd;
+    void *map;
+    size_t map_size;
+
+    SharedCacheSlot *slots;
+    uint8_t *data;
+    uint64_t nb_slots;
+    uint32_t cluster_size;
+
+    /* Identifies the image content in the shared slots, never 0 */
+    uint64_t image_key;
+    int64_t image_size;
+} BDRVSharedCacheState;
+
+#define SHARED_CACHE_OPT_CACHE_FILE     "cache-file"
+#define SHARED_CACHE_OPT_CACHE_ID       "cache-id"
+#define SHARED_CACHE_OPT_CACHE_SIZE     "cache-size"
+#define SHARED_CACHE_OPT_CLUSTER_SIZE   "cluster-size"
+#define SHARED_CACHE_OPT_CACHE_FILE_MODE "cache-file-mode"
+static QemuOptsList runtime_opts = {
+    .name = "shared-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = SHARED_CACHE_OPT_CACHE_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "path of the shared cache file",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CACHE_ID,
+            .type = QEMU_OPT_STRING,
+            .help = "identifier of the image content",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the cache file when it is created, default 1G",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "cache granularity when the cache file is created, "
+                "default 64k",
+        },
+        {
+            .name = SHARED_CACHE_OPT_CACHE_FILE_MODE,
+            .type = QEMU_OPT_NUMBER,
+            .help = "permissions of the cache file when it is created, "
+                "default 0600",
+        },
+        { /* end of list */ }
+    },
+};
+
+#define FNV1A_INIT  0xcbf29ce484222325ULL
+
+/* FNV-1a, so that the key is stable across processes and builds */
+static uint64_t fnv1a(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/*
+ * Compute a value that changes whenever the filtered image is modified or
+ * replaced: the identity and modification time of the image file if it is
+ * a local file, and a hash of its first bytes in any case.
+ */
+static int GRAPH_RDLOCK
+shared_cache_image_generation(BlockDriverState *bs, int64_t image_size,
+                              uint64_t *generation, Error **errp)
+{
+    BlockDriverState *file = bs->file->bs;
+    g_autofree uint8_t *buf = NULL;
+    int64_t len = MIN(image_size, SHARED_CACHE_GEN_HASH_SIZE);
+    uint64_t h = FNV1A_INIT;
+    struct stat st;
+    int ret;
+
+    if (stat(file->filename, &st) == 0 && S_ISREG(st.st_mode)) {
+        uint64_t ids[] = {
+            st.st_dev, st.st_ino, st.st_mtime,
+#ifdef CONFIG_DARWIN
+            st.st_mtimespec.tv_nsec,
+#else
+            st.st_mtim.tv_nsec,
+#endif
+        };
+        h = fnv1a(h, ids, sizeof(ids));
+    }
+
+    if (len > 0) {
+        buf = g_malloc(len);
+        ret = bdrv_pread(bs->file, 0, len, buf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the image");
+            return ret;
+        }
+        h = fnv1a(h, buf, len);
+    }
+
+    *generation = h;
+    return 0;
+}
+
+static uint64_t shared_cache_image_key(const char *cache_id, int64_t size,
+                                       uint64_t generation)
+{
+    uint64_t h = FNV1A_INIT;
+
+    h = fnv1a(h, cache_id, strlen(cache_id));
+    h = fnv1a(h, &size, sizeof(size));
+    h = fnv1a(h, &generation, sizeof(generation));
+
+    return h ?: 1;
+}
+
+static uint32_t shared_cache_checksum(BDRVSharedCacheState *s,
+                                      uint64_t image_key, uint64_t cluster,
+                                      const uint8_t *data)
+{
+    uint32_t crc = 0xffffffff;
+
+    crc = crc32c(crc, (const uint8_t *)&image_key, sizeof(image_key));
+    crc = crc32c(crc, (const uint8_t *)&cluster, sizeof(cluster));
+    return crc32c(crc, data, s->cluster_size);
+}
+
+static int shared_cache_init_file(BDRVSharedCacheState *s, uint64_t size,
+                                  uint32_t cluster_size, mode_t mode,
+                                  Error **errp)
+{
+    SharedCacheHeader *header;
+    uint64_t data_offset;
+    uint64_t nb_slots;
+    void *map;
+
+    nb_slots = (size - qemu_real_host_page_size()) /
+        (cluster_size + sizeof(SharedCacheSlot));
+    nb_slots = MIN(nb_slots, UINT32_MAX);
+    if (nb_slots == 0) {
+        error_setg(errp, "cache-size is too small for cluster-size %" PRIu32,
+                   cluster_size);
+        return -EINVAL;
+    }
+
+    data_offset = ROUND_UP(sizeof(SharedCacheHeader) +
+                           nb_slots * sizeof(SharedCacheSlot),
+                           qemu_real_host_page_size());
+    size = data_offset + nb_slots * cluster_size;
+
+    /* Do not let the umask get in the way of sharing with other users */
+    if (fchmod(s->fd, mode) < 0) {
+        error_setg_errno(errp, errno, "Could not set the cache file mode");
+        return -errno;
+    }
+
+    if (ftruncate(s->fd, size) < 0) {
+        error_setg_errno(errp, errno, "Could not resize the cache file");
+        return -errno;
+    }
+
+    /* A fresh (or previously half-initialized) file must not hold stale data */
+    map = mmap(NULL, data_offset, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map the cache file");
+        return -errno;
+    }
+    memset(map, 0, data_offset);
+
+    header = map;
+    header->version = SHARED_CACHE_VERSION;
+    header->cluster_size = cluster_size;
+    header->nb_slots = nb_slots;
+    header->data_offset = data_offset;
+    header->file_size = size;
+    smp_wmb();
+    header->magic = SHARED_CACHE_MAGIC;
+
+    munmap(map, data_offset);
+    return 0;
+}
+
+static int shared_cache_map(BDRVSharedCacheState *s, const char *path,
+                            uint64_t size, uint32_t cluster_size, mode_t mode,
+                            Error **errp)
+{
+    SharedCacheHeader header;
+    struct stat st;
+    ssize_t len;
+    int ret;
+
+    s->fd = qemu_create(path, O_RDWR | O_CLOEXEC, mode, errp);
+    if (s->fd < 0) {
+        return -errno;
+    }
+
+    /* Serialize the initialization with other processes */
+    if (flock(s->fd, LOCK_EX) < 0) {
+        error_setg_errno(errp, errno, "Could not lock the cache file");
+        ret = -errno;
+        goto fail;
+    }
+
+    len = pread(s->fd, &header, sizeof(header), 0);
+    if (len < 0) {
+        error_setg_errno(errp, errno, "Could not read the cache file header");
+        ret = -errno;
+        goto fail;
+    }
+
+    if (len < sizeof(header) || header.magic == 0) {
+        ret = shared_cache_init_file(s, size, cluster_size, mode, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+        len = pread(s->fd, &header, sizeof(header), 0);
+        if (len != sizeof(header)) {
+            error_setg(errp, "Could not read the cache file header");
+            ret = -EIO;
+            goto fail;
+        }
+    }
+
+    if (header.magic != SHARED_CACHE_MAGIC ||
+        header.version != SHARED_CACHE_VERSION) {
+        error_setg(errp, "'%s' is not a shared cache file", path);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (header.cluster_size != cluster_size) {
+        error_setg(errp, "The cache file uses a cluster size of %" PRIu32
+                   ", but %" PRIu32 " was requested",
+                   header.cluster_size, cluster_size);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    if (fstat(s->fd, &st) < 0 || st.st_size != header.file_size ||
+        header.data_offset + header.nb_slots * cluster_size !=
+            header.file_size) {
+        error_setg(errp, "The cache file '%s' is corrupted", path);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    s->map_size = header.file_size;
+    s->map = mmap(NULL, s->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                  s->fd, 0);
+    if (s->map == MAP_FAILED) {
+        error_setg_errno(errp, errno, "Could not map the cache file");
+        s->map = NULL;
+        ret = -errno;
+        goto fail;
+    }
+
+    s->nb_slots = header.nb_slots;
+    s->cluster_size = cluster_size;
+    s->slots = s->map + sizeof(SharedCacheHeader);
+    s->data = s->map + header.data_offset;
+
+    flock(s->fd, LOCK_UN);
+    return 0;
+
+fail:
+    qemu_close(s->fd);
+    s->fd = -1;
+    return ret;
+}
+
+static int shared_cache_open(BlockDriverState *bs, QDict *options, int flags,
+                             Error **errp)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    const char *cache_file, *cache_id;
+    uint64_t cache_size, cluster_size, cache_file_mode;
+    uint64_t generation;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    s->fd = -1;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_apply_auto_read_only(bs, "The shared-cache driver only "
+                                    "supports read-only nodes", errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    cache_file = qemu_opt_get(opts, SHARED_CACHE_OPT_CACHE_FILE);
+    cache_id = qemu_opt_get(opts, SHARED_CACHE_OPT_CACHE_ID);
+    cache_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CACHE_SIZE, 1 * GiB);
+    cluster_size = qemu_opt_get_size(opts, SHARED_CACHE_OPT_CLUSTER_SIZE,
+                                     64 * KiB);
+    cache_file_mode = qemu_opt_get_number(opts,
+                                          SHARED_CACHE_OPT_CACHE_FILE_MODE,
+                                          0600);
+
+    if (!cache_file || !cache_id) {
+        error_setg(errp, "The shared-cache driver requires the '"
+                   SHARED_CACHE_OPT_CACHE_FILE "' and '"
+                   SHARED_CACHE_OPT_CACHE_ID "' options");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!is_power_of_2(cluster_size) ||
+        cluster_size < SHARED_CACHE_MIN_CLUSTER_SIZE ||
+        cluster_size > SHARED_CACHE_MAX_CLUSTER_SIZE ||
+        cluster_size < qemu_real_host_page_size()) {
+        error_setg(errp, "cluster-size must be a power of two between "
+                   "the host page size and 2M");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (!QEMU_IS_ALIGNED(cluster_size, bs->file->bs->bl.request_alignment)) {
+        error_setg(errp, "cluster-size is not aligned to the request "
+                   "alignment of the filtered node (%" PRIu32 ")",
+                   bs->file->bs->bl.request_alignment);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (cache_size < qemu_real_host_page_size() + cluster_size) {
+        error_setg(errp, "cache-size is too small");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    if (cache_file_mode & ~(uint64_t)0777) {
+        error_setg(errp, "cache-file-mode may only contain permission bits");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        error_setg_errno(errp, -s->image_size, "Failed to get image length");
+        ret = s->image_size;
+        goto out;
+    }
+    ret = shared_cache_image_generation(bs, s->image_size, &generation, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    s->image_key = shared_cache_image_key(cache_id, s->image_size, generation);
+
+    ret = shared_cache_map(s, cache_file, cache_size, cluster_size,
+                           cache_file_mode, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    trace_shared_cache_open(bs, cache_file, s->nb_slots, s->cluster_size);
+    ret = 0;
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void shared_cache_close(BlockDriverState *bs)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+
+    if (s->map) {
+        munmap(s->map, s->map_size);
+        s->map = NULL;
+    }
+    if (s->fd >= 0) {
+        qemu_close(s->fd);
+        s->fd = -1;
+    }
+}
+
+static int shared_cache_reopen_prepare(BDRVReopenState *reopen_state,
+                                       BlockReopenQueue *queue, Error **errp)
+{
+    if (reopen_state->flags & BDRV_O_RDWR) {
+        error_setg(errp, "The shared-cache driver only supports read-only "
+                   "nodes");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static SharedCacheSlot *shared_cache_slot(BDRVSharedCacheState *s,
+                                          uint64_t cluster, uint8_t **data)
+{
+    uint64_t index = qemu_xxhash4(s->image_key, cluster) % s->nb_slots;
+
+    *data = s->data + index * s->cluster_size;
+    return &s->slots[index];
+}
+
+/*
+ * Copy @bytes at @offset_in_cluster of @cluster from the cache to @qiov,
+ * using @bounce (of cluster size) to verify the checksum on a stable copy.
+ * Returns false on a cache miss, in which case @qiov is left untouched.
+ */
+static bool shared_cache_lookup(BDRVSharedCacheState *s, uint64_t cluster,
+                                int64_t offset_in_cluster, int64_t bytes,
+                                QEMUIOVector *qiov, size_t qiov_offset,
+                                uint8_t *bounce)
+{
+    uint8_t *data;
+    SharedCacheSlot *slot = shared_cache_slot(s, cluster, &data);
+    uint32_t seq, checksum;
+
+    seq = qatomic_load_acquire(&slot->seq);
+    if (seq & 1) {
+        return false;
+    }
+    if (slot->image_key != s->image_key || slot->cluster != cluster) {
+        return false;
+    }
+    checksum = slot->checksum;
+
+    memcpy(bounce, data, s->cluster_size);
+
+    smp_rmb();
+    if (qatomic_read(&slot->seq) != seq ||
+        shared_cache_checksum(s, s->image_key, cluster, bounce) != checksum) {
+        return false;
+    }
+
+    qemu_iovec_from_buf(qiov, qiov_offset, bounce + offset_in_cluster, bytes);
+    return true;
+}
+
+/*
+ * Claim @slot for filling.  A slot that has been busy for too long is taken
+ * over.  Returns the new (odd) sequence number, or 0 if the slot is busy.
+ */
+static uint32_t shared_cache_claim(BlockDriverState *bs,
+                                   SharedCacheSlot *slot, uint64_t cluster)
+{
+    uint32_t seq = qatomic_read(&slot->seq);
+    uint32_t now = get_clock() / NANOSECONDS_PER_SECOND;
+
+    if (seq & 1) {
+        uint32_t busy_since = qatomic_read(&slot->busy_since);
+
+        /* A timestamp in the future is left over from before a reboot */
+        if (busy_since <= now &&
+            now - busy_since < SHARED_CACHE_BUSY_TIMEOUT) {
+            return 0;
+        }
+        if (qatomic_cmpxchg(&slot->seq, seq, seq + 2) != seq) {
+            return 0;
+        }
+        trace_shared_cache_reclaim(bs, cluster, seq);
+        seq += 2;
+    } else {
+        if (qatomic_cmpxchg(&slot->seq, seq, seq + 1) != seq) {
+            return 0;
+        }
+        seq += 1;
+    }
+
+    qatomic_set(&slot->busy_since, now);
+    return seq;
+}
+
+/*
+ * Read @cluster from the filtered node directly into its cache slot and copy
+ * the requested part to @qiov. Returns -EBUSY without doing anything if the
+ * slot is being filled by someone else.
+ *
+ * If the slot has been taken over while we were filling it, the data we
+ * copied may have been overwritten by the new owner, so it is read again.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_fill(BlockDriverState *bs, uint64_t cluster,
+                  int64_t offset_in_cluster, int64_t bytes,
+                  QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    uint8_t *data;
+    SharedCacheSlot *slot = shared_cache_slot(s, cluster, &data);
+    uint32_t seq;
+    int ret;
+
+    seq = shared_cache_claim(bs, slot, cluster);
+    if (!seq) {
+        return -EBUSY;
+    }
+
+    /* The slot is page-aligned, so this works with O_DIRECT as well */
+    ret = bdrv_co_pread(bs->file, cluster * s->cluster_size, s->cluster_size,
+                        data, 0);
+    if (ret < 0) {
+        slot->image_key = 0;
+    } else {
+        qemu_iovec_from_buf(qiov, qiov_offset, data + offset_in_cluster,
+                            bytes);
+        slot->checksum = shared_cache_checksum(s, s->image_key, cluster, data);
+        slot->image_key = s->image_key;
+        slot->cluster = cluster;
+    }
+
+    if (qatomic_cmpxchg(&slot->seq, seq, seq + 1) != seq && ret >= 0) {
+        return bdrv_co_preadv_part(bs->file, cluster * s->cluster_size +
+                                   offset_in_cluster, bytes, qiov,
+                                   qiov_offset, 0);
+    }
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+shared_cache_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, QEMUIOVector *qiov,
+                            size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVSharedCacheState *s = bs->opaque;
+    g_autofree uint8_t *bounce = NULL;
+    int ret;
+
+    if (flags & BDRV_REQ_PREFETCH) {
+        return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+    }
+
+    while (bytes) {
+        uint64_t cluster = offset / s->cluster_size;
+        int64_t offset_in_cluster = offset - cluster * s->cluster_size;
+        int64_t n = MIN(bytes, s->cluster_size - offset_in_cluster);
+        bool hit;
+
+        /* The partial cluster at the end of the image is never cached */
+        if ((cluster + 1) * s->cluster_size > s->image_size) {
+            return bdrv_co_preadv_part(bs->file, offset, bytes, qiov,
+                                       qiov_offset, flags);
+        }
+
+        if (!bounce) {
+            bounce = g_malloc(s->cluster_size);
+        }
+        hit = shared_cache_lookup(s, cluster, offset_in_cluster, n,
+                                  qiov, qiov_offset, bounce);
+        trace_shared_cache_lookup(bs, cluster, hit);
+
+        if (!hit) {
+            ret = shared_cache_fill(bs, cluster, offset_in_cluster, n,
+                                    qiov, qiov_offset);
+            if (ret == -EBUSY) {
+                ret = bdrv_co_preadv_part(bs->file, offset, n, qiov,
+                                          qiov_offset, flags);
+            }
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+shared_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void shared_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+    BdrvChildRole role, BlockReopenQueue *reopen_queue,
+    uint64_t perm, uint64_t shared, uint64_t *nperm, uint64_t *nshared)
+{
+    bdrv_default_perms(bs, c, role, reopen_queue, perm, shared, nperm, nshared);
+
+    /*
+     * The cached data is only valid as long as the image does not change,
+     * so nobody may write to or resize it while it is being cached.
+     */
+    *nperm |= BLK_PERM_CONSISTENT_READ;
+    *nshared &= ~(BLK_PERM_WRITE | BLK_PERM_RESIZE);
+}
+
+static BlockDriver bdrv_shared_cache_filter = {
+    .format_name = "shared-cache",
+    .instance_size = sizeof(BDRVSharedCacheState),
+
+    .bdrv_co_getlength    = shared_cache_co_getlength,
+    .bdrv_open            = shared_cache_open,
+    .bdrv_close           = shared_cache_close,
+
+    .bdrv_reopen_prepare  = shared_cache_reopen_prepare,
+
+    .bdrv_co_preadv_part = shared_cache_co_preadv_part,
+
+    .bdrv_child_perm = shared_cache_child_perm,
+
+    .is_filter = true,
+};
+
+static void bdrv_shared_cache_init(void)
+{
+    bdrv_register(&bdrv_shared_cache_filter);
+}
+
+block_init(bdrv_shared_cache_init);
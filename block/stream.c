@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "trace.h"
+#include "block/aio_task.h"
 #include "block/block_int.h"
 #include "block/blockjob_int.h"
 #include "qapi/error.h"
@@ -41,8 +42,22 @@ typedef struct StreamBlockJob {
     char *backing_file_str;
     bool backing_mask_protocol;
     bool bs_read_only;
+    int max_workers;
+
+    /* The first failed request since the last error was handled */
+    int error_ret;
+    int64_t error_offset;
+    /* Total size of the failed requests */
+    int64_t failed_bytes;
 } StreamBlockJob;
 
+typedef struct StreamTask {
+    AioTask task;
+    StreamBlockJob *s;
+    int64_t offset;
+    int64_t bytes;
+} StreamTask;
+
 static int coroutine_fn stream_populate(BlockBackend *blk,
                                         int64_t offset, uint64_t bytes)
 {
@@ -51,6 +66,40 @@ static int coroutine_fn stream_populate(BlockBackend *blk,
     return blk_co_preadv(blk, offset, bytes, NULL, BDRV_REQ_PREFETCH);
 }
 
+static void stream_set_error(StreamBlockJob *s, int64_t offset, int64_t bytes,
+                             int ret)
+{
+    if (!s->error_ret || offset < s->error_offset) {
+        s->error_ret = ret;
+        s->error_offset = offset;
+    }
+    s->failed_bytes += bytes;
+}
+
+static void stream_reset_error(StreamBlockJob *s)
+{
+    s->error_ret = 0;
+    s->error_offset = INT64_MAX;
+    s->failed_bytes = 0;
+}
+
+static int coroutine_fn stream_task_entry(AioTask *task)
+{
+    StreamTask *t = container_of(task, StreamTask, task);
+    StreamBlockJob *s = t->s;
+    int ret;
+
+    ret = stream_populate(s->blk, t->offset, t->bytes);
+    if (ret < 0) {
+        stream_set_error(s, t->offset, t->bytes, ret);
+        return ret;
+    }
+
+    /* Publish progress */
+    job_progress_update(&s->common.job, t->bytes);
+    return 0;
+}
+
 static int stream_prepare(Job *job)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
@@ -156,6 +205,7 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
 {
     StreamBlockJob *s = container_of(job, StreamBlockJob, common.job);
     BlockDriverState *unfiltered_bs = NULL;
+    AioTaskPool *pool;
     int64_t len = -1;
     int64_t offset = 0;
     int error = 0;
@@ -175,22 +225,69 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
     }
     job_progress_set_remaining(&s->common.job, len);
 
-    for ( ; offset < len; offset += n) {
+    pool = aio_task_pool_new(s->max_workers);
+    stream_reset_error(s);
+
+    while (true) {
+        StreamTask *t;
         bool copy;
         int ret = -1;
 
         /* Note that even when no rate limit is applied we need to yield
-         * with no pending I/O here so that bdrv_drain_all() returns.
+         * here so that the job can be paused for bdrv_drain_all().
          */
         block_job_ratelimit_sleep(&s->common);
         if (job_is_cancelled(&s->common.job)) {
             break;
         }
 
+        aio_task_pool_wait_slot(pool);
+        if (s->error_ret < 0 || offset >= len) {
+            aio_task_pool_wait_all(pool);
+        }
+
+        if (s->error_ret < 0) {
+            BlockErrorAction action =
+                block_job_error_action(&s->common, s->on_error, true,
+                                       -s->error_ret);
+            if (action == BLOCK_ERROR_ACTION_STOP) {
+                /*
+                 * Retry from the first failed request.  Requests after it
+                 * that did succeed will be repeated, so account for them
+                 * again.
+                 */
+                job_progress_increase_remaining(&s->common.job,
+                                                offset - s->error_offset -
+                                                s->failed_bytes);
+                offset = s->error_offset;
+                stream_reset_error(s);
+                continue;
+            }
+            if (error == 0) {
+                error = s->error_ret;
+            }
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                break;
+            }
+
+            /* Ignored, so count the failed requests as done */
+            job_progress_update(&s->common.job, s->failed_bytes);
+            stream_reset_error(s);
+        }
+
+        if (offset >= len) {
+            break;
+        }
+
         copy = false;
 
+        /*
+         * Query the whole remaining range so that areas that need no
+         * copying are skipped in one go.
+         */
         WITH_GRAPH_RDLOCK_GUARD() {
-            ret = bdrv_co_is_allocated(unfiltered_bs, offset, STREAM_CHUNK, &n);
+            ret = bdrv_co_is_allocated(unfiltered_bs, offset, len - offset,
+                                       &n);
             if (ret == 1) {
                 /* Allocated in the top, no need to copy.  */
             } else if (ret >= 0) {
@@ -210,31 +307,33 @@ static int coroutine_fn stream_run(Job *job, Error **errp)
             }
         }
         trace_stream_one_iteration(s, offset, n, ret);
-        if (copy) {
-            ret = stream_populate(s->blk, offset, n);
-        }
         if (ret < 0) {
-            BlockErrorAction action =
-                block_job_error_action(&s->common, s->on_error, true, -ret);
-            if (action == BLOCK_ERROR_ACTION_STOP) {
-                n = 0;
-                continue;
-            }
-            if (error == 0) {
-                error = ret;
-            }
-            if (action == BLOCK_ERROR_ACTION_REPORT) {
-                break;
-            }
+            stream_set_error(s, offset, 0, ret);
+            continue;
         }
 
-        /* Publish progress */
-        job_progress_update(&s->common.job, n);
         if (copy) {
+            n = MIN(n, STREAM_CHUNK);
+
+            t = g_new(StreamTask, 1);
+            *t = (StreamTask) {
+                .task.func  = stream_task_entry,
+                .s          = s,
+                .offset     = offset,
+                .bytes      = n,
+            };
+            aio_task_pool_start_task(pool, &t->task);
             block_job_ratelimit_processed_bytes(&s->common, n);
+        } else {
+            /* Publish progress */
+            job_progress_update(&s->common.job, n);
         }
+        offset += n;
     }
 
+    aio_task_pool_wait_all(pool);
+    aio_task_pool_free(pool);
+
     /* Do not remove the backing file if an error was there but ignored. */
     return error;
 }
@@ -256,7 +355,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   bool backing_mask_protocol,
                   BlockDriverState *bottom,
                   int creation_flags, int64_t speed,
-                  BlockdevOnError on_error,
+                  BlockdevOnError on_error, int64_t max_workers,
                   const char *filter_node_name,
                   Error **errp)
 {
@@ -275,6 +374,11 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     assert(!(base && bottom));
     assert(!(backing_file_str && bottom));
 
+    if (max_workers < 1 || max_workers > INT_MAX) {
+        error_setg(errp, "max-workers must be between 1 and %d", INT_MAX);
+        return;
+    }
+
     bdrv_graph_rdlock_main_loop();
 
     if (bottom) {
@@ -411,6 +515,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
     s->bs_read_only = bs_read_only;
 
     s->on_error = on_error;
+    s->max_workers = max_workers;
     trace_stream_start(bs, base, s);
     job_start(&s->common.job);
     return;
@@ -0,0 +1,1292 @@
+/*
+ * Write-back cache filter driver
+ *
+ * The driver puts a fast cache node (typically a file on a local SSD) in
+ * front of a slow image node (typically on NFS or RBD). Writes are appended
+ * to a persistent log on the cache node and complete as soon as the log
+ * write does. A background coroutine copies ("destages") the logged data to
+ * the image node in log order, merging records for adjacent guest ranges
+ * into single requests. Reads of data that is still in the log are served
+ * from the cache node.
+ *
+ * The log is a ring buffer of records, each consisting of a header block and
+ * the written data. The super block at the start of the cache node points to
+ * the oldest record that has not been destaged yet; it is advanced only after
+ * the image node has been flushed. When the node is opened, the records are
+ * replayed in sequence order until the first incomplete one, so after a
+ * crash only writes that were not covered by a completed flush can be lost.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+
+#include "qapi/error.h"
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "trace.h"
+
+#define WBC_SUPER_MAGIC     0x51454d5557424353ULL /* "QEMUWBCS" */
+#define WBC_RECORD_MAGIC    0x51454d5557424352ULL /* "QEMUWBCR" */
+#define WBC_VERSION         1
+
+#define WBC_BLOCK_SIZE      4096
+#define WBC_LOG_START       WBC_BLOCK_SIZE
+#define WBC_MAX_RECORD      (1 * MiB)
+#define WBC_DESTAGE_MAX     (4 * MiB)
+#define WBC_MIN_LOG_SIZE    (16 * MiB)
+
+/* All fields are little-endian. */
+typedef struct QEMU_PACKED WBCSuperBlock {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t crc;           /* of the structure with @crc set to 0 */
+    uint64_t log_id;        /* random, tells current records from stale ones */
+    uint64_t image_size;
+    uint64_t log_end;
+    uint64_t tail;          /* oldest record that has not been destaged */
+    uint64_t tail_seq;
+} WBCSuperBlock;
+
+typedef struct QEMU_PACKED WBCRecordHeader {
+    uint64_t magic;
+    uint64_t log_id;
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t bytes;         /* 0 for padding up to the end of the log */
+    uint32_t data_crc;
+    uint32_t crc;           /* of the structure with @crc set to 0 */
+} WBCRecordHeader;
+
+typedef struct WBCRecord {
+    uint64_t seq;
+    int64_t log_offset;     /* of the header block */
+    int64_t log_bytes;      /* including the header block */
+    int64_t offset;         /* guest range; @bytes is 0 for padding */
+    int64_t bytes;
+
+    bool complete;          /* the log write has finished */
+    bool destaged;          /* the data is on the image node */
+    int readers;            /* reads from the log data in flight */
+
+    QTAILQ_ENTRY(WBCRecord) next;
+    QTAILQ_ENTRY(WBCRecord) next_in_flight;
+} WBCRecord;
+
+typedef struct WBCBlock {
+    int64_t index;          /* guest offset / WBC_BLOCK_SIZE, the hash key */
+    WBCRecord *record;      /* newest completed record containing the block */
+} WBCBlock;
+
+typedef struct BDRVWritebackCacheState {
+    BdrvChild *cache;
+
+    uint64_t log_id;
+    int64_t image_size;
+    int64_t log_end;
+    /* The super block on the cache node describes this log */
+    bool formatted;
+
+    /* Protects the fields below */
+    CoMutex lock;
+
+    /* Records in log order; the destaged ones form a prefix */
+    QTAILQ_HEAD(, WBCRecord) records;
+    /* Records whose log write is in flight, in log order */
+    QTAILQ_HEAD(, WBCRecord) in_flight;
+    /* Maps guest blocks that are only in the log to their WBCBlock */
+    GHashTable *blocks;
+
+    int64_t head;
+    uint64_t next_seq;
+    uint64_t last_complete_seq;
+    int64_t used;
+    int64_t destaged_bytes;
+
+    /* A failed log write makes the rest of the log unrecoverable */
+    int log_ret;
+    int destage_ret;
+    bool destage_running;
+
+    CoQueue space_queue;    /* writers waiting for log space */
+    CoQueue complete_queue; /* flushes waiting for earlier log writes */
+    CoQueue reader_queue;   /* destaging waiting for log readers */
+    CoQueue destage_queue;  /* waiting for destaging to stop */
+
+    /* Stops background destaging; only changes while the node is drained */
+    bool drained;
+} BDRVWritebackCacheState;
+
+static void wbc_header_set_crc(WBCRecordHeader *header)
+{
+    header->crc = 0;
+    header->crc = cpu_to_le32(crc32c(0xffffffff, (uint8_t *)header,
+                                     sizeof(*header)));
+}
+
+static bool wbc_header_valid(BDRVWritebackCacheState *s,
+                             WBCRecordHeader *header, uint64_t seq)
+{
+    uint32_t crc = le32_to_cpu(header->crc);
+
+    wbc_header_set_crc(header);
+    return le32_to_cpu(header->crc) == crc &&
+        le64_to_cpu(header->magic) == WBC_RECORD_MAGIC &&
+        le64_to_cpu(header->log_id) == s->log_id &&
+        le64_to_cpu(header->seq) == seq;
+}
+
+static int64_t wbc_log_tail(BDRVWritebackCacheState *s)
+{
+    int64_t tail = s->head - s->used;
+
+    return tail < WBC_LOG_START ? tail + s->log_end - WBC_LOG_START : tail;
+}
+
+/* Called with s->lock held */
+static WBCRecord *wbc_record_new(BDRVWritebackCacheState *s, int64_t log_bytes,
+                                 int64_t offset, int64_t bytes)
+{
+    WBCRecord *rec = g_new0(WBCRecord, 1);
+
+    rec->seq = s->next_seq++;
+    rec->log_offset = s->head;
+    rec->log_bytes = log_bytes;
+    rec->offset = offset;
+    rec->bytes = bytes;
+    QTAILQ_INSERT_TAIL(&s->records, rec, next);
+
+    s->used += log_bytes;
+    s->head += log_bytes;
+    if (s->head == s->log_end) {
+        s->head = WBC_LOG_START;
+    }
+
+    return rec;
+}
+
+/* Called with s->lock held */
+static void wbc_index_add(BDRVWritebackCacheState *s, WBCRecord *rec)
+{
+    int64_t i;
+
+    for (i = rec->offset / WBC_BLOCK_SIZE;
+         i < (rec->offset + rec->bytes) / WBC_BLOCK_SIZE; i++)
+    {
+        WBCBlock *b = g_hash_table_lookup(s->blocks, &i);
+
+        if (!b) {
+            b = g_new(WBCBlock, 1);
+            b->index = i;
+            g_hash_table_insert(s->blocks, &b->index, b);
+        } else if (b->record->seq > rec->seq) {
+            /* Overwritten by a request that completed earlier */
+            continue;
+        }
+        b->record = rec;
+    }
+}
+
+/*
+ * Drop the blocks in the guest range from @first to @last that are mapped to
+ * one of the records from @first to @last. Called with s->lock held.
+ */
+static void wbc_index_remove(BDRVWritebackCacheState *s, WBCRecord *first,
+                             WBCRecord *last)
+{
+    int64_t i;
+
+    for (i = first->offset / WBC_BLOCK_SIZE;
+         i < (last->offset + last->bytes) / WBC_BLOCK_SIZE; i++)
+    {
+        WBCBlock *b = g_hash_table_lookup(s->blocks, &i);
+
+        if (b && b->record->seq >= first->seq && b->record->seq <= last->seq) {
+            g_hash_table_remove(s->blocks, &i);
+        }
+    }
+}
+
+/*
+ * Return the length of the run at @offset whose blocks are all in the log
+ * data of the same record, stored in *@rec, or all not in the log (*@rec is
+ * NULL then). Called with s->lock held.
+ */
+static int64_t wbc_index_lookup(BDRVWritebackCacheState *s, int64_t offset,
+                                int64_t bytes, WBCRecord **rec)
+{
+    int64_t i = offset / WBC_BLOCK_SIZE;
+    int64_t end = (offset + bytes) / WBC_BLOCK_SIZE;
+    WBCBlock *b;
+
+    if (g_hash_table_size(s->blocks) == 0) {
+        *rec = NULL;
+        return bytes;
+    }
+
+    b = g_hash_table_lookup(s->blocks, &i);
+    *rec = b ? b->record : NULL;
+    for (i++; i < end; i++) {
+        b = g_hash_table_lookup(s->blocks, &i);
+        if ((b ? b->record : NULL) != *rec) {
+            break;
+        }
+    }
+
+    return i * WBC_BLOCK_SIZE - offset;
+}
+
+/*
+ * Return the length of the run at @offset whose blocks are all (*@live is
+ * true) or all not (*@live is false) mapped to one of the records from @first
+ * to @last. Called with s->lock held.
+ */
+static int64_t wbc_index_live_run(BDRVWritebackCacheState *s, int64_t offset,
+                                  int64_t bytes, WBCRecord *first,
+                                  WBCRecord *last, bool *live)
+{
+    int64_t i = offset / WBC_BLOCK_SIZE;
+    int64_t end = (offset + bytes) / WBC_BLOCK_SIZE;
+
+    *live = false;
+    for (; i < end; i++) {
+        WBCBlock *b = g_hash_table_lookup(s->blocks, &i);
+        bool this_live = b && b->record->seq >= first->seq &&
+            b->record->seq <= last->seq;
+
+        if (i == offset / WBC_BLOCK_SIZE) {
+            *live = this_live;
+        } else if (this_live != *live) {
+            break;
+        }
+    }
+
+    return i * WBC_BLOCK_SIZE - offset;
+}
+
+static void coroutine_fn wbc_destage_entry(void *opaque);
+
+/*
+ * Start background destaging unless it is already running. @force starts it
+ * even while the node is drained, for writers waiting for log space.
+ * Called with s->lock held or while the node is drained.
+ */
+static void wbc_kick_destage(BlockDriverState *bs, bool force)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    Coroutine *co;
+
+    if (s->destage_running || (qatomic_read(&s->drained) && !force) ||
+        !(bs->open_flags & BDRV_O_RDWR) || (bs->open_flags & BDRV_O_INACTIVE))
+    {
+        return;
+    }
+
+    s->destage_running = true;
+    bdrv_inc_in_flight(bs);
+    co = qemu_coroutine_create(wbc_destage_entry, bs);
+    aio_co_enter(bdrv_get_aio_context(bs), co);
+}
+
+/*
+ * Reserve log space for a record of @bytes at @offset, preceded by a padding
+ * record in *@padding if the record has to wrap around. Returns NULL if the
+ * log is full. Called with s->lock held.
+ */
+static WBCRecord *wbc_log_alloc(BDRVWritebackCacheState *s, int64_t offset,
+                                int64_t bytes, WBCRecord **padding)
+{
+    int64_t log_bytes = WBC_BLOCK_SIZE + bytes;
+    int64_t tail = wbc_log_tail(s);
+    WBCRecord *rec;
+
+    *padding = NULL;
+    if (s->used && s->head <= tail) {
+        /* The free space is [head, tail) */
+        if (s->head + log_bytes > tail) {
+            return NULL;
+        }
+    } else if (s->head + log_bytes > s->log_end) {
+        /* The free space is [head, log_end) and [WBC_LOG_START, tail) */
+        if (WBC_LOG_START + log_bytes > tail) {
+            return NULL;
+        }
+        *padding = wbc_record_new(s, s->log_end - s->head, 0, 0);
+        QTAILQ_INSERT_TAIL(&s->in_flight, *padding, next_in_flight);
+    }
+
+    rec = wbc_record_new(s, log_bytes, offset, bytes);
+    QTAILQ_INSERT_TAIL(&s->in_flight, rec, next_in_flight);
+    return rec;
+}
+
+/* Called with s->lock held */
+static void wbc_record_complete(BlockDriverState *bs, WBCRecord *rec, int ret)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+
+    QTAILQ_REMOVE(&s->in_flight, rec, next_in_flight);
+    rec->complete = true;
+
+    if (ret < 0) {
+        /*
+         * Replaying stops at the first invalid record, so the records after
+         * this one could not be recovered after a crash. Fail all further
+         * writes; the record itself is dropped like padding.
+         */
+        if (!s->log_ret) {
+            s->log_ret = ret;
+        }
+        rec->bytes = 0;
+    } else if (rec->bytes) {
+        wbc_index_add(s, rec);
+        s->last_complete_seq = MAX(s->last_complete_seq, rec->seq);
+    }
+
+    qemu_co_queue_restart_all(&s->complete_queue);
+    wbc_kick_destage(bs, !qemu_co_queue_empty(&s->space_queue));
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+wbc_write_super(BlockDriverState *bs, int64_t tail, uint64_t tail_seq)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCSuperBlock *sb = qemu_blockalign0(s->cache->bs, WBC_BLOCK_SIZE);
+    int ret;
+
+    *sb = (WBCSuperBlock) {
+        .magic      = cpu_to_le64(WBC_SUPER_MAGIC),
+        .version    = cpu_to_le32(WBC_VERSION),
+        .log_id     = cpu_to_le64(s->log_id),
+        .image_size = cpu_to_le64(s->image_size),
+        .log_end    = cpu_to_le64(s->log_end),
+        .tail       = cpu_to_le64(tail),
+        .tail_seq   = cpu_to_le64(tail_seq),
+    };
+    sb->crc = cpu_to_le32(crc32c(0xffffffff, (uint8_t *)sb, sizeof(*sb)));
+
+    ret = bdrv_pwrite(s->cache, 0, WBC_BLOCK_SIZE, sb, 0);
+    if (ret >= 0) {
+        ret = bdrv_flush(s->cache->bs);
+    }
+
+    qemu_vfree(sb);
+    return ret;
+}
+
+/*
+ * Copy the oldest records that are not on the image node yet to the image
+ * node, merging records for adjacent guest ranges. Returns 1 if progress was
+ * made, 0 if there is nothing to do and -errno on failure.
+ * Called with s->lock held, which is dropped while doing I/O.
+ */
+static int coroutine_fn GRAPH_RDLOCK wbc_co_destage_one(BlockDriverState *bs)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCRecord *first, *last, *rec;
+    int64_t offset, bytes, pos, n;
+    uint8_t *buf;
+    bool live;
+    int ret = 0;
+
+    QTAILQ_FOREACH(first, &s->records, next) {
+        if (!first->destaged) {
+            break;
+        }
+    }
+    if (!first || !first->complete) {
+        return 0;
+    }
+
+    last = first;
+    if (first->bytes) {
+        while ((rec = QTAILQ_NEXT(last, next)) && rec->complete && rec->bytes &&
+               rec->offset == last->offset + last->bytes &&
+               rec->offset + rec->bytes - first->offset <= WBC_DESTAGE_MAX)
+        {
+            last = rec;
+        }
+    }
+
+    offset = first->offset;
+    bytes = last->offset + last->bytes - offset;
+
+    if (bytes) {
+        buf = qemu_try_blockalign(bs->file->bs, bytes);
+        if (!buf) {
+            return -ENOMEM;
+        }
+
+        /* Only destaging removes records, so the list is stable here */
+        qemu_co_mutex_unlock(&s->lock);
+        for (rec = first; ; rec = QTAILQ_NEXT(rec, next)) {
+            ret = bdrv_co_pread(s->cache, rec->log_offset + WBC_BLOCK_SIZE,
+                                rec->bytes, buf + rec->offset - offset, 0);
+            if (ret < 0 || rec == last) {
+                break;
+            }
+        }
+        qemu_co_mutex_lock(&s->lock);
+
+        /*
+         * Skip the blocks that have been overwritten in the meantime, and
+         * the padding of the last block if the image size is not aligned.
+         */
+        for (pos = offset; ret >= 0 && pos < offset + bytes; pos += n) {
+            n = wbc_index_live_run(s, pos, offset + bytes - pos, first, last,
+                                   &live);
+            if (live && pos < s->image_size) {
+                qemu_co_mutex_unlock(&s->lock);
+                ret = bdrv_co_pwrite(bs->file, pos,
+                                     MIN(n, s->image_size - pos),
+                                     buf + pos - offset, 0);
+                qemu_co_mutex_lock(&s->lock);
+            }
+        }
+
+        qemu_vfree(buf);
+        if (ret < 0) {
+            return ret;
+        }
+
+        wbc_index_remove(s, first, last);
+    }
+
+    trace_wbc_destage(bs, offset, bytes, first->seq, last->seq);
+
+    for (rec = first; ; rec = QTAILQ_NEXT(rec, next)) {
+        rec->destaged = true;
+        s->destaged_bytes += rec->log_bytes;
+        if (rec == last) {
+            break;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Make the log space of the destaged records available again. Called with
+ * s->lock held, which is dropped while doing I/O.
+ */
+static int coroutine_fn GRAPH_RDLOCK wbc_co_free_log(BlockDriverState *bs)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCRecord *rec, *next_rec;
+    int64_t tail;
+    uint64_t tail_seq;
+    bool freed = false;
+    int ret;
+
+    QTAILQ_FOREACH(rec, &s->records, next) {
+        if (!rec->destaged) {
+            break;
+        }
+    }
+    tail = rec ? rec->log_offset : s->head;
+    tail_seq = rec ? rec->seq : s->next_seq;
+
+    /* The super block must only point past data that is stable */
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret >= 0) {
+        ret = wbc_write_super(bs, tail, tail_seq);
+    }
+    qemu_co_mutex_lock(&s->lock);
+    if (ret < 0) {
+        return ret;
+    }
+
+    trace_wbc_free_log(bs, tail, tail_seq);
+
+    QTAILQ_FOREACH_SAFE(rec, &s->records, next, next_rec) {
+        if (rec->seq >= tail_seq) {
+            break;
+        }
+        while (rec->readers) {
+            qemu_co_queue_wait(&s->reader_queue, &s->lock);
+        }
+        QTAILQ_REMOVE(&s->records, rec, next);
+        s->used -= rec->log_bytes;
+        s->destaged_bytes -= rec->log_bytes;
+        g_free(rec);
+        freed = true;
+    }
+
+    /*
+     * Only wake up writers when there is new space for them; waking them up
+     * for nothing would make them kick destaging again right away.
+     */
+    if (freed) {
+        qemu_co_queue_restart_all(&s->space_queue);
+    }
+    return 0;
+}
+
+/*
+ * Destage records until there are none left or, unless @all is true, the
+ * node is drained and no writer is waiting for log space. Called with s->lock
+ * held.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_destage(BlockDriverState *bs, bool all)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    int64_t free_threshold = (s->log_end - WBC_LOG_START) / 8;
+    int ret;
+
+    while (true) {
+        ret = wbc_co_destage_one(bs);
+        if (ret < 0) {
+            return ret;
+        }
+        if (ret == 0 && !s->destaged_bytes) {
+            return 0;
+        }
+
+        /* Batch the flushes of the image node */
+        if (ret == 0 || s->destaged_bytes >= free_threshold ||
+            !qemu_co_queue_empty(&s->space_queue))
+        {
+            ret = wbc_co_free_log(bs);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
+        if (!all && qatomic_read(&s->drained) &&
+            qemu_co_queue_empty(&s->space_queue))
+        {
+            return 0;
+        }
+    }
+}
+
+static void coroutine_fn wbc_destage_entry(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    BDRVWritebackCacheState *s = bs->opaque;
+    int ret;
+
+    GRAPH_RDLOCK_GUARD();
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = wbc_co_destage(bs, false);
+    if (ret < 0) {
+        trace_wbc_destage_error(bs, ret);
+    }
+    s->destage_ret = ret;
+    s->destage_running = false;
+    if (ret < 0) {
+        /* Let the writers waiting for log space fail */
+        qemu_co_queue_restart_all(&s->space_queue);
+    }
+    qemu_co_queue_restart_all(&s->destage_queue);
+    qemu_co_mutex_unlock(&s->lock);
+
+    bdrv_dec_in_flight(bs);
+}
+
+typedef struct WBCDestageAllCo {
+    BlockDriverState *bs;
+    int ret;
+} WBCDestageAllCo;
+
+static void coroutine_fn wbc_destage_all_entry(void *opaque)
+{
+    WBCDestageAllCo *d = opaque;
+    BDRVWritebackCacheState *s = d->bs->opaque;
+    int ret;
+
+    GRAPH_RDLOCK_GUARD();
+
+    qemu_co_mutex_lock(&s->lock);
+    while (s->destage_running) {
+        qemu_co_queue_wait(&s->destage_queue, &s->lock);
+    }
+    s->destage_running = true;
+    ret = wbc_co_destage(d->bs, true);
+    s->destage_running = false;
+    qemu_co_queue_restart_all(&s->destage_queue);
+    qemu_co_mutex_unlock(&s->lock);
+
+    d->ret = ret;
+    aio_wait_kick();
+}
+
+/* Write all logged data back to the image node */
+static int wbc_destage_all(BlockDriverState *bs)
+{
+    WBCDestageAllCo d = {
+        .bs = bs,
+        .ret = -EINPROGRESS,
+    };
+
+    assert(!qemu_in_coroutine());
+    aio_co_enter(bdrv_get_aio_context(bs),
+                 qemu_coroutine_create(wbc_destage_all_entry, &d));
+    BDRV_POLL_WHILE(bs, d.ret == -EINPROGRESS);
+
+    return d.ret;
+}
+
+static int coroutine_mixed_fn GRAPH_RDLOCK
+wbc_replay(BlockDriverState *bs, int64_t tail, uint64_t tail_seq, Error **errp)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCRecordHeader *header;
+    uint8_t *buf;
+    int ret = 0;
+
+    s->head = tail;
+    s->next_seq = tail_seq;
+
+    buf = qemu_blockalign(s->cache->bs, WBC_BLOCK_SIZE + WBC_MAX_RECORD);
+    header = (WBCRecordHeader *)buf;
+
+    while (s->used + WBC_BLOCK_SIZE <= s->log_end - WBC_LOG_START) {
+        int64_t pos = s->head;
+        int64_t offset = 0, bytes, log_bytes;
+        WBCRecord *rec;
+
+        ret = bdrv_pread(s->cache, pos, WBC_BLOCK_SIZE, buf, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read the cache log");
+            goto out;
+        }
+        if (!wbc_header_valid(s, header, s->next_seq)) {
+            break;
+        }
+
+        bytes = le32_to_cpu(header->bytes);
+        if (bytes == 0) {
+            log_bytes = s->log_end - pos;
+        } else {
+            uint32_t data_crc = le32_to_cpu(header->data_crc);
+
+            offset = le64_to_cpu(header->offset);
+            log_bytes = WBC_BLOCK_SIZE + bytes;
+            if (bytes > WBC_MAX_RECORD ||
+                !QEMU_IS_ALIGNED(offset | bytes, WBC_BLOCK_SIZE) ||
+                offset + bytes > ROUND_UP(s->image_size, WBC_BLOCK_SIZE) ||
+                pos + log_bytes > s->log_end)
+            {
+                break;
+            }
+
+            ret = bdrv_pread(s->cache, pos + WBC_BLOCK_SIZE, bytes,
+                             buf + WBC_BLOCK_SIZE, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not read the cache log");
+                goto out;
+            }
+            if (crc32c(0xffffffff, buf + WBC_BLOCK_SIZE, bytes) != data_crc) {
+                break;
+            }
+        }
+
+        if (s->used + log_bytes > s->log_end - WBC_LOG_START) {
+            break;
+        }
+
+        rec = wbc_record_new(s, log_bytes, offset, bytes);
+        rec->complete = true;
+        if (bytes) {
+            wbc_index_add(s, rec);
+        }
+    }
+
+    s->last_complete_seq = s->next_seq - 1;
+    ret = 0;
+    trace_wbc_replay(bs, tail_seq, s->next_seq, s->used);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+/* Read the super block and replay the log, or format an empty cache node */
+static int coroutine_mixed_fn GRAPH_RDLOCK
+wbc_load(BlockDriverState *bs, Error **errp)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCSuperBlock sb;
+    int64_t cache_size;
+    uint32_t crc;
+    int ret;
+
+    s->image_size = bdrv_getlength(bs->file->bs);
+    if (s->image_size < 0) {
+        error_setg_errno(errp, -s->image_size, "Could not get image size");
+        return s->image_size;
+    }
+
+    cache_size = bdrv_getlength(s->cache->bs);
+    if (cache_size < 0) {
+        error_setg_errno(errp, -cache_size, "Could not get cache node size");
+        return cache_size;
+    }
+
+    memset(&sb, 0, sizeof(sb));
+    if (cache_size >= WBC_BLOCK_SIZE) {
+        ret = bdrv_pread(s->cache, 0, sizeof(sb), &sb, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret,
+                             "Could not read the cache super block");
+            return ret;
+        }
+    }
+
+    if (le64_to_cpu(sb.magic) != WBC_SUPER_MAGIC) {
+        s->log_id = ((uint64_t)g_random_int() << 32) | g_random_int();
+        s->log_end = QEMU_ALIGN_DOWN(cache_size, WBC_BLOCK_SIZE);
+        if (s->log_end - WBC_LOG_START < WBC_MIN_LOG_SIZE) {
+            error_setg(errp, "The cache node must be at least %" PRId64
+                       " bytes", (int64_t)(WBC_LOG_START + WBC_MIN_LOG_SIZE));
+            return -EINVAL;
+        }
+
+        s->head = WBC_LOG_START;
+        s->next_seq = 1;
+        s->last_complete_seq = 0;
+        s->formatted = false;
+
+        /*
+         * Formatting is left to whoever opens the node read-write, see also
+         * wbc_reopen_commit_post()
+         */
+        if ((bs->open_flags & BDRV_O_RDWR) &&
+            !(bs->open_flags & BDRV_O_INACTIVE))
+        {
+            ret = wbc_write_super(bs, s->head, s->next_seq);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Could not format the cache node");
+                return ret;
+            }
+            s->formatted = true;
+        }
+        return 0;
+    }
+
+    crc = le32_to_cpu(sb.crc);
+    sb.crc = 0;
+    if (crc32c(0xffffffff, (uint8_t *)&sb, sizeof(sb)) != crc) {
+        error_setg(errp, "The cache super block is corrupted");
+        return -EINVAL;
+    }
+
+    if (le32_to_cpu(sb.version) != WBC_VERSION) {
+        error_setg(errp, "Unsupported cache version %" PRIu32,
+                   le32_to_cpu(sb.version));
+        return -ENOTSUP;
+    }
+
+    if (le64_to_cpu(sb.image_size) != s->image_size) {
+        error_setg(errp, "The cache node belongs to an image of a different "
+                   "size");
+        return -EINVAL;
+    }
+
+    s->log_id = le64_to_cpu(sb.log_id);
+    s->log_end = le64_to_cpu(sb.log_end);
+    if (s->log_end > cache_size ||
+        !QEMU_IS_ALIGNED(s->log_end, WBC_BLOCK_SIZE) ||
+        s->log_end - WBC_LOG_START < WBC_MIN_LOG_SIZE ||
+        le64_to_cpu(sb.tail) < WBC_LOG_START ||
+        le64_to_cpu(sb.tail) >= s->log_end ||
+        !QEMU_IS_ALIGNED(le64_to_cpu(sb.tail), WBC_BLOCK_SIZE))
+    {
+        error_setg(errp, "The cache super block is corrupted");
+        return -EINVAL;
+    }
+
+    s->formatted = true;
+    return wbc_replay(bs, le64_to_cpu(sb.tail), le64_to_cpu(sb.tail_seq),
+                      errp);
+}
+
+static void wbc_init_state(BDRVWritebackCacheState *s)
+{
+    qemu_co_mutex_init(&s->lock);
+    QTAILQ_INIT(&s->records);
+    QTAILQ_INIT(&s->in_flight);
+    s->blocks = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                                      g_free);
+    qemu_co_queue_init(&s->space_queue);
+    qemu_co_queue_init(&s->complete_queue);
+    qemu_co_queue_init(&s->reader_queue);
+    qemu_co_queue_init(&s->destage_queue);
+}
+
+static void wbc_reset_state(BDRVWritebackCacheState *s)
+{
+    WBCRecord *rec, *next_rec;
+
+    assert(QTAILQ_EMPTY(&s->in_flight));
+
+    g_hash_table_remove_all(s->blocks);
+    QTAILQ_FOREACH_SAFE(rec, &s->records, next, next_rec) {
+        QTAILQ_REMOVE(&s->records, rec, next);
+        g_free(rec);
+    }
+    s->used = 0;
+    s->destaged_bytes = 0;
+    s->log_ret = 0;
+    s->destage_ret = 0;
+}
+
+static int wbc_open(BlockDriverState *bs, QDict *options, int flags,
+                    Error **errp)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->cache = bdrv_open_child(NULL, options, "cache-file", bs, &child_of_bds,
+                               BDRV_CHILD_METADATA, false, errp);
+    if (!s->cache) {
+        return -EINVAL;
+    }
+
+    wbc_init_state(s);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    ret = wbc_load(bs, errp);
+    if (ret < 0) {
+        wbc_reset_state(s);
+        g_hash_table_destroy(s->blocks);
+        return ret;
+    }
+
+    /* Write back whatever has been replayed from the log */
+    wbc_kick_destage(bs, false);
+
+    return 0;
+}
+
+static void wbc_close(BlockDriverState *bs)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    if ((bs->open_flags & BDRV_O_RDWR) && !(bs->open_flags & BDRV_O_INACTIVE)) {
+        ret = wbc_destage_all(bs);
+        if (ret < 0) {
+            error_report("Could not write back the cache of node '%s': %s; "
+                         "the data remains in the cache log",
+                         bdrv_get_node_name(bs), strerror(-ret));
+        }
+    }
+
+    wbc_reset_state(s);
+    g_hash_table_destroy(s->blocks);
+}
+
+static int GRAPH_RDLOCK wbc_inactivate(BlockDriverState *bs)
+{
+    if (!(bs->open_flags & BDRV_O_RDWR)) {
+        return 0;
+    }
+
+    return wbc_destage_all(bs);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+wbc_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+
+    /* Another process may have used the cache node in the meantime */
+    qemu_co_mutex_lock(&s->lock);
+    wbc_reset_state(s);
+    if (wbc_load(bs, errp) == 0) {
+        wbc_kick_destage(bs, false);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+}
+
+static int wbc_reopen_prepare(BDRVReopenState *reopen_state,
+                              BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void wbc_reopen_commit_post(BDRVReopenState *state)
+{
+    BlockDriverState *bs = state->bs;
+    BDRVWritebackCacheState *s = bs->opaque;
+    int ret;
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    if (!(state->flags & BDRV_O_RDWR) || (state->flags & BDRV_O_INACTIVE) ||
+        s->formatted)
+    {
+        return;
+    }
+
+    /*
+     * The node was opened read-only on an empty cache node, which was left
+     * unformatted. Without a super block the log could not be replayed, so
+     * writes must not be acknowledged until it has been written.
+     */
+    ret = wbc_write_super(bs, s->head, s->next_seq);
+    if (ret < 0) {
+        error_report("%s: Could not format the cache node: %s; writes will "
+                     "fail", bdrv_get_node_name(bs), strerror(-ret));
+        s->log_ret = ret;
+        return;
+    }
+    s->formatted = true;
+}
+
+static void wbc_drain_begin(BlockDriverState *bs)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+
+    qatomic_set(&s->drained, true);
+}
+
+static void wbc_drain_end(BlockDriverState *bs)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+
+    qatomic_set(&s->drained, false);
+
+    /* No request is in flight, so the log cannot change under us */
+    if (!QTAILQ_EMPTY(&s->records)) {
+        wbc_kick_destage(bs, false);
+    }
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                   QEMUIOVector *qiov, size_t qiov_offset,
+                   BdrvRequestFlags flags)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    int ret;
+
+    while (bytes) {
+        WBCRecord *rec;
+        int64_t n;
+
+        qemu_co_mutex_lock(&s->lock);
+        n = wbc_index_lookup(s, offset, bytes, &rec);
+        if (rec) {
+            rec->readers++;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        trace_wbc_read(bs, offset, n, rec != NULL);
+
+        if (rec) {
+            ret = bdrv_co_preadv_part(s->cache, rec->log_offset +
+                                      WBC_BLOCK_SIZE + offset - rec->offset,
+                                      n, qiov, qiov_offset, 0);
+
+            qemu_co_mutex_lock(&s->lock);
+            if (--rec->readers == 0) {
+                qemu_co_queue_restart_all(&s->reader_queue);
+            }
+            qemu_co_mutex_unlock(&s->lock);
+        } else {
+            ret = bdrv_co_preadv_part(bs->file, offset, n, qiov, qiov_offset,
+                                      0);
+        }
+        if (ret < 0) {
+            return ret;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_write_padding(BlockDriverState *bs, WBCRecord *padding)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCRecordHeader *header = qemu_blockalign0(s->cache->bs, WBC_BLOCK_SIZE);
+    int ret;
+
+    header->magic = cpu_to_le64(WBC_RECORD_MAGIC);
+    header->log_id = cpu_to_le64(s->log_id);
+    header->seq = cpu_to_le64(padding->seq);
+    wbc_header_set_crc(header);
+
+    ret = bdrv_co_pwrite(s->cache, padding->log_offset, WBC_BLOCK_SIZE, header,
+                         0);
+    qemu_vfree(header);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                    QEMUIOVector *qiov, size_t qiov_offset,
+                    BdrvRequestFlags flags)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCRecord *rec, *padding = NULL;
+    WBCRecordHeader *header;
+    uint8_t *buf;
+    int ret = 0;
+
+    assert(QEMU_IS_ALIGNED(offset | bytes, WBC_BLOCK_SIZE));
+    assert(bytes <= WBC_MAX_RECORD);
+
+    /*
+     * Copy the data so that the checksum stays valid even if the guest
+     * modifies its buffer while the request is in flight.
+     */
+    buf = qemu_try_blockalign(s->cache->bs, WBC_BLOCK_SIZE + bytes);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    memset(buf, 0, WBC_BLOCK_SIZE);
+    qemu_iovec_to_buf(qiov, qiov_offset, buf + WBC_BLOCK_SIZE, bytes);
+
+    header = (WBCRecordHeader *)buf;
+    header->magic = cpu_to_le64(WBC_RECORD_MAGIC);
+    header->log_id = cpu_to_le64(s->log_id);
+    header->offset = cpu_to_le64(offset);
+    header->bytes = cpu_to_le32(bytes);
+    header->data_crc = cpu_to_le32(crc32c(0xffffffff, buf + WBC_BLOCK_SIZE,
+                                          bytes));
+
+    qemu_co_mutex_lock(&s->lock);
+    while (true) {
+        if (s->log_ret < 0) {
+            ret = s->log_ret;
+            break;
+        }
+        rec = wbc_log_alloc(s, offset, bytes, &padding);
+        if (rec) {
+            break;
+        }
+        if (s->destage_ret < 0) {
+            /* Report the error once, the next writer retries */
+            ret = s->destage_ret;
+            s->destage_ret = 0;
+            break;
+        }
+        wbc_kick_destage(bs, true);
+        qemu_co_queue_wait(&s->space_queue, &s->lock);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        qemu_vfree(buf);
+        return ret;
+    }
+
+    if (padding) {
+        ret = wbc_co_write_padding(bs, padding);
+        qemu_co_mutex_lock(&s->lock);
+        wbc_record_complete(bs, padding, ret);
+        qemu_co_mutex_unlock(&s->lock);
+    }
+
+    header->seq = cpu_to_le64(rec->seq);
+    wbc_header_set_crc(header);
+
+    trace_wbc_write(bs, offset, bytes, rec->seq, rec->log_offset);
+
+    if (ret >= 0) {
+        ret = bdrv_co_pwrite(s->cache, rec->log_offset, WBC_BLOCK_SIZE + bytes,
+                             buf, 0);
+    }
+    qemu_vfree(buf);
+
+    qemu_co_mutex_lock(&s->lock);
+    wbc_record_complete(bs, rec, ret);
+    qemu_co_mutex_unlock(&s->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK wbc_co_flush(BlockDriverState *bs)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    uint64_t target;
+    int ret;
+
+    /*
+     * Replaying stops at the first incomplete record, so all records before
+     * the completed ones must be complete for the latter to be stable.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    target = s->last_complete_seq;
+    while (!QTAILQ_EMPTY(&s->in_flight) &&
+           QTAILQ_FIRST(&s->in_flight)->seq < target)
+    {
+        qemu_co_queue_wait(&s->complete_queue, &s->lock);
+    }
+    ret = s->log_ret;
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The image node is flushed before destaged records are dropped */
+    return bdrv_co_flush(s->cache->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_block_status(BlockDriverState *bs, bool want_zero, int64_t offset,
+                    int64_t bytes, int64_t *pnum, int64_t *map,
+                    BlockDriverState **file)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    WBCRecord *rec;
+
+    qemu_co_mutex_lock(&s->lock);
+    *pnum = wbc_index_lookup(s, offset, bytes, &rec);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (rec) {
+        /* The log data only stays at its offset until it is written back */
+        return BDRV_BLOCK_DATA;
+    }
+
+    *map = offset;
+    *file = bs->file->bs;
+    return BDRV_BLOCK_RAW | BDRV_BLOCK_OFFSET_VALID;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    int64_t i;
+
+    /*
+     * Drop the discarded blocks from the index, so that their log data is
+     * neither read nor written back over the discarded range any more.
+     * Destaging skips blocks that are not in the index. Partially discarded
+     * blocks keep their data.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    for (i = DIV_ROUND_UP(offset, WBC_BLOCK_SIZE);
+         i < (offset + bytes) / WBC_BLOCK_SIZE; i++)
+    {
+        g_hash_table_remove(s->blocks, &i);
+    }
+    qemu_co_mutex_unlock(&s->lock);
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+wbc_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                PreallocMode prealloc, BdrvRequestFlags flags, Error **errp)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    int ret;
+
+    /*
+     * Records beyond the new end of the image must not be written back
+     * after the image node has been shrunk, and the super block records the
+     * image size. So write everything back first and keep destaging stopped
+     * until the super block has been updated.
+     */
+    qemu_co_mutex_lock(&s->lock);
+    while (s->destage_running) {
+        qemu_co_queue_wait(&s->destage_queue, &s->lock);
+    }
+    s->destage_running = true;
+
+    ret = wbc_co_destage(bs, true);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write back the cache log");
+        goto out;
+    }
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    s->image_size = offset;
+    ret = wbc_co_free_log(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not update the cache super block");
+    }
+
+out:
+    s->destage_running = false;
+    qemu_co_queue_restart_all(&s->destage_queue);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+wbc_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static void GRAPH_RDLOCK wbc_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVWritebackCacheState *s = bs->opaque;
+    BlockDriverState *cache_bs = s->cache->bs;
+
+    bs->bl.request_alignment = MAX(bs->bl.request_alignment, WBC_BLOCK_SIZE);
+    bs->bl.request_alignment = MAX(bs->bl.request_alignment,
+                                   cache_bs->bl.request_alignment);
+    bs->bl.max_transfer = MIN_NON_ZERO(bs->bl.max_transfer, WBC_MAX_RECORD);
+    bs->bl.min_mem_alignment = MAX(bs->bl.min_mem_alignment,
+                                   bdrv_min_mem_align(cache_bs));
+    bs->bl.opt_mem_alignment = MAX(bs->bl.opt_mem_alignment,
+                                   bdrv_opt_mem_align(cache_bs));
+}
+
+static BlockDriver bdrv_writeback_cache = {
+    .format_name            = "writeback-cache",
+    .instance_size          = sizeof(BDRVWritebackCacheState),
+
+    .bdrv_open              = wbc_open,
+    .bdrv_close             = wbc_close,
+    .bdrv_inactivate        = wbc_inactivate,
+    .bdrv_co_invalidate_cache = wbc_co_invalidate_cache,
+    .bdrv_reopen_prepare    = wbc_reopen_prepare,
+    .bdrv_reopen_commit_post = wbc_reopen_commit_post,
+    .bdrv_co_getlength      = wbc_co_getlength,
+    .bdrv_co_truncate       = wbc_co_truncate,
+    .bdrv_child_perm        = bdrv_default_perms,
+    .bdrv_refresh_limits    = wbc_refresh_limits,
+
+    .bdrv_drain_begin       = wbc_drain_begin,
+    .bdrv_drain_end         = wbc_drain_end,
+
+    .bdrv_co_preadv_part    = wbc_co_preadv_part,
+    .bdrv_co_pwritev_part   = wbc_co_pwritev_part,
+    .bdrv_co_flush          = wbc_co_flush,
+    .bdrv_co_pdiscard       = wbc_co_pdiscard,
+    .bdrv_co_block_status   = wbc_co_block_status,
+};
+
+static void bdrv_writeback_cache_init(void)
+{
+    bdrv_register(&bdrv_writeback_cache);
+}
+
+block_init(bdrv_writeback_cache_init);
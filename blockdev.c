@@ -2285,6 +2285,7 @@ void qmp_block_stream(const char *job_id, const char *device,
                       const char *bottom,
                       bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_max_workers, int64_t max_workers,
                       const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
@@ -2410,6 +2411,7 @@ void qmp_block_stream(const char *job_id, const char *device,
     stream_start(job_id, bs, base_bs, backing_file,
                  backing_mask_protocol,
                  bottom_bs, job_flags, has_speed ? speed : 0, on_error,
+                 has_max_workers ? max_workers : 1,
                  filter_node_name, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -2433,6 +2435,7 @@ void qmp_block_commit(const char *job_id, const char *device,
                       bool backing_mask_protocol,
                       bool has_speed, int64_t speed,
                       bool has_on_error, BlockdevOnError on_error,
+                      bool has_max_workers, int64_t max_workers,
                       const char *filter_node_name,
                       bool has_auto_finalize, bool auto_finalize,
                       bool has_auto_dismiss, bool auto_dismiss,
@@ -2587,6 +2590,11 @@ void qmp_block_commit(const char *job_id, const char *device,
             }
             return;
         }
+        if (has_max_workers) {
+            error_setg(errp, "'max-workers' specified, but the commit is "
+                       "an active commit");
+            return;
+        }
         if (!job_id) {
             /*
              * Emulate here what block_job_create() does, because it
@@ -2606,6 +2614,7 @@ void qmp_block_commit(const char *job_id, const char *device,
         commit_start(job_id, bs, base_bs, top_bs, job_flags,
                      speed, on_error, backing_file,
                      backing_mask_protocol,
+                     has_max_workers ? max_workers : 1,
                      filter_node_name, &local_err);
     }
     if (local_err != NULL) {
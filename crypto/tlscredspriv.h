@@ -36,6 +36,7 @@ struct QCryptoTLSCreds {
 #endif
     bool verifyPeer;
     char *priority;
+    bool kernelTLS;
 };
 
 struct QCryptoTLSCredsAnon {
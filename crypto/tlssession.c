@@ -33,6 +33,17 @@
 
 #include <gnutls/x509.h>
 
+#ifdef CONFIG_KTLS
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#endif
 
 struct QCryptoTLSSession {
     QCryptoTLSCreds *creds;
@@ -603,6 +614,172 @@ qcrypto_tls_session_get_key_size(QCryptoTLSSession *session,
 }
 
 
+#ifdef CONFIG_KTLS
+static int
+qcrypto_tls_session_check_ktls_keys(const gnutls_datum_t *iv,
+                                    size_t iv_size,
+                                    const gnutls_datum_t *key,
+                                    size_t key_size,
+                                    Error **errp)
+{
+    if (iv->size != iv_size || key->size != key_size) {
+        error_setg(errp, "Unexpected TLS key size %u, IV size %u",
+                   key->size, iv->size);
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+
+int
+qcrypto_tls_session_enable_ktls_send(QCryptoTLSSession *session,
+                                     int fd,
+                                     Error **errp)
+{
+#ifdef CONFIG_KTLS
+    union {
+        struct tls12_crypto_info_aes_gcm_128 aes_gcm_128;
+        struct tls12_crypto_info_aes_gcm_256 aes_gcm_256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+        struct tls12_crypto_info_chacha20_poly1305 chacha20_poly1305;
+#endif
+    } info;
+    gnutls_datum_t mac_key, iv, cipher_key;
+    unsigned char seq[8];
+    gnutls_protocol_t protocol;
+    gnutls_cipher_algorithm_t cipher;
+    uint16_t version;
+    size_t len;
+    int ret;
+
+    if (!session->creds->kernelTLS) {
+        error_setg(errp, "Kernel TLS is not enabled on the TLS credentials");
+        return -1;
+    }
+
+    protocol = gnutls_protocol_get_version(session->handle);
+    switch (protocol) {
+    case GNUTLS_TLS1_2:
+        version = TLS_1_2_VERSION;
+        break;
+    case GNUTLS_TLS1_3:
+        version = TLS_1_3_VERSION;
+        break;
+    default:
+        error_setg(errp, "Kernel TLS does not support %s",
+                   gnutls_protocol_get_name(protocol));
+        return -1;
+    }
+
+    ret = gnutls_record_get_state(session->handle, 0, &mac_key, &iv,
+                                  &cipher_key, seq);
+    if (ret < 0) {
+        error_setg(errp, "Cannot get TLS session keys: %s",
+                   gnutls_strerror(ret));
+        return -1;
+    }
+
+    /*
+     * For AES-GCM, the IV returned by GnuTLS is the salt followed, in
+     * TLS 1.3, by the implicit part of the nonce.  TLS 1.2 sends the
+     * rest of the nonce explicitly, and the kernel starts it from the
+     * sequence number like GnuTLS does.
+     */
+    memset(&info, 0, sizeof(info));
+    cipher = gnutls_cipher_get(session->handle);
+    switch (cipher) {
+    case GNUTLS_CIPHER_AES_128_GCM:
+        if (qcrypto_tls_session_check_ktls_keys(
+                &iv, TLS_CIPHER_AES_GCM_128_SALT_SIZE +
+                (version == TLS_1_3_VERSION ?
+                 TLS_CIPHER_AES_GCM_128_IV_SIZE : 0),
+                &cipher_key, TLS_CIPHER_AES_GCM_128_KEY_SIZE, errp) < 0) {
+            return -1;
+        }
+        info.aes_gcm_128.info.version = version;
+        info.aes_gcm_128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+        memcpy(info.aes_gcm_128.salt, iv.data,
+               TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+        memcpy(info.aes_gcm_128.iv,
+               version == TLS_1_3_VERSION ?
+               iv.data + TLS_CIPHER_AES_GCM_128_SALT_SIZE : seq,
+               TLS_CIPHER_AES_GCM_128_IV_SIZE);
+        memcpy(info.aes_gcm_128.key, cipher_key.data,
+               TLS_CIPHER_AES_GCM_128_KEY_SIZE);
+        memcpy(info.aes_gcm_128.rec_seq, seq,
+               TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+        len = sizeof(info.aes_gcm_128);
+        break;
+    case GNUTLS_CIPHER_AES_256_GCM:
+        if (qcrypto_tls_session_check_ktls_keys(
+                &iv, TLS_CIPHER_AES_GCM_256_SALT_SIZE +
+                (version == TLS_1_3_VERSION ?
+                 TLS_CIPHER_AES_GCM_256_IV_SIZE : 0),
+                &cipher_key, TLS_CIPHER_AES_GCM_256_KEY_SIZE, errp) < 0) {
+            return -1;
+        }
+        info.aes_gcm_256.info.version = version;
+        info.aes_gcm_256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+        memcpy(info.aes_gcm_256.salt, iv.data,
+               TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+        memcpy(info.aes_gcm_256.iv,
+               version == TLS_1_3_VERSION ?
+               iv.data + TLS_CIPHER_AES_GCM_256_SALT_SIZE : seq,
+               TLS_CIPHER_AES_GCM_256_IV_SIZE);
+        memcpy(info.aes_gcm_256.key, cipher_key.data,
+               TLS_CIPHER_AES_GCM_256_KEY_SIZE);
+        memcpy(info.aes_gcm_256.rec_seq, seq,
+               TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+        len = sizeof(info.aes_gcm_256);
+        break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    case GNUTLS_CIPHER_CHACHA20_POLY1305:
+        if (qcrypto_tls_session_check_ktls_keys(
+                &iv, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE,
+                &cipher_key, TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE,
+                errp) < 0) {
+            return -1;
+        }
+        info.chacha20_poly1305.info.version = version;
+        info.chacha20_poly1305.info.cipher_type =
+            TLS_CIPHER_CHACHA20_POLY1305;
+        memcpy(info.chacha20_poly1305.iv, iv.data,
+               TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+        memcpy(info.chacha20_poly1305.key, cipher_key.data,
+               TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE);
+        memcpy(info.chacha20_poly1305.rec_seq, seq,
+               TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+        len = sizeof(info.chacha20_poly1305);
+        break;
+#endif
+    default:
+        error_setg(errp, "Kernel TLS does not support cipher %s",
+                   gnutls_cipher_get_name(cipher));
+        return -1;
+    }
+
+    /* Until it gets the keys, the "tls" ULP passes data through */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls")) < 0) {
+        error_setg_errno(errp, errno, "Cannot enable kernel TLS");
+        ret = -1;
+    } else if (setsockopt(fd, SOL_TLS, TLS_TX, &info, len) < 0) {
+        error_setg_errno(errp, errno, "Cannot set kernel TLS keys");
+        ret = -1;
+    } else {
+        trace_qcrypto_tls_session_enable_ktls_send(session, fd);
+        ret = 0;
+    }
+
+    memset(&info, 0, sizeof(info));
+    return ret;
+#else
+    error_setg(errp, "Kernel TLS is not supported on this host");
+    return -1;
+#endif
+}
+
+
 char *
 qcrypto_tls_session_get_peer_name(QCryptoTLSSession *session)
 {
@@ -708,6 +885,16 @@ qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
 }
 
 
+int
+qcrypto_tls_session_enable_ktls_send(QCryptoTLSSession *sess,
+                                     int fd,
+                                     Error **errp)
+{
+    error_setg(errp, "TLS requires GNUTLS support");
+    return -1;
+}
+
+
 char *
 qcrypto_tls_session_get_peer_name(QCryptoTLSSession *sess)
 {
@@ -30,6 +30,7 @@
 #include "block/snapshot.h"
 #include "qemu/iov.h"
 #include "qemu/rcu.h"
+#include "qemu/seqlock.h"
 #include "qemu/stats64.h"
 
 #define BLOCK_FLAG_LAZY_REFCOUNTS   8
@@ -1066,6 +1067,33 @@ typedef struct BdrvBlockStatusCache {
     int64_t data_end;
 } BdrvBlockStatusCache;
 
+/*
+ * Allows bdrv_co_common_block_status_above() to cache one range that is
+ * known to be unallocated in a read-only layer of a backing chain, so that
+ * walking a deep chain does not need to inquire every layer's metadata
+ * again for every query.
+ *
+ * The cache is updated in place, so that refilling it on every miss does
+ * not need an allocation.  Readers use @seqlock to get a consistent view;
+ * writers hold the node's bsc_modify_lock.
+ *
+ * @valid: Whether the cache is valid (should be accessed with atomic
+ *         functions so this can be reset outside of the seqlock)
+ * @write_gen: The node's write_gen at the time the range was inquired; the
+ *             cache must not be used anymore once the node was written to
+ * @start: Offset where the unallocated range starts
+ * @end: Offset where the unallocated range ends (which is not necessarily
+ *       the start of an allocated region)
+ */
+typedef struct BdrvUnallocatedCache {
+    QemuSeqLock seqlock;
+
+    bool valid;
+    unsigned int write_gen;
+    int64_t start;
+    int64_t end;
+} BdrvUnallocatedCache;
+
 struct BlockDriverState {
     /*
      * Protected by big QEMU lock or read-only after opening.  No special
@@ -1247,10 +1275,13 @@ struct BlockDriverState {
     /* BdrvChild links to this node may never be frozen */
     bool never_freeze;
 
-    /* Lock for block-status cache RCU writers */
+    /* Lock for block-status cache RCU writers and unallocated cache writers */
     CoMutex bsc_modify_lock;
     /* Always non-NULL, but must only be dereferenced under an RCU read guard */
     BdrvBlockStatusCache *block_status_cache;
+    /* Whether unallocated_cache is used (option "unallocated-cache") */
+    bool use_unallocated_cache;
+    BdrvUnallocatedCache unallocated_cache;
 
     /* array of write pointers' location of each zone in the zoned device. */
     BlockZoneWps *wps;
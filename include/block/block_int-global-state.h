@@ -52,6 +52,7 @@
  *                  See @BlockJobCreateFlags
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @on_error: The action to take upon error.
+ * @max_workers: The maximum number of requests the job keeps in flight.
  * @filter_node_name: The node name that should be assigned to the filter
  *                    driver that the stream job inserts into the graph above
  *                    @bs. NULL means that a node name should be autogenerated.
@@ -69,7 +70,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
                   bool backing_mask_protocol,
                   BlockDriverState *bottom,
                   int creation_flags, int64_t speed,
-                  BlockdevOnError on_error,
+                  BlockdevOnError on_error, int64_t max_workers,
                   const char *filter_node_name,
                   Error **errp);
 
@@ -87,6 +88,7 @@ void stream_start(const char *job_id, BlockDriverState *bs,
  * @backing_file_str: String to use as the backing file in @top's overlay
  * @backing_mask_protocol: Replace potential protocol name with 'raw' in
  *                         'backing file format' header
+ * @max_workers: The maximum number of requests the job keeps in flight.
  * @filter_node_name: The node name that should be assigned to the filter
  * driver that the commit job inserts into the graph above @top. NULL means
  * that a node name should be autogenerated.
@@ -97,7 +99,7 @@ void commit_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *base, BlockDriverState *top,
                   int creation_flags, int64_t speed,
                   BlockdevOnError on_error, const char *backing_file_str,
-                  bool backing_mask_protocol,
+                  bool backing_mask_protocol, int64_t max_workers,
                   const char *filter_node_name, Error **errp);
 /**
  * commit_active_start:
@@ -191,4 +191,30 @@ void bdrv_bsc_invalidate_range(BlockDriverState *bs,
  */
 void bdrv_bsc_fill(BlockDriverState *bs, int64_t offset, int64_t bytes);
 
+/**
+ * Check whether the given offset is in the cached unallocated range of
+ * @bs, and whether the cache is still usable, i.e. @bs is read-only and
+ * has not been written to since the range was inquired.
+ *
+ * If so, *pnum is set to how many bytes, starting from @offset, are
+ * unallocated (according to the cache).  Otherwise, *pnum is not touched.
+ */
+bool bdrv_uac_is_unallocated(BlockDriverState *bs, int64_t offset,
+                             int64_t *pnum);
+
+/**
+ * Invalidate the cached unallocated range.
+ *
+ * (To be used when the allocation status of @bs may have changed without
+ * its write_gen being updated, e.g. when its metadata is reloaded.)
+ */
+void bdrv_uac_invalidate(BlockDriverState *bs);
+
+/**
+ * Mark the range [offset, offset + bytes) as unallocated in @bs, as
+ * inquired while bs->write_gen was @write_gen.
+ */
+void bdrv_uac_fill(BlockDriverState *bs, unsigned int write_gen,
+                   int64_t offset, int64_t bytes);
+
 #endif /* BLOCK_INT_IO_H */
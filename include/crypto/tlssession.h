@@ -336,6 +336,35 @@ qcrypto_tls_session_get_handshake_status(QCryptoTLSSession *sess);
 int qcrypto_tls_session_get_key_size(QCryptoTLSSession *sess,
                                      Error **errp);
 
+/**
+ * qcrypto_tls_session_enable_ktls_send:
+ * @sess: the TLS session object
+ * @fd: the TCP socket the session runs over
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Hand the keys used to encrypt the data sent on the
+ * session to the kernel, so that plain data written
+ * to @fd is sent as TLS records. Once this succeeds,
+ * payload data must be written to @fd directly and
+ * not with qcrypto_tls_session_write(), while data
+ * is still received with qcrypto_tls_session_read().
+ *
+ * This fails if the credentials of the session do not
+ * have the "kernel-tls" property set, if the kernel does
+ * not support TLS, or if it does not support the
+ * negotiated protocol version or cipher, in which case
+ * @fd is left usable as before.
+ *
+ * It is an error to call this before
+ * qcrypto_tls_session_get_handshake_status() returns
+ * QCRYPTO_TLS_HANDSHAKE_COMPLETE
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_tls_session_enable_ktls_send(QCryptoTLSSession *sess,
+                                         int fd,
+                                         Error **errp);
+
 /**
  * qcrypto_tls_session_get_peer_name:
  * @sess: the TLS session object
@@ -57,6 +57,11 @@ struct RAMBlock {
      */
     off_t bitmap_offset;
     uint64_t pages_offset;
+    /*
+     * Parts of the block map the migration file privately, see
+     * qemu_ram_map_file_private().  Only used on destination side.
+     */
+    bool file_mapped;
 
     /* Bitmap of already received pages.  Only used on destination side. */
     unsigned long *receivedmap;
@@ -80,6 +85,15 @@ struct RAMBlock {
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
 
+    /*
+     * One byte for each region of guest RAM (see RAM_HEAT_REGION_SHIFT
+     * in migration/ram.c) whose bits tell in which of the last dirty
+     * bitmap syncs the region was dirty, most recent first.  Only used
+     * on the source side with the defer-hot-pages capability, and
+     * protected by the global ram_state.bitmap_mutex.
+     */
+    uint8_t *dirty_heat;
+
     /*
      * RAM block length that corresponds to the used_length on the migration
      * source (after RAM block sizes were synchronized). Especially, after
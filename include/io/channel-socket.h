@@ -245,6 +245,21 @@ SocketAddress *
 qio_channel_socket_get_remote_address(QIOChannelSocket *ioc,
                                       Error **errp);
 
+/**
+ * qio_channel_socket_get_send_queue:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Get the number of bytes written to the socket that the
+ * peer has not acknowledged yet, i.e. the data still queued
+ * in the kernel, whether it was sent on the wire or not.
+ *
+ * Returns: the number of bytes, or -1 on error
+ */
+ssize_t
+qio_channel_socket_get_send_queue(QIOChannelSocket *ioc,
+                                  Error **errp);
+
 
 /**
  * qio_channel_socket_accept:
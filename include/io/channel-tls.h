@@ -41,6 +41,11 @@ OBJECT_DECLARE_SIMPLE_TYPE(QIOChannelTLS, QIO_CHANNEL_TLS)
  *
  * This channel object is capable of running as either a
  * TLS server or TLS client.
+ *
+ * When the credentials have the "kernel-tls" property set,
+ * the master channel is a TCP socket and the host kernel
+ * supports it, the encryption of the data sent is offloaded
+ * to the kernel once the handshake completes.
  */
 
 struct QIOChannelTLS {
@@ -49,6 +54,8 @@ struct QIOChannelTLS {
     QCryptoTLSSession *session;
     QIOChannelShutdown shutdown;
     guint hs_ioc_tag;
+    /* Whether the kernel encrypts the data written to @master */
+    bool ktls_send;
 };
 
 /**
@@ -103,6 +103,22 @@ typedef struct SaveVMHandlers {
      */
     int (*save_live_complete_precopy)(QEMUFile *f, void *opaque);
 
+    /**
+     * @save_live_complete_precopy_thread
+     *
+     * Same as @save_live_complete_precopy, and used instead of it, but
+     * called without the BQL from a thread of its own, in parallel with
+     * the other devices.  @f buffers the data in memory, and the data
+     * goes out in the stream where @save_live_complete_precopy would
+     * have put it, so the destination can't tell the difference.
+     *
+     * @f: QEMUFile where to send the data
+     * @opaque: data pointer passed to register_savevm_live()
+     *
+     * Returns zero to indicate success and negative for error
+     */
+    int (*save_live_complete_precopy_thread)(QEMUFile *f, void *opaque);
+
     /* This runs both outside and inside the BQL.  */
 
     /**
@@ -90,6 +90,21 @@ enum KVMDirtyRingReaperState {
     KVM_DIRTY_RING_REAPER_REAPING,
 };
 
+/*
+ * Helper thread that collects the dirty rings of one group of vCPUs
+ * while a full reap is in progress.
+ */
+typedef struct KVMDirtyRingHarvester {
+    QemuThread thr;
+    KVMState *s;
+    /* Group of vCPUs handled by this harvester (0 is the caller's) */
+    int group;
+    /* Posted by the reaping thread to start a harvest */
+    QemuSemaphore start;
+    /* Pages collected by the last harvest, valid once done is posted */
+    uint64_t count;
+} KVMDirtyRingHarvester;
+
 /*
  * KVM reaper instance, responsible for collecting the KVM dirty bits
  * via the dirty ring.
@@ -99,6 +114,11 @@ struct KVMDirtyRingReaper {
     QemuThread reaper_thr;
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    /* Helpers that split a full reap across groups of vCPUs */
+    int nr_harvesters;
+    KVMDirtyRingHarvester *harvesters;
+    /* Posted by each harvester when its group has been collected */
+    QemuSemaphore harvest_done;
 };
 struct KVMState
 {
@@ -28,6 +28,7 @@
 #include "qapi/clone-visitor.h"
 #ifdef CONFIG_LINUX
 #include <linux/errqueue.h>
+#include <linux/sockios.h>
 #include <sys/socket.h>
 
 #if (defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY))
@@ -55,6 +56,33 @@ qio_channel_socket_get_remote_address(QIOChannelSocket *ioc,
                                       errp);
 }
 
+ssize_t
+qio_channel_socket_get_send_queue(QIOChannelSocket *ioc,
+                                  Error **errp)
+{
+#if defined(CONFIG_LINUX) && defined(SIOCOUTQ)
+    int queued;
+
+    if (ioctl(ioc->fd, SIOCOUTQ, &queued) < 0) {
+        error_setg_errno(errp, errno, "Unable to query socket send queue");
+        return -1;
+    }
+    return queued;
+#elif defined(SO_NWRITE)
+    int queued;
+    socklen_t len = sizeof(queued);
+
+    if (getsockopt(ioc->fd, SOL_SOCKET, SO_NWRITE, &queued, &len) < 0) {
+        error_setg_errno(errp, errno, "Unable to query socket send queue");
+        return -1;
+    }
+    return queued;
+#else
+    error_setg(errp, "Socket send queue is not available on this platform");
+    return -1;
+#endif
+}
+
 QIOChannelSocket *
 qio_channel_socket_new(void)
 {
@@ -22,6 +22,7 @@
 #include "qapi/error.h"
 #include "qemu/module.h"
 #include "io/channel-tls.h"
+#include "io/channel-socket.h"
 #include "trace.h"
 #include "qemu/atomic.h"
 
@@ -34,6 +35,17 @@ static ssize_t qio_channel_tls_write_handler(const char *buf,
     QIOChannelTLS *tioc = QIO_CHANNEL_TLS(opaque);
     ssize_t ret;
 
+    /*
+     * Once the kernel encrypts what is sent, a record from GnuTLS, such
+     * as the reply to a TLS 1.3 KeyUpdate asking for one, would be
+     * encrypted twice.  The kernel cannot rekey either, so give up.
+     */
+    if (tioc->ktls_send) {
+        error_setg(errp, "Cannot send TLS control records with kernel TLS, "
+                   "e.g. to update the keys");
+        return -1;
+    }
+
     ret = qio_channel_write(tioc->master, buf, len, errp);
     if (ret == QIO_CHANNEL_ERR_BLOCK) {
         return QCRYPTO_TLS_SESSION_ERR_BLOCK;
@@ -147,6 +159,25 @@ qio_channel_tls_new_client(QIOChannel *master,
     return NULL;
 }
 
+static void qio_channel_tls_enable_ktls(QIOChannelTLS *tioc)
+{
+    Error *err = NULL;
+
+    if (!object_dynamic_cast(OBJECT(tioc->master), TYPE_QIO_CHANNEL_SOCKET)) {
+        return;
+    }
+
+    if (qcrypto_tls_session_enable_ktls_send(
+            tioc->session, QIO_CHANNEL_SOCKET(tioc->master)->fd, &err) < 0) {
+        trace_qio_channel_tls_ktls_unavailable(tioc, error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+
+    trace_qio_channel_tls_ktls_send(tioc);
+    tioc->ktls_send = true;
+}
+
 struct QIOChannelTLSData {
     QIOTask *task;
     GMainContext *context;
@@ -180,6 +211,7 @@ static void qio_channel_tls_handshake_task(QIOChannelTLS *ioc,
             qio_task_set_error(task, err);
         } else {
             trace_qio_channel_tls_credentials_allow(ioc);
+            qio_channel_tls_enable_ktls(ioc);
         }
         qio_task_complete(task);
     } else {
@@ -311,6 +343,10 @@ static ssize_t qio_channel_tls_writev(QIOChannel *ioc,
     size_t i;
     ssize_t done = 0;
 
+    if (tioc->ktls_send) {
+        return qio_channel_writev(tioc->master, iov, niov, errp);
+    }
+
     for (i = 0 ; i < niov ; i++) {
         ssize_t ret = qcrypto_tls_session_write(tioc->session,
                                                 iov[i].iov_base,
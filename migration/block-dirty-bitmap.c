@@ -742,11 +742,8 @@ static int dirty_bitmap_save_iterate(QEMUFile *f, void *opaque)
     return s->bulk_completed;
 }
 
-/* Called with the BQL taken.  */
-
-static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+static void dirty_bitmap_do_save_complete(QEMUFile *f, DBMSaveState *s)
 {
-    DBMSaveState *s = &((DBMState *)opaque)->save;
     SaveBitmapState *dbms;
     trace_dirty_bitmap_save_complete_enter();
 
@@ -761,11 +758,35 @@ static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
     qemu_put_bitmap_flags(f, DIRTY_BITMAP_MIG_FLAG_EOS);
 
     trace_dirty_bitmap_save_complete_finish();
+}
+
+/* Called with the BQL taken.  */
+
+static int dirty_bitmap_save_complete(QEMUFile *f, void *opaque)
+{
+    DBMSaveState *s = &((DBMState *)opaque)->save;
+
+    dirty_bitmap_do_save_complete(f, s);
 
     dirty_bitmap_save_cleanup(opaque);
     return 0;
 }
 
+/*
+ * Called with no lock taken, while the migration thread holds the BQL.
+ * The VM is stopped and the bitmaps are busy, so nothing changes them
+ * under us.  Dropping the references needs the BQL, so that is left to
+ * dirty_bitmap_save_cleanup().
+ */
+static int dirty_bitmap_save_complete_precopy(QEMUFile *f, void *opaque)
+{
+    DBMSaveState *s = &((DBMState *)opaque)->save;
+
+    dirty_bitmap_do_save_complete(f, s);
+
+    return 0;
+}
+
 static void dirty_bitmap_state_pending(void *opaque,
                                        uint64_t *must_precopy,
                                        uint64_t *can_postcopy)
@@ -1249,7 +1270,7 @@ static bool dirty_bitmap_has_postcopy(void *opaque)
 static SaveVMHandlers savevm_dirty_bitmap_handlers = {
     .save_setup = dirty_bitmap_save_setup,
     .save_live_complete_postcopy = dirty_bitmap_save_complete,
-    .save_live_complete_precopy = dirty_bitmap_save_complete,
+    .save_live_complete_precopy_thread = dirty_bitmap_save_complete_precopy,
     .has_postcopy = dirty_bitmap_has_postcopy,
     .state_pending_exact = dirty_bitmap_state_pending,
     .state_pending_estimate = dirty_bitmap_state_pending,
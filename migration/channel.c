@@ -14,6 +14,7 @@
 #include "channel.h"
 #include "tls.h"
 #include "migration.h"
+#include "options.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "qapi/error.h"
@@ -82,6 +83,9 @@ void migration_channel_connect(MigrationState *s,
         } else {
             QEMUFile *f = qemu_file_new_output(ioc);
 
+            if (migrate_zero_copy_send()) {
+                qemu_file_set_zero_copy(f);
+            }
             migration_ioc_register_yank(ioc);
 
             qemu_mutex_lock(&s->qemu_file_lock);
@@ -0,0 +1,51 @@
+/*
+ * Migration dirty page rate budget
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "dirty-limit.h"
+
+/**
+ * dirty_limit_split_budget: split a total dirty page rate among vCPUs
+ *
+ * vCPUs that dirty memory slower than their share of @budget get a
+ * quota of their own rate, and what they leave of the budget is split
+ * evenly among the others, so that only the vCPUs that dirty the most
+ * memory are slowed down.  The quotas add up to at most @budget.
+ *
+ * Every quota is at least @floor, which takes priority over the budget:
+ * if @budget is less than @floor per vCPU, the quotas add up to more.
+ *
+ * @budget: total dirty page rate
+ * @floor: smallest quota of a vCPU
+ * @demand: dirty page rate of each vCPU, UINT64_MAX if unknown
+ * @nvcpus: number of vCPUs
+ * @quota: where to store the quota of each vCPU
+ */
+void dirty_limit_split_budget(uint64_t budget, uint64_t floor,
+                              const uint64_t *demand, int nvcpus,
+                              uint64_t *quota)
+{
+    g_autofree int *order = g_new(int, nvcpus);
+    int i, j;
+
+    /* Sort the vCPUs by increasing demand */
+    for (i = 0; i < nvcpus; i++) {
+        for (j = i; j > 0 && demand[order[j - 1]] > demand[i]; j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+
+    for (i = 0; i < nvcpus; i++) {
+        int cpu_index = order[i];
+        uint64_t q = MIN(demand[cpu_index], budget / (nvcpus - i));
+
+        q = MAX(q, floor);
+        budget -= MIN(q, budget);
+        quota[cpu_index] = q;
+    }
+}
@@ -0,0 +1,15 @@
+/*
+ * Migration dirty page rate budget
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_DIRTY_LIMIT_H
+#define QEMU_MIGRATION_DIRTY_LIMIT_H
+
+void dirty_limit_split_budget(uint64_t budget, uint64_t floor,
+                              const uint64_t *demand, int nvcpus,
+                              uint64_t *quota);
+
+#endif
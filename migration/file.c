@@ -99,16 +99,25 @@ void file_start_outgoing_migration(MigrationState *s,
     g_autoptr(QIOChannelFile) fioc = NULL;
     g_autofree char *filename = g_strdup(file_args->filename);
     uint64_t offset = file_args->offset;
+    bool incremental = migrate_mapped_ram_incremental();
     QIOChannel *ioc;
 
     trace_migration_file_outgoing(filename);
 
-    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY, 0600, errp);
+    /*
+     * An incremental save leaves the pages of the previous save in place
+     * and reads back its headers to check that the file holds it.  When
+     * it has to save all of RAM instead, the pages it does not write are
+     * not in its bitmaps, so whatever the file held there is not loaded.
+     */
+    fioc = qio_channel_file_new_path(filename, O_CREAT |
+                                     (incremental ? O_RDWR : O_WRONLY),
+                                     0600, errp);
     if (!fioc) {
         return;
     }
 
-    if (ftruncate(fioc->fd, offset)) {
+    if (!incremental && ftruncate(fioc->fd, offset)) {
         error_setg_errno(errp, errno,
                          "failed to truncate migration file to offset %" PRIx64,
                          offset);
@@ -266,3 +275,28 @@ int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp)
 
     return 0;
 }
+
+/*
+ * Map @size bytes of the migration file at @file_offset privately over
+ * the guest RAM of @block at @offset, so that they are read when first
+ * touched.
+ */
+bool file_map_ram(QIOChannel *ioc, RAMBlock *block, ram_addr_t offset,
+                  size_t size, off_t file_offset, Error **errp)
+{
+#ifdef CONFIG_POSIX
+    if (!qemu_ram_map_file_private(block, offset, size,
+                                   QIO_CHANNEL_FILE(ioc)->fd, file_offset,
+                                   errp)) {
+        error_prepend(errp, "migration file at offset 0x%" PRIx64 ": ",
+                      (uint64_t)file_offset);
+        return false;
+    }
+
+    trace_migration_file_map_ram(block->host + offset, size, file_offset);
+    return true;
+#else
+    /* it should have been rejected when setting the parameter */
+    g_assert_not_reached();
+#endif
+}
@@ -23,4 +23,6 @@ bool file_send_channel_create(gpointer opaque, Error **errp);
 int file_write_ramblock_iov(QIOChannel *ioc, const struct iovec *iov,
                             int niov, MultiFDPages_t *pages, Error **errp);
 int multifd_file_recv_data(MultiFDRecvParams *p, Error **errp);
+bool file_map_ram(QIOChannel *ioc, RAMBlock *block, ram_addr_t offset,
+                  size_t size, off_t file_offset, Error **errp);
 #endif
@@ -48,6 +48,8 @@ static void migration_global_dump(Monitor *mon)
                    ms->send_section_footer ? "on" : "off");
     monitor_printf(mon, "clear-bitmap-shift: %u\n",
                    ms->clear_bitmap_shift);
+    monitor_printf(mon, "bitmap-sync-parallel-min: %" PRIu64 "\n",
+                   ms->bitmap_sync_parallel_min);
 }
 
 void hmp_info_migrate(Monitor *mon, const QDict *qdict)
@@ -141,6 +143,19 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                            "Zero-copy-send fallbacks happened: %" PRIu64 " times\n",
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->main_missed_zero_copy) {
+            monitor_printf(mon, "Zero-copy-send fallbacks on the main "
+                           "channel: %" PRIu64 "\n",
+                           info->ram->main_missed_zero_copy);
+        }
+        if (info->ram->dedup_pages) {
+            monitor_printf(mon, "dedup: %" PRIu64 " pages\n",
+                           info->ram->dedup_pages);
+        }
+        if (info->ram->deferred_pages) {
+            monitor_printf(mon, "deferred hot pages: %" PRIu64 " pages\n",
+                           info->ram->deferred_pages);
+        }
     }
 
     if (info->xbzrle_cache) {
@@ -209,6 +224,27 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->vfio->transferred >> 10);
     }
 
+    if (info->downtime_info) {
+        MigrationDowntimeCheckpointList *cp;
+        MigrationDowntimeDeviceList *dev;
+
+        monitor_printf(mon, "downtime checkpoints: [\n");
+        for (cp = info->downtime_info->checkpoints; cp; cp = cp->next) {
+            monitor_printf(mon, "\t%s: %" PRId64 " us\n",
+                           cp->value->name, cp->value->time);
+        }
+        monitor_printf(mon, "]\n");
+
+        monitor_printf(mon, "downtime devices: [\n");
+        for (dev = info->downtime_info->devices; dev; dev = dev->next) {
+            monitor_printf(mon, "\t%s/%" PRIu32 "%s: %" PRId64 " us\n",
+                           dev->value->id, dev->value->instance_id,
+                           dev->value->iterable ? " (iterable)" : "",
+                           dev->value->time);
+        }
+        monitor_printf(mon, "]\n");
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
@@ -358,6 +394,36 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
                                MIGRATION_PARAMETER_DIRECT_IO),
                            params->direct_io ? "on" : "off");
         }
+        if (params->has_multifd_dedup_cache_size) {
+            monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_MULTIFD_DEDUP_CACHE_SIZE),
+                           params->multifd_dedup_cache_size);
+        }
+        if (params->has_dirty_limit_adaptive) {
+            monitor_printf(mon, "%s: %s\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_DIRTY_LIMIT_ADAPTIVE),
+                           params->dirty_limit_adaptive ? "on" : "off");
+        }
+        if (params->has_postcopy_fault_threads) {
+            monitor_printf(mon, "%s: %u\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS),
+                           params->postcopy_fault_threads);
+        }
+        if (params->has_mapped_ram_lazy_load) {
+            monitor_printf(mon, "%s: %s\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_MAPPED_RAM_LAZY_LOAD),
+                           params->mapped_ram_lazy_load ? "on" : "off");
+        }
+        if (params->has_background_snapshot_threads) {
+            monitor_printf(mon, "%s: %u\n",
+                           MigrationParameter_str(
+                               MIGRATION_PARAMETER_BACKGROUND_SNAPSHOT_THREADS),
+                           params->background_snapshot_threads);
+        }
     }
 
     qapi_free_MigrationParameters(params);
@@ -639,6 +705,26 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_direct_io = true;
         visit_type_bool(v, param, &p->direct_io, &err);
         break;
+    case MIGRATION_PARAMETER_MULTIFD_DEDUP_CACHE_SIZE:
+        p->has_multifd_dedup_cache_size = true;
+        visit_type_size(v, param, &p->multifd_dedup_cache_size, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRTY_LIMIT_ADAPTIVE:
+        p->has_dirty_limit_adaptive = true;
+        visit_type_bool(v, param, &p->dirty_limit_adaptive, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS:
+        p->has_postcopy_fault_threads = true;
+        visit_type_uint8(v, param, &p->postcopy_fault_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_MAPPED_RAM_LAZY_LOAD:
+        p->has_mapped_ram_lazy_load = true;
+        visit_type_bool(v, param, &p->mapped_ram_lazy_load, &err);
+        break;
+    case MIGRATION_PARAMETER_BACKGROUND_SNAPSHOT_THREADS:
+        p->has_background_snapshot_threads = true;
+        visit_type_uint8(v, param, &p->background_snapshot_threads, &err);
+        break;
     default:
         g_assert_not_reached();
     }
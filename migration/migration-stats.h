@@ -34,6 +34,16 @@
  * one thread).
  */
 typedef struct {
+    /*
+     * Number of pages sent as a reference to an identical page that
+     * was sent earlier on the same multifd channel.
+     */
+    Stat64 dedup_pages;
+    /*
+     * Number of dirty pages that were put off to the end of a pass over
+     * RAM because they belong to a hot region.
+     */
+    Stat64 deferred_pages;
     /*
      * Number of bytes that were dirty last time that we synced with
      * the guest memory.  We use that to calculate the downtime.  As
@@ -55,6 +65,11 @@ typedef struct {
      * copy.
      */
     Stat64 dirty_sync_missed_zero_copy;
+    /*
+     * Number of times the main channel waited for its zero copy writes,
+     * and the kernel had copied all of them.
+     */
+    Stat64 main_missed_zero_copy;
     /*
      * Number of bytes sent at migration completion stage while the
      * guest is stopped.
@@ -88,6 +88,8 @@ enum mig_rp_message_type {
     MIG_RP_MSG_RECV_BITMAP,  /* send recved_bitmap back to source */
     MIG_RP_MSG_RESUME_ACK,   /* tell source that we are ready to resume */
     MIG_RP_MSG_SWITCHOVER_ACK, /* Tell source it's OK to do switchover */
+    /* data (start: be64, stride: be32, count: be32, id: string) */
+    MIG_RP_MSG_PREFETCH_PAGES,
 
     MIG_RP_MSG_MAX
 };
@@ -109,9 +111,83 @@ static void migrate_fd_cancel(MigrationState *s);
 static bool close_return_path_on_source(MigrationState *s);
 static void migration_completion_end(MigrationState *s);
 
+/*
+ * Start recording where the downtime goes, dropping what was recorded
+ * for the previous migration.
+ */
+void migration_downtime_stats_start(MigrationDowntimeStats *stats)
+{
+    QEMU_LOCK_GUARD(&stats->lock);
+
+    qapi_free_MigrationDowntimeInfo(stats->info);
+    stats->info = g_new0(MigrationDowntimeInfo, 1);
+    stats->checkpoints_tail = &stats->info->checkpoints;
+    stats->devices_tail = &stats->info->devices;
+    stats->start = 0;
+    stats->active = true;
+}
+
+void migration_downtime_stats_stop(MigrationDowntimeStats *stats)
+{
+    QEMU_LOCK_GUARD(&stats->lock);
+
+    stats->active = false;
+}
+
+static MigrationDowntimeInfo *
+migration_downtime_stats_get(MigrationDowntimeStats *stats)
+{
+    QEMU_LOCK_GUARD(&stats->lock);
+
+    return stats->info ? QAPI_CLONE(MigrationDowntimeInfo, stats->info) : NULL;
+}
+
+void migration_downtime_checkpoint(MigrationDowntimeStats *stats,
+                                   const char *name)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    MigrationDowntimeCheckpoint *cp;
+
+    trace_vmstate_downtime_checkpoint(name);
+
+    QEMU_LOCK_GUARD(&stats->lock);
+    if (!stats->active) {
+        return;
+    }
+    if (!stats->start) {
+        stats->start = now;
+    }
+
+    cp = g_new0(MigrationDowntimeCheckpoint, 1);
+    cp->name = g_strdup(name);
+    cp->time = now - stats->start;
+    QAPI_LIST_APPEND(stats->checkpoints_tail, cp);
+}
+
+/* Record the @time (us) spent saving or loading a device state section */
+void migration_downtime_device(MigrationDowntimeStats *stats,
+                               const char *idstr, uint32_t instance_id,
+                               bool iterable, int64_t time)
+{
+    MigrationDowntimeDevice *dev;
+
+    QEMU_LOCK_GUARD(&stats->lock);
+    if (!stats->active) {
+        return;
+    }
+
+    dev = g_new0(MigrationDowntimeDevice, 1);
+    dev->id = g_strdup(idstr);
+    dev->instance_id = instance_id;
+    dev->iterable = iterable;
+    dev->time = time;
+    QAPI_LIST_APPEND(stats->devices_tail, dev);
+}
+
 static void migration_downtime_start(MigrationState *s)
 {
-    trace_vmstate_downtime_checkpoint("src-downtime-start");
+    migration_downtime_stats_start(&s->downtime_stats);
+    migration_downtime_checkpoint(&s->downtime_stats, "src-downtime-start");
     s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 }
 
@@ -127,7 +203,8 @@ static void migration_downtime_end(MigrationState *s)
         s->downtime = now - s->downtime_start;
     }
 
-    trace_vmstate_downtime_checkpoint("src-downtime-end");
+    migration_downtime_checkpoint(&s->downtime_stats, "src-downtime-end");
+    migration_downtime_stats_stop(&s->downtime_stats);
 }
 
 static bool migration_needs_multiple_sockets(void)
@@ -224,7 +301,7 @@ static int migration_stop_vm(MigrationState *s, RunState state)
 
     ret = vm_stop_force_state(state);
 
-    trace_vmstate_downtime_checkpoint("src-vm-stopped");
+    migration_downtime_checkpoint(&s->downtime_stats, "src-vm-stopped");
     trace_migration_completion_vm_stop(ret);
 
     return ret;
@@ -250,11 +327,13 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_mutex_init(&current_incoming->postcopy_pause_fault_lock);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fast_load, 0);
     qemu_sem_init(&current_incoming->postcopy_qemufile_dst_done, 0);
 
     qemu_mutex_init(&current_incoming->page_request_mutex);
     qemu_cond_init(&current_incoming->page_request_cond);
+    qemu_mutex_init(&current_incoming->downtime_stats.lock);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
 
     current_incoming->exit_on_error = INMIGRATE_DEFAULT_EXIT_ON_ERROR;
@@ -430,16 +509,15 @@ static void migrate_generate_event(MigrationStatus new_state)
 
 /*
  * Send a message on the return channel back to the source
- * of the migration.
+ * of the migration.  Must be called with rp_mutex held.
  */
-static int migrate_send_rp_message(MigrationIncomingState *mis,
-                                   enum mig_rp_message_type message_type,
-                                   uint16_t len, void *data)
+static int migrate_send_rp_message_locked(MigrationIncomingState *mis,
+                                          enum mig_rp_message_type message_type,
+                                          uint16_t len, void *data)
 {
     int ret = 0;
 
     trace_migrate_send_rp_message((int)message_type, len);
-    QEMU_LOCK_GUARD(&mis->rp_mutex);
 
     /*
      * It's possible that the file handle got lost due to network
@@ -456,17 +534,26 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return qemu_fflush(mis->to_src_file);
 }
 
-/* Request one page from the source VM at the given start address.
+static int migrate_send_rp_message(MigrationIncomingState *mis,
+                                   enum mig_rp_message_type message_type,
+                                   uint16_t len, void *data)
+{
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+
+    return migrate_send_rp_message_locked(mis, message_type, len, data);
+}
+
+/* Request pages from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -475,10 +562,11 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
 
     /*
-     * We maintain the last ramblock that we requested for page.  Note that we
-     * don't need locking because this function will only be called within the
-     * postcopy ram fault thread.
+     * We maintain the last ramblock that we requested for page.  There can
+     * be several fault threads, so keep it consistent with the order the
+     * requests go out in.
      */
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
     if (rb != mis->last_rb) {
         mis->last_rb = rb;
 
@@ -495,7 +583,34 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
         msg_type = MIG_RP_MSG_REQ_PAGES;
     }
 
-    return migrate_send_rp_message(mis, msg_type, msglen, bufc);
+    return migrate_send_rp_message_locked(mis, msg_type, msglen, bufc);
+}
+
+/*
+ * Ask for @count host pages of @rb that no vCPU is waiting on yet, the
+ * first at @start and each following one @stride bytes after the previous.
+ * The source sends them after the pages requested for faults.
+ */
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                   RAMBlock *rb, ram_addr_t start,
+                                   uint32_t stride, uint32_t count)
+{
+    uint8_t bufc[16 + 1 + 255]; /* start (8), stride (4), count (4), rbname */
+    size_t msglen = 16;
+    const char *rbname = qemu_ram_get_idstr(rb);
+    int rbname_len = strlen(rbname);
+
+    assert(rbname_len < 256);
+
+    *(uint64_t *)bufc = cpu_to_be64((uint64_t)start);
+    *(uint32_t *)(bufc + 8) = cpu_to_be32(stride);
+    *(uint32_t *)(bufc + 12) = cpu_to_be32(count);
+    bufc[msglen++] = rbname_len;
+    memcpy(bufc + msglen, rbname, rbname_len);
+    msglen += rbname_len;
+
+    return migrate_send_rp_message(mis, MIG_RP_MSG_PREFETCH_PAGES, msglen,
+                                   bufc);
 }
 
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
@@ -526,7 +641,8 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
 }
 
 static bool migration_colo_enabled;
@@ -726,7 +842,8 @@ static void process_incoming_migration_bh(void *opaque)
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
 
-    trace_vmstate_downtime_checkpoint("dst-precopy-bh-enter");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-precopy-bh-enter");
 
     /* If capability late_block_activate is set:
      * Only fire up the block code now if we're going to restart the
@@ -753,7 +870,8 @@ static void process_incoming_migration_bh(void *opaque)
      */
     qemu_announce_self(&mis->announce_timer, migrate_announce_params());
 
-    trace_vmstate_downtime_checkpoint("dst-precopy-bh-announced");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-precopy-bh-announced");
 
     multifd_recv_shutdown();
 
@@ -772,7 +890,9 @@ static void process_incoming_migration_bh(void *opaque)
     } else {
         runstate_set(global_state_get_runstate());
     }
-    trace_vmstate_downtime_checkpoint("dst-precopy-bh-vm-started");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-precopy-bh-vm-started");
+    migration_downtime_stats_stop(&mis->downtime_stats);
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -799,11 +919,14 @@ process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_SETUP,
                       MIGRATION_STATUS_ACTIVE);
 
+    migration_downtime_stats_start(&mis->downtime_stats);
+
     mis->loadvm_co = qemu_coroutine_self();
     ret = qemu_loadvm_state(mis->from_src_file);
     mis->loadvm_co = NULL;
 
-    trace_vmstate_downtime_checkpoint("dst-precopy-loadvm-completed");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-precopy-loadvm-completed");
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -832,6 +955,8 @@ process_incoming_migration_co(void *opaque)
     }
 
     if (migration_incoming_colo_enabled()) {
+        /* The checkpoints of COLO are not part of the downtime */
+        migration_downtime_stats_stop(&mis->downtime_stats);
         /* yield until COLO exit */
         colo_incoming_co();
     }
@@ -839,6 +964,7 @@ process_incoming_migration_co(void *opaque)
     migration_bh_schedule(process_incoming_migration_bh, mis);
     return;
 fail:
+    migration_downtime_stats_stop(&mis->downtime_stats);
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_FAILED);
     migrate_set_error(s, local_err);
@@ -1162,6 +1288,9 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
     if (migrate_show_downtime(s)) {
         info->has_downtime = true;
         info->downtime = s->downtime;
+        /* Supersedes the one of a previous incoming migration */
+        qapi_free_MigrationDowntimeInfo(info->downtime_info);
+        info->downtime_info = migration_downtime_stats_get(&s->downtime_stats);
     } else {
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
@@ -1183,6 +1312,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.dirty_sync_count);
     info->ram->dirty_sync_missed_zero_copy =
         stat64_get(&mig_stats.dirty_sync_missed_zero_copy);
+    info->ram->main_missed_zero_copy =
+        stat64_get(&mig_stats.main_missed_zero_copy);
     info->ram->postcopy_requests =
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
@@ -1191,8 +1322,10 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->precopy_bytes = stat64_get(&mig_stats.precopy_bytes);
     info->ram->downtime_bytes = stat64_get(&mig_stats.downtime_bytes);
     info->ram->postcopy_bytes = stat64_get(&mig_stats.postcopy_bytes);
+    info->ram->dedup_pages = stat64_get(&mig_stats.dedup_pages);
+    info->ram->deferred_pages = stat64_get(&mig_stats.deferred_pages);
 
-    if (migrate_xbzrle()) {
+    if (migrate_xbzrle() || multifd_xbzrle_enabled()) {
         info->xbzrle_cache = g_malloc0(sizeof(*info->xbzrle_cache));
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_counters.bytes;
@@ -1321,6 +1454,8 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        info->downtime_info =
+            migration_downtime_stats_get(&mis->downtime_stats);
         break;
     default:
         return;
@@ -1404,6 +1539,9 @@ static void migrate_fd_cleanup(MigrationState *s)
         bql_lock();
     }
 
+    /* In case the migration failed before the downtime ended */
+    migration_downtime_stats_stop(&s->downtime_stats);
+
     WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
         /*
          * Close the file handle without the lock to make sure the critical
@@ -2172,6 +2310,7 @@ static struct rp_cmd_args {
     [MIG_RP_MSG_RECV_BITMAP]    = { .len = -1, .name = "RECV_BITMAP" },
     [MIG_RP_MSG_RESUME_ACK]     = { .len =  4, .name = "RESUME_ACK" },
     [MIG_RP_MSG_SWITCHOVER_ACK] = { .len =  0, .name = "SWITCHOVER_ACK" },
+    [MIG_RP_MSG_PREFETCH_PAGES] = { .len = -1, .name = "PREFETCH_PAGES" },
     [MIG_RP_MSG_MAX]            = { .len = -1, .name = "MAX" },
 };
 
@@ -2202,6 +2341,26 @@ migrate_handle_rp_req_pages(MigrationState *ms, const char* rbname,
     ram_save_queue_pages(rbname, start, len, errp);
 }
 
+static void
+migrate_handle_rp_prefetch_pages(MigrationState *ms, const char *rbname,
+                                 ram_addr_t start, uint32_t stride,
+                                 uint32_t count, Error **errp)
+{
+    long our_host_ps = qemu_real_host_page_size();
+
+    trace_migrate_handle_rp_prefetch_pages(rbname, start, stride, count);
+
+    if (!QEMU_IS_ALIGNED(start, our_host_ps) ||
+        !QEMU_IS_ALIGNED(stride, our_host_ps) || !stride || !count) {
+        error_setg(errp, "MIG_RP_MSG_PREFETCH_PAGES: Invalid request, start: "
+                   RAM_ADDR_FMT " stride: %" PRIu32 " count: %" PRIu32,
+                   start, stride, count);
+        return;
+    }
+
+    ram_save_queue_prefetch_pages(rbname, start, stride, count, errp);
+}
+
 static bool migrate_handle_rp_recv_bitmap(MigrationState *s, char *block_name,
                                           Error **errp)
 {
@@ -2378,6 +2537,27 @@ static void *source_return_path_thread(void *opaque)
             }
             break;
 
+        case MIG_RP_MSG_PREFETCH_PAGES:
+            expected_len = 16 + 1; /* header + termination */
+
+            if (header_len >= expected_len) {
+                tmp32 = buf[16]; /* Length of the following idstr */
+                buf[17 + tmp32] = '\0';
+                expected_len += tmp32;
+            }
+            if (header_len != expected_len) {
+                error_setg(&err, "Prefetch_pages with length %d expecting %zd",
+                           header_len, expected_len);
+                goto out;
+            }
+            migrate_handle_rp_prefetch_pages(ms, (char *)&buf[17],
+                                             ldq_be_p(buf), ldl_be_p(buf + 8),
+                                             ldl_be_p(buf + 12), &err);
+            if (err) {
+                goto out;
+            }
+            break;
+
         case MIG_RP_MSG_RECV_BITMAP:
             if (header_len < 1) {
                 error_setg(&err, "MIG_RP_MSG_RECV_BITMAP missing block name");
@@ -2744,6 +2924,9 @@ static int migration_completion_precopy(MigrationState *s,
     migration_rate_set(RATE_LIMIT_DISABLED);
     ret = qemu_savevm_state_complete_precopy(s->to_dst_file, false,
                                              s->block_inactive);
+    if (!ret) {
+        migration_downtime_checkpoint(&s->downtime_stats, "src-state-flushed");
+    }
 out_unlock:
     bql_unlock();
     return ret;
@@ -2820,8 +3003,10 @@ static void migration_completion(MigrationState *s)
     if (close_return_path_on_source(s)) {
         goto fail;
     }
+    migration_downtime_checkpoint(&s->downtime_stats, "src-return-path-closed");
 
-    if (qemu_file_get_error(s->to_dst_file)) {
+    /* Rather than in the main loop, when the file is closed */
+    if (qemu_file_zero_copy_sync(s->to_dst_file)) {
         trace_migration_completion_file_err();
         goto fail;
     }
@@ -2867,7 +3052,7 @@ static void bg_migration_completion(MigrationState *s)
          * the temporary buffer before RAM saving started.
          */
         qemu_put_buffer(s->to_dst_file, s->bioc->data, s->bioc->usage);
-        qemu_fflush(s->to_dst_file);
+        qemu_file_zero_copy_sync(s->to_dst_file);
     } else if (s->state == MIGRATION_STATUS_CANCELLING) {
         goto fail;
     }
@@ -3838,6 +4023,8 @@ static void migration_instance_finalize(Object *obj)
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     qemu_sem_destroy(&ms->rp_state.rp_pong_acks);
     qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
+    qemu_mutex_destroy(&ms->downtime_stats.lock);
+    qapi_free_MigrationDowntimeInfo(ms->downtime_stats.info);
     error_free(ms->error);
 }
 
@@ -3860,6 +4047,7 @@ static void migration_instance_init(Object *obj)
     qemu_sem_init(&ms->wait_unplug_sem, 0);
     qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_mutex_init(&ms->qemu_file_lock);
+    qemu_mutex_init(&ms->downtime_stats.lock);
 }
 
 /*
@@ -29,20 +29,35 @@
 #include "migration/misc.h"
 
 #define  MIGRATION_THREAD_SNAPSHOT          "mig/snapshot"
+#define  MIGRATION_THREAD_SNAPSHOT_FAULT    "mig/snapshot/fault_%d"
 #define  MIGRATION_THREAD_DIRTY_RATE        "mig/dirtyrate"
 
 #define  MIGRATION_THREAD_SRC_MAIN          "mig/src/main"
 #define  MIGRATION_THREAD_SRC_MULTIFD       "mig/src/send_%d"
 #define  MIGRATION_THREAD_SRC_RETURN        "mig/src/return"
+#define  MIGRATION_THREAD_SRC_SYNC          "mig/src/sync_%d"
+#define  MIGRATION_THREAD_SRC_STATE         "mig/src/state_%d"
 #define  MIGRATION_THREAD_SRC_TLS           "mig/src/tls"
 
 #define  MIGRATION_THREAD_DST_COLO          "mig/dst/colo"
 #define  MIGRATION_THREAD_DST_MULTIFD       "mig/src/recv_%d"
-#define  MIGRATION_THREAD_DST_FAULT         "mig/dst/fault"
+#define  MIGRATION_THREAD_DST_FAULT         "mig/dst/fault_%d"
+#define  MIGRATION_THREAD_DST_SYNC          "mig/dst/sync_%d"
 #define  MIGRATION_THREAD_DST_LISTEN        "mig/dst/listen"
 #define  MIGRATION_THREAD_DST_PREEMPT       "mig/dst/preempt"
 
 struct PostcopyBlocktimeContext;
+struct PostcopyFaultStream;
+
+typedef struct {
+    MigrationIncomingState *mis;
+    QemuThread thread;
+    char *name;
+    /* Only the first fault thread serves the shared userfaultfds */
+    int id;
+    /* To notify the fault thread to wake, e.g., when need to quit */
+    int event_fd;
+} PostcopyFaultThread;
 
 #define  MIGRATION_RESUME_ACK_VALUE  (1)
 
@@ -63,6 +78,12 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Below this amount of RAM, a single thread syncs the dirty bitmap fast
+ * enough.  This is the default value of x-bitmap-sync-parallel-min.
+ */
+#define BITMAP_SYNC_PARALLEL_MIN_DEFAULT  (64 * GiB)
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -81,6 +102,19 @@ typedef struct {
     bool all_zero;
 } PostcopyTmpPage;
 
+/* Breakdown of the downtime of a migration, see MigrationDowntimeInfo */
+typedef struct {
+    /* Protects the fields below against query-migrate */
+    QemuMutex lock;
+    /* Whether the downtime of the current migration is being recorded */
+    bool active;
+    /* Time of the first checkpoint (us), zero until then */
+    int64_t start;
+    MigrationDowntimeInfo *info;
+    MigrationDowntimeCheckpointList **checkpoints_tail;
+    MigrationDowntimeDeviceList **devices_tail;
+} MigrationDowntimeStats;
+
 typedef enum {
     PREEMPT_THREAD_NONE = 0,
     PREEMPT_THREAD_CREATED,
@@ -111,20 +145,22 @@ struct MigrationIncomingState {
 
     size_t         largest_page_size;
     bool           have_fault_thread;
-    QemuThread     fault_thread;
-    /* Set this when we want the fault thread to quit */
+    PostcopyFaultThread *fault_threads;
+    int            nr_fault_threads;
+    /* Set this when we want the fault threads to quit */
     bool           fault_thread_quit;
+    /* Access pattern of the faults, with postcopy-prefetch */
+    struct PostcopyFaultStream *fault_streams;
+    int            nr_fault_streams;
 
     bool           have_listen_thread;
     QemuThread     listen_thread;
 
     /* For the kernel to send us notifications */
     int       userfault_fd;
-    /* To notify the fault_thread to wake, e.g., when need to quit */
-    int       userfault_event_fd;
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
-    /* RAMBlock of last request sent to source */
+    /* RAMBlock of last request sent to source, protected by rp_mutex */
     RAMBlock *last_rb;
     /*
      * Number of postcopy channels including the default precopy channel, so
@@ -196,6 +232,15 @@ struct MigrationIncomingState {
     /* notify PAUSED postcopy incoming migrations to try to continue */
     QemuSemaphore postcopy_pause_sem_dst;
     QemuSemaphore postcopy_pause_sem_fault;
+    /*
+     * Protects postcopy_fault_resume_gen and postcopy_nr_paused_faults.
+     * The generation is bumped whenever the paused fault threads are
+     * released, so that a fault thread that finds the return path broken
+     * only sleeps if no recovery happened since it looked.
+     */
+    QemuMutex postcopy_pause_fault_lock;
+    uint64_t postcopy_fault_resume_gen;
+    int postcopy_nr_paused_faults;
     /*
      * This semaphore is used to allow the ram fast load thread (only when
      * postcopy preempt is enabled) fall into sleep when there's network
@@ -244,6 +289,9 @@ struct MigrationIncomingState {
 
     /* Do exit on incoming migration failure */
     bool exit_on_error;
+
+    /* Where the downtime went on the destination */
+    MigrationDowntimeStats downtime_stats;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -353,6 +401,8 @@ struct MigrationState {
     int64_t downtime_start;
     int64_t downtime;
     int64_t expected_downtime;
+    /* Where the downtime went on the source */
+    MigrationDowntimeStats downtime_stats;
     bool capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
 
@@ -455,6 +505,11 @@ struct MigrationState {
      * (which is in 4M chunk).
      */
     uint8_t clear_bitmap_shift;
+    /*
+     * With multifd, the dirty bitmap is synced by several threads when
+     * the guest has at least this many bytes of RAM.
+     */
+    uint64_t bitmap_sync_parallel_min;
 
     /*
      * This save hostname when out-going migration starts
@@ -499,6 +554,14 @@ MigrationState *migrate_get_current(void);
 bool migration_has_failed(MigrationState *);
 bool migrate_mode_is_cpr(MigrationState *);
 
+void migration_downtime_stats_start(MigrationDowntimeStats *stats);
+void migration_downtime_stats_stop(MigrationDowntimeStats *stats);
+void migration_downtime_checkpoint(MigrationDowntimeStats *stats,
+                                   const char *name);
+void migration_downtime_device(MigrationDowntimeStats *stats,
+                               const char *idstr, uint32_t instance_id,
+                               bool iterable, int64_t time);
+
 uint64_t ram_get_total_transferred_pages(void);
 
 /* Sending on the return path - generic and then for each message type */
@@ -509,7 +572,11 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
+int migrate_send_rp_prefetch_pages(MigrationIncomingState *mis,
+                                   RAMBlock *rb, ram_addr_t start,
+                                   uint32_t stride, uint32_t count);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
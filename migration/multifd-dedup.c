@@ -0,0 +1,297 @@
+/*
+ * Multifd deduplication of identical pages.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "multifd.h"
+#include "options.h"
+#include "ram.h"
+#include "trace.h"
+
+/*
+ * Each channel keeps a ring of copies of the last normal pages that
+ * went through it.  Both sides store the normal pages of a packet in
+ * the ring in the order they appear in the packet, so that a ring slot
+ * holds the same contents on both sides.  The source looks every page
+ * up in a hash table of the ring, and when it finds an identical page
+ * it sends the slot that holds it instead of the page itself.
+ *
+ * The source sends the normal pages from their copy in the ring rather
+ * than from guest memory, so that the destination ends up with the
+ * same contents in its ring even if the guest writes to the page while
+ * it is being sent.
+ */
+
+#define MULTIFD_DEDUP_HASH_PRIME 0x9e3779b97f4a7c15ULL
+
+typedef struct {
+    uint64_t hash;
+    /* sequence number of the page plus one, zero if unused */
+    uint64_t seq;
+} MultiFDDedupEntry;
+
+struct MultiFDDedup {
+    /* copies of the last pages, indexed by sequence number */
+    uint8_t *ring;
+    /* number of pages in the ring, a power of two */
+    uint32_t slots;
+    /* sequence number of the next page stored in the ring */
+    uint64_t seq;
+    /* sequence number of the first normal page of the current packet */
+    uint64_t packet_seq;
+    /* source only: hash table of the pages in the ring */
+    MultiFDDedupEntry *table;
+    /* duplicate pages of the current packet, and the slot holding them */
+    ram_addr_t *dup;
+    uint32_t *dup_slot;
+};
+
+/* Where the slots of the duplicate pages start in a packet */
+static inline uint8_t *multifd_dedup_packet_slots(MultiFDPacket_t *packet)
+{
+    return (uint8_t *)packet + sizeof(MultiFDPacket_t) +
+           multifd_ram_page_count() * sizeof(uint64_t);
+}
+
+static inline void *multifd_dedup_slot(MultiFDDedup *d, uint64_t seq)
+{
+    return d->ring + (seq & (d->slots - 1)) * multifd_ram_page_size();
+}
+
+static uint64_t multifd_dedup_hash(const void *buf, size_t len)
+{
+    const uint64_t *p = buf;
+    uint64_t h0 = 0, h1 = 1, h2 = 2, h3 = 3, h;
+
+    /* Four independent lanes, so that the multiplies can overlap */
+    for (size_t i = 0; i < len / sizeof(uint64_t); i += 4) {
+        h0 = (h0 ^ p[i]) * MULTIFD_DEDUP_HASH_PRIME;
+        h1 = (h1 ^ p[i + 1]) * MULTIFD_DEDUP_HASH_PRIME;
+        h2 = (h2 ^ p[i + 2]) * MULTIFD_DEDUP_HASH_PRIME;
+        h3 = (h3 ^ p[i + 3]) * MULTIFD_DEDUP_HASH_PRIME;
+    }
+
+    h = h0 ^ rol64(h1, 16) ^ rol64(h2, 32) ^ rol64(h3, 48);
+    h ^= h >> 33;
+    h *= MULTIFD_DEDUP_HASH_PRIME;
+    return h ^ (h >> 29);
+}
+
+/* Size of the dedup cache in pages, zero if dedup is disabled */
+uint32_t multifd_dedup_slots(void)
+{
+    return migrate_multifd_dedup_cache_size() / multifd_ram_page_size();
+}
+
+MultiFDDedup *multifd_dedup_new(bool send, Error **errp)
+{
+    uint64_t size = migrate_multifd_dedup_cache_size();
+    uint32_t page_count = multifd_ram_page_count();
+    MultiFDDedup *d = g_new0(MultiFDDedup, 1);
+
+    d->slots = multifd_dedup_slots();
+    d->ring = g_try_malloc0(size);
+    if (!d->ring) {
+        error_setg(errp, "multifd: failed to allocate %" PRIu64
+                   " bytes of dedup cache", size);
+        g_free(d);
+        return NULL;
+    }
+    if (send) {
+        d->table = g_new0(MultiFDDedupEntry, d->slots);
+    }
+    d->dup = g_new0(ram_addr_t, page_count);
+    d->dup_slot = g_new0(uint32_t, page_count);
+
+    return d;
+}
+
+void multifd_dedup_free(MultiFDDedup *d)
+{
+    if (!d) {
+        return;
+    }
+
+    g_free(d->ring);
+    g_free(d->table);
+    g_free(d->dup);
+    g_free(d->dup_slot);
+    g_free(d);
+}
+
+/**
+ * multifd_send_dedup_detect: Look for normal pages that are identical
+ * to a page in the dedup cache.
+ *
+ * Must run after zero page detection.  Stores the other normal pages in
+ * the cache, and reorders p->pages->offset as normal pages, zero pages
+ * and then duplicate pages.  Updates p->pages->normal_num and
+ * p->pages->dup_num.
+ *
+ * @param p A pointer to the send params.
+ */
+void multifd_send_dedup_detect(MultiFDSendParams *p)
+{
+    MultiFDDedup *d = p->dedup;
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t normal_num = 0, dup_num = 0;
+    uint64_t first_valid;
+
+    pages->dup_num = 0;
+    if (!d) {
+        return;
+    }
+
+    /*
+     * Only refer to slots that none of the normal pages of this packet
+     * can overwrite, as the destination stores all of them before it
+     * copies the duplicate pages.
+     */
+    d->packet_seq = d->seq;
+    first_valid = d->seq + pages->num - MIN(d->seq + pages->num, d->slots);
+
+    for (uint32_t i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        void *copy = multifd_dedup_slot(d, d->seq);
+        MultiFDDedupEntry *e;
+        uint64_t hash;
+
+        /*
+         * The slot for the next page holds a page older than
+         * first_valid, which nothing can refer to, so it can be
+         * scribbled over even if the page turns out to be a duplicate.
+         */
+        memcpy(copy, pages->block->host + offset, page_size);
+        hash = multifd_dedup_hash(copy, page_size);
+        e = &d->table[hash & (d->slots - 1)];
+
+        if (e->seq > first_valid && e->hash == hash &&
+            !memcmp(multifd_dedup_slot(d, e->seq - 1), copy, page_size)) {
+            d->dup[dup_num] = offset;
+            d->dup_slot[dup_num] = (e->seq - 1) & (d->slots - 1);
+            dup_num++;
+            continue;
+        }
+
+        e->hash = hash;
+        e->seq = ++d->seq;
+        pages->offset[normal_num++] = offset;
+    }
+
+    if (!dup_num) {
+        return;
+    }
+
+    memmove(&pages->offset[normal_num], &pages->offset[pages->normal_num],
+            zero_num * sizeof(ram_addr_t));
+    memcpy(&pages->offset[normal_num + zero_num], d->dup,
+           dup_num * sizeof(ram_addr_t));
+    pages->normal_num = normal_num;
+    pages->dup_num = dup_num;
+
+    trace_multifd_send_dedup_detect(p->id, normal_num, dup_num);
+}
+
+/* Returns the copy in the dedup cache of the i-th normal page */
+void *multifd_send_dedup_page(MultiFDSendParams *p, uint32_t i)
+{
+    return multifd_dedup_slot(p->dedup, p->dedup->packet_seq + i);
+}
+
+void multifd_send_dedup_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint8_t *slots = multifd_dedup_packet_slots(p->packet);
+
+    for (uint32_t i = 0; i < pages->dup_num; i++) {
+        stl_be_p(slots + i * sizeof(uint32_t), p->dedup->dup_slot[i]);
+    }
+}
+
+int multifd_recv_dedup_unfill_packet(MultiFDRecvParams *p, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    MultiFDDedup *d = p->dedup;
+    uint8_t *slots = multifd_dedup_packet_slots(packet);
+    uint32_t first = p->normal_num + p->zero_num;
+
+    if (!d) {
+        error_setg(errp, "multifd: received %u duplicate pages, but "
+                   "multifd-dedup-cache-size is not set", p->dup_num);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < p->dup_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[first + i]);
+        uint32_t slot = ldl_be_p(slots + i * sizeof(uint32_t));
+
+        if (offset > (p->block->used_length - multifd_ram_page_size())) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        if (slot >= d->slots) {
+            error_setg(errp, "multifd: dedup cache slot %u out of range "
+                       "(max %u)", slot, d->slots - 1);
+            return -1;
+        }
+        d->dup[i] = offset;
+        d->dup_slot[i] = slot;
+    }
+
+    return 0;
+}
+
+/**
+ * multifd_recv_dedup_process: Store the normal pages of a packet in the
+ * dedup cache, then fill in its duplicate pages from the cache.
+ *
+ * Must run once the normal pages have been read into guest memory.
+ *
+ * @param p A pointer to the recv params.
+ */
+void multifd_recv_dedup_process(MultiFDRecvParams *p)
+{
+    MultiFDDedup *d = p->dedup;
+    uint32_t page_size = multifd_ram_page_size();
+
+    if (!d) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < p->normal_num; i++) {
+        memcpy(multifd_dedup_slot(d, d->seq++), p->host + p->normal[i],
+               page_size);
+    }
+
+    for (uint32_t i = 0; i < p->dup_num; i++) {
+        memcpy(p->host + d->dup[i], d->ring + d->dup_slot[i] * page_size,
+               page_size);
+        ramblock_recv_bitmap_set_offset(p->block, d->dup[i]);
+    }
+}
+
+/**
+ * multifd_recv_dedup_colo: Mark the duplicate pages of a packet received
+ * into the COLO cache as dirty.
+ *
+ * @param p A pointer to the recv params.
+ */
+void multifd_recv_dedup_colo(MultiFDRecvParams *p)
+{
+    if (p->dedup && p->dup_num) {
+        colo_record_bitmap(p->block, p->dedup->dup, p->dup_num);
+    }
+}
@@ -14,8 +14,10 @@
 #include "exec/ramblock.h"
 #include "exec/target_page.h"
 #include "file.h"
+#include "migration/colo.h"
 #include "multifd.h"
 #include "options.h"
+#include "ram.h"
 #include "qapi/error.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
@@ -64,6 +66,13 @@ static int multifd_nocomp_send_setup(MultiFDSendParams *p, Error **errp)
 {
     uint32_t page_count = multifd_ram_page_count();
 
+    if (migrate_multifd_dedup_cache_size()) {
+        p->dedup = multifd_dedup_new(true, errp);
+        if (!p->dedup) {
+            return -1;
+        }
+    }
+
     if (migrate_zero_copy_send()) {
         p->write_flags |= QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
     }
@@ -80,6 +89,8 @@ static int multifd_nocomp_send_setup(MultiFDSendParams *p, Error **errp)
 
 static void multifd_nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
+    multifd_dedup_free(p->dedup);
+    p->dedup = NULL;
     g_free(p->iov);
     p->iov = NULL;
     return;
@@ -91,7 +102,12 @@ static void multifd_send_prepare_iovs(MultiFDSendParams *p)
     uint32_t page_size = multifd_ram_page_size();
 
     for (int i = 0; i < pages->normal_num; i++) {
-        p->iov[p->iovs_num].iov_base = pages->block->host + pages->offset[i];
+        if (p->dedup) {
+            p->iov[p->iovs_num].iov_base = multifd_send_dedup_page(p, i);
+        } else {
+            p->iov[p->iovs_num].iov_base = pages->block->host +
+                                           pages->offset[i];
+        }
         p->iov[p->iovs_num].iov_len = page_size;
         p->iovs_num++;
     }
@@ -140,16 +156,53 @@ static int multifd_nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
 
 static int multifd_nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
+    if (migrate_multifd_dedup_cache_size()) {
+        p->dedup = multifd_dedup_new(false, errp);
+        if (!p->dedup) {
+            return -1;
+        }
+    }
+
     p->iov = g_new0(struct iovec, multifd_ram_page_count());
     return 0;
 }
 
 static void multifd_nocomp_recv_cleanup(MultiFDRecvParams *p)
 {
+    multifd_dedup_free(p->dedup);
+    p->dedup = NULL;
     g_free(p->iov);
     p->iov = NULL;
 }
 
+/*
+ * Read the normal pages of a packet straight into their place in guest
+ * memory.  Pages are mostly sent in order, so runs of contiguous pages
+ * are read into a single iovec.
+ */
+int multifd_ram_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t iovs_num = 0;
+
+    for (uint32_t i = 0; i < p->normal_num; i++) {
+        uint8_t *host = p->host + p->normal[i];
+        struct iovec *iov = &p->iov[iovs_num];
+
+        if (iovs_num && iov[-1].iov_base + iov[-1].iov_len == host) {
+            iov[-1].iov_len += page_size;
+        } else {
+            iov->iov_base = host;
+            iov->iov_len = page_size;
+            iovs_num++;
+        }
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    }
+
+    trace_multifd_ram_recv_pages(p->id, p->normal_num, iovs_num);
+    return qio_channel_readv_all(p->c, p->iov, iovs_num, errp);
+}
+
 static int multifd_nocomp_recv(MultiFDRecvParams *p, Error **errp)
 {
     uint32_t flags;
@@ -168,16 +221,16 @@ static int multifd_nocomp_recv(MultiFDRecvParams *p, Error **errp)
 
     multifd_recv_zero_page_process(p);
 
-    if (!p->normal_num) {
-        return 0;
-    }
+    if (p->normal_num) {
+        int ret = multifd_ram_recv_pages(p, errp);
 
-    for (int i = 0; i < p->normal_num; i++) {
-        p->iov[i].iov_base = p->host + p->normal[i];
-        p->iov[i].iov_len = multifd_ram_page_size();
-        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (ret) {
+            return ret;
+        }
     }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+
+    multifd_recv_dedup_process(p);
+    return 0;
 }
 
 static void multifd_pages_reset(MultiFDPages_t *pages)
@@ -188,6 +241,7 @@ static void multifd_pages_reset(MultiFDPages_t *pages)
      */
     pages->num = 0;
     pages->normal_num = 0;
+    pages->dup_num = 0;
     pages->block = NULL;
 }
 
@@ -195,11 +249,12 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
     MultiFDPages_t *pages = &p->data->u.ram;
-    uint32_t zero_num = pages->num - pages->normal_num;
+    uint32_t zero_num = pages->num - pages->normal_num - pages->dup_num;
 
     packet->pages_alloc = cpu_to_be32(multifd_ram_page_count());
     packet->normal_pages = cpu_to_be32(pages->normal_num);
     packet->zero_pages = cpu_to_be32(zero_num);
+    packet->dup_pages = cpu_to_be32(pages->dup_num);
 
     if (pages->block) {
         pstrcpy(packet->ramblock, sizeof(packet->ramblock),
@@ -213,6 +268,10 @@ void multifd_ram_fill_packet(MultiFDSendParams *p)
         packet->offset[i] = cpu_to_be64(temp);
     }
 
+    if (pages->dup_num) {
+        multifd_send_dedup_fill_packet(p);
+    }
+
     trace_multifd_send_ram_fill(p->id, pages->normal_num,
                                 zero_num);
 }
@@ -247,7 +306,15 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    if (p->normal_num == 0 && p->zero_num == 0) {
+    p->dup_num = be32_to_cpu(packet->dup_pages);
+    if (p->dup_num > pages_per_packet - p->normal_num - p->zero_num) {
+        error_setg(errp,
+                   "multifd: received packet with %u duplicate pages, expected maximum %u",
+                   p->dup_num, pages_per_packet - p->normal_num - p->zero_num);
+        return -1;
+    }
+
+    if (p->normal_num == 0 && p->zero_num == 0 && p->dup_num == 0) {
         return 0;
     }
 
@@ -260,7 +327,20 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    p->host = p->block->host;
+    /*
+     * Once in COLO state, the secondary keeps running: the pages of a
+     * checkpoint go to the RAM cache, flushed to the guest on commit.
+     */
+    if (migration_incoming_in_colo_state()) {
+        if (!p->block->colo_cache) {
+            error_setg(errp, "multifd: no COLO cache for ram block %s",
+                       packet->ramblock);
+            return -1;
+        }
+        p->host = p->block->colo_cache;
+    } else {
+        p->host = p->block->host;
+    }
     for (i = 0; i < p->normal_num; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
@@ -285,9 +365,24 @@ int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->zero[i] = offset;
     }
 
+    if (p->dup_num) {
+        return multifd_recv_dedup_unfill_packet(p, errp);
+    }
+
     return 0;
 }
 
+/*
+ * Mark the pages of a packet received into the COLO cache as dirty, so
+ * that the next checkpoint flushes them to the guest.
+ */
+void multifd_ram_recv_colo(MultiFDRecvParams *p)
+{
+    colo_record_bitmap(p->block, p->normal, p->normal_num);
+    colo_record_bitmap(p->block, p->zero, p->zero_num);
+    multifd_recv_dedup_colo(p);
+}
+
 static inline bool multifd_queue_empty(MultiFDPages_t *pages)
 {
     return pages->num == 0;
@@ -343,6 +438,45 @@ retry:
     return true;
 }
 
+/*
+ * Queue a page to be sent by channel @p from its own thread, as done with
+ * the multifd-scan capability.  The pages are sent whenever the queue is
+ * full or the page belongs to a different RAMBlock.
+ *
+ * Returns 0 on success, -1 on error with @errp set.
+ */
+int multifd_ram_channel_queue_page(MultiFDSendParams *p, RAMBlock *block,
+                                   ram_addr_t offset, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+
+    if (!multifd_payload_empty(p->data) &&
+        (pages->block != block || multifd_queue_full(pages))) {
+        if (multifd_send_one_packet(p, errp)) {
+            return -1;
+        }
+    }
+
+    if (multifd_payload_empty(p->data)) {
+        multifd_pages_reset(pages);
+        multifd_set_payload_type(p->data, MULTIFD_PAYLOAD_RAM);
+        pages->block = block;
+    }
+
+    multifd_enqueue(pages, offset);
+    return 0;
+}
+
+/* Send the pages queued by multifd_ram_channel_queue_page(), if any */
+int multifd_ram_channel_flush(MultiFDSendParams *p, Error **errp)
+{
+    if (multifd_payload_empty(p->data)) {
+        return 0;
+    }
+
+    return multifd_send_one_packet(p, errp);
+}
+
 int multifd_ram_flush_and_sync(void)
 {
     if (!migrate_multifd()) {
@@ -0,0 +1,567 @@
+/*
+ * Multifd XBZRLE delta compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/*
+ * The source keeps a copy of the last contents it sent for each page it
+ * can, and sends the pages it finds there as an XBZRLE delta against
+ * that copy.  The destination applies the delta right onto guest
+ * memory, which holds the same contents as the copy: a page is only
+ * sent again after a multifd sync, so the destination is done with the
+ * previous copy of the page before it gets the delta, whatever the
+ * channels that carried them.
+ *
+ * Since any channel can send any page, the copies live in a cache that
+ * all channels share.  It is split into shards, each with its own lock,
+ * so that the channels seldom wait for each other.  Each shard starts
+ * at an eighth of its share of xbzrle-cache-size, and doubles whenever
+ * pages keep missing because their bucket holds another page.
+ *
+ * The data of a packet starts with a 32-bit header for each normal
+ * page, which holds the length of the delta of the page, zero if the
+ * page didn't change, or MULTIFD_XBZRLE_RAW if the page is sent as it
+ * is.  The deltas and pages follow, in the same order.
+ */
+
+#define MULTIFD_XBZRLE_RAW (1u << 31)
+
+/* Shards of the cache for each channel */
+#define MULTIFD_XBZRLE_SHARDS_PER_CHANNEL 4
+/* Lookups of a shard between two decisions on its size */
+#define MULTIFD_XBZRLE_SIZING_WINDOW 4096
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+    /* current and maximum size of the cache, in bytes */
+    uint64_t size;
+    uint64_t max_size;
+    /* lookups, and misses on a bucket holding another page */
+    uint32_t lookups;
+    uint32_t conflicts;
+} MultiFDXbzrleShard;
+
+static struct {
+    MultiFDXbzrleShard *shards;
+    /* number of shards, a power of two */
+    uint32_t nr_shards;
+    /* number of channels using the shards */
+    uint32_t users;
+    /* counters reported in XBZRLECacheStats */
+    Stat64 pages;
+    Stat64 bytes;
+    Stat64 cache_miss;
+    Stat64 overflow;
+} multifd_xbzrle;
+
+struct MultiFDXbzrle {
+    /* copy of the page being encoded, only on the source */
+    uint8_t *current;
+    /* headers, then contents of the pages */
+    uint8_t *buf;
+    /* size of buf */
+    uint32_t buf_len;
+    /* whether this is the state of a send channel */
+    bool send;
+};
+
+/* Whether the multifd channels send XBZRLE deltas */
+bool multifd_xbzrle_enabled(void)
+{
+    if (!migrate_multifd()) {
+        return false;
+    }
+
+    switch (migrate_multifd_compression()) {
+    case MULTIFD_COMPRESSION_XBZRLE:
+        return true;
+#ifdef CONFIG_ZSTD
+    case MULTIFD_COMPRESSION_ADAPTIVE:
+        /*
+         * Zero pages found by the migration thread never reach the
+         * channels, which couldn't clear their copy in the cache.
+         */
+        return migrate_zero_page_detection() != ZERO_PAGE_DETECTION_LEGACY;
+#endif
+    default:
+        return false;
+    }
+}
+
+void multifd_xbzrle_get_counters(XBZRLECacheStats *stats)
+{
+    stats->pages = stat64_get(&multifd_xbzrle.pages);
+    stats->bytes = stat64_get(&multifd_xbzrle.bytes);
+    stats->cache_miss = stat64_get(&multifd_xbzrle.cache_miss);
+    stats->overflow = stat64_get(&multifd_xbzrle.overflow);
+}
+
+static uint32_t multifd_xbzrle_buf_len(void)
+{
+    return multifd_ram_page_count() *
+           (sizeof(uint32_t) + multifd_ram_page_size());
+}
+
+static MultiFDXbzrleShard *multifd_xbzrle_shard(ram_addr_t addr)
+{
+    /*
+     * The cache of a shard uses the low bits of the page number, so
+     * pick the shard from the high bits of a hash of it.
+     */
+    uint64_t hash = (addr >> qemu_target_page_bits()) * 0x9e3779b97f4a7c15ULL;
+
+    return &multifd_xbzrle.shards[hash >>
+                                  (64 - ctz32(multifd_xbzrle.nr_shards))];
+}
+
+static int multifd_xbzrle_shards_init(Error **errp)
+{
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t nr_shards = pow2ceil(migrate_multifd_channels() *
+                                  MULTIFD_XBZRLE_SHARDS_PER_CHANNEL);
+    uint64_t max_size = MAX(migrate_xbzrle_cache_size() / nr_shards,
+                            page_size);
+
+    multifd_xbzrle.shards = g_new0(MultiFDXbzrleShard, nr_shards);
+    multifd_xbzrle.nr_shards = nr_shards;
+
+    for (uint32_t i = 0; i < nr_shards; i++) {
+        MultiFDXbzrleShard *sh = &multifd_xbzrle.shards[i];
+
+        sh->max_size = max_size;
+        sh->size = MAX(max_size / 8, page_size);
+        sh->cache = cache_init(sh->size, page_size, errp);
+        if (!sh->cache) {
+            return -1;
+        }
+        qemu_mutex_init(&sh->lock);
+    }
+
+    stat64_set(&multifd_xbzrle.pages, 0);
+    stat64_set(&multifd_xbzrle.bytes, 0);
+    stat64_set(&multifd_xbzrle.cache_miss, 0);
+    stat64_set(&multifd_xbzrle.overflow, 0);
+    return 0;
+}
+
+static void multifd_xbzrle_shards_cleanup(void)
+{
+    for (uint32_t i = 0; i < multifd_xbzrle.nr_shards; i++) {
+        MultiFDXbzrleShard *sh = &multifd_xbzrle.shards[i];
+
+        if (sh->cache) {
+            cache_fini(sh->cache);
+            qemu_mutex_destroy(&sh->lock);
+        }
+    }
+    g_free(multifd_xbzrle.shards);
+    multifd_xbzrle.shards = NULL;
+    multifd_xbzrle.nr_shards = 0;
+}
+
+/*
+ * A page that misses while its bucket holds another page was evicted
+ * from, or could not enter, a cache that is too small for the pages
+ * the guest keeps writing to.  Grow the shard while that happens for
+ * more than one lookup in eight.  Called with the shard locked.
+ */
+static void multifd_xbzrle_shard_resize(MultiFDXbzrleShard *sh)
+{
+    Error *local_err = NULL;
+
+    if (++sh->lookups < MULTIFD_XBZRLE_SIZING_WINDOW) {
+        return;
+    }
+
+    if (sh->size < sh->max_size && sh->conflicts > sh->lookups / 8) {
+        if (cache_resize(sh->cache, sh->size * 2, &local_err)) {
+            /* Keep going with the current size */
+            warn_report_err(local_err);
+            sh->max_size = sh->size;
+        } else {
+            trace_multifd_xbzrle_shard_resize(sh->size * 2, sh->lookups,
+                                              sh->conflicts);
+            sh->size *= 2;
+        }
+    }
+
+    sh->lookups = 0;
+    sh->conflicts = 0;
+}
+
+/*
+ * Encode the page at @addr, with contents @host, into @dst, which has
+ * room for a whole page.  Returns the header of the page.
+ */
+static uint32_t multifd_xbzrle_save_page(MultiFDXbzrle *x,
+                                         ram_addr_t addr, uint8_t *host,
+                                         uint8_t *dst, uint64_t age)
+{
+    MultiFDXbzrleShard *sh = multifd_xbzrle_shard(addr);
+    uint32_t page_size = multifd_ram_page_size();
+    uint8_t *cached;
+    int len;
+
+    /* The guest may write to the page, work on a stable copy */
+    memcpy(x->current, host, page_size);
+
+    QEMU_LOCK_GUARD(&sh->lock);
+
+    multifd_xbzrle_shard_resize(sh);
+
+    if (!cache_is_cached(sh->cache, addr, age)) {
+        stat64_add(&multifd_xbzrle.cache_miss, 1);
+        if (get_cached_data(sh->cache, addr)) {
+            sh->conflicts++;
+        }
+        /* Remember what the destination will have, if there is room */
+        cache_insert(sh->cache, addr, x->current, age);
+        memcpy(dst, x->current, page_size);
+        return MULTIFD_XBZRLE_RAW;
+    }
+
+    cached = get_cached_data(sh->cache, addr);
+    len = xbzrle_encode_buffer(cached, x->current, page_size, dst, page_size);
+    memcpy(cached, x->current, page_size);
+    stat64_add(&multifd_xbzrle.pages, 1);
+
+    if (len < 0) {
+        stat64_add(&multifd_xbzrle.overflow, 1);
+        stat64_add(&multifd_xbzrle.bytes, page_size);
+        memcpy(dst, x->current, page_size);
+        return MULTIFD_XBZRLE_RAW;
+    }
+
+    stat64_add(&multifd_xbzrle.bytes, len);
+    return len;
+}
+
+MultiFDXbzrle *multifd_xbzrle_new(bool send, Error **errp)
+{
+    MultiFDXbzrle *x;
+
+    if (send) {
+        if (!multifd_xbzrle.users && multifd_xbzrle_shards_init(errp)) {
+            multifd_xbzrle_shards_cleanup();
+            return NULL;
+        }
+        multifd_xbzrle.users++;
+    }
+
+    x = g_new0(MultiFDXbzrle, 1);
+    x->send = send;
+    x->buf_len = multifd_xbzrle_buf_len();
+    x->buf = g_try_malloc(x->buf_len);
+    if (!x->buf) {
+        error_setg(errp, "multifd: out of memory for xbzrle buffer");
+        multifd_xbzrle_free(x);
+        return NULL;
+    }
+    if (send) {
+        x->current = g_malloc(multifd_ram_page_size());
+    }
+
+    return x;
+}
+
+void multifd_xbzrle_free(MultiFDXbzrle *x)
+{
+    if (!x) {
+        return;
+    }
+
+    g_free(x->current);
+    g_free(x->buf);
+    if (x->send && !--multifd_xbzrle.users) {
+        multifd_xbzrle_shards_cleanup();
+    }
+    g_free(x);
+}
+
+/*
+ * The destination clears the zero pages, do the same with their copy,
+ * if any, so that later deltas apply to a zero page.
+ */
+void multifd_xbzrle_send_zero_pages(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint64_t age = stat64_get(&mig_stats.dirty_sync_count);
+
+    for (uint32_t i = pages->normal_num; i < pages->num; i++) {
+        ram_addr_t addr = pages->block->offset + pages->offset[i];
+        MultiFDXbzrleShard *sh = multifd_xbzrle_shard(addr);
+
+        QEMU_LOCK_GUARD(&sh->lock);
+        if (cache_is_cached(sh->cache, addr, age)) {
+            memset(get_cached_data(sh->cache, addr), 0,
+                   multifd_ram_page_size());
+        }
+    }
+}
+
+/*
+ * Encode the normal pages of the packet into one iov, as a header for
+ * each page followed by the deltas and raw pages.
+ */
+void multifd_xbzrle_send_pages(MultiFDSendParams *p, MultiFDXbzrle *x)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t age = stat64_get(&mig_stats.dirty_sync_count);
+    uint32_t pos;
+
+    pos = pages->normal_num * sizeof(uint32_t);
+    for (uint32_t i = 0; i < pages->normal_num; i++) {
+        ram_addr_t offset = pages->offset[i];
+        uint32_t hdr;
+
+        hdr = multifd_xbzrle_save_page(x, pages->block->offset + offset,
+                                       pages->block->host + offset,
+                                       x->buf + pos, age);
+        stl_be_p(x->buf + i * sizeof(uint32_t), hdr);
+        pos += hdr == MULTIFD_XBZRLE_RAW ? page_size : hdr;
+    }
+
+    p->iov[p->iovs_num].iov_base = x->buf;
+    p->iov[p->iovs_num].iov_len = pos;
+    p->iovs_num++;
+    p->next_packet_size = pos;
+}
+
+/*
+ * Copy the normal pages of a packet that doesn't send them as deltas
+ * into the buffer of @x, and remember the copies as what the
+ * destination will have, so that later deltas of the pages still
+ * apply.  The packet must send the pages from the returned buffer.
+ */
+uint8_t *multifd_xbzrle_send_stage(MultiFDSendParams *p, MultiFDXbzrle *x)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    uint32_t page_size = multifd_ram_page_size();
+    uint64_t age = stat64_get(&mig_stats.dirty_sync_count);
+
+    for (uint32_t i = 0; i < pages->normal_num; i++) {
+        ram_addr_t addr = pages->block->offset + pages->offset[i];
+        MultiFDXbzrleShard *sh = multifd_xbzrle_shard(addr);
+        uint8_t *copy = x->buf + i * page_size;
+
+        memcpy(copy, pages->block->host + pages->offset[i], page_size);
+
+        QEMU_LOCK_GUARD(&sh->lock);
+
+        multifd_xbzrle_shard_resize(sh);
+
+        if (cache_is_cached(sh->cache, addr, age)) {
+            memcpy(get_cached_data(sh->cache, addr), copy, page_size);
+            continue;
+        }
+        if (get_cached_data(sh->cache, addr)) {
+            sh->conflicts++;
+        }
+        cache_insert(sh->cache, addr, copy, age);
+    }
+
+    return x->buf;
+}
+
+int multifd_xbzrle_recv_pages(MultiFDRecvParams *p, MultiFDXbzrle *x,
+                              Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t page_size = multifd_ram_page_size();
+    uint32_t hdr_len = p->normal_num * sizeof(uint32_t);
+    uint32_t iovs_num = 0;
+    uint32_t pos;
+    int ret;
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > x->buf_len || in_size < hdr_len) {
+        error_setg(errp, "multifd %u: received %u bytes of xbzrle data "
+                   "for %u pages", p->id, in_size, p->normal_num);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)x->buf, hdr_len, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    /*
+     * Read the raw pages straight into guest memory, and the deltas at
+     * their place in the buffer, to decode them from there.
+     */
+    pos = hdr_len;
+    for (uint32_t i = 0; i < p->normal_num; i++) {
+        uint32_t hdr = ldl_be_p(x->buf + i * sizeof(uint32_t));
+        uint32_t len = hdr == MULTIFD_XBZRLE_RAW ? page_size : hdr;
+        struct iovec *iov = &p->iov[iovs_num];
+        uint8_t *dst;
+
+        if (len > page_size || len > in_size - pos) {
+            error_setg(errp, "multifd %u: invalid xbzrle page length %u",
+                       p->id, len);
+            return -1;
+        }
+        if (!len) {
+            continue;
+        }
+
+        dst = hdr == MULTIFD_XBZRLE_RAW ? p->host + p->normal[i] :
+                                          x->buf + pos;
+        if (iovs_num && iov[-1].iov_base + iov[-1].iov_len == dst) {
+            iov[-1].iov_len += len;
+        } else {
+            iov->iov_base = dst;
+            iov->iov_len = len;
+            iovs_num++;
+        }
+        pos += len;
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size expected %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+
+    if (iovs_num) {
+        ret = qio_channel_readv_all(p->c, p->iov, iovs_num, errp);
+        if (ret != 0) {
+            return ret;
+        }
+    }
+
+    pos = hdr_len;
+    for (uint32_t i = 0; i < p->normal_num; i++) {
+        uint32_t hdr = ldl_be_p(x->buf + i * sizeof(uint32_t));
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (hdr == MULTIFD_XBZRLE_RAW) {
+            pos += page_size;
+            continue;
+        }
+        if (hdr && xbzrle_decode_buffer(x->buf + pos, hdr,
+                                        p->host + p->normal[i],
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode xbzrle page",
+                       p->id);
+            return -1;
+        }
+        pos += hdr;
+    }
+    return 0;
+}
+
+static int multifd_xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    p->compress_data = multifd_xbzrle_new(true, errp);
+    if (!p->compress_data) {
+        return -1;
+    }
+
+    /* Needs 2 IOVs, one for packet header and one for the page data */
+    p->iov = g_new0(struct iovec, 2);
+    return 0;
+}
+
+static void multifd_xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    multifd_xbzrle_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    if (!multifd_send_prepare_common(p)) {
+        multifd_xbzrle_send_zero_pages(p);
+        goto out;
+    }
+
+    multifd_xbzrle_send_zero_pages(p);
+    multifd_xbzrle_send_pages(p, p->compress_data);
+
+out:
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->compress_data = multifd_xbzrle_new(false, errp);
+    if (!p->compress_data) {
+        return -1;
+    }
+
+    /* At most one IOV per normal page */
+    p->iov = g_new0(struct iovec, multifd_ram_page_count());
+    return 0;
+}
+
+static void multifd_xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    multifd_xbzrle_free(p->compress_data);
+    p->compress_data = NULL;
+
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_xbzrle_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    return multifd_xbzrle_recv_pages(p, p->compress_data, errp);
+}
+
+static const MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = multifd_xbzrle_send_setup,
+    .send_cleanup = multifd_xbzrle_send_cleanup,
+    .send_prepare = multifd_xbzrle_send_prepare,
+    .recv_setup = multifd_xbzrle_recv_setup,
+    .recv_cleanup = multifd_xbzrle_recv_cleanup,
+    .recv = multifd_xbzrle_recv
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
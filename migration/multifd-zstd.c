@@ -12,7 +12,9 @@
 
 #include "qemu/osdep.h"
 #include <zstd.h>
+#include "qemu/bitops.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/ramblock.h"
 #include "exec/target_page.h"
 #include "qapi/error.h"
@@ -21,6 +23,49 @@
 #include "options.h"
 #include "multifd.h"
 
+/*
+ * What the adaptive method does with a packet.  Each compressed packet
+ * is a zstd frame of its own, so that the level can change from one
+ * packet to the next without the destination having to know about it.
+ * MULTIFD_ADAPTIVE_DELTA sends the pages as XBZRLE deltas against the
+ * copy of what was last sent for them, like the xbzrle method.
+ */
+typedef enum {
+    MULTIFD_ADAPTIVE_NONE,
+    MULTIFD_ADAPTIVE_FAST,
+    MULTIFD_ADAPTIVE_LEVEL,
+    MULTIFD_ADAPTIVE_DELTA,
+    MULTIFD_ADAPTIVE__MAX,
+} MultiFDAdaptiveChoice;
+
+/* zstd level of MULTIFD_ADAPTIVE_FAST */
+#define MULTIFD_ADAPTIVE_FAST_LEVEL 1
+/* Packets between two samples of a compression level that isn't in use */
+#define MULTIFD_ADAPTIVE_PROBE_INTERVAL 32
+
+typedef struct {
+    /* average encoded size over size of the pages */
+    double ratio;
+    /* average time spent encoding one byte, in ns */
+    double cost;
+    /* packets since the last sample */
+    uint32_t age;
+    bool sampled;
+} MultiFDAdaptiveStats;
+
+typedef struct {
+    /* indexed by MultiFDAdaptiveChoice, unused for MULTIFD_ADAPTIVE_NONE */
+    MultiFDAdaptiveStats stats[MULTIFD_ADAPTIVE__MAX];
+    /* average time the channel takes to send one byte, in ns */
+    double write_cost;
+    /* bitmap of the choices in use */
+    uint32_t choices;
+    /* level the zstd stream currently compresses at */
+    int level;
+    /* packets until the next sample of a compression level not in use */
+    uint32_t probe;
+} MultiFDAdaptive;
+
 struct zstd_data {
     /* stream for compression */
     ZSTD_CStream *zcs;
@@ -33,6 +78,10 @@ struct zstd_data {
     uint8_t *zbuff;
     /* size of compressed buffer */
     uint32_t zbuff_len;
+    /* only used by the adaptive method */
+    MultiFDAdaptive adaptive;
+    /* XBZRLE state of the adaptive method, NULL until deltas are used */
+    MultiFDXbzrle *delta;
 };
 
 /* Multifd zstd compression */
@@ -88,17 +137,20 @@ static void multifd_zstd_send_cleanup(MultiFDSendParams *p, Error **errp)
     p->iov = NULL;
 }
 
-static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
+/*
+ * Compress the normal pages of the packet into one iov.  @src holds a
+ * copy of the pages, or is NULL to compress them from guest memory.
+ * @last is ZSTD_e_flush to keep the frame open for the next packet, or
+ * ZSTD_e_end to close it.
+ */
+static int multifd_zstd_compress(MultiFDSendParams *p, const uint8_t *src,
+                                 ZSTD_EndDirective last, Error **errp)
 {
     MultiFDPages_t *pages = &p->data->u.ram;
     struct zstd_data *z = p->compress_data;
     int ret;
     uint32_t i;
 
-    if (!multifd_send_prepare_common(p)) {
-        goto out;
-    }
-
     z->out.dst = z->zbuff;
     z->out.size = z->zbuff_len;
     z->out.pos = 0;
@@ -107,9 +159,13 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
         ZSTD_EndDirective flush = ZSTD_e_continue;
 
         if (i == pages->normal_num - 1) {
-            flush = ZSTD_e_flush;
+            flush = last;
+        }
+        if (src) {
+            z->in.src = src + i * multifd_ram_page_size();
+        } else {
+            z->in.src = pages->block->host + pages->offset[i];
         }
-        z->in.src = pages->block->host + pages->offset[i];
         z->in.size = multifd_ram_page_size();
         z->in.pos = 0;
 
@@ -140,8 +196,16 @@ static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
     p->iov[p->iovs_num].iov_len = z->out.pos;
     p->iovs_num++;
     p->next_packet_size = z->out.pos;
+    return 0;
+}
+
+static int multifd_zstd_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    if (multifd_send_prepare_common(p) &&
+        multifd_zstd_compress(p, NULL, ZSTD_e_flush, errp)) {
+        return -1;
+    }
 
-out:
     p->flags |= MULTIFD_FLAG_ZSTD;
     multifd_send_fill_packet(p);
     return 0;
@@ -193,23 +257,17 @@ static void multifd_zstd_recv_cleanup(MultiFDRecvParams *p)
     p->compress_data = NULL;
 }
 
-static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
+/* Receive a packet with MULTIFD_FLAG_ZSTD */
+static int multifd_zstd_recv_pages(MultiFDRecvParams *p, Error **errp)
 {
     uint32_t in_size = p->next_packet_size;
     uint32_t out_size = 0;
     uint32_t page_size = multifd_ram_page_size();
     uint32_t expected_size = p->normal_num * page_size;
-    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
     struct zstd_data *z = p->compress_data;
     int ret;
     int i;
 
-    if (flags != MULTIFD_FLAG_ZSTD) {
-        error_setg(errp, "multifd %u: flags received %x flags expected %x",
-                   p->id, flags, MULTIFD_FLAG_ZSTD);
-        return -1;
-    }
-
     multifd_recv_zero_page_process(p);
 
     if (!p->normal_num) {
@@ -265,6 +323,356 @@ static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
     return 0;
 }
 
+static int multifd_zstd_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags != MULTIFD_FLAG_ZSTD) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_ZSTD);
+        return -1;
+    }
+
+    return multifd_zstd_recv_pages(p, errp);
+}
+
+/*
+ * Multifd adaptive compression
+ *
+ * For each packet, pick between sending the pages as they are,
+ * compressing them with zstd at MULTIFD_ADAPTIVE_FAST_LEVEL or at
+ * multifd-zstd-level, and sending them as XBZRLE deltas, whichever is
+ * expected to get the packet through the channel soonest.
+ *
+ * Each channel keeps averages of the time the link takes to send a
+ * byte, and of the ratio and time per byte of each encoding.  The
+ * speed of the link is measured from how fast the socket drains the
+ * data queued in it, so that it doesn't depend on the size of the
+ * socket buffer.  The data still queued when a packet is prepared
+ * must be sent before the packet, so encoding for up to that long
+ * comes for free.  Encodings not in use are sampled again every
+ * MULTIFD_ADAPTIVE_PROBE_INTERVAL packets, so that the choice follows
+ * changes of both the link and the guest workload.
+ *
+ * Deltas need the source to know what the destination has.  When
+ * they are in use, the pages of the other packets are copied first,
+ * the copy is sent and kept in the XBZRLE cache.
+ */
+
+static inline void multifd_adaptive_average(double *avg, double sample,
+                                            bool first)
+{
+    *avg = first ? sample : *avg + (sample - *avg) / 8;
+}
+
+static int multifd_adaptive_level(MultiFDAdaptiveChoice c)
+{
+    return c == MULTIFD_ADAPTIVE_FAST ? MULTIFD_ADAPTIVE_FAST_LEVEL :
+                                        migrate_multifd_zstd_level();
+}
+
+/*
+ * Update the speed of the link with the packet written last, given
+ * that the socket now holds @queued bytes, -1 if unknown.
+ */
+static void multifd_adaptive_sample_link(MultiFDSendParams *p,
+                                         MultiFDAdaptive *a, ssize_t queued)
+{
+    uint64_t bytes = p->write_bytes;
+    double cost;
+
+    if (!bytes) {
+        return;
+    }
+    p->write_bytes = 0;
+
+    if (queued < 0 || p->write_queued < 0) {
+        /* Only the time the write blocked is known */
+        multifd_adaptive_average(&a->write_cost, (double)p->write_ns / bytes,
+                                 !a->write_cost);
+        return;
+    }
+
+    if (p->write_queued <= queued) {
+        return;
+    }
+
+    /*
+     * If the socket still holds data, the link was busy all along and
+     * this is its speed.  Otherwise it may have been idle for a while,
+     * and it is at least that fast.
+     */
+    cost = (double)(get_clock() - p->write_end) / (p->write_queued - queued);
+    if (queued || !a->write_cost || cost < a->write_cost) {
+        multifd_adaptive_average(&a->write_cost, cost, !a->write_cost);
+    }
+}
+
+/*
+ * Pick the choice for a packet of @size bytes, which the link can only
+ * start sending after @wait ns.
+ */
+static MultiFDAdaptiveChoice multifd_adaptive_choose(MultiFDAdaptive *a,
+                                                     uint32_t size,
+                                                     double wait)
+{
+    MultiFDAdaptiveChoice best = MULTIFD_ADAPTIVE_NONE;
+    MultiFDAdaptiveChoice oldest = MULTIFD_ADAPTIVE__MAX;
+    /* Time until the packet is sent, when sent as it is */
+    double best_time = wait + size * a->write_cost;
+
+    for (int c = MULTIFD_ADAPTIVE_FAST; c < MULTIFD_ADAPTIVE__MAX; c++) {
+        MultiFDAdaptiveStats *st = &a->stats[c];
+        double time;
+
+        if (!(a->choices & BIT(c))) {
+            continue;
+        }
+        if (!st->sampled) {
+            return c;
+        }
+
+        st->age++;
+        time = MAX(wait, st->cost * size) + st->ratio * size * a->write_cost;
+        if (time < best_time) {
+            best_time = time;
+            best = c;
+        }
+    }
+
+    if (--a->probe) {
+        return best;
+    }
+
+    a->probe = MULTIFD_ADAPTIVE_PROBE_INTERVAL;
+    for (int c = MULTIFD_ADAPTIVE_FAST; c < MULTIFD_ADAPTIVE__MAX; c++) {
+        if (c != best && (a->choices & BIT(c)) &&
+            (oldest == MULTIFD_ADAPTIVE__MAX ||
+             a->stats[c].age > a->stats[oldest].age)) {
+            oldest = c;
+        }
+    }
+    return oldest == MULTIFD_ADAPTIVE__MAX ? best : oldest;
+}
+
+static int multifd_adaptive_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_data *z;
+    MultiFDAdaptive *a;
+
+    if (multifd_zstd_send_setup(p, errp)) {
+        return -1;
+    }
+
+    z = p->compress_data;
+    a = &z->adaptive;
+    a->level = migrate_multifd_zstd_level();
+    a->probe = MULTIFD_ADAPTIVE_PROBE_INTERVAL;
+    a->choices = BIT(MULTIFD_ADAPTIVE_NONE) | BIT(MULTIFD_ADAPTIVE_FAST);
+    if (migrate_multifd_zstd_level() != MULTIFD_ADAPTIVE_FAST_LEVEL) {
+        a->choices |= BIT(MULTIFD_ADAPTIVE_LEVEL);
+    }
+    if (multifd_xbzrle_enabled()) {
+        z->delta = multifd_xbzrle_new(true, errp);
+        if (!z->delta) {
+            multifd_zstd_send_cleanup(p, NULL);
+            return -1;
+        }
+        a->choices |= BIT(MULTIFD_ADAPTIVE_DELTA);
+    }
+
+    /* Uncompressed packets need one IOV per page, plus the header */
+    g_free(p->iov);
+    p->iov = g_new0(struct iovec, multifd_ram_page_count() + 1);
+    p->sample_queued = true;
+    return 0;
+}
+
+static void multifd_adaptive_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct zstd_data *z = p->compress_data;
+
+    multifd_xbzrle_free(z->delta);
+    z->delta = NULL;
+    multifd_zstd_send_cleanup(p, errp);
+}
+
+static int multifd_adaptive_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = &p->data->u.ram;
+    struct zstd_data *z = p->compress_data;
+    MultiFDAdaptive *a = &z->adaptive;
+    uint32_t page_size = multifd_ram_page_size();
+    ssize_t queued = multifd_send_queued(p);
+    uint8_t *src = NULL;
+    uint32_t in_size;
+    MultiFDAdaptiveChoice c;
+    MultiFDAdaptiveStats *st;
+    int64_t start;
+    int level;
+    size_t ret;
+
+    multifd_adaptive_sample_link(p, a, queued);
+
+    if (!multifd_send_prepare_common(p)) {
+        if (z->delta) {
+            multifd_xbzrle_send_zero_pages(p);
+        }
+        p->flags |= MULTIFD_FLAG_NOCOMP;
+        multifd_send_fill_packet(p);
+        return 0;
+    }
+
+    if (z->delta) {
+        multifd_xbzrle_send_zero_pages(p);
+    }
+
+    in_size = pages->normal_num * page_size;
+    c = multifd_adaptive_choose(a, in_size, MAX(queued, 0) * a->write_cost);
+
+    if (c == MULTIFD_ADAPTIVE_DELTA) {
+        start = get_clock();
+        multifd_xbzrle_send_pages(p, z->delta);
+        p->flags |= MULTIFD_FLAG_XBZRLE;
+        goto sample;
+    }
+
+    if (z->delta) {
+        src = multifd_xbzrle_send_stage(p, z->delta);
+    }
+
+    if (c == MULTIFD_ADAPTIVE_NONE) {
+        if (src) {
+            p->iov[p->iovs_num].iov_base = src;
+            p->iov[p->iovs_num].iov_len = in_size;
+            p->iovs_num++;
+        } else {
+            for (int i = 0; i < pages->normal_num; i++) {
+                p->iov[p->iovs_num].iov_base = pages->block->host +
+                                               pages->offset[i];
+                p->iov[p->iovs_num].iov_len = page_size;
+                p->iovs_num++;
+            }
+        }
+        p->next_packet_size = in_size;
+        p->flags |= MULTIFD_FLAG_NOCOMP;
+        goto out;
+    }
+
+    level = multifd_adaptive_level(c);
+    if (level != a->level) {
+        ret = ZSTD_CCtx_setParameter(z->zcs, ZSTD_c_compressionLevel, level);
+        if (ZSTD_isError(ret)) {
+            error_setg(errp, "multifd %u: failed to set zstd level %d: %s",
+                       p->id, level, ZSTD_getErrorName(ret));
+            return -1;
+        }
+        a->level = level;
+    }
+
+    start = get_clock();
+    if (multifd_zstd_compress(p, src, ZSTD_e_end, errp)) {
+        return -1;
+    }
+    p->flags |= MULTIFD_FLAG_ZSTD;
+
+sample:
+    st = &a->stats[c];
+    multifd_adaptive_average(&st->cost, (double)(get_clock() - start) / in_size,
+                             !st->sampled);
+    multifd_adaptive_average(&st->ratio,
+                             (double)p->next_packet_size / in_size,
+                             !st->sampled);
+    st->sampled = true;
+    st->age = 0;
+
+out:
+    trace_multifd_adaptive_send(p->id, c, in_size, p->next_packet_size);
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+static int multifd_adaptive_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    if (multifd_zstd_recv_setup(p, errp)) {
+        return -1;
+    }
+
+    p->iov = g_new0(struct iovec, multifd_ram_page_count());
+    return 0;
+}
+
+static void multifd_adaptive_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct zstd_data *z = p->compress_data;
+
+    multifd_xbzrle_free(z->delta);
+    z->delta = NULL;
+    multifd_zstd_recv_cleanup(p);
+    g_free(p->iov);
+    p->iov = NULL;
+}
+
+static int multifd_adaptive_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+
+    if (flags == MULTIFD_FLAG_ZSTD) {
+        struct zstd_data *z = p->compress_data;
+        ZSTD_outBuffer out = { 0 };
+        size_t ret;
+
+        if (multifd_zstd_recv_pages(p, errp)) {
+            return -1;
+        }
+
+        /* Consume the end of the frame, which may hold no page data */
+        while (z->in.pos < z->in.size) {
+            size_t pos = z->in.pos;
+
+            ret = ZSTD_decompressStream(z->zds, &out, &z->in);
+            if (ZSTD_isError(ret)) {
+                error_setg(errp, "multifd %u: decompressStream returned %s",
+                           p->id, ZSTD_getErrorName(ret));
+                return -1;
+            }
+            if (z->in.pos == pos) {
+                error_setg(errp, "multifd %u: %zu bytes of trailing data",
+                           p->id, z->in.size - z->in.pos);
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if (flags == MULTIFD_FLAG_XBZRLE) {
+        struct zstd_data *z = p->compress_data;
+
+        if (!z->delta) {
+            z->delta = multifd_xbzrle_new(false, errp);
+            if (!z->delta) {
+                return -1;
+            }
+        }
+        return multifd_xbzrle_recv_pages(p, z->delta, errp);
+    }
+
+    if (flags != MULTIFD_FLAG_NOCOMP) {
+        error_setg(errp, "multifd %u: flags received %x flags expected "
+                   "%x, %x or %x", p->id, flags, MULTIFD_FLAG_NOCOMP,
+                   MULTIFD_FLAG_ZSTD, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        return 0;
+    }
+
+    return multifd_ram_recv_pages(p, errp);
+}
+
 static const MultiFDMethods multifd_zstd_ops = {
     .send_setup = multifd_zstd_send_setup,
     .send_cleanup = multifd_zstd_send_cleanup,
@@ -274,9 +682,19 @@ static const MultiFDMethods multifd_zstd_ops = {
     .recv = multifd_zstd_recv
 };
 
+static const MultiFDMethods multifd_adaptive_ops = {
+    .send_setup = multifd_adaptive_send_setup,
+    .send_cleanup = multifd_adaptive_send_cleanup,
+    .send_prepare = multifd_adaptive_send_prepare,
+    .recv_setup = multifd_adaptive_recv_setup,
+    .recv_cleanup = multifd_adaptive_recv_cleanup,
+    .recv = multifd_adaptive_recv
+};
+
 static void multifd_zstd_register(void)
 {
     multifd_register_ops(MULTIFD_COMPRESSION_ZSTD, &multifd_zstd_ops);
+    multifd_register_ops(MULTIFD_COMPRESSION_ADAPTIVE, &multifd_adaptive_ops);
 }
 
 migration_init(multifd_zstd_register);
@@ -13,6 +13,7 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/rcu.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,6 +21,7 @@
 #include "qapi/error.h"
 #include "file.h"
 #include "migration.h"
+#include "migration/colo.h"
 #include "migration-stats.h"
 #include "socket.h"
 #include "tls.h"
@@ -31,6 +33,7 @@
 #include "qemu/yank.h"
 #include "io/channel-file.h"
 #include "io/channel-socket.h"
+#include "io/channel-tls.h"
 #include "yank_functions.h"
 
 /* Multiple fd's */
@@ -43,7 +46,9 @@ typedef struct {
     uint32_t version;
     unsigned char uuid[16]; /* QemuUUID */
     uint8_t id;
-    uint8_t unused1[7];     /* Reserved for future use */
+    uint8_t unused1[3];     /* Reserved for future use */
+    /* size of the dedup cache in pages, zero without dedup */
+    uint32_t dedup_slots;
     uint64_t unused2[4];    /* Reserved for future use */
 } __attribute__((packed)) MultiFDInit_t;
 
@@ -77,6 +82,9 @@ struct {
     int exiting;
     /* multifd ops */
     const MultiFDMethods *ops;
+    /* Limits of the current stripe scan, see multifd_send_scan() */
+    QEMUFile *scan_file;
+    int64_t scan_deadline;
 } *multifd_send_state;
 
 struct {
@@ -146,6 +154,7 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
     msg.version = cpu_to_be32(MULTIFD_VERSION);
     msg.id = p->id;
+    msg.dedup_slots = cpu_to_be32(multifd_dedup_slots());
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
     ret = qio_channel_write_all(p->c, (char *)&msg, size, errp);
@@ -168,6 +177,7 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
 
     msg.magic = be32_to_cpu(msg.magic);
     msg.version = be32_to_cpu(msg.version);
+    msg.dedup_slots = be32_to_cpu(msg.dedup_slots);
 
     if (msg.magic != MULTIFD_MAGIC) {
         error_setg(errp, "multifd: received packet magic %x "
@@ -198,6 +208,15 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
+    /* The packet layout and the dedup cache slots depend on it */
+    if (msg.dedup_slots != multifd_dedup_slots()) {
+        error_setg(errp, "multifd: source dedup cache has %u pages, "
+                   "destination has %u; multifd-dedup-cache-size must be "
+                   "the same on both sides", msg.dedup_slots,
+                   multifd_dedup_slots());
+        return -1;
+    }
+
     return msg.id;
 }
 
@@ -212,7 +231,12 @@ void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->magic = cpu_to_be32(MULTIFD_MAGIC);
     packet->version = cpu_to_be32(MULTIFD_VERSION);
 
-    packet->flags = cpu_to_be32(p->flags);
+    if (p->dedup) {
+        packet->flags = cpu_to_be32(p->flags | MULTIFD_FLAG_DEDUP);
+        packet->dedup_slots = cpu_to_be32(multifd_dedup_slots());
+    } else {
+        packet->flags = cpu_to_be32(p->flags);
+    }
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
 
     packet_num = qatomic_fetch_inc(&multifd_send_state->packet_num);
@@ -252,6 +276,20 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     p->packet_num = be64_to_cpu(packet->packet_num);
     p->packets_recved++;
 
+    if (!!(p->flags & MULTIFD_FLAG_DEDUP) != !!p->dedup) {
+        error_setg(errp, "multifd: dedup is %s on the source, but %s on "
+                   "the destination",
+                   (p->flags & MULTIFD_FLAG_DEDUP) ? "enabled" : "disabled",
+                   p->dedup ? "enabled" : "disabled");
+        return -1;
+    }
+    if (p->dedup && be32_to_cpu(packet->dedup_slots) != multifd_dedup_slots()) {
+        error_setg(errp, "multifd: received packet for a dedup cache of %u "
+                   "pages, expected %u", be32_to_cpu(packet->dedup_slots),
+                   multifd_dedup_slots());
+        return -1;
+    }
+
     if (!(p->flags & MULTIFD_FLAG_SYNC)) {
         ret = multifd_ram_unfill_packet(p, errp);
     }
@@ -567,6 +605,151 @@ int multifd_send_sync_main(void)
     return 0;
 }
 
+/*
+ * Bytes written to the socket under channel @p that the kernel still
+ * holds, or -1 if unknown.
+ */
+ssize_t multifd_send_queued(MultiFDSendParams *p)
+{
+    QIOChannel *ioc = p->c;
+
+    if (object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS)) {
+        ioc = QIO_CHANNEL_TLS(ioc)->master;
+    }
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET)) {
+        return -1;
+    }
+
+    return qio_channel_socket_get_send_queue(QIO_CHANNEL_SOCKET(ioc), NULL);
+}
+
+/*
+ * Send the payload in p->data through channel @p, from the channel thread.
+ * The payload is left empty on success.
+ *
+ * Returns 0 on success, -1 on error with @errp set.
+ */
+int multifd_send_one_packet(MultiFDSendParams *p, Error **errp)
+{
+    int ret;
+
+    p->flags = 0;
+    p->iovs_num = 0;
+    assert(!multifd_payload_empty(p->data));
+
+    ret = multifd_send_state->ops->send_prepare(p, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (migrate_mapped_ram()) {
+        ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
+                                      &p->data->u.ram, errp);
+    } else {
+        int64_t start = get_clock();
+
+        ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
+                                          NULL, 0, p->write_flags, errp);
+        p->write_end = get_clock();
+        p->write_ns = p->write_end - start;
+        p->write_bytes = (uint64_t)p->next_packet_size + p->packet_len;
+        if (p->sample_queued) {
+            p->write_queued = multifd_send_queued(p);
+        }
+    }
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    stat64_add(&mig_stats.multifd_bytes,
+               (uint64_t)p->next_packet_size + p->packet_len);
+
+    p->next_packet_size = 0;
+    multifd_set_payload_type(p->data, MULTIFD_PAYLOAD_NONE);
+
+    return 0;
+}
+
+/*
+ * Forget where the channels stopped scanning their stripes, so that the
+ * next scan starts over from the first RAMBlock.  Needed whenever the list
+ * of RAMBlocks changes.
+ */
+void multifd_send_scan_reset(void)
+{
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        memset(&p->stripe, 0, sizeof(p->stripe));
+    }
+}
+
+/*
+ * multifd_send_scan: have every channel send the dirty pages of its own
+ * stripe of guest RAM (see ram_save_multifd_stripe()), and wait until all
+ * of them are done.
+ *
+ * Each channel stops when it reaches the end of guest RAM, when the rate
+ * limit of @f is exceeded (unless @f is NULL) or when the realtime clock
+ * passes @deadline in milliseconds (unless it is zero).
+ *
+ * Returns the number of pages sent, or -1 on error.  @clean is set to
+ * true if every channel went through a whole round of its stripe without
+ * finding a dirty page.
+ */
+int64_t multifd_send_scan(QEMUFile *f, int64_t deadline, bool *clean)
+{
+    int64_t pages = 0;
+    int i;
+
+    *clean = true;
+
+    multifd_send_state->scan_file = f;
+    multifd_send_state->scan_deadline = deadline;
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (multifd_send_should_exit()) {
+            return -1;
+        }
+
+        assert(qatomic_read(&p->pending_scan) == false);
+        qatomic_store_release(&p->pending_scan, true);
+        qemu_sem_post(&p->sem);
+    }
+
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        if (multifd_send_should_exit()) {
+            return -1;
+        }
+
+        qemu_sem_wait(&multifd_send_state->channels_ready);
+        qemu_sem_wait(&p->sem_sync);
+
+        /* A channel that failed kicks us out of the waits above */
+        if (multifd_send_should_exit()) {
+            return -1;
+        }
+
+        pages += p->stripe.pages;
+        *clean &= p->stripe.clean;
+    }
+
+    trace_multifd_send_scan(pages, *clean);
+
+    return pages;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -600,40 +783,34 @@ static void *multifd_send_thread(void *opaque)
          * qatomic_store_release() in multifd_send().
          */
         if (qatomic_load_acquire(&p->pending_job)) {
-            p->flags = 0;
-            p->iovs_num = 0;
-            assert(!multifd_payload_empty(p->data));
-
-            ret = multifd_send_state->ops->send_prepare(p, &local_err);
-            if (ret != 0) {
-                break;
-            }
-
-            if (migrate_mapped_ram()) {
-                ret = file_write_ramblock_iov(p->c, p->iov, p->iovs_num,
-                                              &p->data->u.ram, &local_err);
-            } else {
-                ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
-                                                  NULL, 0, p->write_flags,
-                                                  &local_err);
-            }
-
+            ret = multifd_send_one_packet(p, &local_err);
             if (ret != 0) {
                 break;
             }
 
-            stat64_add(&mig_stats.multifd_bytes,
-                       (uint64_t)p->next_packet_size + p->packet_len);
-
-            p->next_packet_size = 0;
-            multifd_set_payload_type(p->data, MULTIFD_PAYLOAD_NONE);
-
             /*
              * Making sure p->data is published before saying "we're
              * free".  Pairs with the smp_mb_acquire() in
              * multifd_send().
              */
             qatomic_store_release(&p->pending_job, false);
+        } else if (qatomic_load_acquire(&p->pending_scan)) {
+            /*
+             * Pairs with the qatomic_store_release() in multifd_send_scan(),
+             * which publishes the scan limits before the flag.
+             */
+            WITH_RCU_READ_LOCK_GUARD() {
+                ret = ram_save_multifd_stripe(p,
+                                              multifd_send_state->scan_file,
+                                              multifd_send_state->scan_deadline,
+                                              &local_err);
+            }
+            if (ret != 0) {
+                break;
+            }
+
+            qatomic_set(&p->pending_scan, false);
+            qemu_sem_post(&p->sem_sync);
         } else {
             /*
              * If not a normal job, must be a sync request.  Note that
@@ -839,6 +1016,10 @@ bool multifd_send_setup(void)
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
                           + sizeof(uint64_t) * page_count;
+            if (migrate_multifd_dedup_cache_size()) {
+                /* Dedup cache slots of the duplicate pages */
+                p->packet_len += sizeof(uint32_t) * page_count;
+            }
             p->packet = g_malloc0(p->packet_len);
         }
         p->name = g_strdup_printf(MIGRATION_THREAD_SRC_MULTIFD, i);
@@ -1152,7 +1333,7 @@ static void *multifd_recv_thread(void *opaque)
             /* recv methods don't know how to handle the SYNC flag */
             p->flags &= ~MULTIFD_FLAG_SYNC;
             if (!(flags & MULTIFD_FLAG_SYNC)) {
-                has_data = p->normal_num || p->zero_num;
+                has_data = p->normal_num || p->zero_num || p->dup_num;
             }
             qemu_mutex_unlock(&p->mutex);
         } else {
@@ -1186,6 +1367,9 @@ static void *multifd_recv_thread(void *opaque)
             if (ret != 0) {
                 break;
             }
+            if (use_packets && migration_incoming_in_colo_state()) {
+                multifd_ram_recv_colo(p);
+            }
         }
 
         if (use_packets) {
@@ -1257,6 +1441,10 @@ int multifd_recv_setup(Error **errp)
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
                 + sizeof(uint64_t) * page_count;
+            if (migrate_multifd_dedup_cache_size()) {
+                /* Dedup cache slots of the duplicate pages */
+                p->packet_len += sizeof(uint32_t) * page_count;
+            }
             p->packet = g_malloc0(p->packet_len);
         }
         p->name = g_strdup_printf(MIGRATION_THREAD_DST_MULTIFD, i);
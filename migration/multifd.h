@@ -18,6 +18,8 @@
 
 typedef struct MultiFDRecvData MultiFDRecvData;
 typedef struct MultiFDSendData MultiFDSendData;
+typedef struct MultiFDDedup MultiFDDedup;
+typedef struct MultiFDXbzrle MultiFDXbzrle;
 
 bool multifd_send_setup(void);
 void multifd_send_shutdown(void);
@@ -42,10 +44,17 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
 #define MULTIFD_FLAG_QATZIP (16 << 1)
 
+/*
+ * The packets are followed by the dedup cache slots of their duplicate
+ * pages, and dedup_slots is the size of the dedup cache in pages.
+ */
+#define MULTIFD_FLAG_DEDUP (1 << 6)
+
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
@@ -62,13 +71,22 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
+    /* pages identical to one in the dedup cache */
+    uint32_t dup_pages;
+    /* size of the dedup cache in pages, with MULTIFD_FLAG_DEDUP */
+    uint32_t dedup_slots;
     uint32_t unused32[1];    /* Reserved for future use */
-    uint64_t unused64[3];    /* Reserved for future use */
+    uint64_t unused64[2];    /* Reserved for future use */
     char ramblock[256];
     /*
      * This array contains the pointers to:
      *  - normal pages (initial normal_pages entries)
      *  - zero pages (following zero_pages entries)
+     *  - duplicate pages (following dup_pages entries)
+     *
+     * With multifd-dedup-cache-size set, it is followed by an array of
+     * multifd_ram_page_count() uint32_t, whose initial dup_pages
+     * entries are the dedup cache slots of the duplicate pages.
      */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
@@ -78,6 +96,8 @@ typedef struct {
     uint32_t num;
     /* number of normal pages */
     uint32_t normal_num;
+    /* number of pages identical to one in the dedup cache */
+    uint32_t dup_num;
     RAMBlock *block;
     /* offset of each page */
     ram_addr_t offset[];
@@ -115,6 +135,23 @@ static inline void multifd_set_payload_type(MultiFDSendData *data,
     data->type = type;
 }
 
+/*
+ * Where a send channel stands in its stripe of guest RAM, with the
+ * multifd-scan capability.  Only used by the channel thread, except for
+ * @pages and @clean, which the migration thread reads once a scan is over.
+ */
+typedef struct {
+    /* RAMBlock and page the next scan starts from, NULL to start over */
+    RAMBlock *block;
+    unsigned long page;
+    /* Pages sent since the channel last started over */
+    uint64_t round_pages;
+    /* Pages sent by the last scan */
+    uint64_t pages;
+    /* Whether the last scan ended a whole round without sending a page */
+    bool clean;
+} MultiFDStripe;
+
 typedef struct {
     /* Fields are only written at creating/deletion time */
     /* No lock required for them, they are read only */
@@ -143,15 +180,17 @@ typedef struct {
     /* multifd flags for each packet */
     uint32_t flags;
     /*
-     * The sender thread has work to do if either of below boolean is set.
+     * The sender thread has work to do if any of below boolean is set.
      *
      * @pending_job:  a job is pending
+     * @pending_scan: a scan of the channel's stripe of RAM is pending
      * @pending_sync: a sync request is pending
      *
-     * For both of these fields, they're only set by the requesters, and
+     * For all of these fields, they're only set by the requesters, and
      * cleared by the multifd sender threads.
      */
     bool pending_job;
+    bool pending_scan;
     bool pending_sync;
     MultiFDSendData *data;
 
@@ -169,6 +208,20 @@ typedef struct {
     uint32_t iovs_num;
     /* used for compression methods */
     void *compress_data;
+    /* cache of recently sent pages, NULL if disabled */
+    MultiFDDedup *dedup;
+    /* time spent writing the last packet to the channel, in ns */
+    int64_t write_ns;
+    /* size of the last packet, header included */
+    uint64_t write_bytes;
+    /* time at which the last packet was written */
+    int64_t write_end;
+    /* whether to sample write_queued after each packet */
+    bool sample_queued;
+    /* bytes the socket still held after the last packet, -1 if unknown */
+    ssize_t write_queued;
+    /* stripe of guest RAM scanned by this channel */
+    MultiFDStripe stripe;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -225,8 +278,12 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* num of pages identical to one in the dedup cache */
+    uint32_t dup_num;
     /* used for de-compression methods */
     void *compress_data;
+    /* cache of recently received pages, NULL if disabled */
+    MultiFDDedup *dedup;
 } MultiFDRecvParams;
 
 typedef struct {
@@ -312,7 +369,26 @@ void multifd_register_ops(int method, const MultiFDMethods *ops);
 void multifd_send_fill_packet(MultiFDSendParams *p);
 bool multifd_send_prepare_common(MultiFDSendParams *p);
 void multifd_send_zero_page_detect(MultiFDSendParams *p);
+ssize_t multifd_send_queued(MultiFDSendParams *p);
 void multifd_recv_zero_page_process(MultiFDRecvParams *p);
+uint32_t multifd_dedup_slots(void);
+MultiFDDedup *multifd_dedup_new(bool send, Error **errp);
+void multifd_dedup_free(MultiFDDedup *d);
+void multifd_send_dedup_detect(MultiFDSendParams *p);
+void *multifd_send_dedup_page(MultiFDSendParams *p, uint32_t i);
+void multifd_send_dedup_fill_packet(MultiFDSendParams *p);
+int multifd_recv_dedup_unfill_packet(MultiFDRecvParams *p, Error **errp);
+void multifd_recv_dedup_process(MultiFDRecvParams *p);
+void multifd_recv_dedup_colo(MultiFDRecvParams *p);
+bool multifd_xbzrle_enabled(void);
+void multifd_xbzrle_get_counters(XBZRLECacheStats *stats);
+MultiFDXbzrle *multifd_xbzrle_new(bool send, Error **errp);
+void multifd_xbzrle_free(MultiFDXbzrle *x);
+void multifd_xbzrle_send_zero_pages(MultiFDSendParams *p);
+void multifd_xbzrle_send_pages(MultiFDSendParams *p, MultiFDXbzrle *x);
+uint8_t *multifd_xbzrle_send_stage(MultiFDSendParams *p, MultiFDXbzrle *x);
+int multifd_xbzrle_recv_pages(MultiFDRecvParams *p, MultiFDXbzrle *x,
+                              Error **errp);
 
 static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 {
@@ -323,6 +399,9 @@ static inline void multifd_send_prepare_header(MultiFDSendParams *p)
 
 void multifd_channel_connect(MultiFDSendParams *p, QIOChannel *ioc);
 bool multifd_send(MultiFDSendData **send_data);
+int multifd_send_one_packet(MultiFDSendParams *p, Error **errp);
+int64_t multifd_send_scan(QEMUFile *f, int64_t deadline, bool *clean);
+void multifd_send_scan_reset(void);
 MultiFDSendData *multifd_send_data_alloc(void);
 
 static inline uint32_t multifd_ram_page_size(void)
@@ -341,4 +420,11 @@ int multifd_ram_flush_and_sync(void);
 size_t multifd_ram_payload_size(void);
 void multifd_ram_fill_packet(MultiFDSendParams *p);
 int multifd_ram_unfill_packet(MultiFDRecvParams *p, Error **errp);
+void multifd_ram_recv_colo(MultiFDRecvParams *p);
+int multifd_ram_recv_pages(MultiFDRecvParams *p, Error **errp);
+int multifd_ram_channel_queue_page(MultiFDSendParams *p, RAMBlock *block,
+                                   ram_addr_t offset, Error **errp);
+int multifd_ram_channel_flush(MultiFDSendParams *p, Error **errp);
+int ram_save_multifd_stripe(MultiFDSendParams *p, QEMUFile *f,
+                            int64_t deadline, Error **errp);
 #endif
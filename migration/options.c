@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "qapi/clone-visitor.h"
 #include "qapi/error.h"
@@ -48,6 +49,7 @@
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE (64 * 1024 * 1024)
+#define DEFAULT_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE 0
 
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
@@ -69,6 +71,8 @@
  * that page requests can still exceed this limit.
  */
 #define DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH 0
+#define DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS 1
+#define DEFAULT_MIGRATE_BACKGROUND_SNAPSHOT_THREADS 0
 
 /*
  * Parameters for self_announce_delay giving a stream of RARP/ARP
@@ -96,6 +100,9 @@ Property migration_properties[] = {
                       multifd_flush_after_each_section, false),
     DEFINE_PROP_UINT8("x-clear-bitmap-shift", MigrationState,
                       clear_bitmap_shift, CLEAR_BITMAP_SHIFT_DEFAULT),
+    DEFINE_PROP_SIZE("x-bitmap-sync-parallel-min", MigrationState,
+                     bitmap_sync_parallel_min,
+                     BITMAP_SYNC_PARALLEL_MIN_DEFAULT),
     DEFINE_PROP_BOOL("x-preempt-pre-7-2", MigrationState,
                      preempt_pre_7_2, false),
 
@@ -172,6 +179,19 @@ Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_SIZE("multifd-dedup-cache-size", MigrationState,
+                      parameters.multifd_dedup_cache_size,
+                      DEFAULT_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE),
+    DEFINE_PROP_BOOL("dirty-limit-adaptive", MigrationState,
+                     parameters.dirty_limit_adaptive, false),
+    DEFINE_PROP_UINT8("postcopy-fault-threads", MigrationState,
+                      parameters.postcopy_fault_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS),
+    DEFINE_PROP_BOOL("mapped-ram-lazy-load", MigrationState,
+                     parameters.mapped_ram_lazy_load, false),
+    DEFINE_PROP_UINT8("background-snapshot-threads", MigrationState,
+                      parameters.background_snapshot_threads,
+                      DEFAULT_MIGRATE_BACKGROUND_SNAPSHOT_THREADS),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -196,6 +216,15 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("x-multifd-scan", MIGRATION_CAPABILITY_MULTIFD_SCAN),
+    DEFINE_PROP_MIG_CAP("x-defer-hot-pages",
+                        MIGRATION_CAPABILITY_DEFER_HOT_PAGES),
+    DEFINE_PROP_MIG_CAP("x-postcopy-prefetch",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREFETCH),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram-incremental",
+                        MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL),
+    DEFINE_PROP_MIG_CAP("x-ram-fd-passing",
+                        MIGRATION_CAPABILITY_RAM_FD_PASSING),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -220,6 +249,13 @@ bool migrate_colo(void)
     return s->capabilities[MIGRATION_CAPABILITY_X_COLO];
 }
 
+bool migrate_defer_hot_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_DEFER_HOT_PAGES];
+}
+
 bool migrate_dirty_bitmaps(void)
 {
     MigrationState *s = migrate_get_current();
@@ -248,6 +284,13 @@ bool migrate_mapped_ram(void)
     return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
 }
 
+bool migrate_mapped_ram_incremental(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL];
+}
+
 bool migrate_ignore_shared(void)
 {
     MigrationState *s = migrate_get_current();
@@ -255,6 +298,13 @@ bool migrate_ignore_shared(void)
     return s->capabilities[MIGRATION_CAPABILITY_X_IGNORE_SHARED];
 }
 
+bool migrate_ram_fd_passing(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_RAM_FD_PASSING];
+}
+
 bool migrate_late_block_activate(void)
 {
     MigrationState *s = migrate_get_current();
@@ -269,6 +319,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_scan(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_SCAN];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -290,6 +347,13 @@ bool migrate_postcopy_preempt(void)
     return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
 }
 
+bool migrate_postcopy_prefetch(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH];
+}
+
 bool migrate_postcopy_ram(void)
 {
     MigrationState *s = migrate_get_current();
@@ -521,12 +585,12 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
 
 #ifdef CONFIG_LINUX
     if (new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] &&
-        (!new_caps[MIGRATION_CAPABILITY_MULTIFD] ||
-         new_caps[MIGRATION_CAPABILITY_XBZRLE] ||
-         migrate_multifd_compression() ||
+        (new_caps[MIGRATION_CAPABILITY_XBZRLE] ||
+         (new_caps[MIGRATION_CAPABILITY_MULTIFD] &&
+          migrate_multifd_compression()) ||
          migrate_tls())) {
         error_setg(errp,
-                   "Zero copy only available for non-compressed non-TLS multifd migration");
+                   "Zero copy only available for non-compressed non-TLS migration");
         return false;
     }
 #else
@@ -537,6 +601,12 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
     }
 #endif
 
+    if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_PREFETCH] &&
+        !new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+        error_setg(errp, "Postcopy prefetch requires postcopy-ram");
+        return false;
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
         if (!new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
             error_setg(errp, "Postcopy preempt requires postcopy-ram");
@@ -599,6 +669,70 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM_INCREMENTAL]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'mapped-ram-incremental' requires "
+                             "capability 'mapped-ram'");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+            error_setg(errp, "Capability 'mapped-ram-incremental' is "
+                             "incompatible with background-snapshot");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_RAM_FD_PASSING]) {
+        if (!new_caps[MIGRATION_CAPABILITY_X_IGNORE_SHARED]) {
+            error_setg(errp, "Capability 'ram-fd-passing' requires "
+                             "capability 'x-ignore-shared'");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'ram-fd-passing' is "
+                             "incompatible with mapped-ram");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_SCAN]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Capability 'multifd-scan' requires capability "
+                             "'multifd'");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM] ||
+            new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Capability 'multifd-scan' is incompatible with "
+                             "postcopy-ram and mapped-ram");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
+            error_setg(errp, "Capability 'multifd-scan' is incompatible with "
+                             "xbzrle");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_DEFER_HOT_PAGES] &&
+        new_caps[MIGRATION_CAPABILITY_MULTIFD_SCAN]) {
+        error_setg(errp, "Capability 'defer-hot-pages' is incompatible with "
+                         "multifd-scan");
+        return false;
+    }
+
+    if ((new_caps[MIGRATION_CAPABILITY_ZERO_COPY_SEND] ||
+         new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) &&
+        migrate_multifd_dedup_cache_size()) {
+        error_setg(errp, "Zero copy and mapped-ram are incompatible with "
+                         "multifd-dedup-cache-size");
+        return false;
+    }
+
     return true;
 }
 
@@ -823,6 +957,34 @@ uint64_t migrate_vcpu_dirty_limit_period(void)
     return s->parameters.x_vcpu_dirty_limit_period;
 }
 
+bool migrate_dirty_limit_adaptive(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.dirty_limit_adaptive;
+}
+
+uint8_t migrate_postcopy_fault_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.postcopy_fault_threads;
+}
+
+bool migrate_mapped_ram_lazy_load(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.mapped_ram_lazy_load;
+}
+
+uint8_t migrate_background_snapshot_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.background_snapshot_threads;
+}
+
 uint64_t migrate_xbzrle_cache_size(void)
 {
     MigrationState *s = migrate_get_current();
@@ -830,6 +992,13 @@ uint64_t migrate_xbzrle_cache_size(void)
     return s->parameters.xbzrle_cache_size;
 }
 
+uint64_t migrate_multifd_dedup_cache_size(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.multifd_dedup_cache_size;
+}
+
 ZeroPageDetection migrate_zero_page_detection(void)
 {
     MigrationState *s = migrate_get_current();
@@ -922,6 +1091,17 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->zero_page_detection = s->parameters.zero_page_detection;
     params->has_direct_io = true;
     params->direct_io = s->parameters.direct_io;
+    params->has_multifd_dedup_cache_size = true;
+    params->multifd_dedup_cache_size = s->parameters.multifd_dedup_cache_size;
+    params->has_dirty_limit_adaptive = true;
+    params->dirty_limit_adaptive = s->parameters.dirty_limit_adaptive;
+    params->has_postcopy_fault_threads = true;
+    params->postcopy_fault_threads = s->parameters.postcopy_fault_threads;
+    params->has_mapped_ram_lazy_load = true;
+    params->mapped_ram_lazy_load = s->parameters.mapped_ram_lazy_load;
+    params->has_background_snapshot_threads = true;
+    params->background_snapshot_threads =
+        s->parameters.background_snapshot_threads;
 
     return params;
 }
@@ -956,6 +1136,11 @@ void migrate_params_init(MigrationParameters *params)
     params->has_mode = true;
     params->has_zero_page_detection = true;
     params->has_direct_io = true;
+    params->has_multifd_dedup_cache_size = true;
+    params->has_dirty_limit_adaptive = true;
+    params->has_postcopy_fault_threads = true;
+    params->has_mapped_ram_lazy_load = true;
+    params->has_background_snapshot_threads = true;
 }
 
 /*
@@ -1106,10 +1291,11 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
 
 #ifdef CONFIG_LINUX
     if (migrate_zero_copy_send() &&
-        ((params->has_multifd_compression && params->multifd_compression) ||
+        ((migrate_multifd() && params->has_multifd_compression &&
+          params->multifd_compression) ||
          (params->tls_creds && *params->tls_creds))) {
         error_setg(errp,
-                   "Zero copy only available for non-compressed non-TLS multifd migration");
+                   "Zero copy only available for non-compressed non-TLS migration");
         return false;
     }
 #endif
@@ -1137,6 +1323,51 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_dedup_cache_size &&
+        params->multifd_dedup_cache_size &&
+        (params->multifd_dedup_cache_size < MiB ||
+         !is_power_of_2(params->multifd_dedup_cache_size))) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "multifd_dedup_cache_size",
+                   "zero or a power of two no less than 1 MiB");
+        return false;
+    }
+
+    if (params->has_multifd_dedup_cache_size &&
+        params->multifd_dedup_cache_size &&
+        (params->multifd_compression || migrate_zero_copy_send() ||
+         migrate_mapped_ram())) {
+        error_setg(errp,
+                   "Multifd dedup only available for non-compressed multifd "
+                   "migration without zero-copy-send and mapped-ram");
+        return false;
+    }
+
+    if (params->has_multifd_compression &&
+        params->multifd_compression == MULTIFD_COMPRESSION_XBZRLE &&
+        params->has_zero_page_detection &&
+        params->zero_page_detection == ZERO_PAGE_DETECTION_LEGACY) {
+        error_setg(errp,
+                   "Multifd xbzrle compression needs zero-page-detection "
+                   "'multifd' or 'none'");
+        return false;
+    }
+
+    if (params->has_postcopy_fault_threads &&
+        params->postcopy_fault_threads < 1) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_fault_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
+#ifndef CONFIG_POSIX
+    if (params->has_mapped_ram_lazy_load && params->mapped_ram_lazy_load) {
+        error_setg(errp, "No support for mapped-ram-lazy-load on this host");
+        return false;
+    }
+#endif
+
     if (params->has_direct_io && params->direct_io && !qemu_has_direct_io()) {
         error_setg(errp, "No build-time support for direct-io");
         return false;
@@ -1255,6 +1486,27 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_direct_io) {
         dest->direct_io = params->direct_io;
     }
+
+    if (params->has_multifd_dedup_cache_size) {
+        dest->multifd_dedup_cache_size = params->multifd_dedup_cache_size;
+    }
+
+    if (params->has_dirty_limit_adaptive) {
+        dest->dirty_limit_adaptive = params->dirty_limit_adaptive;
+    }
+
+    if (params->has_postcopy_fault_threads) {
+        dest->postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+
+    if (params->has_mapped_ram_lazy_load) {
+        dest->mapped_ram_lazy_load = params->mapped_ram_lazy_load;
+    }
+
+    if (params->has_background_snapshot_threads) {
+        dest->background_snapshot_threads =
+            params->background_snapshot_threads;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1387,6 +1639,28 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_direct_io) {
         s->parameters.direct_io = params->direct_io;
     }
+
+    if (params->has_multifd_dedup_cache_size) {
+        s->parameters.multifd_dedup_cache_size =
+            params->multifd_dedup_cache_size;
+    }
+
+    if (params->has_dirty_limit_adaptive) {
+        s->parameters.dirty_limit_adaptive = params->dirty_limit_adaptive;
+    }
+
+    if (params->has_postcopy_fault_threads) {
+        s->parameters.postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+
+    if (params->has_mapped_ram_lazy_load) {
+        s->parameters.mapped_ram_lazy_load = params->mapped_ram_lazy_load;
+    }
+
+    if (params->has_background_snapshot_threads) {
+        s->parameters.background_snapshot_threads =
+            params->background_snapshot_threads;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
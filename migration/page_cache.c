@@ -173,3 +173,48 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
 
     return 0;
 }
+
+int cache_resize(PageCache *cache, uint64_t new_size, Error **errp)
+{
+    PageCache *new_cache;
+    int64_t i;
+
+    g_assert(cache);
+
+    new_cache = cache_init(new_size, cache->page_size, errp);
+    if (!new_cache) {
+        return -1;
+    }
+
+    /* Move the pages over, keeping the most recent one on collisions */
+    for (i = 0; i < cache->max_num_items; i++) {
+        CacheItem *old_it = &cache->page_cache[i];
+        CacheItem *new_it;
+
+        if (!old_it->it_data) {
+            continue;
+        }
+
+        new_it = cache_get_by_addr(new_cache, old_it->it_addr);
+        if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            g_free(old_it->it_data);
+            continue;
+        }
+        if (!new_it->it_data) {
+            new_cache->num_items++;
+        }
+        g_free(new_it->it_data);
+        *new_it = *old_it;
+    }
+
+    trace_migration_pagecache_resize(cache->max_num_items,
+                                     new_cache->max_num_items);
+
+    g_free(cache->page_cache);
+    cache->page_cache = new_cache->page_cache;
+    cache->max_num_items = new_cache->max_num_items;
+    cache->num_items = new_cache->num_items;
+    g_free(new_cache);
+
+    return 0;
+}
@@ -71,4 +71,18 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
                  uint64_t current_age);
 
+/**
+ * cache_resize: change the number of pages the cache can hold.  Pages
+ * that are cached keep their data, unless they collide with another
+ * page in the resized cache, in which case the most recently used of
+ * the two is kept.
+ *
+ * Returns 0 on success, -1 on error with @errp set
+ *
+ * @cache pointer to the PageCache struct
+ * @new_size: new cache size in bytes
+ * @errp: set *errp on failure
+ */
+int cache_resize(PageCache *cache, uint64_t new_size, Error **errp);
+
 #endif
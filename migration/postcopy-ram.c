@@ -18,6 +18,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/madvise.h"
+#include "qemu/units.h"
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
@@ -591,6 +592,8 @@ static void postcopy_temp_pages_cleanup(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
     if (mis->preempt_thread_status == PREEMPT_THREAD_CREATED) {
@@ -630,11 +633,13 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
-        /* Let the fault thread quit */
+        /* Let the fault threads quit */
         qatomic_set(&mis->fault_thread_quit, 1);
         postcopy_fault_thread_notify(mis);
         trace_postcopy_ram_incoming_cleanup_join();
-        qemu_thread_join(&mis->fault_thread);
+        for (i = 0; i < mis->nr_fault_threads; i++) {
+            qemu_thread_join(&mis->fault_threads[i].thread);
+        }
 
         if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_END, &local_err)) {
             error_report_err(local_err);
@@ -647,7 +652,16 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 
         trace_postcopy_ram_incoming_cleanup_closeuf();
         close(mis->userfault_fd);
-        close(mis->userfault_event_fd);
+        for (i = 0; i < mis->nr_fault_threads; i++) {
+            close(mis->fault_threads[i].event_fd);
+            g_free(mis->fault_threads[i].name);
+        }
+        g_free(mis->fault_threads);
+        mis->fault_threads = NULL;
+        mis->nr_fault_threads = 0;
+        g_free(mis->fault_streams);
+        mis->fault_streams = NULL;
+        mis->nr_fault_streams = 0;
         mis->have_fault_thread = false;
     }
 
@@ -943,40 +957,192 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                       affected_cpu);
 }
 
-static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
+static uint64_t postcopy_fault_resume_gen(MigrationIncomingState *mis)
 {
+    QEMU_LOCK_GUARD(&mis->postcopy_pause_fault_lock);
+    return mis->postcopy_fault_resume_gen;
+}
+
+/*
+ * Wait for a postcopy recovery, unless one has completed since the caller
+ * read @gen with postcopy_fault_resume_gen() and found the return path
+ * broken.
+ */
+static void postcopy_pause_fault_thread(MigrationIncomingState *mis,
+                                        uint64_t gen)
+{
+    WITH_QEMU_LOCK_GUARD(&mis->postcopy_pause_fault_lock) {
+        if (mis->postcopy_fault_resume_gen != gen) {
+            return;
+        }
+        mis->postcopy_nr_paused_faults++;
+    }
+
     trace_postcopy_pause_fault_thread();
     qemu_sem_wait(&mis->postcopy_pause_sem_fault);
     trace_postcopy_pause_fault_thread_continued();
 }
 
+/*
+ * With the postcopy-prefetch capability, each vCPU, plus one stream per
+ * fault thread for the faults that don't come from a vCPU, remembers the
+ * stride between its last faults.  Once the same stride shows up twice in
+ * a row, the pages that follow along that stride are requested after the
+ * faulted page, in a window that doubles with each further fault at that
+ * stride.  Only the pages on the stride are requested, not the ones in
+ * between, and the source sends them after the pages vCPUs wait on.
+ *
+ * A vCPU has a single fault outstanding at a time, so even if its faults
+ * are served by different fault threads they never touch its stream at
+ * the same time.
+ */
+#define POSTCOPY_PREFETCH_MAX_STRIDE    16          /* host pages */
+#define POSTCOPY_PREFETCH_MAX_WINDOW    (512 * KiB)
+
+typedef struct PostcopyFaultStream {
+    RAMBlock *rb;
+    /* offset of the last fault */
+    ram_addr_t last;
+    /* distance between the last two faults, in bytes */
+    int64_t stride;
+    /* number of faults in a row at that stride */
+    unsigned int hits;
+    /*
+     * Edge of the pages already requested along the stride: the end of
+     * the last one going up, the start of the last one going down
+     */
+    ram_addr_t prefetched;
+} PostcopyFaultStream;
+
+static PostcopyFaultStream *postcopy_fault_stream(PostcopyFaultThread *ft,
+                                                  uint32_t pid)
+{
+    MigrationIncomingState *mis = ft->mis;
+    int nr_cpus = mis->nr_fault_streams - mis->nr_fault_threads;
+    int cpu = pid ? get_mem_fault_cpu_index(pid) : -1;
+
+    if (cpu < 0 || cpu >= nr_cpus) {
+        cpu = nr_cpus + ft->id;
+    }
+    return &mis->fault_streams[cpu];
+}
+
+/* The host page @i steps away from the fault at @offset along @stride */
+static ram_addr_t postcopy_prefetch_page(ram_addr_t offset, int64_t stride,
+                                         uint64_t i)
+{
+    return stride > 0 ? offset + i * stride : offset - i * -stride;
+}
+
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyFaultStream *st, RAMBlock *rb,
+                              ram_addr_t offset)
+{
+    size_t page_size = qemu_ram_pagesize(rb);
+    int64_t stride = (int64_t)offset - (int64_t)st->last;
+    uint64_t step, window, first, last;
+    ram_addr_t start, far;
+
+    if (rb != st->rb || stride != st->stride || !stride ||
+        ABS(stride) > POSTCOPY_PREFETCH_MAX_STRIDE * page_size) {
+        st->rb = rb;
+        st->last = offset;
+        st->stride = stride;
+        st->hits = 0;
+        st->prefetched = offset;
+        return;
+    }
+
+    st->last = offset;
+    st->hits++;
+    step = ABS(stride);
+    window = MIN(step << MIN(st->hits, 16), POSTCOPY_PREFETCH_MAX_WINDOW);
+
+    /*
+     * The candidates are the pages @step, 2 * @step, ... up to @window
+     * bytes away from the fault, in the direction of the stride, that
+     * are inside the RAMBlock and have not been requested yet.  They are
+     * numbered by their distance from the fault in steps, [first, last].
+     */
+    if (stride > 0) {
+        if (offset + page_size >= rb->used_length) {
+            return;
+        }
+        last = MIN(window, rb->used_length - page_size - offset) / step;
+        first = st->prefetched > offset ?
+                DIV_ROUND_UP(st->prefetched - offset, step) : 1;
+    } else {
+        last = MIN(window, offset) / step;
+        first = st->prefetched <= offset ?
+                (offset - st->prefetched) / step + 1 : 1;
+    }
+    first = MAX(first, 1);
+
+    /* Don't ask again for the pages that are already here */
+    while (first <= last &&
+           ramblock_recv_bitmap_test_byte_offset(
+               rb, postcopy_prefetch_page(offset, stride, first))) {
+        first++;
+    }
+    while (first <= last &&
+           ramblock_recv_bitmap_test_byte_offset(
+               rb, postcopy_prefetch_page(offset, stride, last))) {
+        last--;
+    }
+    if (first > last) {
+        return;
+    }
+
+    /* The request goes up from the lowest page */
+    far = postcopy_prefetch_page(offset, stride, last);
+    if (stride > 0) {
+        start = postcopy_prefetch_page(offset, stride, first);
+        st->prefetched = far + page_size;
+    } else {
+        start = far;
+        st->prefetched = far;
+    }
+
+    trace_postcopy_prefetch(qemu_ram_get_idstr(rb), start, step,
+                            last - first + 1);
+    /*
+     * This is only a hint, if the return path is broken the next fault
+     * will find out.
+     */
+    migrate_send_rp_prefetch_pages(mis, rb, start, step, last - first + 1);
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
+ *
+ * All the fault threads poll the same userfaultfd, and the kernel hands
+ * each fault to only one of them.  The first one also serves the faults
+ * on shared memory of external processes.
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
-    MigrationIncomingState *mis = opaque;
+    PostcopyFaultThread *ft = opaque;
+    MigrationIncomingState *mis = ft->mis;
     struct uffd_msg msg;
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
 
-    trace_postcopy_ram_fault_thread_entry();
+    trace_postcopy_ram_fault_thread_entry(ft->id);
     rcu_register_thread();
-    mis->last_rb = NULL; /* last RAMBlock we sent part of */
     qemu_sem_post(&mis->thread_sync_sem);
 
     struct pollfd *pfd;
-    size_t pfd_len = 2 + mis->postcopy_remote_fds->len;
+    size_t pfd_len = 2 + (ft->id ? 0 : mis->postcopy_remote_fds->len);
 
     pfd = g_new0(struct pollfd, pfd_len);
 
     pfd[0].fd = mis->userfault_fd;
     pfd[0].events = POLLIN;
-    pfd[1].fd = mis->userfault_event_fd;
+    pfd[1].fd = ft->event_fd;
     pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
     trace_postcopy_ram_fault_thread_fds_core(pfd[0].fd, pfd[1].fd);
-    for (index = 0; index < mis->postcopy_remote_fds->len; index++) {
+    for (index = 0; index < pfd_len - 2; index++) {
         struct PostCopyFD *pcfd = &g_array_index(mis->postcopy_remote_fds,
                                                  struct PostCopyFD, index);
         pfd[2 + index].fd = pcfd->fd;
@@ -987,6 +1153,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
 
     while (true) {
         ram_addr_t rb_offset;
+        uint64_t gen;
         int poll_result;
 
         /*
@@ -1001,26 +1168,27 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
+        gen = postcopy_fault_resume_gen(mis);
         if (!mis->to_src_file) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
              * the channel is rebuilt.
              */
-            postcopy_pause_fault_thread(mis);
+            postcopy_pause_fault_thread(mis, gen);
         }
 
         if (pfd[1].revents) {
             uint64_t tmp64 = 0;
 
             /* Consume the signal */
-            if (read(mis->userfault_event_fd, &tmp64, 8) != 8) {
+            if (read(ft->event_fd, &tmp64, 8) != 8) {
                 /* Nothing obviously nicer than posting this error. */
                 error_report("%s: read() failed", __func__);
             }
 
             if (qatomic_read(&mis->fault_thread_quit)) {
-                trace_postcopy_ram_fault_thread_quit();
+                trace_postcopy_ram_fault_thread_quit(ft->id);
                 break;
             }
         }
@@ -1077,13 +1245,21 @@ retry:
              * Send the request to the source - we want to request one
              * of our host page sizes (which is >= TPS)
              */
+            gen = postcopy_fault_resume_gen(mis);
             ret = postcopy_request_page(mis, rb, rb_offset,
                                         msg.arg.pagefault.address);
             if (ret) {
                 /* May be network failure, try to wait for recovery */
-                postcopy_pause_fault_thread(mis);
+                postcopy_pause_fault_thread(mis, gen);
                 goto retry;
             }
+
+            if (mis->fault_streams) {
+                PostcopyFaultStream *st = postcopy_fault_stream(
+                    ft, msg.arg.pagefault.feat.ptid);
+
+                postcopy_prefetch(mis, st, rb, rb_offset);
+            }
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1143,7 +1319,7 @@ retry:
         }
     }
     rcu_unregister_thread();
-    trace_postcopy_ram_fault_thread_exit();
+    trace_postcopy_ram_fault_thread_exit(ft->id);
     g_free(pfd);
     return NULL;
 }
@@ -1203,6 +1379,7 @@ static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
     Error *local_err = NULL;
+    int i;
 
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = uffd_open(O_CLOEXEC | O_NONBLOCK);
@@ -1221,18 +1398,48 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    /* Now an eventfd we use to tell the fault-thread to quit */
-    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
-    if (mis->userfault_event_fd == -1) {
-        error_report("%s: Opening userfault_event_fd: %s", __func__,
-                     strerror(errno));
-        close(mis->userfault_fd);
-        return -1;
+    mis->nr_fault_threads = migrate_postcopy_fault_threads();
+    mis->fault_threads = g_new0(PostcopyFaultThread, mis->nr_fault_threads);
+    for (i = 0; i < mis->nr_fault_threads; i++) {
+        PostcopyFaultThread *ft = &mis->fault_threads[i];
+
+        /* Now an eventfd we use to tell the fault-thread to quit */
+        ft->event_fd = eventfd(0, EFD_CLOEXEC);
+        if (ft->event_fd == -1) {
+            error_report("%s: Opening fault thread eventfd: %s", __func__,
+                         strerror(errno));
+            while (i--) {
+                close(mis->fault_threads[i].event_fd);
+            }
+            g_free(mis->fault_threads);
+            mis->fault_threads = NULL;
+            mis->nr_fault_threads = 0;
+            close(mis->userfault_fd);
+            return -1;
+        }
+        ft->mis = mis;
+        ft->id = i;
+        ft->name = g_strdup_printf(MIGRATION_THREAD_DST_FAULT, i);
+    }
+
+    if (migrate_postcopy_prefetch()) {
+        MachineState *ms = MACHINE(qdev_get_machine());
+
+        mis->nr_fault_streams = ms->smp.cpus + mis->nr_fault_threads;
+        mis->fault_streams = g_new0(PostcopyFaultStream,
+                                    mis->nr_fault_streams);
     }
 
-    postcopy_thread_create(mis, &mis->fault_thread,
-                           MIGRATION_THREAD_DST_FAULT,
-                           postcopy_ram_fault_thread, QEMU_THREAD_JOINABLE);
+    mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    for (i = 0; i < mis->nr_fault_threads; i++) {
+        PostcopyFaultThread *ft = &mis->fault_threads[i];
+
+        qemu_sem_init(&mis->thread_sync_sem, 0);
+        qemu_thread_create(&ft->thread, ft->name, postcopy_ram_fault_thread,
+                           ft, QEMU_THREAD_JOINABLE);
+        qemu_sem_wait(&mis->thread_sync_sem);
+        qemu_sem_destroy(&mis->thread_sync_sem);
+    }
     mis->have_fault_thread = true;
 
     /* Mark so that we get notified of accesses to unwritten areas */
@@ -1447,15 +1654,34 @@ void postcopy_temp_page_reset(PostcopyTmpPage *tmp_page)
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
     uint64_t tmp64 = 1;
+    int i;
 
     /*
-     * Wakeup the fault_thread.  It's an eventfd that should currently
+     * Wakeup the fault threads.  Each has an eventfd that should currently
      * be at 0, we're going to increment it to 1
      */
-    if (write(mis->userfault_event_fd, &tmp64, 8) != 8) {
-        /* Not much we can do here, but may as well report it */
-        error_report("%s: incrementing failed: %s", __func__,
-                     strerror(errno));
+    for (i = 0; i < mis->nr_fault_threads; i++) {
+        if (write(mis->fault_threads[i].event_fd, &tmp64, 8) != 8) {
+            /* Not much we can do here, but may as well report it */
+            error_report("%s: incrementing failed: %s", __func__,
+                         strerror(errno));
+        }
+    }
+}
+
+void postcopy_fault_thread_resume(MigrationIncomingState *mis)
+{
+    int nr_paused;
+
+    WITH_QEMU_LOCK_GUARD(&mis->postcopy_pause_fault_lock) {
+        mis->postcopy_fault_resume_gen++;
+        nr_paused = mis->postcopy_nr_paused_faults;
+        mis->postcopy_nr_paused_faults = 0;
+    }
+
+    trace_postcopy_fault_thread_resume(nr_paused);
+    while (nr_paused--) {
+        qemu_sem_post(&mis->postcopy_pause_sem_fault);
     }
 }
 
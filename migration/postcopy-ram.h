@@ -108,6 +108,8 @@ PostcopyState postcopy_state_get(void);
 PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
+/* Release the fault threads that wait for a postcopy recovery */
+void postcopy_fault_thread_resume(MigrationIncomingState *mis);
 
 /*
  * To be called once at the start before any device initialisation
@@ -37,17 +37,52 @@
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN_CONST(IOV_MAX, 64)
 
+/*
+ * In zero copy mode, pages are not copied anymore, so more of them are
+ * batched in each write.
+ */
+#define MAX_ZERO_COPY_IOV_SIZE MIN_CONST(IOV_MAX, 512)
+
+/* Number of IO_BUF_SIZE arenas the buffer is made of in zero copy mode */
+#define ZERO_COPY_ARENAS 16
+
+/* Data byte sent along with a file descriptor */
+#define QEMU_FILE_FD_TAG 'F'
+
+typedef struct FdEntry {
+    QTAILQ_ENTRY(FdEntry) entry;
+    int fd;
+} FdEntry;
+
 struct QEMUFile {
     QIOChannel *ioc;
     bool is_writable;
 
     int buf_index;
     int buf_size; /* 0 when writing */
-    uint8_t buf[IO_BUF_SIZE];
+    /* Either io_buf, or the current arena in zero copy mode */
+    uint8_t *buf;
+    uint8_t io_buf[IO_BUF_SIZE];
 
-    DECLARE_BITMAP(may_free, MAX_IOV_SIZE);
-    struct iovec iov[MAX_IOV_SIZE];
+    /*
+     * Zero copy mode, see qemu_file_set_zero_copy().  The kernel reads the
+     * written data when it actually sends it, so the buffered data goes
+     * to arenas which are only reused once the kernel is done with them.
+     */
+    bool zero_copy;
+    uint8_t *arenas;
+    unsigned int arena;
+
+    DECLARE_BITMAP(may_free, MAX_ZERO_COPY_IOV_SIZE);
+    struct iovec iov[MAX_ZERO_COPY_IOV_SIZE];
     unsigned int iovcnt;
+    unsigned int iov_max;
+    /* The iovec holds buffers queued by qemu_put_buffer_async() */
+    bool iov_async;
+
+    /* File descriptors received with the data, see qemu_file_get_fd() */
+    bool can_pass_fd;
+    QTAILQ_HEAD(, FdEntry) fds;
 
     int last_error;
     Error *last_error_obj;
@@ -109,6 +144,10 @@ static QEMUFile *qemu_file_new_impl(QIOChannel *ioc, bool is_writable)
     object_ref(ioc);
     f->ioc = ioc;
     f->is_writable = is_writable;
+    f->buf = f->io_buf;
+    f->iov_max = MAX_IOV_SIZE;
+    f->can_pass_fd = qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_FD_PASS);
+    QTAILQ_INIT(&f->fds);
 
     return f;
 }
@@ -132,6 +171,31 @@ QEMUFile *qemu_file_new_input(QIOChannel *ioc)
     return qemu_file_new_impl(ioc, false);
 }
 
+/*
+ * Switch an output file to zero copy mode, if its channel supports it:
+ * the buffers of qemu_put_buffer_async() are then sent with
+ * QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, so they must stay mapped until the
+ * file is closed.  Must be called before anything is written to the file.
+ *
+ * Returns: true if the file is in zero copy mode
+ */
+bool qemu_file_set_zero_copy(QEMUFile *f)
+{
+    assert(f->is_writable && !f->buf_index && !f->iovcnt);
+
+    if (!qio_channel_has_feature(f->ioc,
+                                 QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        return false;
+    }
+
+    f->zero_copy = true;
+    f->arenas = g_malloc(ZERO_COPY_ARENAS * IO_BUF_SIZE);
+    f->arena = 0;
+    f->buf = f->arenas;
+    f->iov_max = MAX_ZERO_COPY_IOV_SIZE;
+    return true;
+}
+
 /*
  * Get last error for stream f with optional Error*
  *
@@ -263,6 +327,55 @@ bool qemu_file_is_seekable(QEMUFile *f)
     return qio_channel_has_feature(f->ioc, QIO_CHANNEL_FEATURE_SEEKABLE);
 }
 
+/* Wait for the kernel to be done with all the zero copy writes */
+static void qemu_file_zero_copy_flush(QEMUFile *f)
+{
+    Error *local_error = NULL;
+    int ret;
+
+    ret = qio_channel_flush(f->ioc, &local_error);
+    if (ret < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+    } else if (ret == 1) {
+        stat64_add(&mig_stats.main_missed_zero_copy, 1);
+    }
+}
+
+/**
+ * qemu_file_zero_copy_sync: flush @f and wait until the kernel is done
+ * with its zero copy writes
+ *
+ * Blocks until the peer received the data, so it is meant for the
+ * migration thread, once the stream is complete; qemu_fclose() does not
+ * wait, as it runs in the main loop.
+ *
+ * Returns: the error of @f, if any, 0 otherwise
+ */
+int qemu_file_zero_copy_sync(QEMUFile *f)
+{
+    if (qemu_fflush(f) || !f->zero_copy) {
+        return f->last_error;
+    }
+
+    qemu_file_zero_copy_flush(f);
+    return f->last_error;
+}
+
+/*
+ * Move on to the next arena once the current one is full.  Before going
+ * back to the first one, wait until no arena is in use by the kernel.
+ */
+static void qemu_file_next_arena(QEMUFile *f)
+{
+    f->arena = (f->arena + 1) % ZERO_COPY_ARENAS;
+    if (!f->arena) {
+        trace_qemu_file_zero_copy_arenas_wrap();
+        qemu_file_zero_copy_flush(f);
+    }
+    f->buf = f->arenas + f->arena * IO_BUF_SIZE;
+    f->buf_index = 0;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -280,9 +393,16 @@ int qemu_fflush(QEMUFile *f)
     }
     if (f->iovcnt > 0) {
         Error *local_error = NULL;
-        if (qio_channel_writev_all(f->ioc,
-                                   f->iov, f->iovcnt,
-                                   &local_error) < 0) {
+        /*
+         * Without pages, the data is only the buffered one, too small
+         * to be worth the completion notifications of zero copy.
+         */
+        int flags = f->zero_copy && f->iov_async ?
+                    QIO_CHANNEL_WRITE_FLAG_ZERO_COPY : 0;
+
+        if (qio_channel_writev_full_all(f->ioc,
+                                        f->iov, f->iovcnt, NULL, 0, flags,
+                                        &local_error) < 0) {
             qemu_file_set_error_obj(f, -EIO, local_error);
         } else {
             uint64_t size = iov_size(f->iov, f->iovcnt);
@@ -292,11 +412,41 @@ int qemu_fflush(QEMUFile *f)
         qemu_iovec_release_ram(f);
     }
 
-    f->buf_index = 0;
+    if (!f->zero_copy) {
+        f->buf_index = 0;
+    } else if (f->buf_index == IO_BUF_SIZE) {
+        /* The data of the current arena may still be in flight */
+        qemu_file_next_arena(f);
+    }
     f->iovcnt = 0;
+    f->iov_async = false;
     return f->last_error;
 }
 
+/*
+ * Read into the buffer like qio_channel_read(), and queue the file
+ * descriptors received along for qemu_file_get_fd().
+ */
+static int qemu_file_read_with_fds(QEMUFile *f, int pending, Error **errp)
+{
+    struct iovec iov = {
+        .iov_base = f->buf + pending,
+        .iov_len = IO_BUF_SIZE - pending,
+    };
+    g_autofree int *fds = NULL;
+    size_t nfd = 0;
+    int len;
+
+    len = qio_channel_readv_full(f->ioc, &iov, 1, &fds, &nfd, 0, errp);
+    for (size_t i = 0; i < nfd; i++) {
+        FdEntry *fde = g_new0(FdEntry, 1);
+
+        fde->fd = fds[i];
+        QTAILQ_INSERT_TAIL(&f->fds, fde, entry);
+    }
+    return len;
+}
+
 /*
  * Attempt to fill the buffer from the underlying file
  * Returns the number of bytes read, or negative value for an error.
@@ -325,10 +475,14 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
     }
 
     do {
-        len = qio_channel_read(f->ioc,
-                               (char *)f->buf + pending,
-                               IO_BUF_SIZE - pending,
-                               &local_error);
+        if (f->can_pass_fd) {
+            len = qemu_file_read_with_fds(f, pending, &local_error);
+        } else {
+            len = qio_channel_read(f->ioc,
+                                   (char *)f->buf + pending,
+                                   IO_BUF_SIZE - pending,
+                                   &local_error);
+        }
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             if (qemu_in_coroutine()) {
                 qio_channel_yield(f->ioc, G_IO_IN);
@@ -362,11 +516,25 @@ static ssize_t coroutine_mixed_fn qemu_fill_buffer(QEMUFile *f)
 int qemu_fclose(QEMUFile *f)
 {
     int ret = qemu_fflush(f);
-    int ret2 = qio_channel_close(f->ioc, NULL);
+    FdEntry *fde, *next;
+    int ret2;
+
+    /*
+     * In zero copy mode, a complete stream was already waited for with
+     * qemu_file_zero_copy_sync().  Otherwise the stream failed: what the
+     * kernel still sends from the arenas does not matter anymore, and the
+     * peer may never ack it.
+     */
+    ret2 = qio_channel_close(f->ioc, NULL);
     if (ret >= 0) {
         ret = ret2;
     }
     g_clear_pointer(&f->ioc, object_unref);
+    g_free(f->arenas);
+    QTAILQ_FOREACH_SAFE(fde, &f->fds, entry, next) {
+        close(fde->fd);
+        g_free(fde);
+    }
     error_free(f->last_error_obj);
     g_free(f);
     trace_qemu_file_fclose();
@@ -391,7 +559,7 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
     {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
-        if (f->iovcnt >= MAX_IOV_SIZE) {
+        if (f->iovcnt >= f->iov_max) {
             /* Should only happen if a previous fflush failed */
             assert(qemu_file_get_error(f) || !qemu_file_is_writable(f));
             return 1;
@@ -403,7 +571,7 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
         f->iov[f->iovcnt++].iov_len = size;
     }
 
-    if (f->iovcnt >= MAX_IOV_SIZE) {
+    if (f->iovcnt >= f->iov_max) {
         qemu_fflush(f);
         return 1;
     }
@@ -413,11 +581,16 @@ static int add_to_iovec(QEMUFile *f, const uint8_t *buf, size_t size,
 
 static void add_buf_to_iovec(QEMUFile *f, size_t len)
 {
-    if (!add_to_iovec(f, f->buf + f->buf_index, len, false)) {
-        f->buf_index += len;
-        if (f->buf_index == IO_BUF_SIZE) {
-            qemu_fflush(f);
-        }
+    const uint8_t *buf = f->buf + f->buf_index;
+
+    /*
+     * Account for the data before adding it: in zero copy mode, flushing
+     * the iovec does not make the buffer reusable.
+     */
+    f->buf_index += len;
+    add_to_iovec(f, buf, len, false);
+    if (f->buf_index == IO_BUF_SIZE) {
+        qemu_fflush(f);
     }
 }
 
@@ -428,6 +601,7 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, size_t size,
         return;
     }
 
+    f->iov_async = true;
     add_to_iovec(f, buf, size, may_free);
 }
 
@@ -807,6 +981,61 @@ void qemu_put_counted_string(QEMUFile *f, const char *str)
     qemu_put_buffer(f, (const uint8_t *)str, len);
 }
 
+/*
+ * Pass @fd to the other side, which gets it with qemu_file_get_fd().
+ * The channel must support file descriptor passing.
+ *
+ * Returns: 0 on success, or a negative error value
+ */
+int qemu_file_put_fd(QEMUFile *f, int fd)
+{
+    uint8_t tag = QEMU_FILE_FD_TAG;
+    struct iovec iov = { .iov_base = &tag, .iov_len = 1 };
+    Error *local_error = NULL;
+
+    /* The tag and the fd must go out together, after the buffered data */
+    if (qemu_fflush(f)) {
+        return f->last_error;
+    }
+
+    if (qio_channel_writev_full_all(f->ioc, &iov, 1, &fd, 1, 0,
+                                    &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+    } else {
+        stat64_add(&mig_stats.qemu_file_transferred, 1);
+    }
+    return f->last_error;
+}
+
+/*
+ * Get a file descriptor passed with qemu_file_put_fd().  The caller
+ * owns it.
+ *
+ * Returns: the file descriptor, or -1 on error
+ */
+int qemu_file_get_fd(QEMUFile *f)
+{
+    FdEntry *fde;
+    int fd;
+
+    /* Reading the tag queued the fd received with it */
+    if (qemu_get_byte(f) != QEMU_FILE_FD_TAG || QTAILQ_EMPTY(&f->fds)) {
+        if (!qemu_file_get_error(f)) {
+            Error *err = NULL;
+
+            error_setg(&err, "Expected a file descriptor in the stream");
+            qemu_file_set_error_obj(f, -EINVAL, err);
+        }
+        return -1;
+    }
+
+    fde = QTAILQ_FIRST(&f->fds);
+    QTAILQ_REMOVE(&f->fds, fde, entry);
+    fd = fde->fd;
+    g_free(fde);
+    return fd;
+}
+
 /*
  * Set the blocking state of the QEMUFile.
  * Note: On some transports the OS only keeps a single blocking state for
@@ -31,6 +31,10 @@
 
 QEMUFile *qemu_file_new_input(QIOChannel *ioc);
 QEMUFile *qemu_file_new_output(QIOChannel *ioc);
+bool qemu_file_set_zero_copy(QEMUFile *f);
+int qemu_file_zero_copy_sync(QEMUFile *f);
+int qemu_file_put_fd(QEMUFile *f, int fd);
+int qemu_file_get_fd(QEMUFile *f);
 int qemu_fclose(QEMUFile *f);
 
 /*
@@ -27,12 +27,16 @@
  */
 
 #include "qemu/osdep.h"
+#include <math.h>
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "qemu/event_notifier.h"
 #include "xbzrle.h"
+#include "dirty-limit.h"
 #include "ram.h"
 #include "migration.h"
 #include "migration-stats.h"
@@ -56,6 +60,8 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "file.h"
+#include "io/channel-file.h"
 #include "sysemu/runstate.h"
 #include "rdma.h"
 #include "options.h"
@@ -65,6 +71,7 @@
 #include "hw/boards.h" /* for machine_dump_guest_core() */
 
 #if defined(__linux__)
+#include <poll.h>
 #include "qemu/userfaultfd.h"
 #endif /* defined(__linux__) */
 
@@ -110,6 +117,15 @@
  */
 #define MAPPED_RAM_LOAD_BUF_SIZE 0x100000
 
+/*
+ * With mapped-ram-lazy-load, runs of pages shorter than this are still
+ * read, and so are all the pages of a ramblock past its first
+ * MAPPED_RAM_MAX_MAPS runs, so that a fragmented ramblock doesn't split
+ * into more mappings than the kernel allows.
+ */
+#define MAPPED_RAM_MAP_MIN_SIZE 0x100000
+#define MAPPED_RAM_MAX_MAPS 4096
+
 XBZRLECacheStats xbzrle_counters;
 
 /* used by the search for pages to send */
@@ -214,11 +230,22 @@ static bool postcopy_preempt_active(void)
     return migrate_postcopy_preempt() && migration_in_postcopy();
 }
 
+/*
+ * With ram-fd-passing, the memory of a shared RAMBlock with a file
+ * descriptor is not sent, its file descriptor is.
+ */
+static bool ram_block_passes_fd(RAMBlock *block)
+{
+    return migrate_ram_fd_passing() && qemu_ram_is_shared(block) &&
+           qemu_ram_get_fd(block) >= 0;
+}
+
 bool migrate_ram_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
            (migrate_ignore_shared() && qemu_ram_is_shared(block)
-                                    && qemu_ram_is_named_file(block));
+                                    && qemu_ram_is_named_file(block)) ||
+           ram_block_passes_fd(block);
 }
 
 #undef RAMBLOCK_FOREACH
@@ -351,6 +378,93 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/* A range of a RAMBlock whose dirty bitmap is synced by one thread */
+typedef struct RAMSyncRange {
+    RAMBlock *rb;
+    ram_addr_t start;
+    ram_addr_t length;
+} RAMSyncRange;
+
+typedef enum {
+    /* Sync the dirty bitmap of the range */
+    RAM_SYNC_OP_SYNC,
+    /* Copy the dirty pages of the range from the COLO cache to the guest */
+    RAM_SYNC_OP_COLO_FLUSH,
+    /* Copy the whole range from the guest to the COLO cache */
+    RAM_SYNC_OP_COLO_FILL,
+} RAMSyncOp;
+
+/*
+ * Helper threads that sync the dirty bitmap of large guests together with
+ * the migration thread.  Every sync, the RAMBlocks are split into ranges
+ * of RAM_SYNC_RANGE_SIZE bytes which all threads pick from @next until
+ * none is left.  On the COLO secondary, the same threads copy the RAM
+ * cache from and to the guest.
+ */
+typedef struct RAMSyncThreads {
+    int nr_threads;
+    QemuThread *threads;
+    /* Posted once per helper thread to start a sync, or to quit */
+    QemuSemaphore sem_start;
+    /* Posted by each helper thread when it has no more ranges to sync */
+    QemuSemaphore sem_done;
+    bool quit;
+    RAMSyncRange *ranges;
+    unsigned int nr_ranges;
+    unsigned int ranges_size;
+    /* What to do with the ranges */
+    RAMSyncOp op;
+    /* Index of the next range to sync, atomically incremented */
+    unsigned int next;
+    /* New dirty pages found, or pages flushed, by all threads */
+    uint64_t pages;
+} RAMSyncThreads;
+
+/* A write fault of the guest left to the migration thread */
+typedef struct RAMWPFault {
+    RAMBlock *rb;
+    ram_addr_t offset;
+
+    QSIMPLEQ_ENTRY(RAMWPFault) next;
+} RAMWPFault;
+
+/* A page that a write fault thread copied aside before un-protecting it */
+typedef struct RAMWPBouncePage {
+    RAMBlock *rb;
+    ram_addr_t offset;
+    /* Index of the copy in RAMWPFaultThreads.pool */
+    unsigned int slot;
+} RAMWPBouncePage;
+
+/*
+ * Threads handling the write faults of the guest during a background
+ * snapshot.  A thread that takes the dirty bit of the faulting page from
+ * the migration thread copies the page into a slot of @pool and releases
+ * its protection right away; the migration thread saves the copy later.
+ * The faults that cannot be handled that way are queued in @faults, and
+ * the migration thread handles them as it does without these threads.
+ */
+typedef struct RAMWPFaultThreads {
+    int nr_threads;
+    QemuThread *threads;
+    int uffd_fd;
+    /* Set, and never reset, to make all the threads quit */
+    EventNotifier quit_notifier;
+    bool quit;
+    /* Protects all the fields below */
+    QemuMutex lock;
+    /* RAM_WP_BOUNCE_PAGES copies of target pages */
+    uint8_t *pool;
+    unsigned int *free_slots;
+    unsigned int nr_free;
+    /* Pages copied aside and not saved yet */
+    RAMWPBouncePage *bounced;
+    unsigned int nr_bounced;
+    /* Pages taken from the dirty bitmap and not in @bounced yet */
+    unsigned int nr_copying;
+    QSIMPLEQ_HEAD(, RAMWPFault) faults;
+} RAMWPFaultThreads;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -360,6 +474,17 @@ struct RAMState {
     PageSearchStatus pss[RAM_CHANNEL_MAX];
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
+    /*
+     * Range of saved pages whose write protection is not released yet,
+     * @wp_release_len is 0 if there is none.
+     */
+    RAMBlock *wp_release_rb;
+    ram_addr_t wp_release_start;
+    ram_addr_t wp_release_len;
+    /* Is the guest waiting for the host page being saved */
+    bool wp_release_now;
+    /* Threads handling the write faults of the guest, NULL if none */
+    RAMWPFaultThreads *wp_threads;
     /* total ram size in bytes */
     uint64_t ram_bytes_total;
     /* Last block that we have visited searching for dirty pages */
@@ -387,6 +512,10 @@ struct RAMState {
     bool xbzrle_started;
     /* Are we on the last stage of migration */
     bool last_stage;
+    /* Are hot regions skipped until a pass over RAM finds no cold page */
+    bool skip_hot_pages;
+    /* Are only the pages dirtied since the previous mapped-ram save sent */
+    bool incremental;
 
     /* total handled target pages at the beginning of period */
     uint64_t target_page_count_prev;
@@ -406,6 +535,11 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /*
+     * The last request in the queue that a vCPU waits on, the prefetch
+     * requests are queued after it
+     */
+    struct RAMSrcPageRequest *last_demand_req;
 
     /*
      * This is only used when postcopy is in recovery phase, to communicate
@@ -414,11 +548,28 @@ struct RAMState {
      * RAM migration.
      */
     unsigned int postcopy_bmap_sync_requested;
+    /* Threads helping with the dirty bitmap sync, NULL if none */
+    RAMSyncThreads *sync_threads;
 };
 typedef struct RAMState RAMState;
 
 static RAMState *ram_state;
 
+/*
+ * Between two migrations with mapped-ram-incremental: once the first one
+ * has written all of RAM to the file, dirty logging is left enabled and
+ * RAMBlock.file_bmap is kept, so that the second one only has to write
+ * the pages dirtied in between.
+ */
+static struct {
+    /* Whether the dirty log has tracked every write since RAM was saved */
+    bool valid;
+    /* ram_list.version when RAM was saved */
+    uint32_t ram_list_version;
+    /* Identifies the save in the headers of the RAM blocks in the file */
+    uint64_t save_id;
+} ram_incremental;
+
 static NotifierWithReturnList precopy_notifier_list;
 
 /* Whether postcopy has queued requests? */
@@ -698,6 +849,28 @@ static int save_xbzrle_page(RAMState *rs, PageSearchStatus *pss,
     return 1;
 }
 
+/*
+ * With the defer-hot-pages capability, guest RAM is cut into regions of
+ * this many target pages (as a power of two) to track how often each
+ * region gets dirtied.
+ */
+#define RAM_HEAT_REGION_SHIFT   9
+
+/* A region that was dirty in each of the last two syncs is hot */
+#define RAM_HEAT_HOT            0xc0
+
+static unsigned long ramblock_heat_regions(RAMBlock *rb)
+{
+    return DIV_ROUND_UP(rb->max_length >> TARGET_PAGE_BITS,
+                        1UL << RAM_HEAT_REGION_SHIFT);
+}
+
+static bool ramblock_page_is_hot(RAMBlock *rb, unsigned long page)
+{
+    return (rb->dirty_heat[page >> RAM_HEAT_REGION_SHIFT] & RAM_HEAT_HOT) ==
+           RAM_HEAT_HOT;
+}
+
 /**
  * pss_find_next_dirty: find the next dirty page of current ramblock
  *
@@ -733,17 +906,42 @@ static void pss_find_next_dirty(PageSearchStatus *pss)
     pss->page = find_next_bit(bitmap, size, pss->page);
 }
 
-static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
-                                                       unsigned long page)
+/**
+ * pss_skip_hot_pages: move pss->page past the dirty pages of hot regions
+ *
+ * Leaves pss->page on the next dirty page of a cold region of the current
+ * ramblock, or at the end of the ramblock when there is none.  The pages
+ * skipped are counted in mig_stats.deferred_pages.
+ *
+ * @pss: the current page search status
+ */
+static void pss_skip_hot_pages(PageSearchStatus *pss)
 {
-    uint8_t shift;
-    hwaddr size, start;
+    RAMBlock *rb = pss->block;
+    unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
 
-    if (!rb->clear_bmap || !clear_bmap_test_and_clear(rb, page)) {
-        return;
+    while (pss->page < size && ramblock_page_is_hot(rb, pss->page)) {
+        unsigned long next = MIN(ROUND_UP(pss->page + 1,
+                                          1UL << RAM_HEAT_REGION_SHIFT),
+                                 size);
+
+        stat64_add(&mig_stats.deferred_pages,
+                   bitmap_count_one_with_offset(rb->bmap, pss->page,
+                                                next - pss->page));
+        pss->page = find_next_bit(rb->bmap, size, next);
     }
+}
+
+/*
+ * Clear the dirty bitmap of the memory region for the clear_bmap chunk
+ * that holds @page, once its bit in clear_bmap was cleared.
+ */
+static void migration_clear_memory_region_chunk(RAMBlock *rb,
+                                                unsigned long page)
+{
+    uint8_t shift = rb->clear_bmap_shift;
+    hwaddr size, start;
 
-    shift = rb->clear_bmap_shift;
     /*
      * CLEAR_BITMAP_SHIFT_MIN should always guarantee this... this
      * can make things easier sometimes since then start address
@@ -760,6 +958,14 @@ static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
     memory_region_clear_dirty_bitmap(rb->mr, start, size);
 }
 
+static void migration_clear_memory_region_dirty_bitmap(RAMBlock *rb,
+                                                       unsigned long page)
+{
+    if (rb->clear_bmap && clear_bmap_test_and_clear(rb, page)) {
+        migration_clear_memory_region_chunk(rb, page);
+    }
+}
+
 static void
 migration_clear_memory_region_dirty_bitmap_range(RAMBlock *rb,
                                                  unsigned long start,
@@ -778,41 +984,6 @@ migration_clear_memory_region_dirty_bitmap_range(RAMBlock *rb,
     }
 }
 
-/*
- * colo_bitmap_find_diry:find contiguous dirty pages from start
- *
- * Returns the page offset within memory region of the start of the contiguout
- * dirty page
- *
- * @rs: current RAM state
- * @rb: RAMBlock where to search for dirty pages
- * @start: page where we start the search
- * @num: the number of contiguous dirty pages
- */
-static inline
-unsigned long colo_bitmap_find_dirty(RAMState *rs, RAMBlock *rb,
-                                     unsigned long start, unsigned long *num)
-{
-    unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
-    unsigned long *bitmap = rb->bmap;
-    unsigned long first, next;
-
-    *num = 0;
-
-    if (migrate_ram_is_ignored(rb)) {
-        return size;
-    }
-
-    first = find_next_bit(bitmap, size, start);
-    if (first >= size) {
-        return first;
-    }
-    next = find_next_zero_bit(bitmap, size, first + 1);
-    assert(next >= first);
-    *num = next - first;
-    return first;
-}
-
 static inline bool migration_bitmap_clear_dirty(RAMState *rs,
                                                 RAMBlock *rb,
                                                 unsigned long page)
@@ -829,7 +1000,12 @@ static inline bool migration_bitmap_clear_dirty(RAMState *rs,
      */
     migration_clear_memory_region_dirty_bitmap(rb, page);
 
-    ret = test_and_clear_bit(page, rb->bmap);
+    if (rs->wp_threads) {
+        /* The write fault threads take pages from the bitmap too */
+        ret = bitmap_test_and_clear_atomic(rb->bmap, page, 1);
+    } else {
+        ret = test_and_clear_bit(page, rb->bmap);
+    }
     if (ret) {
         rs->migration_dirty_pages--;
     }
@@ -857,6 +1033,10 @@ static void dirty_bitmap_clear_section(MemoryRegionSection *section,
     }
     *cleared_bits += bitmap_count_one_with_offset(rb->bmap, start, npages);
     bitmap_clear(rb->bmap, start, npages);
+    /* A previous incremental save may have found them plugged */
+    if (rb->file_bmap) {
+        bitmap_clear(rb->file_bmap, start, npages);
+    }
 }
 
 /*
@@ -912,6 +1092,34 @@ bool ramblock_page_is_discarded(RAMBlock *rb, ram_addr_t start)
     return false;
 }
 
+/*
+ * Record which regions of @rb are dirty after a sync.  Nearly all pages
+ * were sent before the sync, so a dirty region is one that the guest
+ * wrote to since then.
+ *
+ * Called with bitmap_mutex held and within an RCU critical section.
+ */
+static void ramblock_update_dirty_heat(RAMBlock *rb)
+{
+    unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
+    unsigned long region_pages = 1UL << RAM_HEAT_REGION_SHIFT;
+    unsigned long hot = 0;
+    unsigned long i;
+
+    for (i = 0; (i << RAM_HEAT_REGION_SHIFT) < pages; i++) {
+        unsigned long start = i << RAM_HEAT_REGION_SHIFT;
+        unsigned long end = MIN(start + region_pages, pages);
+        bool dirty = find_next_bit(rb->bmap, end, start) < end;
+
+        rb->dirty_heat[i] = (rb->dirty_heat[i] >> 1) | (dirty ? 0x80 : 0);
+        if ((rb->dirty_heat[i] & RAM_HEAT_HOT) == RAM_HEAT_HOT) {
+            hot++;
+        }
+    }
+
+    trace_ramblock_update_dirty_heat(rb->idstr, hot, i);
+}
+
 /* Called with RCU critical section */
 static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
 {
@@ -922,6 +1130,269 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Size of the ranges that are synced in parallel.  It is a multiple of the
+ * guest RAM covered by a bitmap word, so that no two threads ever touch
+ * the same word of rb->bmap and cpu_physical_memory_sync_dirty_bitmap()
+ * can take its fast path whenever the RAMBlock itself is suitably aligned.
+ * The clear_bmap is updated atomically and needs no such care.
+ */
+#define RAM_SYNC_RANGE_SIZE     ((ram_addr_t)1 * GiB)
+
+/*
+ * Size of the ranges of the COLO cache copied in parallel.  Checkpoints
+ * dirty few pages compared to the RAM size, so smaller ranges spread them
+ * better among the threads.  Still a multiple of a bitmap word.
+ */
+#define RAM_COLO_RANGE_SIZE     ((ram_addr_t)64 * MiB)
+
+/* Maximum number of helper threads used to sync the dirty bitmap */
+#define RAM_SYNC_THREADS_MAX    15
+
+/*
+ * Copy the dirty pages of a range of the COLO cache into the guest RAM,
+ * and clear them in the dirty bitmap.  Returns the number of pages copied.
+ */
+static uint64_t colo_flush_range(RAMBlock *rb, ram_addr_t start,
+                                 ram_addr_t length)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = (start + length) >> TARGET_PAGE_BITS;
+    uint64_t pages = 0;
+
+    while ((page = find_next_bit(rb->bmap, end, page)) < end) {
+        unsigned long next = find_next_zero_bit(rb->bmap, end, page);
+        ram_addr_t offset = (ram_addr_t)page << TARGET_PAGE_BITS;
+
+        bitmap_clear(rb->bmap, page, next - page);
+        memcpy(rb->host + offset, rb->colo_cache + offset,
+               (ram_addr_t)(next - page) << TARGET_PAGE_BITS);
+        pages += next - page;
+        page = next;
+    }
+
+    return pages;
+}
+
+static uint64_t ram_sync_range(RAMSyncOp op, RAMBlock *rb,
+                               ram_addr_t start, ram_addr_t length)
+{
+    switch (op) {
+    case RAM_SYNC_OP_SYNC:
+        return cpu_physical_memory_sync_dirty_bitmap(rb, start, length);
+    case RAM_SYNC_OP_COLO_FLUSH:
+        return colo_flush_range(rb, start, length);
+    case RAM_SYNC_OP_COLO_FILL:
+        memcpy(rb->colo_cache + start, rb->host + start, length);
+        return 0;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static void ram_sync_ranges(RAMSyncThreads *st)
+{
+    uint64_t pages = 0;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&st->next)) < st->nr_ranges) {
+        RAMSyncRange *range = &st->ranges[i];
+
+        pages += ram_sync_range(st->op, range->rb, range->start,
+                                range->length);
+    }
+
+    qatomic_add(&st->pages, pages);
+}
+
+static void *ram_sync_thread(void *opaque)
+{
+    RAMSyncThreads *st = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&st->sem_start);
+        if (qatomic_read(&st->quit)) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            ram_sync_ranges(st);
+        }
+        qemu_sem_post(&st->sem_done);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/*
+ * @colo: the threads serve the COLO secondary.  Its checkpoints wait for
+ * the RAM cache to be flushed, so the threads pay off on any guest size.
+ */
+static void ram_sync_threads_create(RAMState *rs, bool colo)
+{
+    MigrationState *ms = migrate_get_current();
+    RAMSyncThreads *st;
+    int nr_threads, i;
+
+    if (!migrate_multifd() ||
+        (!colo && rs->ram_bytes_total < ms->bitmap_sync_parallel_min)) {
+        return;
+    }
+
+    /* The migration (or COLO) thread takes part in the sync too */
+    nr_threads = MIN(migrate_multifd_channels() - 1, RAM_SYNC_THREADS_MAX);
+    if (nr_threads <= 0) {
+        return;
+    }
+
+    st = g_new0(RAMSyncThreads, 1);
+    st->nr_threads = nr_threads;
+    st->threads = g_new0(QemuThread, nr_threads);
+    qemu_sem_init(&st->sem_start, 0);
+    qemu_sem_init(&st->sem_done, 0);
+
+    for (i = 0; i < nr_threads; i++) {
+        g_autofree char *name =
+            g_strdup_printf(colo ? MIGRATION_THREAD_DST_SYNC :
+                            MIGRATION_THREAD_SRC_SYNC, i);
+
+        qemu_thread_create(&st->threads[i], name, ram_sync_thread, st,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    rs->sync_threads = st;
+}
+
+static void ram_sync_threads_destroy(RAMState *rs)
+{
+    RAMSyncThreads *st = rs->sync_threads;
+    int i;
+
+    if (!st) {
+        return;
+    }
+
+    qatomic_set(&st->quit, true);
+    for (i = 0; i < st->nr_threads; i++) {
+        qemu_sem_post(&st->sem_start);
+    }
+    for (i = 0; i < st->nr_threads; i++) {
+        qemu_thread_join(&st->threads[i]);
+    }
+
+    qemu_sem_destroy(&st->sem_start);
+    qemu_sem_destroy(&st->sem_done);
+    g_free(st->threads);
+    g_free(st->ranges);
+    g_free(st);
+    rs->sync_threads = NULL;
+}
+
+static void ram_sync_add_range(RAMSyncThreads *st, RAMBlock *rb,
+                               ram_addr_t start, ram_addr_t length)
+{
+    if (st->nr_ranges == st->ranges_size) {
+        st->ranges_size = MAX(st->ranges_size * 2, 64);
+        st->ranges = g_renew(RAMSyncRange, st->ranges, st->ranges_size);
+    }
+
+    st->ranges[st->nr_ranges++] = (RAMSyncRange) {
+        .rb = rb,
+        .start = start,
+        .length = length,
+    };
+}
+
+/*
+ * Apply @op to all RAMBlocks, split into ranges of @range_size bytes,
+ * together with the sync threads.  Returns the sum of what @op returned
+ * for each range.
+ *
+ * Called within an RCU critical section, which keeps the RAMBlocks alive
+ * until the helper threads are done with them.
+ */
+static uint64_t ram_sync_threads_run(RAMSyncThreads *st, RAMSyncOp op,
+                                     ram_addr_t range_size)
+{
+    RAMBlock *block;
+    int i;
+
+    st->nr_ranges = 0;
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start;
+
+        for (start = 0; start < block->used_length; start += range_size) {
+            ram_sync_add_range(st, block, start,
+                               MIN(range_size, block->used_length - start));
+        }
+    }
+
+    trace_ram_sync_threads_run(op, st->nr_ranges, st->nr_threads);
+
+    st->op = op;
+    qatomic_set(&st->next, 0);
+    qatomic_set(&st->pages, 0);
+    for (i = 0; i < st->nr_threads; i++) {
+        qemu_sem_post(&st->sem_start);
+    }
+
+    ram_sync_ranges(st);
+
+    for (i = 0; i < st->nr_threads; i++) {
+        qemu_sem_wait(&st->sem_done);
+    }
+
+    return st->pages;
+}
+
+/*
+ * Sync the dirty bitmap of all RAMBlocks, splitting the work among the
+ * sync threads if there are any.
+ *
+ * Called with bitmap_mutex held and within an RCU critical section.
+ */
+static void ramblock_sync_dirty_bitmap_all(RAMState *rs)
+{
+    RAMBlock *block;
+    uint64_t new_dirty_pages;
+
+    if (!rs->sync_threads) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    new_dirty_pages = ram_sync_threads_run(rs->sync_threads, RAM_SYNC_OP_SYNC,
+                                           RAM_SYNC_RANGE_SIZE);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
+/*
+ * Apply @op to the whole COLO RAM cache, splitting the work among the
+ * sync threads if there are any.  Returns the number of pages flushed.
+ *
+ * Called within an RCU critical section.
+ */
+static uint64_t colo_ram_cache_run(RAMState *rs, RAMSyncOp op)
+{
+    RAMBlock *block;
+    uint64_t pages = 0;
+
+    if (rs->sync_threads) {
+        return ram_sync_threads_run(rs->sync_threads, op,
+                                    RAM_COLO_RANGE_SIZE);
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        pages += ram_sync_range(op, block, 0, block->used_length);
+    }
+    return pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -947,7 +1418,9 @@ uint64_t ram_get_total_transferred_pages(void)
 {
     return stat64_get(&mig_stats.normal_pages) +
         stat64_get(&mig_stats.zero_pages) +
-        xbzrle_counters.pages;
+        stat64_get(&mig_stats.dedup_pages) +
+        /* multifd counts its xbzrle pages as normal pages */
+        (migrate_xbzrle() ? xbzrle_counters.pages : 0);
 }
 
 static void migration_update_rates(RAMState *rs, int64_t end_time)
@@ -963,7 +1436,11 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
         return;
     }
 
-    if (migrate_xbzrle()) {
+    if (multifd_xbzrle_enabled()) {
+        multifd_xbzrle_get_counters(&xbzrle_counters);
+    }
+
+    if (migrate_xbzrle() || multifd_xbzrle_enabled()) {
         double encoded_size, unencoded_size;
 
         xbzrle_counters.cache_miss_rate = (double)(xbzrle_counters.cache_miss -
@@ -1013,7 +1490,117 @@ static void migration_dirty_limit_guest(void)
     trace_migration_dirty_limit_guest(quota_dirtyrate);
 }
 
-static void migration_trigger_throttle(RAMState *rs)
+/*
+ * Give each vCPU its share of a total dirty page rate of @budget MB/s,
+ * see dirty_limit_split_budget().
+ *
+ * Every vCPU keeps a quota of at least vcpu-dirty-limit: a quota of 0
+ * would cancel its limit, and with no vCPU limited anymore the dirtylimit
+ * service stops, losing the per-vCPU rates the next round relies on.
+ */
+static void migration_dirty_limit_distribute(uint64_t budget)
+{
+    MigrationState *s = migrate_get_current();
+    MachineState *ms = MACHINE(qdev_get_machine());
+    int nvcpus = ms->smp.max_cpus;
+    g_autoptr(DirtyLimitInfoList) limited = NULL;
+    g_autofree uint64_t *demand = NULL;
+    g_autofree uint64_t *quota = NULL;
+    int i;
+
+    if (!dirtylimit_in_service()) {
+        /* There are no per-vCPU rates yet, start with even quotas */
+        uint64_t even = MAX(budget / nvcpus, s->parameters.vcpu_dirty_limit);
+
+        qmp_set_vcpu_dirty_limit(false, -1, even, NULL);
+        trace_migration_dirty_limit_guest(even);
+        return;
+    }
+
+    demand = g_new(uint64_t, nvcpus);
+    quota = g_new(uint64_t, nvcpus);
+    for (i = 0; i < nvcpus; i++) {
+        demand[i] = vcpu_dirty_rate_get(i);
+    }
+
+    /*
+     * A vCPU that reaches its quota may want to dirty memory faster
+     * still.  Only trust its rate if it stays well below the quota.
+     */
+    limited = qmp_query_vcpu_dirty_limit(NULL);
+    for (DirtyLimitInfoList *l = limited; l; l = l->next) {
+        if (l->value->current_rate * 2 >= l->value->limit_rate) {
+            demand[l->value->cpu_index] = UINT64_MAX;
+        }
+    }
+
+    dirty_limit_split_budget(budget, s->parameters.vcpu_dirty_limit,
+                             demand, nvcpus, quota);
+
+    for (i = 0; i < nvcpus; i++) {
+        trace_migration_dirty_limit_vcpu(i, demand[i], quota[i]);
+        qmp_set_vcpu_dirty_limit(true, i, quota[i], NULL);
+    }
+}
+
+/*
+ * Each iteration sends the memory that is dirty, while the guest dirties
+ * more of it.  With a bandwidth B and a dirty page rate D, the remaining
+ * memory shrinks by D / B every iteration.  Predict how many iterations
+ * it takes to fit it in the downtime limit, and if that is more than
+ * DIRTY_LIMIT_ADAPTIVE_ITERATIONS, limit the dirty page rate so that it
+ * takes just that many.
+ */
+#define DIRTY_LIMIT_ADAPTIVE_ITERATIONS 4
+
+static void migration_dirty_limit_adaptive(uint64_t period_ms,
+                                           uint64_t bytes_xfer_period,
+                                           uint64_t bytes_dirty_period)
+{
+    MigrationState *s = migrate_get_current();
+    double remaining = ram_bytes_remaining();
+    double bandwidth = (double)bytes_xfer_period * 1000 / period_ms;
+    double dirty_rate = (double)bytes_dirty_period * 1000 / period_ms;
+    double target = s->threshold_size;
+    double budget;
+    int iterations;
+
+    if (!target) {
+        target = bandwidth * migrate_downtime_limit() / 1000;
+    }
+    if (!bandwidth || !target) {
+        return;
+    }
+
+    if (remaining <= target) {
+        iterations = 0;
+    } else if (dirty_rate >= bandwidth) {
+        iterations = -1;
+    } else {
+        iterations = ceil(log(remaining / target) /
+                          log(bandwidth / dirty_rate));
+    }
+    trace_migration_dirty_limit_predict(remaining, bandwidth, dirty_rate,
+                                        iterations,
+                                        remaining * dirty_rate / bandwidth /
+                                        bandwidth * 1000);
+
+    if (iterations >= 0 && iterations <= DIRTY_LIMIT_ADAPTIVE_ITERATIONS &&
+        !dirtylimit_in_service()) {
+        return;
+    }
+
+    /*
+     * The dirty page rate that gets to the target in the given number of
+     * iterations.  Once limited, this also loosens the quotas as the
+     * remaining memory shrinks.
+     */
+    budget = bandwidth * pow(target / remaining,
+                             1.0 / DIRTY_LIMIT_ADAPTIVE_ITERATIONS);
+    migration_dirty_limit_distribute(budget / MiB);
+}
+
+static void migration_trigger_throttle(RAMState *rs, int64_t end_time)
 {
     uint64_t threshold = migrate_throttle_trigger_threshold();
     uint64_t bytes_xfer_period =
@@ -1021,6 +1608,12 @@ static void migration_trigger_throttle(RAMState *rs)
     uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
     uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
 
+    if (migrate_dirty_limit() && migrate_dirty_limit_adaptive()) {
+        migration_dirty_limit_adaptive(end_time - rs->time_last_bitmap_sync,
+                                       bytes_xfer_period, bytes_dirty_period);
+        return;
+    }
+
     /*
      * The following detection logic can be refined later. For now:
      * Check to see if the ratio between dirtied bytes and the approx.
@@ -1043,7 +1636,6 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
-    RAMBlock *block;
     int64_t end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
@@ -1057,10 +1649,18 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
-            }
+            ramblock_sync_dirty_bitmap_all(rs);
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
+            /* The first sync finds everything dirty, it tells nothing */
+            if (migrate_defer_hot_pages() &&
+                stat64_get(&mig_stats.dirty_sync_count) > 1) {
+                RAMBlock *block;
+
+                RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                    ramblock_update_dirty_heat(block);
+                }
+                rs->skip_hot_pages = true;
+            }
         }
     }
 
@@ -1071,7 +1671,7 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     /* more than 1 second = 1000 millisecons */
     if (end_time > rs->time_last_bitmap_sync + 1000) {
-        migration_trigger_throttle(rs);
+        migration_trigger_throttle(rs, end_time);
 
         migration_update_rates(rs, end_time);
 
@@ -1308,9 +1908,23 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
 {
     /* Update pss->page for the next dirty bit in ramblock */
     pss_find_next_dirty(pss);
+    if (rs->skip_hot_pages) {
+        pss_skip_hot_pages(pss);
+    }
 
     if (pss->complete_round && pss->block == rs->last_seen_block &&
         pss->page >= rs->last_page) {
+        if (rs->skip_hot_pages) {
+            /*
+             * We've been once around the RAM and only hot pages are left,
+             * go around again to send them.
+             */
+            trace_find_dirty_block_hot_pages();
+            rs->skip_hot_pages = false;
+            pss->complete_round = false;
+            pss->page = rs->last_page;
+            return PAGE_TRY_AGAIN;
+        }
         /*
          * We've been once around the RAM and haven't found anything.
          * Give up.
@@ -1323,6 +1937,11 @@ static int find_dirty_block(RAMState *rs, PageSearchStatus *pss)
         pss->page = 0;
         pss->block = QLIST_NEXT_RCU(pss->block, next);
         if (!pss->block) {
+            /* Do not keep saved pages write protected over the next pass */
+            if (ram_wp_release_flush(rs, pss) < 0) {
+                return -1;
+            }
+
             if (migrate_multifd() &&
                 (!migrate_multifd_flush_after_each_section() ||
                  migrate_mapped_ram())) {
@@ -1392,6 +2011,9 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
     } else {
         memory_region_unref(block->mr);
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
+        if (rs->last_demand_req == entry) {
+            rs->last_demand_req = NULL;
+        }
         g_free(entry);
         migration_consume_urgent_request();
     }
@@ -1400,6 +2022,15 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
 }
 
 #if defined(__linux__)
+/* Saved RAM whose write protection is released at once */
+#define RAM_WP_RELEASE_BATCH    (1 * MiB)
+
+/* Pages that the write fault threads can copy aside at a time */
+#define RAM_WP_BOUNCE_PAGES     256
+
+/* Faults read from the userfaultfd at a time by a write fault thread */
+#define RAM_WP_FAULT_BATCH      16
+
 /**
  * poll_fault_page: try to get next UFFD write fault page and, if pending fault
  *   is found, return RAM block pointer and page offset
@@ -1412,6 +2043,7 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
  */
 static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 {
+    RAMWPFaultThreads *wt = rs->wp_threads;
     struct uffd_msg uffd_msg;
     void *page_address;
     RAMBlock *block;
@@ -1421,6 +2053,26 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
         return NULL;
     }
 
+    if (wt) {
+        RAMWPFault *fault = NULL;
+
+        /* The write fault threads read the faults */
+        WITH_QEMU_LOCK_GUARD(&wt->lock) {
+            fault = QSIMPLEQ_FIRST(&wt->faults);
+            if (fault) {
+                QSIMPLEQ_REMOVE_HEAD(&wt->faults, next);
+            }
+        }
+        if (!fault) {
+            return NULL;
+        }
+        block = fault->rb;
+        *offset = fault->offset;
+        g_free(fault);
+        rs->wp_release_now = true;
+        return block;
+    }
+
     res = uffd_read_events(rs->uffdio_fd, &uffd_msg, 1);
     if (res <= 0) {
         return NULL;
@@ -1429,9 +2081,31 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
     page_address = (void *)(uintptr_t) uffd_msg.arg.pagefault.address;
     block = qemu_ram_block_from_host(page_address, false, offset);
     assert(block && (block->flags & RAM_UF_WRITEPROTECT) != 0);
+    rs->wp_release_now = true;
     return block;
 }
 
+/* Release the write protection of the pending range of saved pages */
+static int ram_wp_release_flush(RAMState *rs, PageSearchStatus *pss)
+{
+    int res;
+
+    if (!rs->wp_release_len) {
+        return 0;
+    }
+
+    /* Flush async buffers before un-protect. */
+    qemu_fflush(pss->pss_channel);
+    trace_ram_wp_release(rs->wp_release_rb->idstr, rs->wp_release_start,
+                         rs->wp_release_len);
+    res = uffd_change_protection(rs->uffdio_fd,
+                                 rs->wp_release_rb->host +
+                                 rs->wp_release_start,
+                                 rs->wp_release_len, false, false);
+    rs->wp_release_len = 0;
+    return res;
+}
+
 /**
  * ram_save_release_protection: release UFFD write protection after
  *   a range of pages has been saved
@@ -1445,19 +2119,37 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
 static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
         unsigned long start_page)
 {
+    ram_addr_t start = (ram_addr_t)start_page << TARGET_PAGE_BITS;
+    ram_addr_t length = (pss->page - start_page) << TARGET_PAGE_BITS;
     int res = 0;
 
     /* Check if page is from UFFD-managed region. */
-    if (pss->block->flags & RAM_UF_WRITEPROTECT) {
-        void *page_address = pss->block->host + (start_page << TARGET_PAGE_BITS);
-        uint64_t run_length = (pss->page - start_page) << TARGET_PAGE_BITS;
+    if (!(pss->block->flags & RAM_UF_WRITEPROTECT)) {
+        return 0;
+    }
 
-        /* Flush async buffers before un-protect. */
-        qemu_fflush(pss->pss_channel);
-        /* Un-protect memory range. */
-        res = uffd_change_protection(rs->uffdio_fd, page_address, run_length,
-                false, false);
+    /*
+     * Each release costs a flush of the stream and an ioctl, so the
+     * ranges saved one after the other are released together.  A range
+     * that the guest waits for is released right away, together with
+     * the pending one.
+     */
+    if (rs->wp_release_len &&
+        (rs->wp_release_rb != pss->block ||
+         rs->wp_release_start + rs->wp_release_len != start)) {
+        res = ram_wp_release_flush(rs, pss);
+    }
+    if (!rs->wp_release_len) {
+        rs->wp_release_rb = pss->block;
+        rs->wp_release_start = start;
+    }
+    rs->wp_release_len += length;
+
+    if (!res && (rs->wp_release_now ||
+                 rs->wp_release_len >= RAM_WP_RELEASE_BATCH)) {
+        res = ram_wp_release_flush(rs, pss);
     }
+    rs->wp_release_now = false;
 
     return res;
 }
@@ -1646,6 +2338,191 @@ static int ram_block_uffd_protect(RAMBlock *rb, int uffd_fd)
                                   rb->used_length, true, false);
 }
 
+/*
+ * Handle a write fault of the guest from a write fault thread.
+ * Called within an RCU critical section.
+ */
+static void ram_wp_fault(RAMWPFaultThreads *wt, void *page_address)
+{
+    RAMBlock *rb;
+    ram_addr_t offset;
+    unsigned int slot = 0;
+    bool bounce = false;
+    RAMWPFault *fault;
+
+    rb = qemu_ram_block_from_host(page_address, false, &offset);
+    assert(rb && (rb->flags & RAM_UF_WRITEPROTECT) != 0);
+    offset = (offset >> TARGET_PAGE_BITS) << TARGET_PAGE_BITS;
+
+    /* Huge pages are too large to copy aside */
+    if (rb->page_size == TARGET_PAGE_SIZE) {
+        WITH_QEMU_LOCK_GUARD(&wt->lock) {
+            if (wt->nr_free) {
+                slot = wt->free_slots[--wt->nr_free];
+                wt->nr_copying++;
+                bounce = true;
+            }
+        }
+    }
+
+    /*
+     * Whoever clears the dirty bit saves the page.  If the migration
+     * thread did, it may still be reading the page, and releases the
+     * protection itself once it is done.
+     */
+    if (bounce && !bitmap_test_and_clear_atomic(rb->bmap,
+                                                offset >> TARGET_PAGE_BITS,
+                                                1)) {
+        WITH_QEMU_LOCK_GUARD(&wt->lock) {
+            wt->free_slots[wt->nr_free++] = slot;
+            wt->nr_copying--;
+        }
+        bounce = false;
+    }
+
+    if (!bounce) {
+        trace_ram_wp_fault_queued(rb->idstr, offset);
+        fault = g_new(RAMWPFault, 1);
+        fault->rb = rb;
+        fault->offset = offset;
+        WITH_QEMU_LOCK_GUARD(&wt->lock) {
+            QSIMPLEQ_INSERT_TAIL(&wt->faults, fault, next);
+        }
+        return;
+    }
+
+    memcpy(wt->pool + (size_t)slot * TARGET_PAGE_SIZE, rb->host + offset,
+           TARGET_PAGE_SIZE);
+    WITH_QEMU_LOCK_GUARD(&wt->lock) {
+        wt->bounced[wt->nr_bounced++] = (RAMWPBouncePage) {
+            .rb = rb,
+            .offset = offset,
+            .slot = slot,
+        };
+        wt->nr_copying--;
+    }
+
+    trace_ram_wp_fault_bounced(rb->idstr, offset);
+    uffd_change_protection(wt->uffd_fd, rb->host + offset, TARGET_PAGE_SIZE,
+                           false, false);
+}
+
+static void *ram_wp_fault_thread(void *opaque)
+{
+    RAMWPFaultThreads *wt = opaque;
+    struct pollfd pfd[2] = {
+        { .fd = wt->uffd_fd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&wt->quit_notifier), .events = POLLIN },
+    };
+    struct uffd_msg msgs[RAM_WP_FAULT_BATCH];
+
+    rcu_register_thread();
+
+    while (!qatomic_read(&wt->quit)) {
+        int nr_msgs, i;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        /* Another thread may have read the faults already */
+        nr_msgs = uffd_read_events(wt->uffd_fd, msgs, ARRAY_SIZE(msgs));
+        if (nr_msgs < 0) {
+            break;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (i = 0; i < nr_msgs; i++) {
+                if (msgs[i].event != UFFD_EVENT_PAGEFAULT) {
+                    continue;
+                }
+                ram_wp_fault(wt, (void *)(uintptr_t)
+                             msgs[i].arg.pagefault.address);
+            }
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void ram_wp_fault_threads_create(RAMState *rs)
+{
+    int nr_threads = migrate_background_snapshot_threads();
+    RAMWPFaultThreads *wt;
+    int i;
+
+    if (!nr_threads) {
+        return;
+    }
+
+    wt = g_new0(RAMWPFaultThreads, 1);
+    if (event_notifier_init(&wt->quit_notifier, false) < 0) {
+        error_report("%s: failed to create the quit notifier, the migration "
+                     "thread handles the write faults", __func__);
+        g_free(wt);
+        return;
+    }
+    wt->nr_threads = nr_threads;
+    wt->threads = g_new0(QemuThread, nr_threads);
+    wt->uffd_fd = rs->uffdio_fd;
+    qemu_mutex_init(&wt->lock);
+    wt->pool = qemu_memalign(qemu_real_host_page_size(),
+                             RAM_WP_BOUNCE_PAGES * TARGET_PAGE_SIZE);
+    wt->free_slots = g_new(unsigned int, RAM_WP_BOUNCE_PAGES);
+    for (i = 0; i < RAM_WP_BOUNCE_PAGES; i++) {
+        wt->free_slots[i] = i;
+    }
+    wt->nr_free = RAM_WP_BOUNCE_PAGES;
+    wt->bounced = g_new(RAMWPBouncePage, RAM_WP_BOUNCE_PAGES);
+    QSIMPLEQ_INIT(&wt->faults);
+
+    /* From now on, only these threads read the faults */
+    rs->wp_threads = wt;
+
+    for (i = 0; i < nr_threads; i++) {
+        g_autofree char *name = g_strdup_printf(MIGRATION_THREAD_SNAPSHOT_FAULT,
+                                                i);
+
+        qemu_thread_create(&wt->threads[i], name, ram_wp_fault_thread, wt,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void ram_wp_fault_threads_destroy(RAMState *rs)
+{
+    RAMWPFaultThreads *wt = rs->wp_threads;
+    RAMWPFault *fault, *next;
+    int i;
+
+    if (!wt) {
+        return;
+    }
+
+    qatomic_set(&wt->quit, true);
+    event_notifier_set(&wt->quit_notifier);
+    for (i = 0; i < wt->nr_threads; i++) {
+        qemu_thread_join(&wt->threads[i]);
+    }
+
+    /* The pages are all saved unless the snapshot failed */
+    QSIMPLEQ_FOREACH_SAFE(fault, &wt->faults, next, next) {
+        g_free(fault);
+    }
+    event_notifier_cleanup(&wt->quit_notifier);
+    qemu_mutex_destroy(&wt->lock);
+    qemu_vfree(wt->pool);
+    g_free(wt->free_slots);
+    g_free(wt->bounced);
+    g_free(wt->threads);
+    g_free(wt);
+    rs->wp_threads = NULL;
+}
+
 /*
  * ram_write_tracking_start: start UFFD-WP memory tracking
  *
@@ -1689,6 +2566,7 @@ int ram_write_tracking_start(void)
                 block->host, block->max_length);
     }
 
+    ram_wp_fault_threads_create(rs);
     return 0;
 
 fail:
@@ -1717,6 +2595,8 @@ void ram_write_tracking_stop(void)
     RAMState *rs = ram_state;
     RAMBlock *block;
 
+    ram_wp_fault_threads_destroy(rs);
+
     RCU_READ_LOCK_GUARD();
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
@@ -1749,6 +2629,14 @@ static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
     return NULL;
 }
 
+static int ram_wp_release_flush(RAMState *rs, PageSearchStatus *pss)
+{
+    (void) rs;
+    (void) pss;
+
+    return 0;
+}
+
 static int ram_save_release_protection(RAMState *rs, PageSearchStatus *pss,
         unsigned long start_page)
 {
@@ -1866,6 +2754,39 @@ static void migration_page_queue_free(RAMState *rs)
         QSIMPLEQ_REMOVE_HEAD(&rs->src_page_requests, next_req);
         g_free(mspr);
     }
+    rs->last_demand_req = NULL;
+}
+
+/*
+ * Queue @len bytes at @start of @ramblock for the migration thread.  With
+ * @demand, a vCPU is waiting on the pages, so they go before the pages
+ * the destination only asked for ahead of time.
+ */
+static void ram_save_queue_request(RAMState *rs, RAMBlock *ramblock,
+                                   ram_addr_t start, ram_addr_t len,
+                                   bool demand)
+{
+    struct RAMSrcPageRequest *new_entry =
+        g_new0(struct RAMSrcPageRequest, 1);
+    new_entry->rb = ramblock;
+    new_entry->offset = start;
+    new_entry->len = len;
+
+    memory_region_ref(ramblock->mr);
+    qemu_mutex_lock(&rs->src_page_req_mutex);
+    if (!demand) {
+        QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
+    } else {
+        if (rs->last_demand_req) {
+            QSIMPLEQ_INSERT_AFTER(&rs->src_page_requests, rs->last_demand_req,
+                                  new_entry, next_req);
+        } else {
+            QSIMPLEQ_INSERT_HEAD(&rs->src_page_requests, new_entry, next_req);
+        }
+        rs->last_demand_req = new_entry;
+    }
+    migration_make_urgent_request();
+    qemu_mutex_unlock(&rs->src_page_req_mutex);
 }
 
 /**
@@ -1946,6 +2867,18 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
          * assert; if something wrong we're mostly split brain anyway.
          */
         assert(len % page_size == 0);
+
+        /*
+         * Only the first host page can be the one a vCPU faulted on.  Leave
+         * the others to the migration thread rather than holding up the
+         * next fault request behind them.
+         */
+        if (len > page_size) {
+            ram_save_queue_request(rs, ramblock, start + page_size,
+                                   len - page_size, false);
+            len = page_size;
+        }
+
         while (len) {
             if (ram_save_host_page_urgent(pss)) {
                 error_setg(errp, "ram_save_host_page_urgent() failed: "
@@ -1959,9 +2892,7 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
              * will automatically be moved and point to the next host page
              * we're going to send, so no need to update here.
              *
-             * Normally QEMU never sends >1 host page in requests, so
-             * logically we don't even need that as the loop should only
-             * run once, but just to be consistent.
+             * The loop only runs once, but just to be consistent.
              */
             len -= page_size;
         };
@@ -1970,18 +2901,65 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
         return ret;
     }
 
-    struct RAMSrcPageRequest *new_entry =
-        g_new0(struct RAMSrcPageRequest, 1);
-    new_entry->rb = ramblock;
-    new_entry->offset = start;
-    new_entry->len = len;
+    ram_save_queue_request(rs, ramblock, start, len, true);
+    return 0;
+}
 
-    memory_region_ref(ramblock->mr);
-    qemu_mutex_lock(&rs->src_page_req_mutex);
-    QSIMPLEQ_INSERT_TAIL(&rs->src_page_requests, new_entry, next_req);
-    migration_make_urgent_request();
-    qemu_mutex_unlock(&rs->src_page_req_mutex);
+/**
+ * ram_save_queue_prefetch_pages: queue pages the destination predicts it
+ * will fault on
+ *
+ * The pages are sent by the migration thread after the pages that vCPUs
+ * are waiting on, even with postcopy preempt.
+ *
+ * Returns zero on success or negative on error
+ *
+ * @rbname: Name of the RAMBlock of the request
+ * @start: address of the first host page from the start of the RAMBlock
+ * @stride: distance between the host pages, in bytes
+ * @count: number of host pages
+ */
+int ram_save_queue_prefetch_pages(const char *rbname, ram_addr_t start,
+                                  uint32_t stride, uint32_t count,
+                                  Error **errp)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *ramblock;
+    size_t page_size;
+    uint32_t i;
+
+    RCU_READ_LOCK_GUARD();
+
+    ramblock = qemu_ram_block_by_name(rbname);
+    if (!ramblock) {
+        error_setg(errp, "MIG_RP_MSG_PREFETCH_PAGES has no block '%s'",
+                   rbname);
+        return -1;
+    }
+
+    page_size = qemu_ram_pagesize(ramblock);
+    if (!count || start % page_size || stride % page_size ||
+        !offset_in_ramblock(ramblock, start + (uint64_t)(count - 1) * stride +
+                                      page_size - 1)) {
+        error_setg(errp, "MIG_RP_MSG_PREFETCH_PAGES invalid request, "
+                   "start=" RAM_ADDR_FMT " stride=%" PRIu32 " count=%" PRIu32
+                   " blocklen=" RAM_ADDR_FMT,
+                   start, stride, count, ramblock->used_length);
+        return -1;
+    }
 
+    trace_ram_save_queue_prefetch_pages(ramblock->idstr, start, stride,
+                                        count);
+    if (stride == page_size) {
+        ram_save_queue_request(rs, ramblock, start,
+                               (ram_addr_t)count * page_size, false);
+    } else {
+        for (i = 0; i < count; i++) {
+            ram_save_queue_request(rs, ramblock,
+                                   start + (ram_addr_t)i * stride,
+                                   page_size, false);
+        }
+    }
     return 0;
 }
 
@@ -2208,18 +3186,73 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
             tmppages = 0;
         }
 
-        if (tmppages < 0) {
-            pss_host_page_finish(pss);
-            return tmppages;
-        }
+        if (tmppages < 0) {
+            pss_host_page_finish(pss);
+            return tmppages;
+        }
+
+        pss_find_next_dirty(pss);
+    } while (pss_within_range(pss));
+
+    pss_host_page_finish(pss);
+
+    res = ram_save_release_protection(rs, pss, start_page);
+    return (res < 0 ? res : pages);
+}
+
+/*
+ * Save one of the pages that the write fault threads copied aside.
+ *
+ * Returns the number of pages saved, 0 if there was none to save.
+ *
+ * Called with the bitmap_mutex held.
+ */
+static int ram_save_bounced_page(RAMState *rs, PageSearchStatus *pss)
+{
+    RAMWPFaultThreads *wt = rs->wp_threads;
+    RAMWPBouncePage bp;
+    int pages;
+
+    if (!wt) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&wt->lock);
+    if (!wt->nr_bounced) {
+        qemu_mutex_unlock(&wt->lock);
+        return 0;
+    }
+    bp = wt->bounced[--wt->nr_bounced];
+    qemu_mutex_unlock(&wt->lock);
 
-        pss_find_next_dirty(pss);
-    } while (pss_within_range(pss));
+    /* Like for a queued page, the background search continues from here */
+    pss->block = bp.rb;
+    pss->page = bp.offset >> TARGET_PAGE_BITS;
+    pss->complete_round = false;
 
-    pss_host_page_finish(pss);
+    /* The page is copied to the stream, so that the slot is free again */
+    pages = save_normal_page(pss, bp.rb, bp.offset,
+                             wt->pool + (size_t)bp.slot * TARGET_PAGE_SIZE,
+                             false);
+    WITH_QEMU_LOCK_GUARD(&wt->lock) {
+        wt->free_slots[wt->nr_free++] = bp.slot;
+    }
+    rs->migration_dirty_pages--;
 
-    res = ram_save_release_protection(rs, pss, start_page);
-    return (res < 0 ? res : pages);
+    return pages;
+}
+
+/* Is a write fault thread still copying a page it took from the bitmap */
+static bool ram_wp_copying(RAMState *rs)
+{
+    RAMWPFaultThreads *wt = rs->wp_threads;
+
+    if (!wt) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&wt->lock);
+    return wt->nr_copying || wt->nr_bounced;
 }
 
 /**
@@ -2260,11 +3293,28 @@ static int ram_find_and_save_block(RAMState *rs)
     pss_init(pss, rs->last_seen_block, rs->last_page);
 
     while (true){
+        pages = ram_save_bounced_page(rs, pss);
+        if (pages) {
+            break;
+        }
         if (!get_queued_page(rs, pss)) {
             /* priority queue empty, so just search for something dirty */
             int res = find_dirty_block(rs, pss);
             if (res != PAGE_DIRTY_FOUND) {
                 if (res == PAGE_ALL_CLEAN) {
+                    /*
+                     * Nothing is left to save for now: the guest must not
+                     * wait for the end of the snapshot to write the pages
+                     * that were saved last.
+                     */
+                    res = ram_wp_release_flush(rs, pss);
+                    if (res < 0) {
+                        pages = res;
+                        break;
+                    }
+                    if (ram_wp_copying(rs)) {
+                        continue;
+                    }
                     break;
                 } else if (res == PAGE_TRY_AGAIN) {
                     continue;
@@ -2286,6 +3336,195 @@ static int ram_find_and_save_block(RAMState *rs)
     return pages;
 }
 
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+/*
+ * Smallest unit of the stripes of guest RAM that the multifd channels scan
+ * by themselves with the multifd-scan capability.
+ */
+#define RAM_STRIPE_UNIT_MIN     (2 * MiB)
+
+/*
+ * Number of pages in a unit of the stripes of @rb.  A unit never shares a
+ * word of the dirty bitmap, a host page or a clear_bmap chunk with another
+ * one, so that each channel can clear the dirty bits of its own units
+ * without taking the bitmap_mutex.  Units do share the words of
+ * clear_bmap, whose bits the channels clear atomically.
+ */
+static unsigned long ram_stripe_unit_pages(RAMBlock *rb)
+{
+    unsigned long pages;
+
+    pages = MAX(RAM_STRIPE_UNIT_MIN, qemu_ram_pagesize(rb)) >> TARGET_PAGE_BITS;
+    pages = ROUND_UP(pages, BITS_PER_LONG);
+    if (rb->clear_bmap) {
+        pages = MAX(pages, 1UL << rb->clear_bmap_shift);
+    }
+
+    return pages;
+}
+
+static bool ram_stripe_should_stop(QEMUFile *f, int64_t deadline)
+{
+    if (f && migration_rate_exceeded(f)) {
+        return true;
+    }
+
+    return deadline && qemu_clock_get_ms(QEMU_CLOCK_REALTIME) > deadline;
+}
+
+/**
+ * ram_save_multifd_stripe: send the dirty pages of a multifd channel's
+ * stripe of guest RAM
+ *
+ * Called by the send thread of channel @p within an RCU critical section,
+ * while the migration thread waits in ram_save_multifd_scan() with the
+ * bitmap_mutex held.  The units of each RAMBlock are handed out to the
+ * channels round-robin, starting from a channel picked by hashing the
+ * name of the RAMBlock, and each channel clears the dirty bits of its own
+ * units only.  A given page is thus always sent by the same channel, so
+ * that the destination can never see two versions of it out of order.
+ *
+ * The scan resumes where the previous one stopped, and goes on until the
+ * end of guest RAM or until ram_stripe_should_stop() says otherwise.
+ *
+ * Returns 0 on success, -1 on error with @errp set.
+ *
+ * @p: multifd channel doing the scan
+ * @f: QEMUFile whose rate limit applies, or NULL
+ * @deadline: realtime clock in ms after which to stop, or 0
+ * @errp: pointer to error object
+ */
+int ram_save_multifd_stripe(MultiFDSendParams *p, QEMUFile *f,
+                            int64_t deadline, Error **errp)
+{
+    MultiFDStripe *st = &p->stripe;
+    uint64_t nr_channels = migrate_multifd_channels();
+    unsigned int i = 0;
+
+    st->pages = 0;
+    st->clean = false;
+
+    if (!st->block) {
+        st->block = QLIST_FIRST_RCU(&ram_list.blocks);
+        st->page = 0;
+        st->round_pages = 0;
+    }
+
+    while (st->block) {
+        RAMBlock *rb = st->block;
+        unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
+        unsigned long unit_pages = ram_stripe_unit_pages(rb);
+        uint64_t base = g_str_hash(rb->idstr);
+
+        if (migrate_ram_is_ignored(rb)) {
+            st->page = size;
+        }
+
+        while (st->page < size) {
+            uint64_t unit = st->page / unit_pages;
+            uint64_t skip = (p->id + nr_channels -
+                             (base + unit) % nr_channels) % nr_channels;
+            unsigned long end;
+
+            if (skip) {
+                /* Jump to the next unit of our own stripe */
+                st->page = MIN((unit + skip) * unit_pages, size);
+                continue;
+            }
+
+            end = MIN((unit + 1) * unit_pages, size);
+            st->page = find_next_bit(rb->bmap, end, st->page);
+            if (st->page >= end) {
+                continue;
+            }
+
+            /* Other channels clear bits in the same word of clear_bmap */
+            if (rb->clear_bmap &&
+                clear_bmap_test_and_clear_atomic(rb, st->page)) {
+                migration_clear_memory_region_chunk(rb, st->page);
+            }
+            clear_bit(st->page, rb->bmap);
+
+            if (multifd_ram_channel_queue_page(p, rb,
+                        (ram_addr_t)st->page << TARGET_PAGE_BITS, errp)) {
+                return -1;
+            }
+            st->page++;
+            st->pages++;
+            st->round_pages++;
+
+            /* Checking the clock is a bit expensive, do it every few pages */
+            if ((++i & 63) == 0 && ram_stripe_should_stop(f, deadline)) {
+                return multifd_ram_channel_flush(p, errp);
+            }
+        }
+
+        st->block = QLIST_NEXT_RCU(rb, next);
+        st->page = 0;
+    }
+
+    /* Reached the end of guest RAM, start over next time */
+    st->clean = !st->round_pages;
+
+    trace_ram_save_multifd_stripe(p->id, st->pages, st->clean);
+
+    return multifd_ram_channel_flush(p, errp);
+}
+
+/**
+ * ram_save_multifd_scan: have the multifd channels find and send the
+ * dirty pages of their stripes of guest RAM
+ *
+ * Called with the bitmap_mutex held and within an RCU critical section.
+ *
+ * Returns 0 if all of guest RAM is clean, 1 if some dirty pages may be
+ * left, or negative on error.
+ *
+ * @rs: current RAM state
+ * @f: QEMUFile where to send the data
+ * @rate_limit: whether to stop at the rate limit and after MAX_WAIT
+ */
+static int ram_save_multifd_scan(RAMState *rs, QEMUFile *f, bool rate_limit)
+{
+    int64_t deadline = 0;
+    int64_t pages;
+    bool clean;
+    int ret;
+
+    if (rate_limit) {
+        deadline = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) + MAX_WAIT;
+    }
+
+    pages = multifd_send_scan(rate_limit ? f : NULL, deadline, &clean);
+    if (pages < 0) {
+        return -1;
+    }
+
+    rs->migration_dirty_pages -= pages;
+    rs->target_page_count += pages;
+
+    if (!clean) {
+        return 1;
+    }
+
+    /*
+     * Same as when find_dirty_block() wraps around: let the destination
+     * know that it has received every page sent so far.
+     */
+    if (!migrate_multifd_flush_after_each_section()) {
+        ret = multifd_ram_flush_and_sync();
+        if (ret < 0) {
+            return ret;
+        }
+
+        qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
+        qemu_fflush(f);
+    }
+
+    return 0;
+}
+
 static uint64_t ram_bytes_total_with_ignored(void)
 {
     RAMBlock *block;
@@ -2326,6 +3565,7 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        ram_sync_threads_destroy(*rsp);
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2359,8 +3599,12 @@ static void ram_bitmaps_destroy(void)
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
-        g_free(block->file_bmap);
-        block->file_bmap = NULL;
+        if (!ram_incremental.valid) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
+        g_free(block->dirty_heat);
+        block->dirty_heat = NULL;
     }
 }
 
@@ -2373,7 +3617,8 @@ static void ram_save_cleanup(void *opaque)
         /* caller have hold BQL or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        if (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) {
+        if ((global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) &&
+            !ram_incremental.valid) {
             /*
              * do not stop dirty log without starting it, since
              * memory_global_dirty_log_stop will assert that
@@ -2404,9 +3649,11 @@ static void ram_state_reset(RAMState *rs)
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_started = false;
-}
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
+    if (migrate_multifd_scan()) {
+        multifd_send_scan_reset();
+    }
+}
 
 /* **** functions for postcopy ***** */
 
@@ -2714,7 +3961,7 @@ static bool ram_state_init(RAMState **rsp, Error **errp)
     return true;
 }
 
-static void ram_list_init_bitmaps(void)
+static void ram_list_init_bitmaps(bool incremental)
 {
     MigrationState *ms = migrate_get_current();
     RAMBlock *block;
@@ -2744,14 +3991,24 @@ static void ram_list_init_bitmaps(void)
              * new migration after a failed migration, ram_list.
              * dirty_memory[DIRTY_MEMORY_MIGRATION] don't include the whole
              * guest memory.
+             * An incremental save is the exception: the dirty log has been
+             * running since the previous save, and file_bmap still tells
+             * which pages that save left in the file.
              */
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
-            if (migrate_mapped_ram()) {
-                block->file_bmap = bitmap_new(pages);
+            if (!incremental) {
+                bitmap_set(block->bmap, 0, pages);
+                if (migrate_mapped_ram()) {
+                    g_free(block->file_bmap);
+                    block->file_bmap = bitmap_new(pages);
+                }
             }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
+            if (migrate_defer_hot_pages()) {
+                block->dirty_heat = g_new0(uint8_t,
+                                           ramblock_heat_regions(block));
+            }
         }
     }
 }
@@ -2769,6 +4026,24 @@ static void migration_bitmap_clear_discarded_pages(RAMState *rs)
     }
 }
 
+static bool ram_incremental_usable(void)
+{
+    RAMBlock *block;
+
+    if (!migrate_mapped_ram_incremental() || !ram_incremental.valid ||
+        ram_incremental.ram_list_version != ram_list.version ||
+        !(global_dirty_tracking & GLOBAL_DIRTY_MIGRATION)) {
+        return false;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (!block->file_bmap) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static bool ram_init_bitmaps(RAMState *rs, Error **errp)
 {
     bool ret = true;
@@ -2776,7 +4051,14 @@ static bool ram_init_bitmaps(RAMState *rs, Error **errp)
     qemu_mutex_lock_ramlist();
 
     WITH_RCU_READ_LOCK_GUARD() {
-        ram_list_init_bitmaps();
+        /* Until this save completes, the file is a mix of two saves */
+        rs->incremental = ram_incremental_usable();
+        ram_incremental.valid = false;
+        if (rs->incremental) {
+            rs->migration_dirty_pages = 0;
+        }
+
+        ram_list_init_bitmaps(rs->incremental);
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
             ret = memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION, errp);
@@ -2785,6 +4067,9 @@ static bool ram_init_bitmaps(RAMState *rs, Error **errp)
             }
             migration_bitmap_sync_precopy(false);
         }
+        if (rs->incremental) {
+            trace_ram_incremental_start(rs->migration_dirty_pages);
+        }
     }
 out_unlock:
     qemu_mutex_unlock_ramlist();
@@ -2813,6 +4098,8 @@ static int ram_init_all(RAMState **rsp, Error **errp)
         return -1;
     }
 
+    ram_sync_threads_create(*rsp, false);
+
     if (!ram_init_bitmaps(*rsp, errp)) {
         return -1;
     }
@@ -2900,7 +4187,8 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
-#define MAPPED_RAM_HDR_VERSION 1
+/* Version 2 adds save_id, only used with mapped-ram-incremental */
+#define MAPPED_RAM_HDR_VERSION 2
 struct MappedRamHeader {
     uint32_t version;
     /*
@@ -2918,17 +4206,31 @@ struct MappedRamHeader {
      * are stored.
      */
     uint64_t pages_offset;
+    /*
+     * Random identifier of the save that wrote the file, so that an
+     * incremental save can check that the file holds the previous one.
+     */
+    uint64_t save_id;
 } QEMU_PACKED;
 typedef struct MappedRamHeader MappedRamHeader;
 
+static size_t mapped_ram_header_size(uint32_t version)
+{
+    return version >= 2 ? sizeof(MappedRamHeader) :
+                          offsetof(MappedRamHeader, save_id);
+}
+
 static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
 {
     g_autofree MappedRamHeader *header = NULL;
     size_t header_size, bitmap_size;
+    uint32_t version;
     long num_pages;
 
+    /* Keep files readable by older versions unless save_id is needed */
+    version = migrate_mapped_ram_incremental() ? 2 : 1;
     header = g_new0(MappedRamHeader, 1);
-    header_size = sizeof(MappedRamHeader);
+    header_size = mapped_ram_header_size(version);
 
     num_pages = block->used_length >> TARGET_PAGE_BITS;
     bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
@@ -2943,10 +4245,11 @@ static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
                                    bitmap_size,
                                    MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
 
-    header->version = cpu_to_be32(MAPPED_RAM_HDR_VERSION);
+    header->version = cpu_to_be32(version);
     header->page_size = cpu_to_be64(TARGET_PAGE_SIZE);
     header->bitmap_offset = cpu_to_be64(block->bitmap_offset);
     header->pages_offset = cpu_to_be64(block->pages_offset);
+    header->save_id = cpu_to_be64(ram_incremental.save_id);
 
     qemu_put_buffer(file, (uint8_t *) header, header_size);
 
@@ -2957,7 +4260,7 @@ static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
 static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
                                    Error **errp)
 {
-    size_t ret, header_size = sizeof(MappedRamHeader);
+    size_t ret, header_size = mapped_ram_header_size(1);
 
     ret = qemu_get_buffer(file, (uint8_t *)header, header_size);
     if (ret != header_size) {
@@ -2976,13 +4279,78 @@ static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
         return false;
     }
 
+    /* Read the fields added by later versions */
+    header_size = mapped_ram_header_size(header->version) - header_size;
+    header->save_id = 0;
+    if (header_size) {
+        ret = qemu_get_buffer(file, (uint8_t *)&header->save_id, header_size);
+        if (ret != header_size) {
+            error_setg(errp, "Could not read whole mapped-ram migration "
+                       "header (expected %zd more, got %zd bytes)",
+                       header_size, ret);
+            return false;
+        }
+    }
+
     header->page_size = be64_to_cpu(header->page_size);
     header->bitmap_offset = be64_to_cpu(header->bitmap_offset);
     header->pages_offset = be64_to_cpu(header->pages_offset);
+    header->save_id = be64_to_cpu(header->save_id);
+
+    return true;
+}
+
+/*
+ * Check that the file holds the previous save, from the headers that
+ * save wrote for the RAM blocks.  The migration target may be a new or
+ * another file, which only has the pages an incremental save writes.
+ */
+static bool ram_incremental_file_matches(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMBlock *block;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        return false;
+    }
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        MappedRamHeader header;
+
+        if (qio_channel_pread(ioc, (char *)&header, sizeof(header),
+                              block->bitmap_offset - sizeof(header),
+                              NULL) != sizeof(header) ||
+            be32_to_cpu(header.version) < 2 ||
+            be64_to_cpu(header.save_id) != ram_incremental.save_id ||
+            be64_to_cpu(header.bitmap_offset) != block->bitmap_offset ||
+            be64_to_cpu(header.pages_offset) != block->pages_offset) {
+            return false;
+        }
+    }
 
     return true;
 }
 
+/*
+ * The pages of the RAM blocks are not at the same place in the file as
+ * in the previous save, or the file does not hold that save, so those
+ * not dirtied since are lost: save all of RAM again.
+ */
+static void ram_incremental_fallback(RAMState *rs)
+{
+    RAMBlock *block;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
+
+        bitmap_set(block->bmap, 0, pages);
+        bitmap_zero(block->file_bmap, pages);
+    }
+    rs->migration_dirty_pages = rs->ram_bytes_total >> TARGET_PAGE_BITS;
+    rs->incremental = false;
+    migration_bitmap_clear_discarded_pages(rs);
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -3003,6 +4371,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
 {
     RAMState **rsp = opaque;
     RAMBlock *block;
+    bool layout_changed = false, other_file = false;
     int ret, max_hg_page_size;
 
     /* migration has already setup the bitmap, reuse it. */
@@ -3019,7 +4388,26 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
      */
     max_hg_page_size = MAX(qemu_real_host_page_size(), TARGET_PAGE_SIZE);
 
+    if (migrate_ram_fd_passing() &&
+        !qio_channel_has_feature(qemu_file_get_ioc(f),
+                                 QIO_CHANNEL_FEATURE_FD_PASS)) {
+        error_setg(errp, "ram-fd-passing requires a migration channel that "
+                   "can pass file descriptors, such as a UNIX socket");
+        return -1;
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
+        if (migrate_mapped_ram_incremental()) {
+            /* Before the headers of the previous save are overwritten */
+            if ((*rsp)->incremental && !ram_incremental_file_matches(f)) {
+                other_file = true;
+            }
+            do {
+                ram_incremental.save_id =
+                    ((uint64_t)g_random_int() << 32) | g_random_int();
+            } while (!ram_incremental.save_id);
+        }
+
         qemu_put_be64(f, ram_bytes_total_with_ignored()
                          | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -3034,11 +4422,34 @@ static int ram_save_setup(QEMUFile *f, void *opaque, Error **errp)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_ram_fd_passing()) {
+                bool pass_fd = ram_block_passes_fd(block);
+
+                qemu_put_byte(f, pass_fd);
+                if (pass_fd) {
+                    qemu_put_be64(f, block->fd_offset);
+                    if (qemu_file_put_fd(f, block->fd)) {
+                        error_setg(errp, "cannot pass the memory of RAM "
+                                   "block '%s'", block->idstr);
+                        return -1;
+                    }
+                }
+            }
 
             if (migrate_mapped_ram()) {
+                uint64_t pages_offset = block->pages_offset;
+
                 mapped_ram_setup_ramblock(f, block);
+                if (block->pages_offset != pages_offset) {
+                    layout_changed = true;
+                }
             }
         }
+
+        if ((*rsp)->incremental && (layout_changed || other_file)) {
+            trace_ram_incremental_fallback(layout_changed, other_file);
+            ram_incremental_fallback(*rsp);
+        }
     }
 
     ret = rdma_registration_start(f, RAM_CONTROL_SETUP);
@@ -3100,10 +4511,13 @@ static void ram_save_file_bmap(QEMUFile *f)
         /*
          * Free the bitmap here to catch any synchronization issues
          * with multifd channels. No channels should be sending pages
-         * after we've written the bitmap to file.
+         * after we've written the bitmap to file.  Keep it for the
+         * next save if it is incremental.
          */
-        g_free(block->file_bmap);
-        block->file_bmap = NULL;
+        if (!migrate_mapped_ram_incremental()) {
+            g_free(block->file_bmap);
+            block->file_bmap = NULL;
+        }
     }
 }
 
@@ -3155,6 +4569,16 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
                 goto out;
             }
 
+            if (migrate_multifd_scan()) {
+                /* The multifd channels look for dirty pages by themselves */
+                ret = ram_save_multifd_scan(rs, f, true);
+                if (ret < 0) {
+                    qemu_file_set_error(f, ret);
+                }
+                done = ret == 0;
+                goto unlock;
+            }
+
             t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
             i = 0;
             while ((ret = migration_rate_exceeded(f)) == 0 ||
@@ -3198,6 +4622,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
     }
 
+unlock:
     /*
      * Must occur before EOS (or any QEMUFile operation)
      * because of RDMA protocol.
@@ -3248,7 +4673,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
+            MigrationState *ms = migrate_get_current();
+
             migration_bitmap_sync_precopy(true);
+            migration_downtime_checkpoint(&ms->downtime_stats,
+                                          "src-ram-synced");
         }
 
         ret = rdma_registration_start(f, RAM_CONTROL_FINISH);
@@ -3264,7 +4693,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         while (true) {
             int pages;
 
-            pages = ram_find_and_save_block(rs);
+            if (migrate_multifd_scan()) {
+                /* Positive until all of RAM has been found clean */
+                pages = ram_save_multifd_scan(rs, f, false);
+            } else {
+                pages = ram_find_and_save_block(rs);
+            }
             /* no more blocks to sent */
             if (pages == 0) {
                 break;
@@ -3298,6 +4732,12 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
             error_reportf_err(local_err, "Failed to write bitmap to file: ");
             return -err;
         }
+
+        /* All of RAM is in the file, keep tracking what changes next */
+        if (migrate_mapped_ram_incremental()) {
+            ram_incremental.valid = true;
+            ram_incremental.ram_list_version = ram_list.version;
+        }
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
@@ -3509,7 +4949,9 @@ static void colo_init_ram_state(void)
 
     if (!ram_state_init(&ram_state, &local_err)) {
         error_report_err(local_err);
+        return;
     }
+    ram_sync_threads_create(ram_state, true);
 }
 
 /*
@@ -3572,6 +5014,14 @@ void colo_incoming_start_dirty_log(void)
 
     memory_global_dirty_log_sync(false);
     WITH_RCU_READ_LOCK_GUARD() {
+        /*
+         * The multifd channels placed the pages of the migration in the
+         * guest RAM only, while the main channel backed them up in the
+         * cache: bring the cache up to date in one go.
+         */
+        if (migrate_multifd()) {
+            colo_ram_cache_run(ram_state, RAM_SYNC_OP_COLO_FILL);
+        }
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             ramblock_sync_dirty_bitmap(ram_state, block);
             /* Discard this dirty bitmap record */
@@ -3845,46 +5295,16 @@ static bool postcopy_is_running(void)
  */
 void colo_flush_ram_cache(void)
 {
-    RAMBlock *block = NULL;
-    void *dst_host;
-    void *src_host;
-    unsigned long offset = 0;
+    uint64_t flushed;
 
     memory_global_dirty_log_sync(false);
     qemu_mutex_lock(&ram_state->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(ram_state, block);
-        }
-    }
-
-    trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
-    WITH_RCU_READ_LOCK_GUARD() {
-        block = QLIST_FIRST_RCU(&ram_list.blocks);
-
-        while (block) {
-            unsigned long num = 0;
+        ramblock_sync_dirty_bitmap_all(ram_state);
 
-            offset = colo_bitmap_find_dirty(ram_state, block, offset, &num);
-            if (!offset_in_ramblock(block,
-                                    ((ram_addr_t)offset) << TARGET_PAGE_BITS)) {
-                offset = 0;
-                num = 0;
-                block = QLIST_NEXT_RCU(block, next);
-            } else {
-                unsigned long i = 0;
-
-                for (i = 0; i < num; i++) {
-                    migration_bitmap_clear_dirty(ram_state, block, offset + i);
-                }
-                dst_host = block->host
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                src_host = block->colo_cache
-                         + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                memcpy(dst_host, src_host, TARGET_PAGE_SIZE * num);
-                offset += num;
-            }
-        }
+        trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
+        flushed = colo_ram_cache_run(ram_state, RAM_SYNC_OP_COLO_FLUSH);
+        ram_state->migration_dirty_pages -= flushed;
     }
     qemu_mutex_unlock(&ram_state->bitmap_mutex);
     trace_colo_flush_ram_cache_end();
@@ -3906,6 +5326,40 @@ static size_t ram_load_multifd_pages(void *host_addr, size_t size,
     return size;
 }
 
+/*
+ * Whether the pages of @block can be mapped from the migration file
+ * instead of being read from it.
+ */
+static bool mapped_ram_can_map(QEMUFile *f, RAMBlock *block)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+
+    if (!migrate_mapped_ram_lazy_load() ||
+        !object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        return false;
+    }
+
+    /*
+     * Only anonymous private memory can be replaced by a private file
+     * mapping, anything else is visible to someone else through its fd.
+     */
+    if (block->fd >= 0 || qemu_ram_is_shared(block) ||
+        block->page_size != qemu_real_host_page_size()) {
+        return false;
+    }
+
+    /*
+     * Whoever pinned the memory (e.g. vfio, which disables discarding)
+     * would keep using the pages that the mapping replaces.  Discarding
+     * itself maps anonymous memory again, see qemu_ram_map_file_private().
+     */
+    if (ram_block_discard_is_disabled()) {
+        return false;
+    }
+
+    return QEMU_IS_ALIGNED(block->pages_offset, qemu_real_host_page_size());
+}
+
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                      long num_pages, unsigned long *bitmap,
                                      Error **errp)
@@ -3915,6 +5369,8 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
     ram_addr_t offset;
     void *host;
     size_t read, unread, size;
+    bool map = mapped_ram_can_map(f, block);
+    unsigned int maps = 0;
 
     for (set_bit_idx = find_first_bit(bitmap, num_pages);
          set_bit_idx < num_pages;
@@ -3925,6 +5381,23 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         unread = TARGET_PAGE_SIZE * (clear_bit_idx - set_bit_idx);
         offset = set_bit_idx << TARGET_PAGE_BITS;
 
+        if (map && unread >= MAPPED_RAM_MAP_MIN_SIZE &&
+            maps < MAPPED_RAM_MAX_MAPS &&
+            QEMU_IS_ALIGNED(offset | unread, qemu_real_host_page_size())) {
+            if (!offset_in_ramblock(block, offset + unread - 1)) {
+                error_setg(errp, "page outside of ramblock %s range",
+                           block->idstr);
+                return false;
+            }
+            if (!file_map_ram(qemu_file_get_ioc(f), block, offset, unread,
+                              block->pages_offset + offset, errp)) {
+                error_prepend(errp, "(%s) ", block->idstr);
+                return false;
+            }
+            maps++;
+            continue;
+        }
+
         while (unread > 0) {
             host = host_from_ram_block_offset(block, offset);
             if (!host) {
@@ -3951,6 +5424,8 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         }
     }
 
+    trace_read_ramblock_mapped_ram(block->idstr, maps);
+
     return true;
 
 err:
@@ -4067,6 +5542,36 @@ static int parse_ramblock(QEMUFile *f, RAMBlock *block, ram_addr_t length)
             return -EINVAL;
         }
     }
+    if (migrate_ram_fd_passing()) {
+        bool pass_fd = qemu_get_byte(f);
+
+        if (pass_fd != ram_block_passes_fd(block)) {
+            error_report("Mismatched ram-fd-passing for block %s: the "
+                         "source %s its file descriptor", block->idstr,
+                         pass_fd ? "passes" : "does not pass");
+            return -EINVAL;
+        }
+        if (pass_fd) {
+            uint64_t fd_offset = qemu_get_be64(f);
+            int fd = qemu_file_get_fd(f);
+
+            if (fd < 0) {
+                return -EINVAL;
+            }
+            /* Devices such as VFIO already pinned the current memory */
+            if (ram_block_discard_is_disabled()) {
+                close(fd);
+                error_report("Cannot replace the memory of block %s, "
+                             "it is pinned by a device", block->idstr);
+                return -EINVAL;
+            }
+            if (!qemu_ram_remap_fd(block, fd, fd_offset, &local_err)) {
+                error_report_err(local_err);
+                return -EINVAL;
+            }
+            trace_ram_load_remap_fd(block->idstr, fd_offset);
+        }
+    }
     ret = rdma_block_notification_handle(f, block->idstr);
     if (ret < 0) {
         qemu_file_set_error(f, ret);
@@ -4499,6 +6004,9 @@ static void ram_mig_ram_block_resized(RAMBlockNotifier *n, void *host,
         return;
     }
 
+    /* The pages of the next blocks move in the file */
+    ram_incremental.valid = false;
+
     if (migration_is_running()) {
         /*
          * Precopy code on the source cannot deal with the size of RAM blocks
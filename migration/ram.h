@@ -53,6 +53,9 @@ void mig_throttle_counter_reset(void);
 uint64_t ram_pagesize_summary(void);
 int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len,
                          Error **errp);
+int ram_save_queue_prefetch_pages(const char *rbname, ram_addr_t start,
+                                  uint32_t stride, uint32_t count,
+                                  Error **errp);
 void ram_postcopy_migrated_memory_release(MigrationState *ms);
 /* For outgoing discard bitmap */
 void ram_postcopy_send_discard_bitmap(MigrationState *ms);
@@ -94,6 +94,10 @@ enum qemu_vm_cmd {
 };
 
 #define MAX_VM_CMD_PACKAGED_SIZE UINT32_MAX
+
+/* Initial size of the buffers of save_live_complete_precopy_thread */
+#define SAVEVM_STATE_BUFFER_SIZE 0x100000
+
 static struct mig_cmd_args {
     ssize_t     len; /* -1 = variable */
     const char *name;
@@ -1470,25 +1474,123 @@ void qemu_savevm_state_complete_postcopy(QEMUFile *f)
     qemu_fflush(f);
 }
 
-static
-int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
+static bool savevm_state_complete_precopy_needed(SaveStateEntry *se,
+                                                 bool in_postcopy)
 {
-    int64_t start_ts_each, end_ts_each;
+    if (!se->ops ||
+        (in_postcopy && se->ops->has_postcopy &&
+         se->ops->has_postcopy(se->opaque)) ||
+        (!se->ops->save_live_complete_precopy &&
+         !se->ops->save_live_complete_precopy_thread)) {
+        return false;
+    }
+
+    if (se->ops->is_active) {
+        if (!se->ops->is_active(se->opaque)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+typedef struct {
     SaveStateEntry *se;
+    QemuThread thread;
+    QIOChannelBuffer *bioc;
+    QEMUFile *f;
     int ret;
+    bool joined;
+} SaveCompleteThread;
+
+static void *savevm_state_complete_precopy_thread(void *opaque)
+{
+    SaveCompleteThread *t = opaque;
+    SaveStateEntry *se = t->se;
+
+    t->ret = se->ops->save_live_complete_precopy_thread(t->f, se->opaque);
+    if (!t->ret) {
+        t->ret = qemu_fflush(t->f);
+    }
+    trace_savevm_state_complete_precopy_thread(se->idstr, se->section_id,
+                                               t->ret, t->bioc->usage);
 
+    return NULL;
+}
+
+/*
+ * Wait for the device state that @t saved and put it into @f.  Returns
+ * what the handler returned.
+ */
+static int savevm_state_complete_precopy_join(QEMUFile *f,
+                                              SaveCompleteThread *t)
+{
+    int ret;
+
+    qemu_thread_join(&t->thread);
+    t->joined = true;
+
+    ret = t->ret;
+    if (!ret) {
+        qemu_put_buffer(f, t->bioc->data, t->bioc->usage);
+    }
+    qemu_fclose(t->f);
+
+    return ret;
+}
+
+static int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f,
+                                                       bool in_postcopy)
+{
+    MigrationState *ms = migrate_get_current();
+    int64_t start_ts_each, end_ts_each;
+    g_autofree SaveCompleteThread *threads = NULL;
+    int nr_threads = 0, i;
+    SaveStateEntry *se;
+    int ret = 0;
+
+    /*
+     * Let the devices that can save their state without the BQL do it
+     * in parallel, while the others go through the loop below.
+     */
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
-        if (!se->ops ||
-            (in_postcopy && se->ops->has_postcopy &&
-             se->ops->has_postcopy(se->opaque)) ||
-            !se->ops->save_live_complete_precopy) {
+        if (savevm_state_complete_precopy_needed(se, in_postcopy) &&
+            se->ops->save_live_complete_precopy_thread) {
+            nr_threads++;
+        }
+    }
+    if (nr_threads) {
+        threads = g_new0(SaveCompleteThread, nr_threads);
+    }
+
+    i = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        SaveCompleteThread *t;
+        g_autofree char *name = NULL;
+
+        if (!savevm_state_complete_precopy_needed(se, in_postcopy) ||
+            !se->ops->save_live_complete_precopy_thread) {
             continue;
         }
 
-        if (se->ops->is_active) {
-            if (!se->ops->is_active(se->opaque)) {
-                continue;
-            }
+        t = &threads[i];
+        t->se = se;
+        t->bioc = qio_channel_buffer_new(SAVEVM_STATE_BUFFER_SIZE);
+        qio_channel_set_name(QIO_CHANNEL(t->bioc), "migration-state-buffer");
+        t->f = qemu_file_new_output(QIO_CHANNEL(t->bioc));
+        object_unref(OBJECT(t->bioc));
+
+        name = g_strdup_printf(MIGRATION_THREAD_SRC_STATE, i);
+        qemu_thread_create(&t->thread, name,
+                           savevm_state_complete_precopy_thread, t,
+                           QEMU_THREAD_JOINABLE);
+        i++;
+    }
+
+    i = 0;
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!savevm_state_complete_precopy_needed(se, in_postcopy)) {
+            continue;
         }
 
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
@@ -1496,19 +1598,39 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
 
-        ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        if (se->ops->save_live_complete_precopy_thread) {
+            ret = savevm_state_complete_precopy_join(f, &threads[i++]);
+        } else {
+            ret = se->ops->save_live_complete_precopy(f, se->opaque);
+        }
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         save_section_footer(f, se);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
-            return -1;
+            ret = -1;
+            break;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+        migration_downtime_device(&ms->downtime_stats, se->idstr,
+                                  se->instance_id, true,
+                                  end_ts_each - start_ts_each);
     }
 
-    trace_vmstate_downtime_checkpoint("src-iterable-saved");
+    /* On error, the devices after the failing one are still running */
+    for (i = 0; i < nr_threads; i++) {
+        if (!threads[i].joined) {
+            qemu_thread_join(&threads[i].thread);
+            qemu_fclose(threads[i].f);
+        }
+    }
+
+    if (ret) {
+        return ret;
+    }
+
+    migration_downtime_checkpoint(&ms->downtime_stats, "src-iterable-saved");
 
     return 0;
 }
@@ -1544,6 +1666,9 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
+        migration_downtime_device(&ms->downtime_stats, se->idstr,
+                                  se->instance_id, false,
+                                  end_ts_each - start_ts_each);
     }
 
     if (inactivate_disks) {
@@ -1578,7 +1703,8 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     json_writer_free(vmdesc);
     ms->vmdesc = NULL;
 
-    trace_vmstate_downtime_checkpoint("src-non-iterable-saved");
+    migration_downtime_checkpoint(&ms->downtime_stats,
+                                  "src-non-iterable-saved");
 
     return 0;
 }
@@ -2124,18 +2250,21 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
 
-    trace_vmstate_downtime_checkpoint("dst-postcopy-bh-enter");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-postcopy-bh-enter");
 
     /* TODO we should move all of this lot into postcopy_ram.c or a shared code
      * in migration.c
      */
     cpu_synchronize_all_post_init();
 
-    trace_vmstate_downtime_checkpoint("dst-postcopy-bh-cpu-synced");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-postcopy-bh-cpu-synced");
 
     qemu_announce_self(&mis->announce_timer, migrate_announce_params());
 
-    trace_vmstate_downtime_checkpoint("dst-postcopy-bh-announced");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-postcopy-bh-announced");
 
     /* Make sure all file formats throw away their mutable metadata.
      * If we get an error here, just don't restart the VM yet. */
@@ -2146,7 +2275,8 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
         autostart = false;
     }
 
-    trace_vmstate_downtime_checkpoint("dst-postcopy-bh-cache-invalidated");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-postcopy-bh-cache-invalidated");
 
     dirty_bitmap_mig_before_vm_start();
 
@@ -2158,7 +2288,9 @@ static void loadvm_postcopy_handle_run_bh(void *opaque)
         runstate_set(RUN_STATE_PAUSED);
     }
 
-    trace_vmstate_downtime_checkpoint("dst-postcopy-bh-vm-started");
+    migration_downtime_checkpoint(&mis->downtime_stats,
+                                  "dst-postcopy-bh-vm-started");
+    migration_downtime_stats_stop(&mis->downtime_stats);
 }
 
 /* After all discards we can start running and asking for pages */
@@ -2206,7 +2338,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
@@ -2266,12 +2399,12 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
     migrate_send_rp_req_pages_pending(mis);
 
     /*
-     * It's time to switch state and release the fault thread to continue
+     * It's time to switch state and release the fault threads to continue
      * service page faults.  Note that this should be explicitly after the
-     * above call to migrate_send_rp_req_pages_pending().  In short:
-     * migrate_send_rp_message_req_pages() is not thread safe, yet.
+     * above call to migrate_send_rp_req_pages_pending(), so that the
+     * pending requests go out before any new one.
      */
-    qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    postcopy_fault_thread_resume(mis);
 
     if (migrate_postcopy_preempt()) {
         /*
@@ -2561,6 +2694,7 @@ static bool check_section_footer(QEMUFile *f, SaveStateEntry *se)
 static int
 qemu_loadvm_section_start_full(QEMUFile *f, uint8_t type)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     bool trace_downtime = (type == QEMU_VM_SECTION_FULL);
     uint32_t instance_id, version_id, section_id;
     int64_t start_ts, end_ts;
@@ -2627,6 +2761,8 @@ qemu_loadvm_section_start_full(QEMUFile *f, uint8_t type)
         end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_load("non-iterable", se->idstr,
                                     se->instance_id, end_ts - start_ts);
+        migration_downtime_device(&mis->downtime_stats, se->idstr,
+                                  se->instance_id, false, end_ts - start_ts);
     }
 
     if (!check_section_footer(f, se)) {
@@ -2639,6 +2775,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, uint8_t type)
 static int
 qemu_loadvm_section_part_end(QEMUFile *f, uint8_t type)
 {
+    MigrationIncomingState *mis = migration_incoming_get_current();
     bool trace_downtime = (type == QEMU_VM_SECTION_END);
     int64_t start_ts, end_ts;
     uint32_t section_id;
@@ -2680,6 +2817,8 @@ qemu_loadvm_section_part_end(QEMUFile *f, uint8_t type)
         end_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         trace_vmstate_downtime_load("iterable", se->idstr,
                                     se->instance_id, end_ts - start_ts);
+        migration_downtime_device(&mis->downtime_stats, se->idstr,
+                                  se->instance_id, true, end_ts - start_ts);
     }
 
     if (!check_section_footer(f, se)) {
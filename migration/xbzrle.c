@@ -13,11 +13,28 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/host-utils.h"
+#include "qemu/units.h"
 #include "xbzrle.h"
 
-#if defined(CONFIG_AVX512BW_OPT)
+#if defined(CONFIG_AVX512BW_OPT) || defined(CONFIG_AVX2_OPT)
 #include <immintrin.h>
 #include "host/cpuinfo.h"
+#define XBZRLE_ENCODE_ACCEL
+#ifdef CONFIG_AVX2_OPT
+#define XBZRLE_ENCODE_EQ_MASKS
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define XBZRLE_ENCODE_ACCEL
+#define XBZRLE_ENCODE_EQ_MASKS
+#endif
+
+#ifdef XBZRLE_ENCODE_ACCEL
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen);
+#endif
+
+#if defined(CONFIG_AVX512BW_OPT)
 
 static int __attribute__((target("avx512bw")))
 xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
@@ -136,20 +153,193 @@ xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf, int slen,
     }
     return d;
 }
+#endif
 
-static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
-                                    int slen, uint8_t *dst, int dlen);
+#ifdef XBZRLE_ENCODE_EQ_MASKS
+/*
+ * Encoders that first compare the two buffers with vector instructions,
+ * building a bitmap with one bit set for each byte that didn't change,
+ * then find the runs by counting bits in the bitmap.
+ */
+
+/* Longest buffer handled with a bitmap on the stack */
+#define XBZRLE_EQ_MASKS_MAX_LEN (64 * KiB)
+
+/* Compare the bytes that don't fill a whole 64-bit mask */
+static void xbzrle_eq_masks_tail(const uint8_t *old_buf,
+                                 const uint8_t *new_buf, int i, int slen,
+                                 uint64_t *eq)
+{
+    uint64_t m = 0;
+
+    if (i == slen) {
+        return;
+    }
+
+    for (int j = 0; i + j < slen; j++) {
+        m |= (uint64_t)(old_buf[i + j] == new_buf[i + j]) << j;
+    }
+    eq[i / 64] = m;
+}
+
+/*
+ * Returns the length of the run starting at @i of bytes that are all
+ * unchanged if @same, or all changed otherwise.
+ */
+static int xbzrle_eq_run_len(const uint64_t *eq, int i, int slen, bool same)
+{
+    int start = i;
 
+    while (i < slen) {
+        int shift = i % 64;
+        uint64_t m = (same ? eq[i / 64] : ~eq[i / 64]) >> shift;
+        int run = ctz64(~m);
+
+        i += run;
+        if (run < 64 - shift) {
+            break;
+        }
+    }
+
+    return MIN(i, slen) - start;
+}
+
+/* Same output as xbzrle_encode_buffer_int(), from the bitmap in @eq */
+static int xbzrle_encode_eq_masks(const uint64_t *eq, uint8_t *new_buf,
+                                  int slen, uint8_t *dst, int dlen)
+{
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        int zrun_len, nzrun_len;
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_len = xbzrle_eq_run_len(eq, i, slen, true);
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        i += zrun_len;
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_len = xbzrle_eq_run_len(eq, i, slen, false);
+        d += uleb128_encode_small(dst + d, nzrun_len);
+
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static int __attribute__((target("avx2")))
+xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                          uint8_t *dst, int dlen)
+{
+    uint64_t eq[XBZRLE_EQ_MASKS_MAX_LEN / 64];
+    int i;
+
+    if (slen > XBZRLE_EQ_MASKS_MAX_LEN) {
+        return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+    }
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        __m256i o0 = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i o1 = _mm256_loadu_si256((__m256i *)(old_buf + i + 32));
+        __m256i n0 = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        __m256i n1 = _mm256_loadu_si256((__m256i *)(new_buf + i + 32));
+        uint32_t lo = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o0, n0));
+        uint32_t hi = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o1, n1));
+
+        eq[i / 64] = lo | ((uint64_t)hi << 32);
+    }
+    xbzrle_eq_masks_tail(old_buf, new_buf, i, slen, eq);
+
+    return xbzrle_encode_eq_masks(eq, new_buf, slen, dst, dlen);
+}
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+static int xbzrle_encode_buffer_neon(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    static const uint8_t bits[16] = {
+        1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128
+    };
+    uint8x16_t weights = vld1q_u8(bits);
+    uint64_t eq[XBZRLE_EQ_MASKS_MAX_LEN / 64];
+    int i;
+
+    if (slen > XBZRLE_EQ_MASKS_MAX_LEN) {
+        return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+    }
+
+    for (i = 0; i + 64 <= slen; i += 64) {
+        uint64_t m = 0;
+
+        for (int j = 0; j < 64; j += 16) {
+            uint8x16_t c = vceqq_u8(vld1q_u8(old_buf + i + j),
+                                    vld1q_u8(new_buf + i + j));
+            uint8x16_t w = vandq_u8(c, weights);
+            uint64_t b = vaddv_u8(vget_low_u8(w)) |
+                         ((uint64_t)vaddv_u8(vget_high_u8(w)) << 8);
+
+            m |= b << j;
+        }
+        eq[i / 64] = m;
+    }
+    xbzrle_eq_masks_tail(old_buf, new_buf, i, slen, eq);
+
+    return xbzrle_encode_eq_masks(eq, new_buf, slen, dst, dlen);
+}
+#endif
+
+#ifdef XBZRLE_ENCODE_ACCEL
 static int (*accel_func)(uint8_t *, uint8_t *, int, uint8_t *, int);
 
 static void __attribute__((constructor)) init_accel(void)
 {
+#if defined(__aarch64__)
+    accel_func = xbzrle_encode_buffer_neon;
+#else
     unsigned info = cpuinfo_init();
+
+    accel_func = xbzrle_encode_buffer_int;
+#ifdef CONFIG_AVX2_OPT
+    if (info & CPUINFO_AVX2) {
+        accel_func = xbzrle_encode_buffer_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512BW_OPT
     if (info & CPUINFO_AVX512BW) {
         accel_func = xbzrle_encode_buffer_avx512;
-    } else {
-        accel_func = xbzrle_encode_buffer_int;
     }
+#endif
+#endif
 }
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
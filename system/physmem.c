@@ -2142,6 +2142,8 @@ static void reclaim_ramblock(RAMBlock *block)
         ram_block_discard_require(false);
     }
 
+    /* Kept across migrations by mapped-ram-incremental */
+    g_free(block->file_bmap);
     g_free(block);
 }
 
@@ -2209,6 +2211,166 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+/* Give a new mapping of guest RAM the advice that ram_block_add() gives */
+static void qemu_ram_setup_advice(void *addr, size_t length)
+{
+    memory_try_enable_merging(addr, length);
+    qemu_ram_setup_dump(addr, length);
+    qemu_madvise(addr, length, QEMU_MADV_HUGEPAGE);
+    if (!qtest_enabled()) {
+        qemu_madvise(addr, length, QEMU_MADV_DONTFORK);
+    }
+}
+
+/*
+ * Map @length bytes of @fd at @fd_offset privately over the memory of
+ * @block at @offset, so that they are only read when first touched, e.g.
+ * to load guest RAM lazily from a migration file.  @block must be private
+ * anonymous memory.
+ */
+bool qemu_ram_map_file_private(RAMBlock *block, ram_addr_t offset,
+                               size_t length, int fd, off_t fd_offset,
+                               Error **errp)
+{
+    int flags = MAP_PRIVATE | MAP_FIXED;
+    void *host = ramblock_ptr(block, offset);
+
+    assert(block->fd < 0 && !qemu_ram_is_shared(block));
+
+    flags |= block->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    if (mmap(host, length, PROT_READ | PROT_WRITE, flags, fd,
+             fd_offset) == MAP_FAILED) {
+        error_setg_errno(errp, errno, "cannot map 0x%zx bytes of a file "
+                         "over RAM block '%s'", length, block->idstr);
+        return false;
+    }
+    qemu_ram_setup_advice(host, length);
+    block->file_mapped = true;
+    return true;
+}
+
+/*
+ * Discard memory of a block that qemu_ram_map_file_private() was used on:
+ * MADV_DONTNEED would read the pages of a private file mapping back from
+ * the file, rather than as zero.  Map anonymous memory again instead.
+ * Like madvise(), returns -1 and sets errno on failure.
+ */
+static int qemu_ram_discard_file_mapped(RAMBlock *block, void *host,
+                                        size_t length)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+
+    flags |= block->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    if (mmap(host, length, PROT_READ | PROT_WRITE, flags, -1, 0) ==
+        MAP_FAILED) {
+        return -1;
+    }
+    qemu_ram_setup_advice(host, length);
+    return 0;
+}
+
+/* Like dup2(), but the new file descriptor is closed on exec */
+static int qemu_ram_dup_fd(int oldfd, int newfd)
+{
+#ifdef CONFIG_DUP3
+    return dup3(oldfd, newfd, O_CLOEXEC);
+#else
+    if (dup2(oldfd, newfd) < 0) {
+        return -1;
+    }
+    qemu_set_cloexec(newfd);
+    return newfd;
+#endif
+}
+
+/*
+ * Map the memory of @fd, from @fd_offset, in place of the current memory
+ * of @block, e.g. when the source of a migration passed its own.  @block
+ * keeps its host address, and the file descriptor number of its backend.
+ * Takes ownership of @fd.
+ */
+bool qemu_ram_remap_fd(RAMBlock *block, int fd, uint64_t fd_offset,
+                       Error **errp)
+{
+    int flags = MAP_SHARED | MAP_FIXED;
+    int prot = PROT_READ;
+    int old_fd = -1;
+    struct stat st;
+    void *area;
+
+    if (block->fd < 0 || !(block->flags & RAM_SHARED)) {
+        error_setg(errp, "RAM block '%s' is not shared memory with a file "
+                   "descriptor", block->idstr);
+        goto err;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "cannot stat the memory of RAM block "
+                         "'%s'", block->idstr);
+        goto err;
+    }
+    if ((uint64_t)st.st_size < fd_offset + block->max_length) {
+        error_setg(errp, "the memory of RAM block '%s' is smaller than "
+                   RAM_ADDR_FMT " bytes", block->idstr, block->max_length);
+        goto err;
+    }
+    if (qemu_fd_getpagesize(fd) != block->page_size) {
+        error_setg(errp, "the memory of RAM block '%s' does not have "
+                   "a page size of %zu", block->idstr, block->page_size);
+        goto err;
+    }
+
+    /*
+     * Whoever got the fd of the block keeps a valid one.  Replace it before
+     * the mapping, which cannot be undone, and put the old file back if
+     * mapping the new one fails.
+     */
+    old_fd = qemu_dup(block->fd);
+    if (old_fd < 0) {
+        error_setg_errno(errp, errno, "cannot duplicate the file descriptor "
+                         "of RAM block '%s'", block->idstr);
+        goto err;
+    }
+    if (qemu_ram_dup_fd(fd, block->fd) < 0) {
+        error_setg_errno(errp, errno, "cannot replace the file descriptor "
+                         "of RAM block '%s'", block->idstr);
+        goto err;
+    }
+
+    flags |= block->flags & RAM_NORESERVE ? MAP_NORESERVE : 0;
+    prot |= block->flags & RAM_READONLY ? 0 : PROT_WRITE;
+    area = mmap(block->host, block->max_length, prot, flags, block->fd,
+                fd_offset);
+    if (area != block->host) {
+        error_setg_errno(errp, errno, "cannot map the memory of RAM block "
+                         "'%s'", block->idstr);
+        if (qemu_ram_dup_fd(old_fd, block->fd) < 0) {
+            error_report("cannot restore the file descriptor of RAM block "
+                         "'%s': %s", block->idstr, strerror(errno));
+        }
+        goto err;
+    }
+    qemu_ram_setup_advice(block->host, block->max_length);
+
+    close(old_fd);
+    close(fd);
+    block->fd_offset = fd_offset;
+    return true;
+
+err:
+    if (old_fd >= 0) {
+        close(old_fd);
+    }
+    close(fd);
+    return false;
+}
+#else
+bool qemu_ram_remap_fd(RAMBlock *block, int fd, uint64_t fd_offset,
+                       Error **errp)
+{
+    error_setg(errp, "RAM file descriptors cannot be remapped on this host");
+    return false;
+}
 #endif /* !_WIN32 */
 
 /*
@@ -3711,7 +3873,9 @@ int ram_block_discard_range(RAMBlock *rb, uint64_t start, size_t length)
              * fallocate'd away).
              */
 #if defined(CONFIG_MADVISE)
-            if (qemu_ram_is_shared(rb) && rb->fd < 0) {
+            if (rb->file_mapped) {
+                ret = qemu_ram_discard_file_mapped(rb, host_startaddr, length);
+            } else if (qemu_ram_is_shared(rb) && rb->fd < 0) {
                 ret = madvise(host_startaddr, length, QEMU_MADV_REMOVE);
             } else {
                 ret = madvise(host_startaddr, length, QEMU_MADV_DONTNEED);
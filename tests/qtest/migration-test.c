@@ -37,6 +37,10 @@
 #include "linux/kvm.h"
 #endif
 
+#ifdef CONFIG_LINUX
+#include <sys/resource.h>
+#endif
+
 unsigned start_address;
 unsigned end_address;
 static bool uffd_feature_thread_id;
@@ -601,6 +605,8 @@ typedef struct {
      */
     bool hide_stderr;
     bool use_shmem;
+    /* Back the guest RAM with a shared memfd */
+    bool use_memfd;
     /* only launch the target process */
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
@@ -707,6 +713,7 @@ typedef struct {
     /* Postcopy specific fields */
     void *postcopy_data;
     bool postcopy_preempt;
+    bool postcopy_prefetch;
     PostcopyRecoveryFailStage postcopy_recovery_fail_stage;
 } MigrateCommon;
 
@@ -800,6 +807,10 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             "-object memory-backend-file,id=mem0,size=%s"
             ",mem-path=%s,share=on -numa node,memdev=mem0",
             memory_size, shmem_path);
+    } else if (args->use_memfd) {
+        shmem_opts = g_strdup_printf(
+            "-object memory-backend-memfd,id=mem0,size=%s,share=on "
+            "-numa node,memdev=mem0", memory_size);
     }
 
     if (args->use_dirty_ring) {
@@ -1272,6 +1283,11 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
         migrate_set_capability(to, "postcopy-preempt", true);
     }
 
+    if (args->postcopy_prefetch) {
+        migrate_set_capability(from, "postcopy-prefetch", true);
+        migrate_set_capability(to, "postcopy-prefetch", true);
+    }
+
     migrate_ensure_non_converge(from);
 
     migrate_prepare_for_dirty_mem(from);
@@ -1358,6 +1374,34 @@ static void test_postcopy_preempt(void)
     test_postcopy_common(&args);
 }
 
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .postcopy_prefetch = true,
+    };
+
+    test_postcopy_common(&args);
+}
+
+static void *test_postcopy_fault_threads_start(QTestState *from,
+                                               QTestState *to)
+{
+    migrate_set_parameter_int(to, "postcopy-fault-threads", 4);
+
+    return NULL;
+}
+
+static void test_postcopy_preempt_fault_threads(void)
+{
+    MigrateCommon args = {
+        .postcopy_preempt = true,
+        .postcopy_prefetch = true,
+        .start_hook = test_postcopy_fault_threads_start,
+    };
+
+    test_postcopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_postcopy_tls_psk(void)
 {
@@ -1613,6 +1657,25 @@ static void test_postcopy_preempt_recovery(void)
     test_postcopy_recovery_common(&args);
 }
 
+static void test_postcopy_recovery_fault_threads(void)
+{
+    MigrateCommon args = {
+        .start_hook = test_postcopy_fault_threads_start,
+    };
+
+    test_postcopy_recovery_common(&args);
+}
+
+static void test_postcopy_recovery_fault_threads_fail_handshake(void)
+{
+    MigrateCommon args = {
+        .start_hook = test_postcopy_fault_threads_start,
+        .postcopy_recovery_fail_stage = POSTCOPY_FAIL_RECOVERY,
+    };
+
+    test_postcopy_recovery_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 /* This contains preempt+recovery+tls test altogether */
 static void test_postcopy_preempt_all(void)
@@ -1906,6 +1969,30 @@ finish:
     test_migrate_end(from, to, args->result == MIG_TEST_SUCCEED);
 }
 
+static void test_migrate_downtime_info_finish(QTestState *from,
+                                              QTestState *to,
+                                              void *opaque)
+{
+    QDict *rsp_return, *downtime_info;
+    QList *checkpoints, *devices;
+    QDict *first;
+
+    rsp_return = migrate_query_not_failed(from);
+    downtime_info = qdict_get_qdict(rsp_return, "downtime-info");
+    g_assert(downtime_info);
+
+    checkpoints = qdict_get_qlist(downtime_info, "checkpoints");
+    g_assert(checkpoints && !qlist_empty(checkpoints));
+    first = qobject_to(QDict, qlist_peek(checkpoints));
+    g_assert_cmpstr(qdict_get_str(first, "name"), ==, "src-downtime-start");
+    g_assert_cmpint(qdict_get_int(first, "time"), ==, 0);
+
+    devices = qdict_get_qlist(downtime_info, "devices");
+    g_assert(devices && !qlist_empty(devices));
+
+    qobject_unref(rsp_return);
+}
+
 static void test_precopy_unix_plain(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1917,11 +2004,38 @@ static void test_precopy_unix_plain(void)
          * get-dirty-log dirty tracking.
          */
         .live = true,
+        .finish_hook = test_migrate_downtime_info_finish,
     };
 
     test_precopy_common(&args);
 }
 
+#ifdef CONFIG_LINUX
+static void *test_precopy_unix_ram_fd_passing_start(QTestState *from,
+                                                    QTestState *to)
+{
+    migrate_set_capability(from, "x-ignore-shared", true);
+    migrate_set_capability(to, "x-ignore-shared", true);
+    migrate_set_capability(from, "ram-fd-passing", true);
+    migrate_set_capability(to, "ram-fd-passing", true);
+
+    return NULL;
+}
+
+static void test_precopy_unix_ram_fd_passing(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start.use_memfd = true,
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_precopy_unix_ram_fd_passing_start,
+    };
+
+    test_precopy_common(&args);
+}
+#endif
+
 static void test_precopy_unix_suspend_live(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1951,6 +2065,43 @@ static void test_precopy_unix_suspend_notlive(void)
     test_precopy_common(&args);
 }
 
+static void *
+test_migrate_defer_hot_pages_start(QTestState *from, QTestState *to)
+{
+    migrate_set_capability(from, "defer-hot-pages", true);
+
+    return NULL;
+}
+
+static void test_migrate_defer_hot_pages_end(QTestState *from,
+                                             QTestState *to,
+                                             void *opaque)
+{
+    /*
+     * The guest writes to all of its test memory between two syncs, so
+     * that memory is hot by the last sync and its pages get deferred.
+     */
+    g_assert_cmpint(read_ram_property_int(from, "deferred-pages"), >, 0);
+}
+
+static void test_precopy_unix_defer_hot_pages(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_migrate_defer_hot_pages_start,
+        .finish_hook = test_migrate_defer_hot_pages_end,
+        /*
+         * The guest keeps dirtying the same pages, which makes them hot
+         * after a few passes, and they must still all get sent.
+         */
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_dirty_ring(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1970,6 +2121,27 @@ static void test_precopy_unix_dirty_ring(void)
     test_precopy_common(&args);
 }
 
+/*
+ * With more than 16 possible vCPUs, full reaps of the dirty rings are
+ * split between the reaping thread and "kvm-harvest" helper threads.
+ */
+static void test_precopy_unix_dirty_ring_harvesters(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .use_dirty_ring = true,
+            .opts_source = "-smp 20",
+            .opts_target = "-smp 20",
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_precopy_unix_tls_psk(void)
 {
@@ -2097,6 +2269,60 @@ static void test_precopy_file(void)
     test_file_common(&args, true);
 }
 
+/*
+ * Take a background snapshot of the running source into a file, then
+ * check that the destination resumes from a consistent state.
+ */
+static void test_background_snapshot_common(int threads)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    /* Write tracking needs both the kernel and the guest RAM to allow it */
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                    "'arguments': { 'capabilities': [ {"
+                    "'capability': 'background-snapshot',"
+                    "'state': true } ] } }");
+    if (qdict_haskey(rsp, "error")) {
+        qobject_unref(rsp);
+        g_test_skip("Background snapshot not available");
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+    migrate_set_parameter_int(from, "background-snapshot-threads", threads);
+
+    /* The guest keeps writing its memory while it is saved */
+    wait_for_serial("src_serial");
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+
+    migrate_incoming_qmp(to, uri, "{}");
+    wait_for_migration_complete(to);
+    wait_for_resume(to, &dst_state);
+
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_background_snapshot(void)
+{
+    test_background_snapshot_common(0);
+}
+
+static void test_background_snapshot_threads(void)
+{
+    test_background_snapshot_common(2);
+}
+
 #ifndef _WIN32
 static void fdset_add_fds(QTestState *qts, const char *file, int flags,
                           int num_fds, bool direct_io)
@@ -2230,6 +2456,99 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_mapped_ram_lazy_load_start(QTestState *from,
+                                                QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+
+    migrate_set_parameter_bool(to, "mapped-ram-lazy-load", true);
+
+    return NULL;
+}
+
+static void test_precopy_file_mapped_ram_lazy_load(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_lazy_load_start,
+    };
+
+    test_file_common(&args, true);
+}
+
+static void migrate_mapped_ram_incremental_first(QTestState *from,
+                                                 QTestState *to,
+                                                 const char *filename)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs, filename);
+
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(from, "mapped-ram-incremental", true);
+
+    /*
+     * Save all of RAM a first time, the migration done by the test then
+     * only writes the pages the guest dirtied since.
+     */
+    migrate_ensure_converge(from);
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+}
+
+static void *migrate_mapped_ram_incremental_start(QTestState *from,
+                                                  QTestState *to)
+{
+    migrate_mapped_ram_incremental_first(from, to, FILE_TEST_FILENAME);
+    return NULL;
+}
+
+#define FILE_TEST_PREV_FILENAME "migfile.prev"
+
+static void *migrate_mapped_ram_incremental_other_start(QTestState *from,
+                                                        QTestState *to)
+{
+    /* The test migrates to a new file, which must get all of RAM */
+    migrate_mapped_ram_incremental_first(from, to, FILE_TEST_PREV_FILENAME);
+    return NULL;
+}
+
+static void migrate_mapped_ram_incremental_other_end(QTestState *from,
+                                                     QTestState *to,
+                                                     void *opaque)
+{
+    cleanup(FILE_TEST_PREV_FILENAME);
+}
+
+static void test_precopy_file_mapped_ram_incremental_other(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_incremental_other_start,
+        .finish_hook = migrate_mapped_ram_incremental_other_end,
+    };
+
+    test_file_common(&args, false);
+}
+
+static void test_precopy_file_mapped_ram_incremental(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_mapped_ram_incremental_start,
+    };
+
+    test_file_common(&args, false);
+}
+
 static void *migrate_multifd_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_mapped_ram_start(from, to);
@@ -2392,6 +2711,47 @@ static void test_precopy_tcp_plain(void)
     test_precopy_common(&args);
 }
 
+#ifdef CONFIG_LINUX
+static void *test_migrate_precopy_tcp_zero_copy_start(QTestState *from,
+                                                      QTestState *to)
+{
+    migrate_set_capability(from, "zero-copy-send", true);
+
+    return NULL;
+}
+
+static void test_migrate_precopy_tcp_zero_copy_end(QTestState *from,
+                                                   QTestState *to,
+                                                   void *opaque)
+{
+    /*
+     * The kernel copies what is sent over loopback, which the source sees
+     * at least when it waits for its zero copy writes at completion.
+     */
+    g_assert_cmpint(read_ram_property_int(from, "main-missed-zero-copy"),
+                    >, 0);
+}
+
+static void test_precopy_tcp_zero_copy(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "tcp:127.0.0.1:0",
+        .start_hook = test_migrate_precopy_tcp_zero_copy_start,
+        .finish_hook = test_migrate_precopy_tcp_zero_copy_end,
+    };
+    struct rlimit rlim;
+
+    /* Pages in flight are charged to the locked memory of the source */
+    if (geteuid() && !getrlimit(RLIMIT_MEMLOCK, &rlim) &&
+        rlim.rlim_cur != RLIM_INFINITY && rlim.rlim_cur < 64 * 1024 * 1024) {
+        g_test_skip("Not enough locked memory allowed for zero copy");
+        return;
+    }
+
+    test_precopy_common(&args);
+}
+#endif /* CONFIG_LINUX */
+
 static void *test_migrate_switchover_ack_start(QTestState *from, QTestState *to)
 {
 
@@ -2930,6 +3290,38 @@ test_migration_precopy_tcp_multifd_start_no_zero_page(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_start_scan(QTestState *from,
+                                            QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_capability(from, "multifd-scan", true);
+    return NULL;
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_start_dedup(QTestState *from,
+                                             QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_parameter_int(from, "multifd-dedup-cache-size", 1024 * 1024);
+    migrate_set_parameter_int(to, "multifd-dedup-cache-size", 1024 * 1024);
+    /* Have zero pages go through the cache, so there are duplicates */
+    migrate_set_parameter_str(from, "zero-page-detection", "none");
+    return NULL;
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_start_dedup_mismatch(QTestState *from,
+                                                      QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_parameter_int(from, "multifd-dedup-cache-size", 1024 * 1024);
+    migrate_set_parameter_int(to, "multifd-dedup-cache-size",
+                              2 * 1024 * 1024);
+    return NULL;
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
                                             QTestState *to)
@@ -2944,6 +3336,15 @@ test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "xbzrle");
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
@@ -2954,6 +3355,27 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zstd");
 }
+
+static void *
+test_migrate_precopy_tcp_multifd_adaptive_start(QTestState *from,
+                                                QTestState *to)
+{
+    migrate_set_parameter_int(from, "multifd-zstd-level", 3);
+    migrate_set_parameter_int(to, "multifd-zstd-level", 3);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to,
+                                                         "adaptive");
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_adaptive_no_delta_start(QTestState *from,
+                                                         QTestState *to)
+{
+    /* Zero pages found by the migration thread rule out deltas */
+    migrate_set_parameter_str(from, "zero-page-detection", "legacy");
+
+    return test_migrate_precopy_tcp_multifd_adaptive_start(from, to);
+}
 #endif /* CONFIG_ZSTD */
 
 #ifdef CONFIG_QATZIP
@@ -3030,6 +3452,69 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_scan(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start_scan,
+        /*
+         * The channels clear the dirty bitmap by themselves, make sure
+         * no page is lost while the guest keeps changing them.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+/*
+ * Guests below x-bitmap-sync-parallel-min sync the dirty bitmap from the
+ * migration thread alone.  Lower it so that the helper threads run.
+ */
+static void test_multifd_tcp_parallel_sync(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .opts_source = "-global migration.x-bitmap-sync-parallel-min=0",
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        /*
+         * The threads sync disjoint ranges of the bitmap, make sure no
+         * dirty page is lost while the guest keeps changing them.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_dedup(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start_dedup,
+        /*
+         * Pages are sent from their copy in the cache, make sure the
+         * caches on both sides stay in sync while the guest keeps
+         * changing them.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_dedup_mismatch(void)
+{
+    MigrateCommon args = {
+        .start = {
+            .hide_stderr = true,
+        },
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start_dedup_mismatch,
+        .result = MIG_TEST_FAIL,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_channels_none(void)
 {
     MigrateCommon args = {
@@ -3054,6 +3539,20 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        /*
+         * Pages are sent again while the guest runs, make sure the
+         * deltas apply to what the destination got before.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
@@ -3063,6 +3562,31 @@ static void test_multifd_tcp_zstd(void)
     };
     test_precopy_common(&args);
 }
+
+static void test_multifd_tcp_adaptive(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_adaptive_start,
+        /*
+         * Packets switch between compressed, uncompressed and deltas,
+         * make sure the guest pages still arrive intact while they
+         * change.
+         */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_adaptive_no_delta(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_adaptive_no_delta_start,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
 #endif
 
 #ifdef CONFIG_QATZIP
@@ -3751,6 +4275,55 @@ static void test_migrate_dirty_limit(void)
     test_migrate_end(from, to, true);
 }
 
+/*
+ * With dirty-limit-adaptive, the guest dirties memory faster than the
+ * bandwidth allows to send it, so the migration only converges once
+ * the dirty page rate gets limited.
+ */
+static void test_migrate_dirty_limit_adaptive(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    QTestState *from, *to;
+    uint64_t throttle_us_per_full = 0;
+    MigrateCommon args = {
+        .start = {
+            .hide_stderr = true,
+            .use_dirty_ring = true,
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+    };
+
+    if (test_migrate_start(&from, &to, args.listen_uri, &args.start)) {
+        return;
+    }
+
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_bool(from, "dirty-limit-adaptive", true);
+    migrate_set_parameter_int(from, "downtime-limit", 250);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000);
+
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, args.connect_uri, NULL, "{}");
+
+    /* Wait for dirty limit throttle begin */
+    while (throttle_us_per_full == 0) {
+        throttle_us_per_full =
+            read_migrate_property_int(from,
+                                      "dirty-limit-throttle-time-per-round");
+        usleep(100);
+        g_assert_false(src_state.stop_seen);
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
 static bool kvm_dirty_ring_supported(void)
 {
 #if defined(__linux__) && defined(HOST_X86_64)
@@ -3836,8 +4409,17 @@ int main(int argc, char **argv)
                            test_postcopy_recovery);
         migration_test_add("/migration/postcopy/preempt/plain",
                            test_postcopy_preempt);
+        migration_test_add("/migration/postcopy/prefetch/plain",
+                           test_postcopy_prefetch);
+        migration_test_add("/migration/postcopy/preempt/fault-threads",
+                           test_postcopy_preempt_fault_threads);
         migration_test_add("/migration/postcopy/preempt/recovery/plain",
                            test_postcopy_preempt_recovery);
+        migration_test_add("/migration/postcopy/recovery/fault-threads",
+                           test_postcopy_recovery_fault_threads);
+        migration_test_add("/migration/postcopy/recovery/double-failures/"
+                           "fault-threads",
+                           test_postcopy_recovery_fault_threads_fail_handshake);
         migration_test_add("/migration/postcopy/recovery/double-failures/handshake",
                            test_postcopy_recovery_fail_handshake);
         migration_test_add("/migration/postcopy/recovery/double-failures/reconnect",
@@ -3850,12 +4432,22 @@ int main(int argc, char **argv)
 
     migration_test_add("/migration/precopy/unix/plain",
                        test_precopy_unix_plain);
+    migration_test_add("/migration/precopy/unix/defer-hot-pages",
+                       test_precopy_unix_defer_hot_pages);
+#ifdef CONFIG_LINUX
+    migration_test_add("/migration/precopy/unix/ram-fd-passing",
+                       test_precopy_unix_ram_fd_passing);
+#endif
     if (g_test_slow()) {
         migration_test_add("/migration/precopy/unix/xbzrle",
                            test_precopy_unix_xbzrle);
     }
     migration_test_add("/migration/precopy/file",
                        test_precopy_file);
+    migration_test_add("/migration/background-snapshot/file",
+                       test_background_snapshot);
+    migration_test_add("/migration/background-snapshot/file/threads",
+                       test_background_snapshot_threads);
     migration_test_add("/migration/precopy/file/offset",
                        test_precopy_file_offset);
 #ifndef _WIN32
@@ -3877,6 +4469,12 @@ int main(int argc, char **argv)
                        test_precopy_file_mapped_ram);
     migration_test_add("/migration/precopy/file/mapped-ram/live",
                        test_precopy_file_mapped_ram_live);
+    migration_test_add("/migration/precopy/file/mapped-ram/lazy-load",
+                       test_precopy_file_mapped_ram_lazy_load);
+    migration_test_add("/migration/precopy/file/mapped-ram/incremental",
+                       test_precopy_file_mapped_ram_incremental);
+    migration_test_add("/migration/precopy/file/mapped-ram/incremental/other",
+                       test_precopy_file_mapped_ram_incremental_other);
 
     migration_test_add("/migration/multifd/file/mapped-ram",
                        test_multifd_file_mapped_ram);
@@ -3921,6 +4519,10 @@ int main(int argc, char **argv)
 #endif /* CONFIG_GNUTLS */
 
     migration_test_add("/migration/precopy/tcp/plain", test_precopy_tcp_plain);
+#ifdef CONFIG_LINUX
+    migration_test_add("/migration/precopy/tcp/plain/zero-copy",
+                       test_precopy_tcp_zero_copy);
+#endif
 
     migration_test_add("/migration/precopy/tcp/plain/switchover-ack",
                        test_precopy_tcp_switchover_ack);
@@ -3976,6 +4578,8 @@ int main(int argc, char **argv)
             has_kvm && kvm_dirty_ring_supported()) {
             migration_test_add("/migration/dirty_limit",
                                test_migrate_dirty_limit);
+            migration_test_add("/migration/dirty_limit/adaptive",
+                               test_migrate_dirty_limit_adaptive);
         }
     }
     migration_test_add("/migration/multifd/tcp/uri/plain/none",
@@ -3986,13 +4590,27 @@ int main(int argc, char **argv)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/scan",
+                       test_multifd_tcp_scan);
+    migration_test_add("/migration/multifd/tcp/plain/parallel-sync",
+                       test_multifd_tcp_parallel_sync);
+    migration_test_add("/migration/multifd/tcp/plain/dedup",
+                       test_multifd_tcp_dedup);
+    migration_test_add("/migration/multifd/tcp/plain/dedup/mismatch",
+                       test_multifd_tcp_dedup_mismatch);
     migration_test_add("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
                        test_multifd_tcp_zlib);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
+    migration_test_add("/migration/multifd/tcp/plain/adaptive",
+                       test_multifd_tcp_adaptive);
+    migration_test_add("/migration/multifd/tcp/plain/adaptive/no-delta",
+                       test_multifd_tcp_adaptive_no_delta);
 #endif
 #ifdef CONFIG_QATZIP
     migration_test_add("/migration/multifd/tcp/plain/qatzip",
@@ -4028,6 +4646,8 @@ int main(int argc, char **argv)
     if (g_str_equal(arch, "x86_64") && has_kvm && kvm_dirty_ring_supported()) {
         migration_test_add("/migration/dirty_ring",
                            test_precopy_unix_dirty_ring);
+        migration_test_add("/migration/dirty_ring/harvesters",
+                           test_precopy_unix_dirty_ring_harvesters);
         if (qtest_has_machine("pc") && g_test_slow()) {
             migration_test_add("/migration/vcpu_dirty_limit",
                                test_vcpu_dirty_limit);
@@ -0,0 +1,128 @@
+/*
+ * Migration dirty page rate budget unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "../migration/dirty-limit.h"
+
+#define NVCPUS 8
+
+static uint64_t quota_sum(const uint64_t *quota, int nvcpus)
+{
+    uint64_t sum = 0;
+
+    for (int i = 0; i < nvcpus; i++) {
+        sum += quota[i];
+    }
+    return sum;
+}
+
+static void test_all_capped(void)
+{
+    uint64_t demand[NVCPUS];
+    uint64_t quota[NVCPUS];
+
+    for (int i = 0; i < NVCPUS; i++) {
+        demand[i] = UINT64_MAX;
+    }
+
+    dirty_limit_split_budget(800, 1, demand, NVCPUS, quota);
+    for (int i = 0; i < NVCPUS; i++) {
+        g_assert_cmpuint(quota[i], ==, 100);
+    }
+    g_assert_cmpuint(quota_sum(quota, NVCPUS), ==, 800);
+}
+
+static void test_spare_budget(void)
+{
+    /* Two slow vCPUs leave their spare budget to the others */
+    uint64_t demand[NVCPUS] = {
+        10, UINT64_MAX, 500, 20, UINT64_MAX, 1000, UINT64_MAX, 200,
+    };
+    uint64_t quota[NVCPUS];
+
+    dirty_limit_split_budget(1000, 1, demand, NVCPUS, quota);
+    g_assert_cmpuint(quota[0], ==, 10);
+    g_assert_cmpuint(quota[3], ==, 20);
+    /* (1000 - 30) / 6, rounded down or up */
+    for (int i = 1; i < NVCPUS; i++) {
+        if (i != 3) {
+            g_assert_cmpuint(quota[i], >=, 161);
+            g_assert_cmpuint(quota[i], <=, 162);
+        }
+    }
+    g_assert_cmpuint(quota_sum(quota, NVCPUS), ==, 1000);
+}
+
+static void test_random(void)
+{
+    uint64_t demand[NVCPUS];
+    uint64_t quota[NVCPUS];
+    GRand *rand = g_rand_new_with_seed(0);
+
+    for (int round = 0; round < 10000; round++) {
+        uint64_t budget = g_rand_int_range(rand, NVCPUS, 100000);
+        int nvcpus = g_rand_int_range(rand, 1, NVCPUS + 1);
+        uint64_t max_share = 0;
+
+        for (int i = 0; i < nvcpus; i++) {
+            demand[i] = g_rand_boolean(rand) ?
+                        UINT64_MAX : g_rand_int_range(rand, 0, 50000);
+        }
+
+        dirty_limit_split_budget(budget, 1, demand, nvcpus, quota);
+        g_assert_cmpuint(quota_sum(quota, nvcpus), <=, budget);
+
+        for (int i = 0; i < nvcpus; i++) {
+            g_assert_cmpuint(quota[i], >=, 1);
+            if (quota[i] < demand[i]) {
+                max_share = MAX(max_share, quota[i]);
+            }
+        }
+        /*
+         * vCPUs that get less than their demand all get the same share,
+         * give or take the rounding
+         */
+        for (int i = 0; i < nvcpus; i++) {
+            if (quota[i] < demand[i]) {
+                g_assert_cmpuint(quota[i] + 1, >=, max_share);
+            }
+        }
+    }
+
+    g_rand_free(rand);
+}
+
+static void test_floor(void)
+{
+    uint64_t demand[NVCPUS];
+    uint64_t quota[NVCPUS];
+
+    for (int i = 0; i < NVCPUS; i++) {
+        demand[i] = i ? UINT64_MAX : 0;
+    }
+
+    /* The floor takes priority over a budget that is too small */
+    dirty_limit_split_budget(4, 1, demand, NVCPUS, quota);
+    for (int i = 0; i < NVCPUS; i++) {
+        g_assert_cmpuint(quota[i], ==, 1);
+    }
+
+    /* A budget that covers the floor of every vCPU is kept */
+    dirty_limit_split_budget(NVCPUS * 10, 10, demand, NVCPUS, quota);
+    g_assert_cmpuint(quota[0], ==, 10);
+    g_assert_cmpuint(quota_sum(quota, NVCPUS), <=, NVCPUS * 10);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/dirty-limit/all-capped", test_all_capped);
+    g_test_add_func("/dirty-limit/spare-budget", test_spare_budget);
+    g_test_add_func("/dirty-limit/random", test_random);
+    g_test_add_func("/dirty-limit/floor", test_floor);
+    return g_test_run();
+}
@@ -46,6 +46,8 @@ struct QIOChannelTLSTestData {
     bool expectClientFail;
     const char *hostname;
     const char *const *wildcards;
+    /* Connect over TCP, with the "kernel-tls" property set */
+    bool kernelTLS;
 };
 
 struct QIOChannelTLSHandshakeData {
@@ -64,7 +66,8 @@ static void test_tls_handshake_done(QIOTask *task,
 
 
 static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
-                                              const char *certdir)
+                                              const char *certdir,
+                                              bool kernelTLS)
 {
     Object *parent = object_get_objects_root();
     Object *creds = object_new_with_props(
@@ -78,6 +81,7 @@ static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
         "dir", certdir,
         "verify-peer", "yes",
         "priority", "NORMAL",
+        "kernel-tls", kernelTLS ? "yes" : "no",
         /* We skip initial sanity checks here because we
          * want to make sure that problems are being
          * detected at the TLS session validation stage,
@@ -92,6 +96,37 @@ static QCryptoTLSCreds *test_tls_creds_create(QCryptoTLSCredsEndpoint endpoint,
 }
 
 
+#ifndef _WIN32
+/*
+ * Kernel TLS needs a TCP socket, so get a connected pair of them
+ * over the loopback interface.
+ */
+static void test_tls_tcp_socketpair(int sv[2])
+{
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t addrlen = sizeof(addr);
+    int lfd;
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(lfd >= 0);
+    g_assert(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    g_assert(listen(lfd, 1) == 0);
+    g_assert(getsockname(lfd, (struct sockaddr *)&addr, &addrlen) == 0);
+
+    sv[0] = socket(AF_INET, SOCK_STREAM, 0);
+    g_assert(sv[0] >= 0);
+    g_assert(connect(sv[0], (struct sockaddr *)&addr, sizeof(addr)) == 0);
+    sv[1] = accept(lfd, NULL, NULL);
+    g_assert(sv[1] >= 0);
+
+    close(lfd);
+}
+#endif
+
+
 /*
  * This tests validation checking of peer certificates
  *
@@ -121,7 +156,14 @@ static void test_io_channel_tls(const void *opaque)
     GMainContext *mainloop;
 
     /* We'll use this for our fake client-server connection */
-    g_assert(qemu_socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == 0);
+#ifndef _WIN32
+    if (data->kernelTLS) {
+        test_tls_tcp_socketpair(channel);
+    } else
+#endif
+    {
+        g_assert(qemu_socketpair(AF_UNIX, SOCK_STREAM, 0, channel) == 0);
+    }
 
 #define CLIENT_CERT_DIR "tests/test-io-channel-tls-client/"
 #define SERVER_CERT_DIR "tests/test-io-channel-tls-server/"
@@ -152,12 +194,12 @@ static void test_io_channel_tls(const void *opaque)
 
     clientCreds = test_tls_creds_create(
         QCRYPTO_TLS_CREDS_ENDPOINT_CLIENT,
-        CLIENT_CERT_DIR);
+        CLIENT_CERT_DIR, data->kernelTLS);
     g_assert(clientCreds != NULL);
 
     serverCreds = test_tls_creds_create(
         QCRYPTO_TLS_CREDS_ENDPOINT_SERVER,
-        SERVER_CERT_DIR);
+        SERVER_CERT_DIR, data->kernelTLS);
     g_assert(serverCreds != NULL);
 
     auth = qauthz_list_new("channeltlsacl",
@@ -224,6 +266,15 @@ static void test_io_channel_tls(const void *opaque)
     g_assert(clientHandshake.failed == data->expectClientFail);
     g_assert(serverHandshake.failed == data->expectServerFail);
 
+    /*
+     * Kernel TLS is only used when asked for.  When it is, whether the
+     * host supports it or not, the data must go through all the same.
+     */
+    if (!data->kernelTLS) {
+        g_assert(!clientChanTLS->ktls_send);
+        g_assert(!serverChanTLS->ktls_send);
+    }
+
     test = qio_channel_test_new();
     qio_channel_test_run_threads(test, false,
                                  QIO_CHANNEL(clientChanTLS),
@@ -321,6 +372,15 @@ int main(int argc, char **argv)
                  clientcertreq.filename, false, false,
                  "qemu.org", wildcards);
 
+#ifndef _WIN32
+    struct QIOChannelTLSTestData ktls = {
+        cacertreq.filename, cacertreq.filename, servercertreq.filename,
+        clientcertreq.filename, false, false, "qemu.org", wildcards, true
+    };
+    g_test_add_data_func("/qio/channel/tls/kernel-tls",
+                         &ktls, test_io_channel_tls);
+#endif
+
     ret = g_test_run();
 
     test_tls_discard_cert(&clientcertreq);